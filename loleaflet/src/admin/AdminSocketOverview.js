@@ -8,8 +8,6 @@ var AdminSocketOverview = AdminSocketBase.extend({
 		this.base(host);
 	},
 
-	_basicStatsIntervalId: 0,
-
 	_docElapsedTimeIntervalId: 0,
 
 	_getBasicStats: function() {
@@ -23,14 +21,11 @@ var AdminSocketOverview = AdminSocketBase.extend({
 		this.base.call(this);
 
 		this.socket.send('documents');
-		this.socket.send('subscribe adddoc rmdoc');
+		this.socket.send('subscribe adddoc rmdoc total_mem propchange');
 
+		// Initial snapshot; from here on the server pushes deltas.
 		this._getBasicStats();
 		var socketOverview = this;
-		this._basicStatsIntervalId =
-		setInterval(function() {
-			return socketOverview._getBasicStats();
-		}, 5000);
 
 		this._docElapsedTimeIntervalId =
 		setInterval(function() {
@@ -106,7 +101,8 @@ var AdminSocketOverview = AdminSocketBase.extend({
 					                                    .text(sViews);
 				$rowContainer.append($views);
 
-				$mem = $(document.createElement('td')).text(Util.humanizeMem(parseInt(sMem)));
+				$mem = $(document.createElement('td')).attr('id', 'docmem' + sPid)
+					                                  .text(Util.humanizeMem(parseInt(sMem)));
 				$rowContainer.append($mem);
 
 				$docTime = $(document.createElement('td')).addClass('elapsed_time')
@@ -139,7 +135,8 @@ var AdminSocketOverview = AdminSocketBase.extend({
 					                                    .text(0);
 				$rowContainer.append($views);
 
-				$mem = $(document.createElement('td')).text(Util.humanizeMem(parseInt(sMem)));
+				$mem = $(document.createElement('td')).attr('id', 'docmem' + sPid)
+					                                  .text(Util.humanizeMem(parseInt(sMem)));
 				$rowContainer.append($mem);
 
 				$docTime = $(document.createElement('td')).addClass('elapsed_time')
@@ -174,6 +171,17 @@ var AdminSocketOverview = AdminSocketBase.extend({
 			}
 			$(document.getElementById(sCommand)).text(nData);
 		}
+		else if (textMsg.startsWith('propchange')) {
+			// Batched property updates: 'propchange mem pid=kb pid=kb ...'
+			textMsg = textMsg.substring('propchange'.length);
+			docProps = textMsg.trim().split(' ');
+			if (docProps[0] === 'mem') {
+				for (var iProp = 1; iProp < docProps.length; iProp++) {
+					var change = docProps[iProp].split('=');
+					$(document.getElementById('docmem' + change[0])).text(Util.humanizeMem(parseInt(change[1])));
+				}
+			}
+		}
 		else if (textMsg.startsWith('rmdoc')) {
 			textMsg = textMsg.substring('rmdoc'.length);
 			docProps = textMsg.trim().split(' ');
@@ -197,7 +205,6 @@ var AdminSocketOverview = AdminSocketBase.extend({
 	},
 
 	onSocketClose: function() {
-		clearInterval(this._basicStatsIntervalId);
 		clearInterval(this._docElapsedTimeIntervalId);
 	}
 });
@@ -73,7 +73,9 @@ L.Socket = L.Class.extend({
 	_onSocketOpen: function () {
 		// Always send the protocol version number.
 		// TODO: Move the version number somewhere sensible.
-		this._doSend('loolclient ' + this.ProtocolVersionNumber);
+		// 'bundle' advertises that we can unpack several small messages
+		// multiplexed into a single 'bundle:' frame.
+		this._doSend('loolclient ' + this.ProtocolVersionNumber + ' bundle');
 
 		var msg = 'load url=' + this._map.options.doc;
 		if (this._map._docLayer) {
@@ -113,6 +115,16 @@ L.Socket = L.Class.extend({
 	_onMessage: function (e) {
 		var imgBytes, index, textMsg;
 
+		if (typeof (e.data) === 'string' && e.data.startsWith('bundle:\n')) {
+			// Several small single-line messages packed into one frame;
+			// handle each as if it had arrived on its own.
+			var parts = e.data.substring(8).split('\n');
+			for (var part = 0; part < parts.length; part++) {
+				this._onMessage({data: parts[part]});
+			}
+			return;
+		}
+
 		if (typeof (e.data) === 'string') {
 			textMsg = e.data;
 		}
@@ -144,6 +156,16 @@ L.Socket = L.Class.extend({
 			                         lokitVersionObj.ProductVersion + lokitVersionObj.ProductExtension.replace('.10.','-') +
 			                         ' (git hash: ' + lokitVersionObj.BuildId.substring(0, 7) + ')');
 		}
+		else if (textMsg.startsWith('redirect:')) {
+			// The document lives on another host of the cluster;
+			// reconnect there with the same document URL.
+			if (command.uri) {
+				this.close();
+				this._map.options.server = command.uri;
+				this.initialize(this._map);
+			}
+			return;
+		}
 		else if (textMsg.startsWith('error:') && command.errorCmd === 'internal') {
 			this._map._fatal = true;
 			if (command.errorKind === 'diskfull') {
@@ -415,6 +437,9 @@ L.Socket = L.Class.extend({
 			else if (tokens[i].substring(0, 5) === 'port=') {
 				command.port = tokens[i].substring(5);
 			}
+			else if (tokens[i].substring(0, 4) === 'uri=') {
+				command.uri = tokens[i].substring(4);
+			}
 			else if (tokens[i].substring(0, 5) === 'font=') {
 				command.font = window.decodeURIComponent(tokens[i].substring(5));
 			}
@@ -12,6 +12,7 @@
 #include <cassert>
 #include <mutex>
 #include <sys/poll.h>
+#include <unistd.h>
 
 #include <Poco/Net/HTTPCookie.h>
 #include <Poco/Net/HTTPRequest.h>
@@ -31,6 +32,7 @@
 #include "Auth.hpp"
 #include "Common.hpp"
 #include "FileServer.hpp"
+#include "Histogram.hpp"
 #include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLWSD.hpp"
@@ -92,7 +94,11 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
              tokens[0] == "active_users_count" ||
              tokens[0] == "active_docs_count" ||
              tokens[0] == "mem_stats" ||
-             tokens[0] == "cpu_stats" )
+             tokens[0] == "mem_stats_minute" ||
+             tokens[0] == "mem_stats_hour" ||
+             tokens[0] == "cpu_stats" ||
+             tokens[0] == "cpu_stats_minute" ||
+             tokens[0] == "cpu_stats_hour" )
     {
         const std::string result = model.query(tokens[0]);
         if (!result.empty())
@@ -119,6 +125,10 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
         const auto totalMem = _admin->getTotalMemoryUsage(model);
         sendTextFrame("total_mem " + std::to_string(totalMem));
     }
+    else if (tokens[0] == "histograms")
+    {
+        sendTextFrame("histograms " + Histogram::toJSONAll());
+    }
     else if (tokens[0] == "kill" && tokens.count() == 2)
     {
         try
@@ -178,6 +188,7 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
                 if (settingVal != _admin->getMemStatsInterval())
                 {
                     _admin->rescheduleMemTimer(settingVal);
+                    model.setMemStatsInterval(settingVal);
                     model.clearMemStats();
                     model.notify("settings mem_stats_interval=" + std::to_string(settingVal));
                 }
@@ -194,6 +205,7 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
                 if (settingVal != _admin->getCpuStatsInterval())
                 {
                     _admin->rescheduleCpuTimer(settingVal);
+                    model.setCpuStatsInterval(settingVal);
                     model.clearCpuStats();
                     model.notify("settings cpu_stats_interval=" + std::to_string(settingVal));
                 }
@@ -287,6 +299,9 @@ Admin::Admin() :
 {
     Log::info("Admin ctor.");
 
+    _model.setMemStatsInterval(_memStatsTaskInterval);
+    _model.setCpuStatsInterval(_cpuStatsTaskInterval);
+
     _memStatsTask = new MemoryStats(this);
     _memStatsTimer.schedule(_memStatsTask, _memStatsTaskInterval, _memStatsTaskInterval);
 
@@ -329,6 +344,10 @@ void MemoryStats::run()
     if (totalMem != _lastTotalMemory)
     {
         Log::trace("Total memory used: " + std::to_string(totalMem));
+
+        // Subscribed dashboards get the new total pushed; they no
+        // longer need to poll for it.
+        model.notify("total_mem " + std::to_string(totalMem));
     }
 
     _lastTotalMemory = totalMem;
@@ -337,9 +356,12 @@ void MemoryStats::run()
 
 void CpuStats::run()
 {
-    //TODO: Implement me
-    //std::unique_lock<std::mutex> modelLock(_admin->getLock());
-    //model.addCpuStats(totalMem);
+    std::unique_lock<std::mutex> modelLock(_admin->getLock());
+    AdminModel& model = _admin->getModel();
+    const auto totalCpu = _admin->getTotalCpuUsage(model);
+
+    Log::trace("Total CPU usage: " + std::to_string(totalCpu) + "% of one CPU.");
+    model.addCpuStats(totalCpu);
 }
 
 void Admin::rescheduleMemTimer(unsigned interval)
@@ -369,6 +391,37 @@ unsigned Admin::getTotalMemoryUsage(AdminModel& model)
     return totalMem;
 }
 
+unsigned Admin::getTotalCpuUsage(AdminModel& model)
+{
+    unsigned total = model.getTotalCpuUsage(_cpuStatsTaskInterval);
+
+    // Add forkit and ourselves, tracked the same way: the percentage
+    // of one CPU the tick delta represents over the stats interval.
+    const long ticksPerSec = sysconf(_SC_CLK_TCK);
+    const auto addProcess = [&](const Poco::Process::PID pid, long& lastTicks)
+    {
+        const auto ticks = Util::getCpuUsage(pid);
+        if (ticks < 0)
+        {
+            return;
+        }
+
+        if (lastTicks >= 0 && ticks >= lastTicks &&
+            ticksPerSec > 0 && _cpuStatsTaskInterval > 0)
+        {
+            total += (ticks - lastTicks) * 1000 * 100 /
+                     (ticksPerSec * static_cast<long>(_cpuStatsTaskInterval));
+        }
+
+        lastTicks = ticks;
+    };
+
+    addProcess(_forKitPid, _lastForKitCpuTicks);
+    addProcess(Poco::Process::id(), _lastSelfCpuTicks);
+
+    return total;
+}
+
 unsigned Admin::getMemStatsInterval()
 {
     return _memStatsTaskInterval;
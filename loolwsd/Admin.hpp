@@ -62,6 +62,11 @@ public:
 
     unsigned getTotalMemoryUsage(AdminModel&);
 
+    /// The CPU usage of all our processes (kits, forkit and wsd
+    /// itself) over the last stats interval, as a percentage of one
+    /// CPU. Callers must hold the model lock.
+    unsigned getTotalCpuUsage(AdminModel&);
+
     /// Update the Admin Model.
     void update(const std::string& message);
 
@@ -110,6 +115,11 @@ private:
     Poco::Util::Timer _cpuStatsTimer;
     Poco::Util::TimerTask::Ptr _cpuStatsTask;
     unsigned _cpuStatsTaskInterval = 5000;
+
+    /// Cumulative CPU ticks of forkit and of wsd itself at the last
+    /// sweep; -1 before the first sample.
+    long _lastForKitCpuTicks = -1;
+    long _lastSelfCpuTicks = -1;
 };
 
 /// Memory statistics.
@@ -139,7 +149,8 @@ private:
 class CpuStats : public Poco::Util::TimerTask
 {
 public:
-    CpuStats(Admin* /*admin*/)
+    CpuStats(Admin* admin)
+        : _admin(admin)
     {
         Log::debug("Cpu stat ctor");
     }
@@ -152,6 +163,7 @@ public:
     void run() override;
 
 private:
+    Admin* _admin;
 };
 
 #endif
@@ -10,6 +10,8 @@
 #include "AdminModel.hpp"
 #include "config.h"
 
+#include <unistd.h>
+
 #include <memory>
 #include <set>
 #include <sstream>
@@ -105,37 +107,116 @@ std::string AdminModel::query(const std::string& command)
     {
         return getMemStats();
     }
+    else if (tokens[0] == "mem_stats_minute")
+    {
+        return _memStats.minutesToString();
+    }
+    else if (tokens[0] == "mem_stats_hour")
+    {
+        return _memStats.hoursToString();
+    }
     else if (tokens[0] == "mem_stats_size")
     {
-        return std::to_string(_memStatsSize);
+        return std::to_string(_memStats.getCapacity());
     }
     else if (tokens[0] == "cpu_stats")
     {
         return getCpuStats();
     }
+    else if (tokens[0] == "cpu_stats_minute")
+    {
+        return _cpuStats.minutesToString();
+    }
+    else if (tokens[0] == "cpu_stats_hour")
+    {
+        return _cpuStats.hoursToString();
+    }
     else if (tokens[0] == "cpu_stats_size")
     {
-        return std::to_string(_cpuStatsSize);
+        return std::to_string(_cpuStats.getCapacity());
     }
 
     return std::string("");
 }
 
-/// Returns memory consumed by all active loolkit processes
 unsigned AdminModel::getTotalMemoryUsage()
 {
+    std::vector<Poco::Process::PID> pids;
+    for (auto& it: _documents)
+    {
+        if (!it.second.isExpired())
+        {
+            pids.push_back(it.second.getPid());
+        }
+    }
+
+    auto usage = Util::getMemoryUsage(pids);
+
     unsigned totalMem = 0;
+    for (const auto& it : usage)
+    {
+        if (it.second > 0)
+        {
+            totalMem += it.second;
+        }
+    }
+
+    // Refresh the per-document cache and report the changes
+    // to subscribers, batched into a single message.
+    std::ostringstream oss;
     for (auto& it: _documents)
     {
         if (it.second.isExpired())
             continue;
 
-        totalMem += Util::getMemoryUsage(it.second.getPid());
+        const auto mem = usage[it.second.getPid()];
+        if (mem > 0 && it.second.updateMemoryUsage(mem))
+        {
+            oss << ' ' << it.second.getPid() << '=' << mem;
+        }
+    }
+
+    const auto changes = oss.str();
+    if (!changes.empty())
+    {
+        notify("propchange mem" + changes);
     }
 
     return totalMem;
 }
 
+unsigned AdminModel::getTotalCpuUsage(unsigned intervalMs)
+{
+    const long ticksPerSec = sysconf(_SC_CLK_TCK);
+
+    unsigned totalPercent = 0;
+    std::ostringstream oss;
+    for (auto& it : _documents)
+    {
+        if (it.second.isExpired())
+            continue;
+
+        const auto ticks = Util::getCpuUsage(it.second.getPid());
+        if (ticks < 0)
+            continue;
+
+        if (it.second.updateCpuUsage(ticks, intervalMs, ticksPerSec))
+        {
+            oss << ' ' << it.second.getPid() << '=' << it.second.getCpuPercent();
+        }
+
+        totalPercent += it.second.getCpuPercent();
+    }
+
+    const auto changes = oss.str();
+    if (!changes.empty())
+    {
+        notify("propchange cpu" + changes);
+    }
+
+    return totalPercent;
+}
+
 void AdminModel::subscribe(int nSessionId, std::shared_ptr<Poco::Net::WebSocket>& ws)
 {
     const auto ret = _subscribers.emplace(nSessionId, Subscriber(nSessionId, ws));
@@ -165,11 +246,7 @@ void AdminModel::unsubscribe(int nSessionId, const std::string& command)
 
 void AdminModel::addMemStats(unsigned memUsage)
 {
-    _memStats.push_back(memUsage);
-    if (_memStats.size() > _memStatsSize)
-    {
-        _memStats.pop_front();
-    }
+    _memStats.add(memUsage);
 
     std::ostringstream oss;
     oss << "mem_stats "
@@ -179,11 +256,7 @@ void AdminModel::addMemStats(unsigned memUsage)
 
 void AdminModel::addCpuStats(unsigned cpuUsage)
 {
-    _cpuStats.push_back(cpuUsage);
-    if (_cpuStats.size() > _cpuStatsSize)
-    {
-        _cpuStats.pop_front();
-    }
+    _cpuStats.add(cpuUsage);
 
     std::ostringstream oss;
     oss << "cpu_stats "
@@ -193,33 +266,23 @@ void AdminModel::addCpuStats(unsigned cpuUsage)
 
 void AdminModel::setCpuStatsSize(unsigned size)
 {
-    int wasteValuesLen = _cpuStats.size() - size;
-    while (wasteValuesLen-- > 0)
-    {
-        _cpuStats.pop_front();
-    }
-    _cpuStatsSize = size;
+    _cpuStats.setCapacity(size);
 
     std::ostringstream oss;
     oss << "settings "
         << "cpu_stats_size="
-        << std::to_string(_cpuStatsSize);
+        << std::to_string(size);
     notify(oss.str());
 }
 
 void AdminModel::setMemStatsSize(unsigned size)
 {
-    int wasteValuesLen = _memStats.size() - size;
-    while (wasteValuesLen-- > 0)
-    {
-        _memStats.pop_front();
-    }
-    _memStatsSize = size;
+    _memStats.setCapacity(size);
 
     std::ostringstream oss;
     oss << "settings "
         << "mem_stats_size="
-        << std::to_string(_memStatsSize);
+        << std::to_string(size);
     notify(oss.str());
 }
 
@@ -247,6 +310,7 @@ void AdminModel::addDocument(const std::string& docKey, Poco::Process::PID pid,
 
     // Notify the subscribers
     unsigned memUsage = Util::getMemoryUsage(pid);
+    ret.first->second.updateMemoryUsage(memUsage);
     std::ostringstream oss;
     std::string encodedFilename;
     Poco::URI::encode(filename, " ", encodedFilename);
@@ -302,28 +366,6 @@ void AdminModel::removeDocument(const std::string& docKey)
     }
 }
 
-std::string AdminModel::getMemStats()
-{
-    std::string response;
-    for (auto& i: _memStats)
-    {
-        response += std::to_string(i) + ",";
-    }
-
-    return response;
-}
-
-std::string AdminModel::getCpuStats()
-{
-    std::string response;
-    for (auto& i: _cpuStats)
-    {
-        response += std::to_string(i) + ",";
-    }
-
-    return response;
-}
-
 unsigned AdminModel::getTotalActiveViews()
 {
     unsigned nTotalViews = 0;
@@ -349,7 +391,7 @@ std::string AdminModel::getDocuments()
         const auto sPid = std::to_string(it.second.getPid());
         const auto sFilename = it.second.getFilename();
         const auto sViews = std::to_string(it.second.getActiveViews());
-        const auto sMem = std::to_string(Util::getMemoryUsage(it.second.getPid()));
+        const auto sMem = std::to_string(it.second.getMemoryUsage());
         const auto sElapsed = std::to_string(it.second.getElapsedTime());
 
         std::string encodedFilename;
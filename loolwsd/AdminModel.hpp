@@ -10,9 +10,11 @@
 #ifndef INCLUDED_ADMINMODEL_HPP
 #define INCLUDED_ADMINMODEL_HPP
 
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Process.h>
@@ -61,6 +63,41 @@ public:
 
     std::string getFilename() const { return _filename; }
 
+    unsigned getMemoryUsage() const { return _memoryKb; }
+
+    /// Refresh the cached memory figure; returns true when it changed.
+    bool updateMemoryUsage(unsigned memoryKb)
+    {
+        if (memoryKb == _memoryKb)
+            return false;
+
+        _memoryKb = memoryKb;
+        return true;
+    }
+
+    unsigned getCpuPercent() const { return _cpuPercent; }
+
+    /// Update from a fresh utime+stime sample taken intervalMs after
+    /// the previous one; returns true when the rounded percentage of
+    /// one CPU this document's kit consumed changed.
+    bool updateCpuUsage(long cpuTicks, unsigned intervalMs, long ticksPerSec)
+    {
+        unsigned percent = 0;
+        if (_lastCpuTicks >= 0 && cpuTicks >= _lastCpuTicks &&
+            intervalMs > 0 && ticksPerSec > 0)
+        {
+            percent = (cpuTicks - _lastCpuTicks) * 1000 * 100 /
+                      (ticksPerSec * static_cast<long>(intervalMs));
+        }
+
+        _lastCpuTicks = cpuTicks;
+        if (percent == _cpuPercent)
+            return false;
+
+        _cpuPercent = percent;
+        return true;
+    }
+
     bool isExpired() const { return _end != 0 && std::time(nullptr) >= _end; }
 
     std::time_t getElapsedTime() const { return std::time(nullptr) - _start; }
@@ -82,11 +119,184 @@ private:
     unsigned _activeViews = 0;
     /// Hosted filename
     std::string _filename;
+    /// Memory use of the kit process in KB, cached by the
+    /// periodic sweep so queries need no /proc pass.
+    unsigned _memoryKb = 0;
+    /// Cumulative CPU ticks of the kit at the last sweep; -1 before
+    /// the first sample (no rate can be derived from one reading).
+    long _lastCpuTicks = -1;
+    /// Percentage of one CPU the kit consumed over the last interval.
+    unsigned _cpuPercent = 0;
 
     std::time_t _start;
     std::time_t _end = 0;
 };
 
+/// Fixed-capacity history of one metric at one resolution.
+/// The samples live in a preallocated ring and their comma-separated
+/// serialization is maintained incrementally, so once the ring is full
+/// neither adding a sample nor querying the history allocates.
+class StatsRing
+{
+public:
+    StatsRing(unsigned capacity) :
+        _capacity(capacity)
+    {
+        _samples.reserve(capacity);
+    }
+
+    void add(unsigned value)
+    {
+        // A capacity of zero disables the history.
+        if (_capacity == 0)
+        {
+            return;
+        }
+
+        if (_samples.size() < _capacity)
+        {
+            _samples.push_back(value);
+        }
+        else
+        {
+            // Overwrite the oldest sample and drop its token
+            // from the front of the serialization.
+            _samples[_head] = value;
+            _head = (_head + 1) % _capacity;
+            _serialized.erase(0, _serialized.find(',') + 1);
+        }
+
+        _serialized += std::to_string(value);
+        _serialized += ',';
+    }
+
+    /// Resize the ring, dropping the oldest samples on a shrink.
+    void setCapacity(unsigned capacity)
+    {
+        std::vector<unsigned> ordered;
+        ordered.reserve(capacity);
+        const auto count = _samples.size();
+        for (auto i = (count > capacity ? count - capacity : 0); i < count; ++i)
+        {
+            ordered.push_back(_samples[(_head + i) % count]);
+        }
+
+        _samples = std::move(ordered);
+        _head = 0;
+        _capacity = capacity;
+
+        _serialized.clear();
+        for (const auto sample : _samples)
+        {
+            _serialized += std::to_string(sample);
+            _serialized += ',';
+        }
+    }
+
+    void clear()
+    {
+        _samples.clear();
+        _head = 0;
+        _serialized.clear();
+    }
+
+    unsigned getCapacity() const { return _capacity; }
+
+    /// The samples, oldest first, each followed by a comma.
+    const std::string& toString() const { return _serialized; }
+
+private:
+    std::vector<unsigned> _samples;
+    unsigned _capacity;
+    /// Index of the oldest sample once the ring is full.
+    unsigned _head = 0;
+    std::string _serialized;
+};
+
+/// A metric's history at three resolutions: the raw samples, per-minute
+/// averages covering the last day and per-hour averages covering the
+/// last week. Memory use is constant however long the server runs.
+class StatsHistory
+{
+public:
+    StatsHistory(unsigned capacity, unsigned intervalMs) :
+        _fine(capacity),
+        _minutes(60 * 24),
+        _hours(24 * 7),
+        _samplesPerMinute(samplesPerMinute(intervalMs))
+    {
+    }
+
+    void add(unsigned value)
+    {
+        _fine.add(value);
+
+        _minuteSum += value;
+        if (++_minuteCount >= _samplesPerMinute)
+        {
+            const unsigned minuteAvg = _minuteSum / _minuteCount;
+            _minutes.add(minuteAvg);
+            _minuteSum = 0;
+            _minuteCount = 0;
+
+            _hourSum += minuteAvg;
+            if (++_hourCount >= 60)
+            {
+                _hours.add(_hourSum / _hourCount);
+                _hourSum = 0;
+                _hourCount = 0;
+            }
+        }
+    }
+
+    /// Adjust to a changed sampling interval; the minute in
+    /// progress restarts.
+    void setInterval(unsigned intervalMs)
+    {
+        _samplesPerMinute = samplesPerMinute(intervalMs);
+        _minuteSum = 0;
+        _minuteCount = 0;
+    }
+
+    /// Resize the raw tier; the downsampled tiers have fixed spans.
+    void setCapacity(unsigned capacity) { _fine.setCapacity(capacity); }
+
+    unsigned getCapacity() const { return _fine.getCapacity(); }
+
+    void clear()
+    {
+        _fine.clear();
+        _minutes.clear();
+        _hours.clear();
+        _minuteSum = 0;
+        _minuteCount = 0;
+        _hourSum = 0;
+        _hourCount = 0;
+    }
+
+    const std::string& toString() const { return _fine.toString(); }
+
+    const std::string& minutesToString() const { return _minutes.toString(); }
+
+    const std::string& hoursToString() const { return _hours.toString(); }
+
+private:
+    static unsigned samplesPerMinute(unsigned intervalMs)
+    {
+        return intervalMs > 0 ? std::max(60 * 1000 / intervalMs, 1u) : 1;
+    }
+
+private:
+    StatsRing _fine;
+    StatsRing _minutes;
+    StatsRing _hours;
+    unsigned _samplesPerMinute;
+    unsigned long _minuteSum = 0;
+    unsigned _minuteCount = 0;
+    unsigned long _hourSum = 0;
+    unsigned _hourCount = 0;
+};
+
 /// An Admin session subscriber.
 class Subscriber
 {
@@ -142,9 +352,18 @@ public:
 
     std::string query(const std::string& command);
 
-    /// Returns memory consumed by all active loolkit processes
+    /// Returns memory consumed by all active loolkit processes.
+    /// Also refreshes each document's cached figure and notifies
+    /// subscribers of the changed ones in one batched 'propchange'.
     unsigned getTotalMemoryUsage();
 
+    /// Returns the summed CPU usage of all active loolkit processes,
+    /// as a percentage of one CPU, from /proc/<pid>/stat deltas over
+    /// the given interval. Also refreshes each document's cached
+    /// figure and notifies subscribers of the changed ones in one
+    /// batched 'propchange'.
+    unsigned getTotalCpuUsage(unsigned intervalMs);
+
     void subscribe(int sessionId, std::shared_ptr<Poco::Net::WebSocket>& ws);
     void subscribe(int sessionId, const std::string& command);
 
@@ -162,6 +381,10 @@ public:
 
     void setMemStatsSize(unsigned size);
 
+    void setCpuStatsInterval(unsigned intervalMs) { _cpuStats.setInterval(intervalMs); }
+
+    void setMemStatsInterval(unsigned intervalMs) { _memStats.setInterval(intervalMs); }
+
     void notify(const std::string& message);
 
     void addDocument(const std::string& docKey, Poco::Process::PID pid, const std::string& filename, const std::string& sessionId);
@@ -171,9 +394,9 @@ public:
 
 private:
 
-    std::string getMemStats();
+    const std::string& getMemStats() { return _memStats.toString(); }
 
-    std::string getCpuStats();
+    const std::string& getCpuStats() { return _cpuStats.toString(); }
 
     unsigned getTotalActiveViews();
 
@@ -183,11 +406,10 @@ private:
     std::map<int, Subscriber> _subscribers;
     std::map<std::string, Document> _documents;
 
-    std::list<unsigned> _memStats;
-    unsigned _memStatsSize = 100;
-
-    std::list<unsigned> _cpuStats;
-    unsigned _cpuStatsSize = 100;
+    // The default interval matches Admin's; it updates the moment
+    // Admin starts (or reschedules) the stats timers.
+    StatsHistory _memStats{ 100, 5000 };
+    StatsHistory _cpuStats{ 100, 5000 };
 };
 
 #endif
@@ -10,6 +10,9 @@
 #include "ChildSession.hpp"
 #include "config.h"
 
+#include <unistd.h>
+
+#include <cstdlib>
 #include <sstream>
 
 #include <Poco/JSON/Object.h>
@@ -76,7 +79,7 @@ void ChildSession::disconnect()
 bool ChildSession::_handleInput(const char *buffer, int length)
 {
     const std::string firstLine = getFirstLine(buffer, length);
-    StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    Tokenizer tokens(firstLine);
 
     if (LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]))
     {
@@ -276,7 +279,7 @@ bool ChildSession::_handleInput(const char *buffer, int length)
     return true;
 }
 
-bool ChildSession::loadDocument(const char * /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::loadDocument(const char * /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int part = -1;
     if (tokens.count() < 2)
@@ -346,7 +349,7 @@ bool ChildSession::loadDocument(const char * /*buffer*/, int /*length*/, StringT
     return true;
 }
 
-bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     std::string font, decodedFont;
 
@@ -358,7 +361,7 @@ bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, Str
     }
 
     URI::decode(font, decodedFont);
-    std::string response = "renderfont: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
+    std::string response = "renderfont: " + tokens.cat(" ", 1) + "\n";
 
     std::vector<char> output;
     output.resize(response.size());
@@ -379,7 +382,8 @@ bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, Str
     Log::trace("renderFont [" + font + "] rendered in " + std::to_string(timestamp.elapsed()/1000.) + "ms");
 
     if (!ptrFont ||
-        !png::encodeBufferToPNG(ptrFont, width, height, output, LOK_TILEMODE_RGBA))
+        !png::encodeBufferToPNG(ptrFont, width, height, output, LOK_TILEMODE_RGBA,
+                                png::EncodeProfile::Compact))
     {
         std::free(ptrFont);
         return sendTextFrame("error: cmd=renderfont kind=failure");
@@ -441,7 +445,7 @@ void insertUserNames(const std::map<int, std::string>& viewInfo, std::string& js
 
 }
 
-bool ChildSession::getCommandValues(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::getCommandValues(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     bool success;
     char* pValues;
@@ -497,7 +501,7 @@ bool ChildSession::getPartPageRectangles(const char* /*buffer*/, int /*length*/)
     return true;
 }
 
-bool ChildSession::clientZoom(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::clientZoom(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int tilePixelWidth, tilePixelHeight, tileTwipWidth, tileTwipHeight;
 
@@ -519,7 +523,7 @@ bool ChildSession::clientZoom(const char* /*buffer*/, int /*length*/, StringToke
     return true;
 }
 
-bool ChildSession::clientVisibleArea(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::clientVisibleArea(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int x;
     int y;
@@ -544,7 +548,7 @@ bool ChildSession::clientVisibleArea(const char* /*buffer*/, int /*length*/, Str
     return true;
 }
 
-bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     std::string name, id, format, filterOptions;
 
@@ -562,7 +566,7 @@ bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, StringToke
     {
         if (tokens.count() > 5)
         {
-            filterOptions += Poco::cat(std::string(" "), tokens.begin() + 5, tokens.end());
+            filterOptions += tokens.cat(" ", 5);
         }
     }
 
@@ -573,16 +577,54 @@ bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, StringToke
     const Poco::Path filenameParam(name);
     const auto url = JAILED_DOCUMENT_ROOT + tmpDir + "/" + filenameParam.getFileName();
 
+    // Export from a copy-on-write snapshot: fork() while holding the
+    // document lock (so the core is quiescent), run saveAs in the child
+    // against its frozen copy of the document state, and keep serving
+    // edits and tiles here in the meantime. The output lands in the
+    // shared jail filesystem where the parent can stream it from.
+    pid_t exportPid = -1;
     {
         auto lock(_loKitDocument->getLock());
 
-        _loKitDocument->saveAs(url.c_str(),
-                format.size() == 0 ? nullptr :format.c_str(),
-                filterOptions.size() == 0 ? nullptr : filterOptions.c_str());
+        exportPid = fork();
+        if (exportPid == 0)
+        {
+            const auto success = _loKitDocument->saveAs(url.c_str(),
+                    format.size() == 0 ? nullptr : format.c_str(),
+                    filterOptions.size() == 0 ? nullptr : filterOptions.c_str());
+            // Skip destructors; the websocket and the jail belong to
+            // the parent.
+            _exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
     }
 
-    sendTextFrame("downloadas: jail=" + _jailId + " dir=" + tmpDir + " name=" + name +
-                  " port=" + std::to_string(ClientPortNumber) + " id=" + id);
+    if (exportPid < 0)
+    {
+        // Out of processes; export in-line as before.
+        Log::syserror("fork() failed, exporting in-process.");
+        {
+            auto lock(_loKitDocument->getLock());
+
+            _loKitDocument->saveAs(url.c_str(),
+                    format.size() == 0 ? nullptr : format.c_str(),
+                    filterOptions.size() == 0 ? nullptr : filterOptions.c_str());
+        }
+
+        sendTextFrame("downloadas: jail=" + _jailId + " dir=" + tmpDir + " name=" + name +
+                      " port=" + std::to_string(ClientPortNumber) + " id=" + id);
+        return true;
+    }
+
+    // Reap the exporter and announce the result only then. The watcher
+    // belongs to the document, which outlives this session: a client
+    // that starts a long export and disconnects still leaves a live
+    // document behind it, never a dangling manager pointer.
+    const auto doneMsg = "client-" + getId() + " downloadas: jail=" + _jailId + " dir=" + tmpDir +
+                         " name=" + name + " port=" + std::to_string(ClientPortNumber) +
+                         " id=" + id;
+    const auto failMsg = "client-" + getId() + " error: cmd=downloadas kind=savefailed";
+    _docManager.watchExport(exportPid, doneMsg, failMsg);
+
     return true;
 }
 
@@ -592,7 +634,7 @@ bool ChildSession::getChildId()
     return true;
 }
 
-bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     std::string mimeType;
 
@@ -617,7 +659,7 @@ bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, Stri
     return true;
 }
 
-bool ChildSession::paste(const char* buffer, int length, StringTokenizer& tokens)
+bool ChildSession::paste(const char* buffer, int length, Tokenizer& tokens)
 {
     std::string mimeType;
 
@@ -640,7 +682,7 @@ bool ChildSession::paste(const char* buffer, int length, StringTokenizer& tokens
     return true;
 }
 
-bool ChildSession::insertFile(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::insertFile(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     std::string name, type;
     if (tokens.count() != 3 ||
@@ -671,7 +713,7 @@ bool ChildSession::insertFile(const char* /*buffer*/, int /*length*/, StringToke
     return true;
 }
 
-bool ChildSession::keyEvent(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::keyEvent(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int type, charcode, keycode;
     if (tokens.count() != 4 ||
@@ -710,7 +752,7 @@ bool ChildSession::keyEvent(const char* /*buffer*/, int /*length*/, StringTokeni
     return true;
 }
 
-bool ChildSession::mouseEvent(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::mouseEvent(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int type, x, y, count;
     bool success = true;
@@ -755,7 +797,7 @@ bool ChildSession::mouseEvent(const char* /*buffer*/, int /*length*/, StringToke
     return true;
 }
 
-bool ChildSession::unoCommand(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::unoCommand(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     if (tokens.count() <= 1)
     {
@@ -763,32 +805,34 @@ bool ChildSession::unoCommand(const char* /*buffer*/, int /*length*/, StringToke
         return false;
     }
 
+    const std::string command = tokens[1];
+
     // we need to get LOK_CALLBACK_UNO_COMMAND_RESULT callback when saving
-    const bool bNotify = (tokens[1] == ".uno:Save");
+    const bool bNotify = (command == ".uno:Save");
 
     auto lock(_loKitDocument->getLock());
 
     _loKitDocument->setView(_viewId);
 
-    if (tokens.count() == 2 && tokens[1] == ".uno:fakeDiskFull")
+    if (tokens.count() == 2 && command == ".uno:fakeDiskFull")
     {
         Util::alertAllUsers("internal", "diskfull");
     }
     else if (tokens.count() == 2)
     {
-        _loKitDocument->postUnoCommand(tokens[1].c_str(), nullptr, bNotify);
+        _loKitDocument->postUnoCommand(command.c_str(), nullptr, bNotify);
     }
     else
     {
-        _loKitDocument->postUnoCommand(tokens[1].c_str(),
-                                       Poco::cat(std::string(" "), tokens.begin() + 2, tokens.end()).c_str(),
+        _loKitDocument->postUnoCommand(command.c_str(),
+                                       tokens.cat(" ", 2).c_str(),
                                        bNotify);
     }
 
     return true;
 }
 
-bool ChildSession::selectText(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::selectText(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int type, x, y;
     if (tokens.count() != 4 ||
@@ -813,7 +857,7 @@ bool ChildSession::selectText(const char* /*buffer*/, int /*length*/, StringToke
     return true;
 }
 
-bool ChildSession::selectGraphic(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::selectGraphic(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int type, x, y;
     if (tokens.count() != 4 ||
@@ -837,7 +881,7 @@ bool ChildSession::selectGraphic(const char* /*buffer*/, int /*length*/, StringT
     return true;
 }
 
-bool ChildSession::resetSelection(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::resetSelection(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     if (tokens.count() != 1)
     {
@@ -854,7 +898,7 @@ bool ChildSession::resetSelection(const char* /*buffer*/, int /*length*/, String
     return true;
 }
 
-bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     std::string url, format, filterOptions;
 
@@ -871,7 +915,7 @@ bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, StringTokenize
     {
         if (tokens.count() > 4)
         {
-            filterOptions += Poco::cat(std::string(" "), tokens.begin() + 4, tokens.end());
+            filterOptions += tokens.cat(" ", 4);
         }
     }
 
@@ -895,7 +939,7 @@ bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, StringTokenize
     return true;
 }
 
-bool ChildSession::setClientPart(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::setClientPart(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int part;
     if (tokens.count() < 2 ||
@@ -917,7 +961,7 @@ bool ChildSession::setClientPart(const char* /*buffer*/, int /*length*/, StringT
     return true;
 }
 
-bool ChildSession::setPage(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ChildSession::setPage(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     int page;
     if (tokens.count() < 2 ||
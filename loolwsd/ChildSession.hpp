@@ -10,6 +10,8 @@
 #ifndef INCLUDED_CHILDSESSION_HPP
 #define INCLUDED_CHILDSESSION_HPP
 
+#include <sys/types.h>
+
 #include <mutex>
 
 #include <Poco/Thread.h>
@@ -53,6 +55,14 @@ public:
 
     virtual
     bool sendTextFrame(const std::string& message) = 0;
+
+    /// Watch the forked snapshot exporter with the given pid and
+    /// deliver doneMsg (or failMsg) when it exits. The watcher belongs
+    /// to the document, which outlives the calling session and joins
+    /// the watcher before going away.
+    virtual
+    void watchExport(const pid_t pid, const std::string& doneMsg,
+                     const std::string& failMsg) = 0;
 };
 
 /// Represents a session to the WSD process, in a Kit process. Note that this is not a singleton.
@@ -95,27 +105,27 @@ public:
     }
 
 private:
-    bool loadDocument(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool loadDocument(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
 
-    bool sendFontRendering(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool getCommandValues(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool sendFontRendering(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool getCommandValues(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
 
-    bool clientZoom(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool clientVisibleArea(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool downloadAs(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool clientZoom(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool clientVisibleArea(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool downloadAs(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
     bool getChildId();
-    bool getTextSelection(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool paste(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool insertFile(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool keyEvent(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool mouseEvent(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool unoCommand(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool selectText(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool selectGraphic(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool resetSelection(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool saveAs(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool setClientPart(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool setPage(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool getTextSelection(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool paste(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool insertFile(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool keyEvent(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool mouseEvent(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool unoCommand(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool selectText(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool selectGraphic(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool resetSelection(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool saveAs(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool setClientPart(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool setPage(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
 
     virtual void disconnect() override;
     virtual bool _handleInput(const char *buffer, int length) override;
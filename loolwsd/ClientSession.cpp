@@ -10,6 +10,8 @@
 #include "ClientSession.hpp"
 #include "config.h"
 
+#include <chrono>
+#include <cstdio>
 #include <fstream>
 
 #include <Poco/FileStream.h>
@@ -19,20 +21,52 @@
 #include <Poco/URIStreamOpener.h>
 
 #include "Common.hpp"
+#include "Histogram.hpp"
 #include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLSession.hpp"
 #include "LOOLWSD.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "PrisonerSession.hpp"
 #include "Rectangle.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
+#include "UserMessages.hpp"
 #include "Util.hpp"
 
 using namespace LOOLProtocol;
 
-using Poco::StringTokenizer;
+namespace
+{
+
+/// The tile position part of a "tile:" first-line, without the
+/// version/imgsize tail that varies between renders of the same tile.
+std::string tilePositionKey(const std::string& firstLine)
+{
+    const auto pos = firstLine.find(" ver=");
+    return pos == std::string::npos ? firstLine : firstLine.substr(0, pos);
+}
+
+/// Whether a queued message may be packed into a 'bundle:' frame.
+/// Bundle parts are newline-delimited, so only single-line text
+/// messages qualify.
+bool isBundlable(const Message& message)
+{
+    return !message.isBinary() &&
+           std::memchr(message.data(), '\n', message.size()) == nullptr;
+}
+
+/// An unguessable token for reattaching to this session.
+std::string generateResumeToken()
+{
+    std::ostringstream oss;
+    oss << std::hex << Util::rng::getNext() << Util::rng::getNext()
+        << Util::rng::getNext() << Util::rng::getNext();
+    return oss.str();
+}
+
+}
 
 ClientSession::ClientSession(const std::string& id,
                              std::shared_ptr<Poco::Net::WebSocket> ws,
@@ -41,9 +75,17 @@ ClientSession::ClientSession(const std::string& id,
     LOOLSession(id, Kind::ToClient, ws),
     _docBroker(std::move(docBroker)),
     _isReadOnly(readOnly),
-    _loadPart(-1)
+    _loadPart(-1),
+    _gotSnapshotStatus(false),
+    _resumeToken(generateResumeToken()),
+    _detached(false),
+    _bundling(false),
+    _stopSender(false)
 {
     Log::info("ClientSession ctor [" + getName() + "].");
+
+    ++Metrics::SessionsActive;
+    _senderThread = std::thread(&ClientSession::senderThread, this);
 }
 
 ClientSession::~ClientSession()
@@ -52,12 +94,186 @@ ClientSession::~ClientSession()
 
     // Release the save-as queue.
     _saveAsQueue.put("");
+
+    // Stop the sender; anything still queued is moot now.
+    {
+        std::lock_guard<std::mutex> lock(_senderMutex);
+        _stopSender = true;
+    }
+
+    _senderCv.notify_one();
+    if (_senderThread.joinable())
+    {
+        _senderThread.join();
+    }
+
+    Metrics::SenderQueueDepth -= _senderQueue.size();
+    --Metrics::SessionsActive;
+}
+
+bool ClientSession::enqueueSendMessage(const MessagePtr& message)
+{
+    if (isCloseFrame())
+    {
+        Log::trace(getName() + ": Client began the closing handshake. Dropping message: " +
+                   message->abbreviation());
+        return true;
+    }
+    else if (isHeadless())
+    {
+        // Fail silently and return as there is no actual websocket
+        // connection in this case.
+        Log::info(getName() + ": Headless client, not sending message: " + message->abbreviation());
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(_senderMutex);
+
+    if (message->firstToken() == "tile:")
+    {
+        // A newer version of a tile supersedes any queued one.
+        const auto key = tilePositionKey(message->firstLine());
+        for (auto& queued : _senderQueue)
+        {
+            if (queued->firstToken() == "tile:" &&
+                tilePositionKey(queued->firstLine()) == key)
+            {
+                Log::debug(getName() + ": Replacing superseded queued tile: " + queued->firstLine());
+                queued = message;
+                lock.unlock();
+                _senderCv.notify_one();
+                return true;
+            }
+        }
+
+        if (_senderQueue.size() >= MaxSenderQueueSize)
+        {
+            // The client is not keeping up. Drop the tile rather than
+            // blocking the producer; the client re-requests what it
+            // still needs.
+            Log::warn(getName() + ": Send queue full, dropping tile: " + message->firstLine());
+            return false;
+        }
+    }
+
+    _senderQueue.push_back(message);
+    ++Metrics::SenderQueueDepth;
+    lock.unlock();
+    _senderCv.notify_one();
+    return true;
+}
+
+void ClientSession::senderThread()
+{
+    Util::setThreadName("client_snd_" + getId());
+
+    std::vector<MessagePtr> batch;
+    while (true)
+    {
+        batch.clear();
+        {
+            std::unique_lock<std::mutex> lock(_senderMutex);
+            _senderCv.wait(lock, [this] { return _stopSender ||
+                                                 (!_senderQueue.empty() && !_detached); });
+            if (_stopSender)
+            {
+                break;
+            }
+
+            batch.push_back(_senderQueue.front());
+            _senderQueue.pop_front();
+            --Metrics::SenderQueueDepth;
+
+            if (_bundling && isBundlable(*batch[0]))
+            {
+                // Let the burst of small messages that typically
+                // follows (cursor, state changes) accumulate briefly,
+                // so they can share one frame.
+                _senderCv.wait_for(lock, std::chrono::milliseconds(BundleWindowMs),
+                                   [this] { return _stopSender.load(); });
+
+                while (!_senderQueue.empty() && isBundlable(*_senderQueue.front()))
+                {
+                    batch.push_back(_senderQueue.front());
+                    _senderQueue.pop_front();
+                    --Metrics::SenderQueueDepth;
+                }
+            }
+        }
+
+        if (batch.size() == 1)
+        {
+            if (batch[0]->firstToken() == "tile:")
+            {
+                // How long the tile sat in the sender queue, and how
+                // long the socket write itself takes.
+                Histogram::get("tile_queue_wait").record(batch[0]->elapsedMicros());
+
+                const auto start = std::chrono::steady_clock::now();
+                sendMessage(batch[0]);
+                Histogram::get("tile_send").record(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+            }
+            else
+            {
+                sendMessage(batch[0]);
+            }
+
+            continue;
+        }
+
+        // Pack the whole batch into a single multiplexed frame.
+        size_t size = 7; // strlen("bundle:")
+        for (const auto& part : batch)
+        {
+            size += part->size() + 1;
+        }
+
+        std::string bundle;
+        bundle.reserve(size);
+        bundle = "bundle:";
+        for (const auto& part : batch)
+        {
+            bundle += '\n';
+            bundle.append(part->data(), part->size());
+        }
+
+        Log::trace(getName() + ": Bundling " + std::to_string(batch.size()) + " messages.");
+        sendTextFrame(bundle);
+    }
+}
+
+void ClientSession::detach()
+{
+    {
+        std::lock_guard<std::mutex> lock(_senderMutex);
+        _detached = true;
+    }
+
+    Log::info(getName() + ": Detached; buffering for resume.");
+}
+
+void ClientSession::rebind(const std::shared_ptr<Poco::Net::WebSocket>& ws)
+{
+    setWebSocket(ws);
+
+    size_t buffered;
+    {
+        std::lock_guard<std::mutex> lock(_senderMutex);
+        _detached = false;
+        buffered = _senderQueue.size();
+    }
+
+    _senderCv.notify_one();
+    Log::info(getName() + ": Rebound to a new socket; flushing " +
+              std::to_string(buffered) + " buffered messages.");
 }
 
 bool ClientSession::_handleInput(const char *buffer, int length)
 {
     const std::string firstLine = getFirstLine(buffer, length);
-    StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    Tokenizer tokens(firstLine);
     Log::trace(getName() + ": handling [" + firstLine + "].");
 
     LOOLWSD::dumpIncomingTrace(_docBroker->getJailId(), getId(), firstLine);
@@ -68,6 +284,16 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         updateLastActivityTime();
     }
 
+    if (_docBroker->isHibernated())
+    {
+        // Any client traffic revives a hibernated document.
+        if (!_docBroker->wakeUp())
+        {
+            sendTextFrame(SERVICE_UNAVAILABLE_INTERNAL_ERROR);
+            return false;
+        }
+    }
+
     if (tokens[0] == "loolclient")
     {
         const auto versionTuple = ParseVersion(tokens[1]);
@@ -78,6 +304,16 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             return false;
         }
 
+        // Optional capability tokens follow the version.
+        for (size_t i = 2; i < tokens.count(); ++i)
+        {
+            if (tokens[i] == "bundle")
+            {
+                Log::info(getName() + ": Client supports message bundling.");
+                _bundling = true;
+            }
+        }
+
         // Send LOOL version information
         std::string version, hash;
         Util::getVersionInfo(version, hash);
@@ -127,7 +363,8 @@ bool ClientSession::_handleInput(const char *buffer, int length)
              tokens[0] != "tilecombine" &&
              tokens[0] != "uno" &&
              tokens[0] != "useractive" &&
-             tokens[0] != "userinactive")
+             tokens[0] != "userinactive" &&
+             tokens[0] != "viewport")
     {
         sendTextFrame("error: cmd=" + tokens[0] + " kind=unknown");
         return false;
@@ -172,6 +409,10 @@ bool ClientSession::_handleInput(const char *buffer, int length)
     {
         return sendCombinedTiles(buffer, length, tokens);
     }
+    else if (tokens[0] == "viewport")
+    {
+        return sendViewportTiles(buffer, length, tokens);
+    }
     else
     {
         // All other commands are such that they always require a
@@ -204,7 +445,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
     return false;
 }
 
-bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     if (tokens.count() < 2)
     {
@@ -219,44 +460,84 @@ bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/, StringT
         std::string timestamp;
         parseDocOptions(tokens, _loadPart, timestamp);
 
-        std::ostringstream oss;
-        oss << "load";
-        oss << " url=" << _docBroker->getPublicUri().toString();
-        oss << " jail=" << _docBroker->getJailedUri().toString();
+        return sendLoadRequest();
+    }
+    catch (const Poco::SyntaxException&)
+    {
+        sendTextFrame("error: cmd=load kind=uriinvalid");
+    }
+
+    return false;
+}
 
-        if (!_userName.empty())
-        {
-            std::string encodedUserName;
-            Poco::URI::encode(_userName, "", encodedUserName);
-            oss << " author=" + encodedUserName;
-        }
+bool ClientSession::sendLoadRequest()
+{
+    std::ostringstream oss;
+    oss << "load";
+    oss << " url=" << _docBroker->getPublicUri().toString();
+    oss << " jail=" << _docBroker->getJailedUri().toString();
+
+    if (!_userName.empty())
+    {
+        std::string encodedUserName;
+        Poco::URI::encode(_userName, "", encodedUserName);
+        oss << " author=" + encodedUserName;
+    }
 
-        if (_loadPart >= 0)
-            oss << " part=" + std::to_string(_loadPart);
+    if (_loadPart >= 0)
+        oss << " part=" + std::to_string(_loadPart);
 
-        if (_haveDocPassword)
-            oss << " password=" << _docPassword;
+    if (_haveDocPassword)
+        oss << " password=" << _docPassword;
 
-        if (!_docOptions.empty())
-            oss << " options=" << _docOptions;
+    if (!_docOptions.empty())
+        oss << " options=" << _docOptions;
 
-        const auto loadRequest = oss.str();
-        return forwardToChild(loadRequest.c_str(), loadRequest.size());
+    const auto loadRequest = oss.str();
+    if (!forwardToChild(loadRequest.c_str(), loadRequest.size()))
+    {
+        return false;
     }
-    catch (const Poco::SyntaxException&)
+
+    // Replay the join snapshot, if the broker has one: the document
+    // is already loaded, so the client can build its UI from the
+    // cached status while the kit sets up the new view.
+    const auto status = _docBroker->getJoinReply("status");
+    if (!status.empty())
     {
-        sendTextFrame("error: cmd=load kind=uriinvalid");
+        Log::debug(getName() + ": Replaying status from the join snapshot.");
+        _gotSnapshotStatus = true;
+        sendTextFrame(status);
     }
 
-    return false;
+    return true;
+}
+
+bool ClientSession::resendDocumentLoad()
+{
+    if (_docURL.empty())
+    {
+        // Nothing was loaded over this session yet;
+        // the client drives the load itself.
+        return false;
+    }
+
+    Log::info(getName() + ": Replaying the document load into the new kit.");
+    return sendLoadRequest();
 }
 
 bool ClientSession::getStatus(const char *buffer, int length)
 {
+    const auto status = _docBroker->getJoinReply("status");
+    if (!status.empty())
+    {
+        return sendTextFrame(status);
+    }
+
     return forwardToChild(buffer, length);
 }
 
-bool ClientSession::getCommandValues(const char *buffer, int length, StringTokenizer& tokens)
+bool ClientSession::getCommandValues(const char *buffer, int length, Tokenizer& tokens)
 {
     std::string command;
     if (tokens.count() != 2 || !getTokenString(tokens[1], "command", command))
@@ -284,7 +565,7 @@ bool ClientSession::getPartPageRectangles(const char *buffer, int length)
     return forwardToChild(buffer, length);
 }
 
-bool ClientSession::sendFontRendering(const char *buffer, int length, StringTokenizer& tokens)
+bool ClientSession::sendFontRendering(const char *buffer, int length, Tokenizer& tokens)
 {
     std::string font;
     if (tokens.count() < 2 ||
@@ -293,7 +574,7 @@ bool ClientSession::sendFontRendering(const char *buffer, int length, StringToke
         return sendTextFrame("error: cmd=renderfont kind=syntax");
     }
 
-    const std::string response = "renderfont: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
+    const std::string response = "renderfont: " + tokens.cat(" ", 1) + "\n";
 
     std::vector<char> output;
     output.resize(response.size());
@@ -316,11 +597,20 @@ bool ClientSession::sendFontRendering(const char *buffer, int length, StringToke
     return forwardToChild(buffer, length);
 }
 
-bool ClientSession::sendTile(const char * /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ClientSession::sendTile(const char* buffer, int length, Tokenizer& /*tokens*/)
 {
     try
     {
-        auto tileDesc = TileDesc::parse(tokens);
+        auto tileDesc = TileDesc::parse(buffer, length);
+
+        // Fast path: a cached tile goes from memory to the sender
+        // queue without touching the broker's tile lock, so scrolling
+        // back over rendered content never waits behind renders.
+        if (sendCachedTile(tileDesc))
+        {
+            return true;
+        }
+
         _docBroker->handleTileRequest(tileDesc, shared_from_this());
     }
     catch (const std::exception& exc)
@@ -332,11 +622,82 @@ bool ClientSession::sendTile(const char * /*buffer*/, int /*length*/, StringToke
     return true;
 }
 
-bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
+bool ClientSession::sendCachedTile(TileDesc& tileDesc)
+{
+    // Probe first: a miss falls through to the broker, which does the
+    // counted lookup, so the cache statistics see each request once.
+    if (!_docBroker->tileCache().hasTile(tileDesc))
+    {
+        return false;
+    }
+
+    const auto cachedTile = _docBroker->tileCache().lookupTile(tileDesc);
+    if (!cachedTile)
+    {
+        // Evicted between the probe and the lookup; render it.
+        return false;
+    }
+
+    return sendCachedTileData(tileDesc, cachedTile);
+}
+
+bool ClientSession::sendCachedTileData(TileDesc& tileDesc, const TileCache::Tile& cachedTile)
+{
+    tileDesc.setVersion(_docBroker->nextTileVersion());
+
+#if ENABLE_DEBUG
+    const std::string response = tileDesc.serialize("tile:") + " renderid=cached\n";
+#else
+    const std::string response = tileDesc.serialize("tile:") + '\n';
+#endif
+
+    std::vector<char> output;
+    output.reserve(response.size() + cachedTile->size());
+    output.insert(output.end(), response.begin(), response.end());
+    output.insert(output.end(), cachedTile->begin(), cachedTile->end());
+
+    return enqueueSendMessage(
+        std::make_shared<Message>(std::move(output), Message::Type::Binary));
+}
+
+bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
 {
     try
     {
         auto tileCombined = TileCombined::parse(tokens);
+
+        // Fast path: when every tile of the request is cached, stream
+        // them here and skip the broker (and its tile lock) entirely.
+        // The stats-free probe keeps the cache statistics from seeing
+        // the request twice when we fall through to the broker.
+        bool allCached = true;
+        for (const auto& tile : tileCombined.getTiles())
+        {
+            if (!_docBroker->tileCache().hasTile(tile))
+            {
+                allCached = false;
+                break;
+            }
+        }
+
+        if (allCached)
+        {
+            std::vector<std::pair<TileDesc, TileCache::Tile>> hits;
+            std::vector<TileDesc> misses;
+            _docBroker->tileCache().lookupTiles(tileCombined.getTiles(), hits, misses);
+            if (misses.empty())
+            {
+                for (auto& hit : hits)
+                {
+                    sendCachedTileData(hit.first, hit.second);
+                }
+
+                return true;
+            }
+
+            // Evicted between the probe and the lookup; render below.
+        }
+
         _docBroker->handleTileCombinedRequest(tileCombined, shared_from_this());
     }
     catch (const std::exception& exc)
@@ -348,6 +709,41 @@ bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, St
     return true;
 }
 
+bool ClientSession::sendViewportTiles(const char* /*buffer*/, int /*length*/, Tokenizer& tokens)
+{
+    int part = -1;
+    int width = 0;
+    int height = 0;
+    int tileWidth = 0;
+    int tileHeight = 0;
+    std::string area;
+    if (!getTokenInteger(tokens, "part", part) ||
+        !getTokenInteger(tokens, "width", width) ||
+        !getTokenInteger(tokens, "height", height) ||
+        !getTokenString(tokens, "area", area) ||
+        !getTokenInteger(tokens, "tilewidth", tileWidth) ||
+        !getTokenInteger(tokens, "tileheight", tileHeight))
+    {
+        return sendTextFrame("error: cmd=viewport kind=syntax");
+    }
+
+    int areaX = 0;
+    int areaY = 0;
+    int areaWidth = 0;
+    int areaHeight = 0;
+    if (std::sscanf(area.c_str(), "%d,%d,%d,%d", &areaX, &areaY, &areaWidth, &areaHeight) != 4 ||
+        areaX < 0 || areaY < 0 || areaWidth <= 0 || areaHeight <= 0 ||
+        part < 0 || width <= 0 || height <= 0 || tileWidth <= 0 || tileHeight <= 0)
+    {
+        return sendTextFrame("error: cmd=viewport kind=syntax");
+    }
+
+    _docBroker->handleViewportRequest(part, width, height,
+                                      areaX, areaY, areaWidth, areaHeight,
+                                      tileWidth, tileHeight, shared_from_this());
+    return true;
+}
+
 bool ClientSession::shutdownPeer(Poco::UInt16 statusCode)
 {
     auto peer = _peer.lock();
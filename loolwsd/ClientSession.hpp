@@ -10,8 +10,15 @@
 #ifndef INCLUDED_CLIENTSSESSION_HPP
 #define INCLUDED_CLIENTSSESSION_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include "LOOLSession.hpp"
 #include "MessageQueue.hpp"
+#include "TileCache.hpp"
 
 class DocumentBroker;
 class PrisonerSession;
@@ -52,22 +59,71 @@ public:
 
     std::shared_ptr<DocumentBroker> getDocumentBroker() const { return _docBroker; }
 
+    /// Queue a message for delivery to the client by the dedicated
+    /// sender thread and return immediately, so that a slow client
+    /// link never stalls the caller. A newer version of a tile
+    /// replaces a queued older one; when the client falls too far
+    /// behind, excess tiles are dropped (the client re-requests what
+    /// it still needs).
+    bool enqueueSendMessage(const MessagePtr& message);
+
+    /// Re-send the load request to a fresh kit after its document
+    /// has been woken from hibernation. Returns true if a load was
+    /// actually replayed; false if this session never loaded.
+    bool resendDocumentLoad();
+
+    /// Whether this session already got the document status from the
+    /// broker's join snapshot, making the kit's own copy a duplicate.
+    bool gotSnapshotStatus() const { return _gotSnapshotStatus; }
+
+    /// The token a reconnecting client presents to reattach to this
+    /// session within the resume window.
+    const std::string& getResumeToken() const { return _resumeToken; }
+
+    /// The socket dropped but the client may come back: pause the
+    /// sender thread so the queue buffers what changes. Tiles beyond
+    /// the queue cap are dropped as usual; the client re-requests
+    /// them from the warm cache after resuming.
+    void detach();
+
+    /// Attach a freshly accepted socket to this parked session and
+    /// flush the messages buffered while detached.
+    void rebind(const std::shared_ptr<Poco::Net::WebSocket>& ws);
+
+    bool isDetached() const { return _detached; }
+
 private:
 
     virtual bool _handleInput(const char *buffer, int length) override;
 
-    bool loadDocument(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool loadDocument(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+
+    /// Build and forward the load request for this session's document.
+    bool sendLoadRequest();
 
     bool getStatus(const char *buffer, int length);
-    bool getCommandValues(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool getCommandValues(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
     bool getPartPageRectangles(const char *buffer, int length);
 
-    bool sendTile(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool sendCombinedTiles(const char *buffer, int length, Poco::StringTokenizer& tokens);
-    bool sendFontRendering(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool sendTile(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+    bool sendCombinedTiles(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+
+    /// Parse a 'viewport' subscription and hand the area to the
+    /// broker, which derives and schedules the tiles itself.
+    bool sendViewportTiles(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
+
+    /// The cache-hit fast path: stream a cached tile straight to the
+    /// sender queue, without entering the broker. Returns false on a
+    /// cache miss.
+    bool sendCachedTile(TileDesc& tileDesc);
+    bool sendCachedTileData(TileDesc& tileDesc, const TileCache::Tile& cachedTile);
+    bool sendFontRendering(const char *buffer, int length, LOOLProtocol::Tokenizer& tokens);
 
     bool forwardToChild(const char *buffer, int length);
 
+    /// Delivers queued messages to the client.
+    void senderThread();
+
 private:
 
     std::shared_ptr<DocumentBroker> _docBroker;
@@ -82,6 +138,35 @@ private:
     MessageQueue _saveAsQueue;
 
     int _loadPart;
+
+    /// Whether the load handshake was answered from the join snapshot.
+    std::atomic<bool> _gotSnapshotStatus;
+
+    /// Survives a WebSocket drop: never sent over the document's
+    /// own channel to other views, only to this session's client.
+    const std::string _resumeToken;
+
+    /// Set while no client socket is attached; the sender thread
+    /// then buffers instead of writing.
+    std::atomic<bool> _detached;
+
+    /// The bound on _senderQueue; beyond it tiles are dropped.
+    static constexpr size_t MaxSenderQueueSize = 256;
+
+    /// How long the sender thread lets further small messages
+    /// accumulate before packing what it has into a single frame.
+    static constexpr int BundleWindowMs = 5;
+
+    /// Whether the client negotiated message bundling by appending
+    /// 'bundle' to its 'loolclient' handshake.
+    std::atomic<bool> _bundling;
+
+    /// Messages waiting to be written to the client socket.
+    std::deque<MessagePtr> _senderQueue;
+    std::mutex _senderMutex;
+    std::condition_variable _senderCv;
+    std::atomic<bool> _stopSender;
+    std::thread _senderThread;
 };
 
 #endif
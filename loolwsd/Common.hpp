@@ -32,11 +32,23 @@ constexpr int READ_BUFFER_SIZE = 2048;
 /// size are considered small messages.
 constexpr int SMALL_MESSAGE_SIZE = READ_BUFFER_SIZE / 2;
 
+/// Default per-document budget, in bytes, for the in-memory tile cache layer.
+constexpr size_t DEFAULT_TILE_CACHE_MEMORY_SIZE = 32 * 1024 * 1024;
+/// Default per-document budget, in bytes, for the persistent tile store.
+constexpr size_t DEFAULT_TILE_CACHE_STORE_SIZE = 128 * 1024 * 1024;
+/// Default budget, in bytes, for the tile stores of all documents together.
+constexpr size_t DEFAULT_TILE_CACHE_GLOBAL_SIZE = 1024 * 1024 * 1024;
+
 constexpr auto JAILED_DOCUMENT_ROOT = "/user/docs/";
 constexpr auto CHILD_URI = "/loolws/child?";
 constexpr auto NEW_CHILD_URI = "/loolws/newchild?";
 constexpr auto LO_JAIL_SUBPATH = "lo";
 
+/// Subdirectory of the child root where forkit keeps jails
+/// provisioned ahead of need; a forked kit adopts one with a
+/// single rename instead of cloning the templates.
+constexpr auto READY_JAILS_SUBPATH = "ready";
+
 // The client port number, both loolwsd and the kits have this.
 extern int ClientPortNumber;
 extern int MasterPortNumber;
@@ -10,14 +10,17 @@
 #include "DocumentBroker.hpp"
 #include "config.h"
 
+#include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <sstream>
 
 #include <Poco/Path.h>
 #include <Poco/SHA1Engine.h>
 #include <Poco/StringTokenizer.h>
 
 #include "ClientSession.hpp"
+#include "Common.hpp"
 #include "Exceptions.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLWSD.hpp"
@@ -25,6 +28,8 @@
 #include "PrisonerSession.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
+#include "TileRing.hpp"
+#include "TraceSpan.hpp"
 #include "Unit.hpp"
 
 using namespace LOOLProtocol;
@@ -103,6 +108,7 @@ std::string DocumentBroker::getDocKey(const Poco::URI& uri)
 DocumentBroker::DocumentBroker() :
     _uriPublic(),
     _docKey(),
+    _docId(),
     _childRoot(),
     _cacheRoot(),
     _childProcess(),
@@ -111,16 +117,20 @@ DocumentBroker::DocumentBroker() :
     _lastEditableSession(true),
     _isLoaded(false),
     _isModified(false),
+    _hibernated(false),
+    _convertOnly(false),
     _cursorPosX(0),
     _cursorPosY(0),
     _cursorWidth(0),
     _cursorHeight(0),
-    _mutex(),
+    _sessionsMutex(),
     _saveMutex(),
+    _bridgesConnected(0),
     _tileVersion(0),
     _debugRenderedTileCount(0)
 {
     Log::info("Empty DocumentBroker (marked to destroy) created.");
+    ++Metrics::DocumentsActive;
 }
 
 DocumentBroker::DocumentBroker(const Poco::URI& uriPublic,
@@ -129,6 +139,7 @@ DocumentBroker::DocumentBroker(const Poco::URI& uriPublic,
                                std::shared_ptr<ChildProcess> childProcess) :
     _uriPublic(uriPublic),
     _docKey(docKey),
+    _docId(Util::encodeId(Util::rng::getNext(), 4)),
     _childRoot(childRoot),
     _cacheRoot(getCachePath(uriPublic.toString())),
     _childProcess(std::move(childProcess)),
@@ -137,12 +148,15 @@ DocumentBroker::DocumentBroker(const Poco::URI& uriPublic,
     _lastEditableSession(false),
     _isLoaded(false),
     _isModified(false),
+    _hibernated(false),
+    _convertOnly(false),
     _cursorPosX(0),
     _cursorPosY(0),
     _cursorWidth(0),
     _cursorHeight(0),
-    _mutex(),
+    _sessionsMutex(),
     _saveMutex(),
+    _bridgesConnected(0),
     _tileVersion(0),
     _debugRenderedTileCount(0)
 {
@@ -150,6 +164,7 @@ DocumentBroker::DocumentBroker(const Poco::URI& uriPublic,
     assert(!_childRoot.empty());
 
     Log::info("DocumentBroker [" + _uriPublic.toString() + "] created. DocKey: [" + _docKey + "]");
+    ++Metrics::DocumentsActive;
 }
 
 const StorageBase::FileInfo DocumentBroker::validate(const Poco::URI& uri)
@@ -180,7 +195,9 @@ bool DocumentBroker::load(const std::string& jailId)
 {
     Log::debug("Loading from URI: " + _uriPublic.toString());
 
-    std::unique_lock<std::mutex> lock(_mutex);
+    TraceSpan::Span loadSpan("wsd.load", _docKey);
+
+    std::unique_lock<std::mutex> lock(_saveMutex);
 
     if (_markToDestroy)
     {
@@ -194,7 +211,13 @@ bool DocumentBroker::load(const std::string& jailId)
     // We need to map it to a jailed path and copy the file there.
 
     // user/doc/jailId
-    const auto jailPath = Poco::Path(JAILED_DOCUMENT_ROOT, jailId);
+    auto jailPath = Poco::Path(JAILED_DOCUMENT_ROOT, jailId);
+    if (LOOLWSD::MultiDocKits)
+    {
+        // Documents sharing a kit share its jail; keep each in its
+        // own subdirectory so filenames cannot collide.
+        jailPath.pushDirectory(_docId);
+    }
     std::string jailRoot = getJailRoot();
 
     Log::info("jailPath: " + jailPath.toString() + ", jailRoot: " + jailRoot);
@@ -221,6 +244,8 @@ bool DocumentBroker::load(const std::string& jailId)
 
     if (_storage)
     {
+        TraceSpan::Span fetchSpan("wsd.storage.fetch", _docKey);
+
         const auto fileInfo = _storage->getFileInfo();
         _filename = fileInfo._filename;
 
@@ -229,7 +254,12 @@ bool DocumentBroker::load(const std::string& jailId)
 
         // Use the local temp file's timestamp.
         _lastFileModifiedTime = Poco::File(_storage->getLocalRootPath()).getLastModified();
-        _tileCache.reset(new TileCache(_uriPublic.toString(), _lastFileModifiedTime, _cacheRoot));
+        if (!_convertOnly)
+        {
+            // A conversion job never requests tiles; skip the cache
+            // (directory, tile store, write-behind thread) entirely.
+            _tileCache.reset(new TileCache(_uriPublic.toString(), _lastFileModifiedTime, _cacheRoot));
+        }
 
         return true;
     }
@@ -267,27 +297,148 @@ bool DocumentBroker::save(bool success, const std::string& result)
 
     Log::debug("Saving to URI [" + uri + "].");
 
-    assert(_storage && _tileCache);
-    if (_storage->saveLocalFileToStorage())
+    assert(_storage && (_tileCache || _convertOnly));
+
+    // Snapshot the saved file and release the document immediately;
+    // the upload happens in the background, so storage latency never
+    // blocks the interactive path.
+    const auto jailedFilePath = _storage->getJailedFilePath();
+    const auto snapshotPath = jailedFilePath + ".upload." + std::to_string(++_snapshotVersion);
+    try
+    {
+        Poco::File(jailedFilePath).copyTo(snapshotPath);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        Log::error("Failed to snapshot [" + jailedFilePath + "] for upload: " + exc.displayText());
+        return false;
+    }
+
+    _isModified = false;
+    _lastFileModifiedTime = newFileModifiedTime;
+    if (_tileCache)
     {
-        _isModified = false;
         _tileCache->setUnsavedChanges(false);
-        _lastFileModifiedTime = newFileModifiedTime;
         _tileCache->saveLastModified(_lastFileModifiedTime);
-        _lastSaveTime = std::chrono::steady_clock::now();
-        Log::debug("Saved to URI [" + uri + "] and updated tile cache.");
-        _saveCV.notify_all();
-        return true;
     }
+    _lastSaveTime = std::chrono::steady_clock::now();
+
+    queueUpload(snapshotPath);
+
+    Log::debug("Saved [" + uri + "] locally and queued the upload to storage.");
+    _saveCV.notify_all();
+    return true;
+}
+
+void DocumentBroker::queueUpload(const std::string& snapshotPath)
+{
+    std::unique_lock<std::mutex> lock(_uploadMutex);
+
+    // A newer snapshot supersedes anything still waiting in the queue.
+    for (const auto& stale : _uploadQueue)
+    {
+        Log::debug("Dropping superseded upload snapshot: " + stale);
+        Util::removeFile(stale);
+    }
+
+    _uploadQueue.clear();
+    _uploadQueue.push_back(snapshotPath);
+
+    if (!_uploadThread.joinable())
+    {
+        _uploadThread = std::thread(&DocumentBroker::uploadThread, this);
+    }
+
+    lock.unlock();
+    _uploadCv.notify_one();
+}
 
-    Log::error("Failed to save to URI [" + uri + "].");
+bool DocumentBroker::uploadSnapshot(const std::string& snapshotPath)
+{
+    TraceSpan::Span uploadSpan("wsd.storage.upload", _docKey);
+
+    for (int attempt = 1; attempt <= UploadRetryCount; ++attempt)
+    {
+        try
+        {
+            if (_storage->saveLocalFileToStorage(snapshotPath))
+            {
+                if (_storage->lastSaveSkipped())
+                    Log::debug("Storage already had the content of [" + snapshotPath + "]; upload skipped.");
+                else
+                    Log::debug("Uploaded [" + snapshotPath + "] to storage.");
+
+                Util::removeFile(snapshotPath);
+                return true;
+            }
+
+            Log::warn() << "Upload attempt " << attempt << " of [" << snapshotPath
+                        << "] to storage failed." << Log::end;
+        }
+        catch (const std::exception& exc)
+        {
+            Log::warn() << "Upload attempt " << attempt << " of [" << snapshotPath
+                        << "] to storage failed: " << exc.what() << Log::end;
+        }
+
+        if (attempt < UploadRetryCount)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(attempt));
+        }
+    }
+
+    Log::error("Failed to upload [" + snapshotPath + "] to storage. Giving up.");
+    Util::removeFile(snapshotPath);
+    alertAllUsersOfDocument("storage", "savefailed");
     return false;
 }
 
+void DocumentBroker::uploadThread()
+{
+    Util::setThreadName("doc_upload");
+
+    Log::debug("Upload thread started.");
+
+    while (true)
+    {
+        std::string snapshotPath;
+        {
+            std::unique_lock<std::mutex> lock(_uploadMutex);
+            _uploadCv.wait(lock, [this] { return _stopUploader || !_uploadQueue.empty(); });
+            if (_uploadQueue.empty())
+            {
+                // Stopping, and nothing left to flush.
+                break;
+            }
+
+            snapshotPath = _uploadQueue.front();
+            _uploadQueue.pop_front();
+        }
+
+        uploadSnapshot(snapshotPath);
+    }
+
+    Log::debug("Upload thread finished.");
+}
+
+void DocumentBroker::stopUploadThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(_uploadMutex);
+        _stopUploader = true;
+    }
+
+    _uploadCv.notify_one();
+    if (_uploadThread.joinable())
+    {
+        _uploadThread.join();
+    }
+}
+
 bool DocumentBroker::autoSave(const bool force, const size_t waitTimeoutMs)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    if (_sessions.empty() || _storage == nullptr || !_isLoaded ||
+    std::unique_lock<std::mutex> lock(_saveMutex);
+    if (getSessionsCount() == 0 || _storage == nullptr || !_isLoaded ||
         (!_isModified && !force))
     {
         // Nothing to do.
@@ -309,9 +460,12 @@ bool DocumentBroker::autoSave(const bool force, const size_t waitTimeoutMs)
     {
         // Find the most recent activity.
         double inactivityTimeMs = std::numeric_limits<double>::max();
-        for (auto& sessionIt: _sessions)
         {
-            inactivityTimeMs = std::min(sessionIt.second->getInactivityMS(), inactivityTimeMs);
+            std::lock_guard<std::mutex> sessionsLock(_sessionsMutex);
+            for (auto& sessionIt: _sessions)
+            {
+                inactivityTimeMs = std::min(sessionIt.second->getInactivityMS(), inactivityTimeMs);
+            }
         }
 
         Log::trace("Most recent activity was " + std::to_string((int)inactivityTimeMs) + " ms ago.");
@@ -342,13 +496,130 @@ bool DocumentBroker::autoSave(const bool force, const size_t waitTimeoutMs)
     return sent;
 }
 
+bool DocumentBroker::hibernate()
+{
+    std::unique_lock<std::mutex> lock(_hibernateMutex);
+
+    if (_hibernated || !_isLoaded || _markToDestroy)
+    {
+        return false;
+    }
+
+    if (LOOLWSD::MultiDocKits)
+    {
+        // The kit may host other documents; closing it would take
+        // them down too.
+        return false;
+    }
+
+    Log::info("Hibernating idle document [" + _docKey + "].");
+
+    // Persist before releasing the kit; on failure keep serving as usual.
+    if (!autoSave(true, COMMAND_TIMEOUT_MS))
+    {
+        Log::warn("Not hibernating [" + _docKey + "]: failed to save first.");
+        return false;
+    }
+
+    // Flag before closing, so the prisoner sockets going away
+    // does not tear down the still-connected clients.
+    _hibernated = true;
+
+    // Release the kit. The tile cache and the saved file stay on
+    // disk, and the view state lives in the still-connected client
+    // sessions, so there is nothing else to serialize.
+    _childProcess->close(false);
+
+    // Make the next load() re-populate the fresh jail.
+    _storage->setLoaded(false);
+    _isLoaded = false;
+
+    Log::info("Document [" + _docKey + "] hibernated.");
+    return true;
+}
+
+bool DocumentBroker::wakeUp()
+{
+    std::unique_lock<std::mutex> lock(_hibernateMutex);
+
+    if (!_hibernated)
+    {
+        // Someone else woke us up already.
+        return true;
+    }
+
+    Log::info("Waking up hibernated document [" + _docKey + "].");
+
+    auto child = LOOLWSD::getNewChild();
+    if (!child)
+    {
+        Log::error("Failed to get a kit process to wake up [" + _docKey + "].");
+        return false;
+    }
+
+    child->setDocumentBroker(shared_from_this());
+    {
+        std::lock_guard<std::mutex> wsLock(_childWsMutex);
+        _childProcess = child;
+        _hibernated = false;
+    }
+
+    // Ask the kit to re-create every view. Each one connects a new
+    // prisoner socket, which re-wires the peer, loads the document
+    // into the new jail and replays the session's load request.
+    std::vector<std::string> ids;
+    {
+        std::lock_guard<std::mutex> sessionsLock(_sessionsMutex);
+        for (const auto& it : _sessions)
+        {
+            ids.push_back(it.first);
+        }
+    }
+
+    const auto target = _bridgesConnected + ids.size();
+    for (const auto& id : ids)
+    {
+        sendRequestToChild("session " + id + " " + _docKey + "\n");
+    }
+
+    // Wait for the bridges, so the caller can forward
+    // messages to the new kit right away.
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(COMMAND_TIMEOUT_MS);
+    while (_bridgesConnected < target)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            Log::error("Timed out while waiting for the sessions of [" + _docKey + "] to reconnect.");
+            return false;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    Log::info("Document [" + _docKey + "] resumed with " +
+              std::to_string(ids.size()) + " sessions.");
+    return true;
+}
+
 bool DocumentBroker::sendUnoSave(const bool dontSaveIfUnmodified)
 {
     Log::info("Autosave triggered for doc [" + _docKey + "].");
-    Util::assertIsLocked(_mutex);
+    Util::assertIsLocked(_saveMutex);
 
     // Save using session holding the edit-lock (or first if multview).
-    for (auto& sessionIt: _sessions)
+    // Take a reference outside the sessions lock, since handleInput
+    // below re-enters the broker.
+    std::shared_ptr<ClientSession> savingSession;
+    {
+        std::lock_guard<std::mutex> sessionsLock(_sessionsMutex);
+        if (!_sessions.empty())
+        {
+            savingSession = _sessions.begin()->second;
+        }
+    }
+
+    if (savingSession)
     {
         // Invalidate the timestamp to force persisting.
         _lastFileModifiedTime.fromEpochTime(0);
@@ -383,7 +654,7 @@ bool DocumentBroker::sendUnoSave(const bool dontSaveIfUnmodified)
         const auto saveArgs = oss.str();
         Log::trace(".uno:Save arguments: " + saveArgs);
         const auto command = "uno .uno:Save " + saveArgs;
-        sessionIt.second->handleInput(command.data(), command.size());
+        savingSession->handleInput(command.data(), command.size());
         return true;
     }
 
@@ -391,6 +662,24 @@ bool DocumentBroker::sendUnoSave(const bool dontSaveIfUnmodified)
     return false;
 }
 
+double DocumentBroker::getIdleTimeMs() const
+{
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+
+    if (_sessions.empty())
+    {
+        return 0;
+    }
+
+    double idleTimeMs = std::numeric_limits<double>::max();
+    for (const auto& it : _sessions)
+    {
+        idleTimeMs = std::min(it.second->getInactivityMS(), idleTimeMs);
+    }
+
+    return idleTimeMs;
+}
+
 std::string DocumentBroker::getJailRoot() const
 {
     assert(!_jailId.empty());
@@ -402,11 +691,11 @@ size_t DocumentBroker::addSession(std::shared_ptr<ClientSession>& session)
     const auto id = session->getId();
     const std::string aMessage = "session " + id + " " + _docKey + "\n";
 
-    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
 
     // Request a new session from the child kit.
     Log::debug("DocBroker to Child: " + aMessage.substr(0, aMessage.length() - 1));
-    _childProcess->getWebSocket()->sendFrame(aMessage.data(), aMessage.size());
+    sendRequestToChild(aMessage);
 
     auto ret = _sessions.emplace(id, session);
     if (!ret.second)
@@ -431,7 +720,7 @@ bool DocumentBroker::connectPeers(std::shared_ptr<PrisonerSession>& session)
 {
     const auto id = session->getId();
 
-    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
 
     auto it = _sessions.find(id);
     if (it != _sessions.end())
@@ -444,9 +733,29 @@ bool DocumentBroker::connectPeers(std::shared_ptr<PrisonerSession>& session)
     return false;
 }
 
+bool DocumentBroker::resumeSession(const std::string& id)
+{
+    std::shared_ptr<ClientSession> session;
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        const auto it = _sessions.find(id);
+        if (it != _sessions.end())
+        {
+            session = it->second;
+        }
+    }
+
+    const bool resumed = session && session->resendDocumentLoad();
+
+    // Count the bridge only now that the document is loaded and the
+    // view (if any) replayed; wakeUp() waits on this.
+    ++_bridgesConnected;
+    return resumed;
+}
+
 size_t DocumentBroker::removeSession(const std::string& id)
 {
-    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
 
     auto it = _sessions.find(id);
     if (it != _sessions.end())
@@ -454,22 +763,86 @@ size_t DocumentBroker::removeSession(const std::string& id)
         _sessions.erase(it);
 
         // Let the child know the client has disconnected.
-        const std::string msg("child-" + id + " disconnect");
-        _childProcess->getWebSocket()->sendFrame(msg.data(), msg.size());
+        sendRequestToChild("child-" + id + " disconnect");
     }
 
     return _sessions.size();
 }
 
+bool DocumentBroker::parkSessionForResume(const std::shared_ptr<ClientSession>& session)
+{
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+
+        if (_sessions.find(session->getId()) == _sessions.end())
+        {
+            return false;
+        }
+
+        _parkedSessions[session->getResumeToken()] =
+            std::make_pair(session, std::chrono::steady_clock::now());
+    }
+
+    session->detach();
+    Log::info("Parked session [" + session->getId() + "] of [" + _docKey + "] for resume.");
+    return true;
+}
+
+std::shared_ptr<ClientSession> DocumentBroker::takeParkedSession(const std::string& token)
+{
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+
+    const auto it = _parkedSessions.find(token);
+    if (it == _parkedSessions.end())
+    {
+        return nullptr;
+    }
+
+    auto session = it->second.first;
+    _parkedSessions.erase(it);
+    return session;
+}
+
+size_t DocumentBroker::expireParkedSessions(const unsigned timeoutSecs)
+{
+    std::vector<std::string> expiredIds;
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+
+        const auto now = std::chrono::steady_clock::now();
+        for (auto it = _parkedSessions.begin(); it != _parkedSessions.end();)
+        {
+            if (now - it->second.second >= std::chrono::seconds(timeoutSecs))
+            {
+                expiredIds.push_back(it->second.first->getId());
+                it = _parkedSessions.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // removeSession takes _sessionsMutex itself.
+    for (const auto& id : expiredIds)
+    {
+        Log::info("Resume window of parked session [" + id + "] expired; removing.");
+        removeSession(id);
+    }
+
+    return expiredIds.size();
+}
+
 void DocumentBroker::alertAllUsersOfDocument(const std::string& cmd, const std::string& kind)
 {
-    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
 
-    std::stringstream ss;
-    ss << "error: cmd=" << cmd << " kind=" << kind;
+    const auto message = std::make_shared<Message>("error: cmd=" + cmd + " kind=" + kind,
+                                                   Message::Type::Text);
     for (auto& it: _sessions)
     {
-        it.second->sendTextFrame(ss.str());
+        it.second->enqueueSendMessage(message);
     }
 }
 
@@ -515,22 +888,45 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
 
 void DocumentBroker::invalidateTiles(const std::string& tiles)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    std::unique_lock<std::mutex> lock(_tileMutex);
+
+    // Remove from cache. Conversion jobs carry no cache.
+    if (_tileCache)
+    {
+        _tileCache->invalidateTiles(tiles);
+    }
 
-    // Remove from cache.
-    _tileCache->invalidateTiles(tiles);
+    // The document changed; the kit's next status: message rebuilds
+    // the join snapshot.
+    {
+        std::unique_lock<std::mutex> snapshotLock(_joinSnapshotMutex);
+        _joinSnapshot.clear();
+    }
+}
+
+void DocumentBroker::cacheJoinReply(const std::string& command, const std::string& payload)
+{
+    std::unique_lock<std::mutex> lock(_joinSnapshotMutex);
+    _joinSnapshot[command] = payload;
+}
+
+std::string DocumentBroker::getJoinReply(const std::string& command)
+{
+    std::unique_lock<std::mutex> lock(_joinSnapshotMutex);
+    const auto it = _joinSnapshot.find(command);
+    return (it != _joinSnapshot.end() ? it->second : std::string());
 }
 
 void DocumentBroker::handleTileRequest(TileDesc& tile,
                                        const std::shared_ptr<ClientSession>& session)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    std::unique_lock<std::mutex> lock(_tileMutex);
 
     tile.setVersion(++_tileVersion);
     const auto tileMsg = tile.serialize();
     Log::trace() << "Tile request for " << tile.serialize() << Log::end;
 
-    std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(tile);
+    TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
     if (cachedTile)
     {
 #if ENABLE_DEBUG
@@ -540,103 +936,399 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
 #endif
 
         std::vector<char> output;
-        output.reserve(static_cast<size_t>(4) * tile.getWidth() * tile.getHeight());
+        output.reserve(response.size() + cachedTile->size());
         output.resize(response.size());
         std::memcpy(output.data(), response.data(), response.size());
 
-        assert(cachedTile->is_open());
-        cachedTile->seekg(0, std::ios_base::end);
         const auto pos = output.size();
-        std::streamsize size = cachedTile->tellg();
-        output.resize(pos + size);
-        cachedTile->seekg(0, std::ios_base::beg);
-        cachedTile->read(output.data() + pos, size);
-        cachedTile->close();
+        output.resize(pos + cachedTile->size());
+        std::memcpy(output.data() + pos, cachedTile->data(), cachedTile->size());
 
         session->sendBinaryFrame(output.data(), output.size());
         return;
     }
 
-    tileCache().subscribeToTileRendering(tile, session);
-
-    // Forward to child to render.
     Log::debug() << "Sending render request for tile (" << tile.getPart() << ',' << tile.getTilePosX() << ',' << tile.getTilePosY() << ")." << Log::end;
-    const std::string request = "tile " + tile.serialize();
-    _childProcess->getWebSocket()->sendFrame(request.data(), request.size());
-    _debugRenderedTileCount++;
+    std::vector<TileDesc> misses(1, tile);
+    dispatchTiles(session, misses);
 }
 
 void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
                                                const std::shared_ptr<ClientSession>& session)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    std::unique_lock<std::mutex> lock(_tileMutex);
 
     Log::trace() << "TileCombined request for " << tileCombined.serialize() << Log::end;
 
-    // Satisfy as many tiles from the cache.
+    // Resolve the whole request against the cache in a single pass.
+    std::vector<std::pair<TileDesc, TileCache::Tile>> hits;
+    std::vector<TileDesc> misses;
+    _tileCache->lookupTiles(tileCombined.getTiles(), hits, misses);
+
+    for (const auto& hit : hits)
+    {
+#if ENABLE_DEBUG
+        const std::string response = hit.first.serialize("tile:") + " renderid=cached\n";
+#else
+        const std::string response = hit.first.serialize("tile:") + "\n";
+#endif
+
+        std::vector<char> output;
+        output.reserve(response.size() + hit.second->size());
+        output.insert(output.end(), response.begin(), response.end());
+        output.insert(output.end(), hit.second->begin(), hit.second->end());
+
+        // Queue the hits back-to-back; the session's sender thread
+        // writes them without holding our lock.
+        session->enqueueSendMessage(
+            std::make_shared<Message>(std::move(output), Message::Type::Binary));
+    }
+
+    if (!misses.empty())
+    {
+        dispatchTiles(session, misses);
+    }
+
+    prefetchTiles(tileCombined);
+}
+
+void DocumentBroker::handleViewportRequest(int part, int width, int height,
+                                           int areaX, int areaY, int areaWidth, int areaHeight,
+                                           int tileWidth, int tileHeight,
+                                           const std::shared_ptr<ClientSession>& session)
+{
+    std::unique_lock<std::mutex> lock(_tileMutex);
+
+    // Derive the covering tile grid, snapped to tile boundaries.
+    const int firstX = (areaX / tileWidth) * tileWidth;
+    const int firstY = (areaY / tileHeight) * tileHeight;
+    const int lastX = areaX + areaWidth - 1;
+    const int lastY = areaY + areaHeight - 1;
+
     std::vector<TileDesc> tiles;
-    for (auto& tile : tileCombined.getTiles())
+    for (int y = firstY; y <= lastY && tiles.size() < MaxViewportTiles; y += tileHeight)
     {
-        std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(tile);
-        if (cachedTile)
+        for (int x = firstX; x <= lastX && tiles.size() < MaxViewportTiles; x += tileWidth)
         {
-            //TODO: Combine the response to reduce latency.
+            tiles.emplace_back(part, width, height, x, y, tileWidth, tileHeight);
+        }
+    }
+
+    if (tiles.empty())
+    {
+        return;
+    }
+
+    Log::trace() << "Viewport request for part " << part << " area ("
+                 << areaX << ',' << areaY << ' ' << areaWidth << 'x' << areaHeight
+                 << "): " << tiles.size() << " tiles." << Log::end;
+
+    // Render center-out, so the content under the user's eyes appears
+    // before the edges of the viewport.
+    const int centerX = areaX + areaWidth / 2;
+    const int centerY = areaY + areaHeight / 2;
+    std::sort(tiles.begin(), tiles.end(),
+              [&](const TileDesc& a, const TileDesc& b)
+              {
+                  const int64_t dxA = a.getTilePosX() + tileWidth / 2 - centerX;
+                  const int64_t dyA = a.getTilePosY() + tileHeight / 2 - centerY;
+                  const int64_t dxB = b.getTilePosX() + tileWidth / 2 - centerX;
+                  const int64_t dyB = b.getTilePosY() + tileHeight / 2 - centerY;
+                  return dxA * dxA + dyA * dyA < dxB * dxB + dyB * dyB;
+              });
+
+    // The new viewport supersedes whatever this session still had
+    // queued outside it: drop those renders here instead of waiting
+    // for a canceltiles round-trip.
+    const auto rqIt = _renderQueues.find(session->getId());
+    if (rqIt != _renderQueues.end() && !rqIt->second._pending.empty())
+    {
+        auto& pending = rqIt->second._pending;
+        const auto oldSize = pending.size();
+        pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                     [&](const TileDesc& tile)
+                                     {
+                                         return tile.getPart() != part ||
+                                                tile.getTilePosX() + tile.getTileWidth() <= areaX ||
+                                                tile.getTilePosX() >= areaX + areaWidth ||
+                                                tile.getTilePosY() + tile.getTileHeight() <= areaY ||
+                                                tile.getTilePosY() >= areaY + areaHeight;
+                                     }),
+                      pending.end());
+        if (pending.size() != oldSize)
+        {
+            Log::debug() << "Viewport dropped " << (oldSize - pending.size())
+                         << " off-screen pending tiles of session " << session->getId()
+                         << '.' << Log::end;
+        }
+    }
+
+    // Resolve against the cache in one pass and stream the hits; the
+    // misses go to the kit in the center-out order derived above.
+    std::vector<std::pair<TileDesc, TileCache::Tile>> hits;
+    std::vector<TileDesc> misses;
+    _tileCache->lookupTiles(tiles, hits, misses);
+
+    for (auto& hit : hits)
+    {
+        hit.first.setVersion(++_tileVersion);
 #if ENABLE_DEBUG
-            const std::string response = tile.serialize("tile:") + " renderid=cached\n";
+        const std::string response = hit.first.serialize("tile:") + " renderid=cached\n";
 #else
-            const std::string response = tile.serialize("tile:") + "\n";
+        const std::string response = hit.first.serialize("tile:") + "\n";
 #endif
 
-            std::vector<char> output;
-            output.reserve(static_cast<size_t>(4) * tile.getWidth() * tile.getHeight());
-            output.resize(response.size());
-            std::memcpy(output.data(), response.data(), response.size());
+        std::vector<char> output;
+        output.reserve(response.size() + hit.second->size());
+        output.insert(output.end(), response.begin(), response.end());
+        output.insert(output.end(), hit.second->begin(), hit.second->end());
+
+        session->enqueueSendMessage(
+            std::make_shared<Message>(std::move(output), Message::Type::Binary));
+    }
+
+    if (!misses.empty())
+    {
+        dispatchTiles(session, misses);
+    }
 
-            assert(cachedTile->is_open());
-            cachedTile->seekg(0, std::ios_base::end);
-            const auto pos = output.size();
-            std::streamsize size = cachedTile->tellg();
-            output.resize(pos + size);
-            cachedTile->seekg(0, std::ios_base::beg);
-            cachedTile->read(output.data() + pos, size);
-            cachedTile->close();
+    prefetchTiles(TileCombined::create(tiles));
+}
 
-            session->sendBinaryFrame(output.data(), output.size());
+void DocumentBroker::prefetchTiles(const TileCombined& tileCombined)
+{
+    const int ring = LOOLWSD::TilePrefetchRing;
+    const auto& tiles = tileCombined.getTiles();
+    if (ring <= 0 || tiles.empty())
+    {
+        return;
+    }
+
+    // The bounding box of the request, in tile-grid coordinates.
+    const auto& first = tiles[0];
+    const int tileWidth = first.getTileWidth();
+    const int tileHeight = first.getTileHeight();
+    int minX = first.getTilePosX();
+    int maxX = minX;
+    int minY = first.getTilePosY();
+    int maxY = minY;
+    for (const auto& tile : tiles)
+    {
+        minX = std::min(minX, tile.getTilePosX());
+        maxX = std::max(maxX, tile.getTilePosX());
+        minY = std::min(minY, tile.getTilePosY());
+        maxY = std::max(maxY, tile.getTilePosY());
+    }
+
+    std::ostringstream areaStream;
+    areaStream << first.getPart() << ',' << minX << ',' << minY << ',' << maxX << ',' << maxY
+               << ',' << tileWidth << ',' << tileHeight;
+    const auto area = areaStream.str();
+    if (area == _lastPrefetchArea)
+    {
+        // Already requested this ring; its renders may still be in flight.
+        return;
+    }
+
+    // Collect the uncached tiles of the surrounding ring.
+    std::vector<TileDesc> candidates;
+    for (int x = minX - ring * tileWidth; x <= maxX + ring * tileWidth; x += tileWidth)
+    {
+        for (int y = minY - ring * tileHeight; y <= maxY + ring * tileHeight; y += tileHeight)
+        {
+            if (x < 0 || y < 0 || (x >= minX && x <= maxX && y >= minY && y <= maxY))
+            {
+                // Outside the document or part of the request itself.
+                continue;
+            }
+
+            TileDesc tile(first.getPart(), first.getWidth(), first.getHeight(),
+                          x, y, tileWidth, tileHeight);
+            if (!_tileCache->hasTile(tile))
+            {
+                tile.setVersion(++_tileVersion);
+                candidates.push_back(tile);
+            }
         }
-        else
+    }
+
+    _lastPrefetchArea = area;
+    if (candidates.empty())
+    {
+        return;
+    }
+
+    // No subscribers: the rendered tiles just land in the cache. The
+    // kit's queue prioritizes cursor-adjacent tiles, so these fill in
+    // behind interactive requests. Out-of-document tiles are declined
+    // by the kit and forgotten.
+    auto prefetchCombined = TileCombined::create(candidates);
+    prefetchCombined.setVersion(++_tileVersion);
+    const auto req = prefetchCombined.serialize("tilecombine");
+    Log::debug() << "Prefetching " << candidates.size() << " tiles: " << req << Log::end;
+    sendRequestToChild(req);
+}
+
+void DocumentBroker::dispatchTiles(const std::shared_ptr<ClientSession>& session,
+                                   std::vector<TileDesc>& tiles)
+{
+    Util::assertIsLocked(_tileMutex);
+
+    auto& queue = _renderQueues[session->getId()];
+    queue._session = session;
+
+    // A newer request supersedes a pending tile for the same position;
+    // the client no longer wants the stale version.
+    const auto samePosition = [](const TileDesc& a, const TileDesc& b)
+    {
+        return a.getPart() == b.getPart() &&
+               a.getWidth() == b.getWidth() &&
+               a.getHeight() == b.getHeight() &&
+               a.getTilePosX() == b.getTilePosX() &&
+               a.getTilePosY() == b.getTilePosY() &&
+               a.getTileWidth() == b.getTileWidth() &&
+               a.getTileHeight() == b.getTileHeight();
+    };
+
+    if (!queue._pending.empty())
+    {
+        for (const auto& tile : tiles)
         {
-            // Not cached, needs rendering.
-            tile.setVersion(++_tileVersion);
-            tileCache().subscribeToTileRendering(tile, session);
-            tiles.push_back(tile);
-            _debugRenderedTileCount++;
+            for (auto it = queue._pending.begin(); it != queue._pending.end();)
+            {
+                if (samePosition(*it, tile))
+                {
+                    Log::trace() << "Superseding pending tile " << it->serialize() << Log::end;
+                    it = queue._pending.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
         }
     }
 
-    if (!tiles.empty())
+    // Admit up to the window; queue the rest for releaseRenderSlots.
+    const size_t slots = (queue._inFlight < MaxTilesInFlightPerSession
+                          ? MaxTilesInFlightPerSession - queue._inFlight : 0);
+    if (tiles.size() > slots)
     {
-        auto newTileCombined = TileCombined::create(tiles);
-        newTileCombined.setVersion(++_tileVersion);
+        queue._pending.insert(queue._pending.end(), tiles.begin() + slots, tiles.end());
+        tiles.resize(slots);
 
-        // Forward to child to render.
-        const auto req = newTileCombined.serialize("tilecombine");
-        Log::debug() << "Sending residual tilecombine: " << req << Log::end;
-        _childProcess->getWebSocket()->sendFrame(req.data(), req.size());
+        if (queue._pending.size() > MaxPendingTilesPerSession)
+        {
+            Log::warn() << "Session " << session->getId() << " overflowed its tile backlog; dropping "
+                        << (queue._pending.size() - MaxPendingTilesPerSession)
+                        << " oldest pending tiles." << Log::end;
+            queue._pending.erase(queue._pending.begin(),
+                                 queue._pending.begin() +
+                                 (queue._pending.size() - MaxPendingTilesPerSession));
+        }
+    }
+
+    if (tiles.empty())
+    {
+        return;
+    }
+
+    for (auto& tile : tiles)
+    {
+        tile.setVersion(++_tileVersion);
+        _debugRenderedTileCount++;
+    }
+
+    // Subscribe to all the tiles under one lock.
+    tileCache().subscribeToTileRendering(tiles, session);
+    queue._inFlight += tiles.size();
+
+    auto newTileCombined = TileCombined::create(tiles);
+    newTileCombined.setVersion(++_tileVersion);
+
+    // Forward to child to render.
+    const auto req = newTileCombined.serialize("tilecombine");
+    Log::debug() << "Sending residual tilecombine: " << req << Log::end;
+    sendRequestToChild(req);
+}
+
+void DocumentBroker::releaseRenderSlots(const std::vector<std::string>& sessionIds)
+{
+    if (sessionIds.empty())
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_tileMutex);
+
+    for (const auto& sessionId : sessionIds)
+    {
+        const auto it = _renderQueues.find(sessionId);
+        if (it == _renderQueues.end())
+        {
+            continue;
+        }
+
+        auto& queue = it->second;
+        if (queue._inFlight > 0)
+        {
+            --queue._inFlight;
+        }
+
+        if (queue._pending.empty())
+        {
+            continue;
+        }
+
+        auto session = queue._session.lock();
+        if (!session)
+        {
+            // The session is gone; nobody wants these tiles anymore.
+            _renderQueues.erase(it);
+            continue;
+        }
+
+        // Move the waiting tiles into the freed slot; dispatchTiles
+        // re-queues whatever still does not fit.
+        std::vector<TileDesc> next(queue._pending.begin(), queue._pending.end());
+        queue._pending.clear();
+        dispatchTiles(session, next);
     }
 }
 
 void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& session)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    std::unique_lock<std::mutex> lock(_tileMutex);
+
+    // The cancelled renders will notify nobody; reset this session's
+    // admission state so new requests do not wait on stale slots.
+    const auto it = _renderQueues.find(session->getId());
+    if (it != _renderQueues.end())
+    {
+        it->second._inFlight = 0;
+        it->second._pending.clear();
+    }
 
     const auto canceltiles = tileCache().cancelTiles(session);
     if (!canceltiles.empty())
     {
         Log::debug() << "Forwarding canceltiles request: " << canceltiles << Log::end;
-        _childProcess->getWebSocket()->sendFrame(canceltiles.data(), canceltiles.size());
+        sendRequestToChild(canceltiles);
     }
 }
 
+std::shared_ptr<TileRing> DocumentBroker::getTileRing()
+{
+    const auto path = getJailRoot() + TileRing::ringPath(_docKey);
+    if (!_tileRing || _tileRingPath != path)
+    {
+        _tileRing = TileRing::open(path);
+        _tileRingPath = path;
+    }
+
+    return _tileRing;
+}
+
 void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 {
     const std::string firstLine = getFirstLine(payload);
@@ -646,9 +1338,36 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
         const auto buffer = payload.data();
         const auto length = payload.size();
 
-        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        // The payload may sit in the kit's shared-memory ring instead
+        // of trailing the message.
+        int64_t ringPos = -1;
+        std::string ringPosStr;
+        if (getTokenStringFromMessage(firstLine, "shmpos", ringPosStr))
         {
-            tileCache().saveTileAndNotify(
+            ringPos = std::stoll(ringPosStr);
+        }
+
+        std::vector<std::string> notified;
+        if (ringPos >= 0 && tile.getImgSize() > 0)
+        {
+            std::vector<char> data(tile.getImgSize());
+            const auto ring = getTileRing();
+            if (ring && ring->read(ringPos, data.data(), data.size()))
+            {
+                notified = tileCache().saveTileAndNotify(tile, data.data(), data.size());
+            }
+            else
+            {
+                // Lost payload; drop the render so the clients
+                // re-request what they still need.
+                Log::error("Missing tile ring payload for " + firstLine);
+                std::unique_lock<std::mutex> tileBeingRenderedLock(tileCache().getTilesBeingRenderedLock());
+                notified = tileCache().forgetTileBeingRendered(tile);
+            }
+        }
+        else if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        {
+            notified = tileCache().saveTileAndNotify(
                 tile, buffer + firstLine.size() + 1,
                 length - firstLine.size() - 1);
         }
@@ -656,8 +1375,10 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
         {
             Log::debug() << "Render request declined for " << firstLine << Log::end;
             std::unique_lock<std::mutex> tileBeingRenderedLock(tileCache().getTilesBeingRenderedLock());
-            tileCache().forgetTileBeingRendered(tile);
+            notified = tileCache().forgetTileBeingRendered(tile);
         }
+
+        releaseRenderSlots(notified);
     }
     catch (const std::exception& exc)
     {
@@ -679,11 +1400,13 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
         const auto length = payload.size();
         auto offset = firstLine.size() + 1;
 
+        std::vector<std::string> notified;
         if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
         {
             for (const auto& tile : tileCombined.getTiles())
             {
-                tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
+                const auto ids = tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
+                notified.insert(notified.end(), ids.begin(), ids.end());
                 offset += tile.getImgSize();
             }
         }
@@ -693,9 +1416,12 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
             std::unique_lock<std::mutex> tileBeingRenderedLock(tileCache().getTilesBeingRenderedLock());
             for (const auto& tile : tileCombined.getTiles())
             {
-                tileCache().forgetTileBeingRendered(tile);
+                const auto ids = tileCache().forgetTileBeingRendered(tile);
+                notified.insert(notified.end(), ids.begin(), ids.end());
             }
         }
+
+        releaseRenderSlots(notified);
     }
     catch (const std::exception& exc)
     {
@@ -707,7 +1433,7 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
 
 bool DocumentBroker::startDestroy(const std::string& id)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    std::unique_lock<std::mutex> lock(_sessionsMutex);
 
     const auto currentSession = _sessions.find(id);
     assert(currentSession != _sessions.end());
@@ -735,7 +1461,11 @@ bool DocumentBroker::startDestroy(const std::string& id)
 
 void DocumentBroker::setModified(const bool value)
 {
-    _tileCache->setUnsavedChanges(value);
+    if (_tileCache)
+    {
+        _tileCache->setUnsavedChanges(value);
+    }
+
     _isModified = value;
 }
 
@@ -744,12 +1474,17 @@ bool DocumentBroker::forwardToChild(const std::string& viewId, const char *buffe
     const auto message = std::string(buffer, length);
     Log::trace() << "Forwarding payload to child [" << viewId << "]: " << message << Log::end;
 
-    const auto it = _sessions.find(viewId);
-    if (it != _sessions.end())
+    bool found;
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        found = (_sessions.find(viewId) != _sessions.end());
+    }
+
+    if (found)
     {
         const auto msg = "child-" + viewId + ' ' + message;
         Log::debug("DocBroker to Child: " + msg);
-        _childProcess->getWebSocket()->sendFrame(msg.data(), msg.size());
+        sendRequestToChild(msg);
         return true;
     }
     else
@@ -770,19 +1505,27 @@ bool DocumentBroker::forwardToClient(const std::string& prefix, const std::vecto
     std::string sid;
     if (LOOLProtocol::parseNameValuePair(prefix, name, sid, '-') && name == "client")
     {
-        const auto it = _sessions.find(sid);
-        if (it != _sessions.end())
+        std::shared_ptr<PrisonerSession> peer;
+        bool found;
         {
-            const auto peer = it->second->getPeer();
-            if (peer)
-            {
-                return peer->handleInput(message.data(), message.size());
-            }
-            else
+            std::lock_guard<std::mutex> lock(_sessionsMutex);
+            const auto it = _sessions.find(sid);
+            found = (it != _sessions.end());
+            if (found)
             {
-                Log::warn() << "Client session [" << sid << "] has no peer to forward message: " << message << Log::end;
+                peer = it->second->getPeer();
             }
         }
+
+        if (peer)
+        {
+            // Handle outside the sessions lock; this delivers to the client.
+            return peer->handleInput(message.data(), message.size());
+        }
+        else if (found)
+        {
+            Log::warn() << "Client session [" << sid << "] has no peer to forward message: " << message << Log::end;
+        }
         else
         {
             Log::warn() << "Client session [" << sid << "] not found to forward message: " << message << Log::end;
@@ -796,6 +1539,35 @@ bool DocumentBroker::forwardToClient(const std::string& prefix, const std::vecto
     return false;
 }
 
+void DocumentBroker::sendRequestToChild(const std::string& message)
+{
+    std::lock_guard<std::mutex> lock(_childWsMutex);
+
+    if (_hibernated)
+    {
+        // There is no kit to talk to; the sender wakes us up first.
+        Log::debug("Document [" + _docKey + "] is hibernated. Dropping: " +
+                   LOOLProtocol::getAbbreviatedMessage(message.data(), message.size()));
+        return;
+    }
+
+    _childProcess->getWebSocket()->sendFrame(message.data(), message.size());
+}
+
+void DocumentBroker::requestAddDoc()
+{
+    try
+    {
+        sendRequestToChild("adddoc\n");
+    }
+    catch (const std::exception& ex)
+    {
+        // Not fatal; the document falls back to a fresh kit.
+        Log::warn("Failed to request another document of kit [" +
+                  std::to_string(getChildPid()) + "]: " + ex.what());
+    }
+}
+
 const std::chrono::duration<double> DocumentBroker::getStorageLoadDuration() const
 {
     if (dynamic_cast<WopiStorage*>(_storage.get()) != nullptr)
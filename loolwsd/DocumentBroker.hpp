@@ -15,6 +15,7 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -26,6 +27,7 @@
 
 #include "IoUtil.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
 #include "Util.hpp"
@@ -121,12 +123,13 @@ private:
 
 class PrisonerSession;
 class ClientSession;
+class TileRing;
 
 /// DocumentBroker is responsible for setting up a document
 /// in jail and brokering loading it from Storage
 /// and saving it back.
 /// Contains URI, physical path, etc.
-class DocumentBroker
+class DocumentBroker : public std::enable_shared_from_this<DocumentBroker>
 {
 public:
 
@@ -150,6 +153,9 @@ public:
         Log::info() << "~DocumentBroker [" << _uriPublic.toString()
                     << "] destroyed with " << getSessionsCount()
                     << " sessions left." << Log::end;
+
+        --Metrics::DocumentsActive;
+        stopUploadThread();
     }
 
     const StorageBase::FileInfo validate(const Poco::URI& uri);
@@ -173,6 +179,24 @@ public:
     /// and receives save notification. Otherwise, false.
     bool autoSave(const bool force, const size_t waitTimeoutMs);
 
+    /// Save the document and release its kit process, keeping the
+    /// client sessions connected. The saved file and the tile cache
+    /// stay on disk; the next client message (or a new view) revives
+    /// the document via wakeUp().
+    bool hibernate();
+
+    /// Re-spawn a kit process for a hibernated document and
+    /// re-establish the bridges of all its sessions.
+    bool wakeUp();
+
+    bool isHibernated() const { return _hibernated; }
+
+    /// Mark this broker as a headless conversion job: load() skips
+    /// the tile cache entirely (no view ever requests tiles), leaving
+    /// just the load/saveas round-trip on the kit.
+    void setConvertOnly() { _convertOnly = true; }
+    bool isConvertOnly() const { return _convertOnly; }
+
     Poco::URI getPublicUri() const { return _uriPublic; }
     Poco::URI getJailedUri() const { return _uriJailed; }
     const std::string& getJailId() const { return _jailId; }
@@ -180,9 +204,15 @@ public:
     const std::string& getFilename() const { return _filename; };
     TileCache& tileCache() { return *_tileCache; }
     bool isAlive() const { return _childProcess && _childProcess->isAlive(); }
+    Poco::Process::PID getChildPid() const { return _childProcess ? _childProcess->getPid() : -1; }
+
+    /// Ask our kit process to host one more document on a fresh
+    /// control connection (multidoc mode). The connection registers
+    /// like a newly spawned child.
+    void requestAddDoc();
     size_t getSessionsCount() const
     {
-        std::lock_guard<std::mutex> lock(_mutex);
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
         return _sessions.size();
     }
 
@@ -193,15 +223,36 @@ public:
         return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
     }
 
+    /// The time in milliseconds since the last activity
+    /// of the busiest session.
+    double getIdleTimeMs() const;
+
     std::string getJailRoot() const;
 
     /// Add a new session. Returns the new number of sessions.
     size_t addSession(std::shared_ptr<ClientSession>& session);
     /// Connect a prison session to its client peer.
     bool connectPeers(std::shared_ptr<PrisonerSession>& session);
+    /// Replay the document load of a session whose bridge was
+    /// re-established after hibernation. Returns true if it did.
+    bool resumeSession(const std::string& id);
     /// Removes a session by ID. Returns the new number of sessions.
     size_t removeSession(const std::string& id);
 
+    /// Keep the session of a dropped socket alive for the resume
+    /// window: it stays registered (the kit view and tile cache stay
+    /// warm) and its sender queue buffers what changes. Returns false
+    /// when the session is not registered here.
+    bool parkSessionForResume(const std::shared_ptr<ClientSession>& session);
+
+    /// Hand over the parked session matching the given resume token,
+    /// or nullptr when the token is unknown or already claimed.
+    std::shared_ptr<ClientSession> takeParkedSession(const std::string& token);
+
+    /// Tear down parked sessions whose resume window has passed.
+    /// Returns the number of sessions expired.
+    size_t expireParkedSessions(const unsigned timeoutSecs);
+
     void alertAllUsersOfDocument(const std::string& cmd, const std::string& kind);
 
     /// Invalidate the cursor position.
@@ -214,11 +265,38 @@ public:
     }
 
     void invalidateTiles(const std::string& tiles);
+
+    /// Record one canonical reply of the load handshake in the join
+    /// snapshot, so later sessions get it straight from WSD memory
+    /// instead of serializing through the kit.
+    void cacheJoinReply(const std::string& command, const std::string& payload);
+
+    /// The join snapshot reply for the given command; empty when none
+    /// has been captured (or the document changed since).
+    std::string getJoinReply(const std::string& command);
+
     void handleTileRequest(TileDesc& tile,
                            const std::shared_ptr<ClientSession>& session);
     void handleTileCombinedRequest(TileCombined& tileCombined,
                                    const std::shared_ptr<ClientSession>& session);
+
+    /// Serve a viewport subscription: derive the tiles covering the
+    /// given area (in twips) here, stream the cached ones, render the
+    /// misses center-out, and drop this session's queued renders that
+    /// fell outside the new area. One such message per scroll step
+    /// replaces the client-computed tilecombine/canceltiles chatter.
+    void handleViewportRequest(int part, int width, int height,
+                               int areaX, int areaY, int areaWidth, int areaHeight,
+                               int tileWidth, int tileHeight,
+                               const std::shared_ptr<ClientSession>& session);
+
     void cancelTileRequests(const std::shared_ptr<ClientSession>& session);
+
+    /// Speculatively render a ring of tiles around the area a view
+    /// just requested, so scrolling hits the cache instead of the
+    /// kit. Must be called with _tileMutex held.
+    void prefetchTiles(const TileCombined& tileCombined);
+
     void handleTileResponse(const std::vector<char>& payload);
     void handleTileCombinedResponse(const std::vector<char>& payload);
 
@@ -236,6 +314,10 @@ public:
 
     int getRenderedTileCount() { return _debugRenderedTileCount; }
 
+    /// Next tile version for a cached tile served outside the broker;
+    /// _tileVersion is atomic, so the fast path can tick it lock-free.
+    size_t nextTileVersion() { return ++_tileVersion; }
+
     /// Returns time taken in making calls to storage during load
     /// Currently, only makes sense in case storage is WOPI
     const std::chrono::duration<double> getStorageLoadDuration() const;
@@ -251,9 +333,48 @@ private:
     /// Forward a message from child session to its respective client session.
     bool forwardToClient(const std::string& prefix, const std::vector<char>& payload);
 
+    /// Send a message to the child process, serializing the
+    /// concurrent writers of its WebSocket.
+    void sendRequestToChild(const std::string& message);
+
+    /// Admission-controlled dispatch of uncached tiles for one
+    /// session: a newer request supersedes a pending tile for the
+    /// same position, up to MaxTilesInFlightPerSession renders go to
+    /// the kit, the rest wait for slots to free up. Must be called
+    /// with _tileMutex held. Consumes tiles.
+    void dispatchTiles(const std::shared_ptr<ClientSession>& session,
+                       std::vector<TileDesc>& tiles);
+
+    /// Free one render slot per entry (a tile was delivered to, or
+    /// declined for, that session) and dispatch the tiles that were
+    /// waiting for them.
+    void releaseRenderSlots(const std::vector<std::string>& sessionIds);
+
+    /// Queue an upload snapshot for the background worker,
+    /// superseding any snapshot still waiting its turn.
+    void queueUpload(const std::string& snapshotPath);
+
+    /// Upload one snapshot to storage, with retries.
+    /// Removes the snapshot when done with it.
+    bool uploadSnapshot(const std::string& snapshotPath);
+
+    /// The background worker: uploads queued snapshots to storage.
+    void uploadThread();
+
+    /// Flush pending uploads and join the worker thread.
+    void stopUploadThread();
+
+    /// The kit's shared-memory tile ring, opened (or re-opened, after
+    /// a jail change) on demand. Only called from the child-socket
+    /// thread that handles tile responses. May return null.
+    std::shared_ptr<TileRing> getTileRing();
+
 private:
     const Poco::URI _uriPublic;
     const std::string _docKey;
+    /// Short unique id; names this document's subdirectory when
+    /// several documents share one jail (multidoc mode).
+    const std::string _docId;
     const std::string _childRoot;
     const std::string _cacheRoot;
     std::shared_ptr<ChildProcess> _childProcess;
@@ -263,28 +384,114 @@ private:
     std::chrono::steady_clock::time_point _lastSaveTime;
     Poco::Timestamp _lastFileModifiedTime;
     std::map<std::string, std::shared_ptr<ClientSession>> _sessions;
+    /// Sessions whose socket dropped, by resume token, with the time
+    /// they were parked. They remain in _sessions until claimed by a
+    /// reconnect or expired. Guarded by _sessionsMutex.
+    std::map<std::string,
+             std::pair<std::shared_ptr<ClientSession>,
+                       std::chrono::steady_clock::time_point>> _parkedSessions;
     std::unique_ptr<StorageBase> _storage;
     std::unique_ptr<TileCache> _tileCache;
+    /// The kit's shared tile ring and the path it was opened from;
+    /// only touched by the child-socket thread via getTileRing().
+    std::shared_ptr<TileRing> _tileRing;
+    std::string _tileRingPath;
     std::atomic<bool> _markToDestroy;
     std::atomic<bool> _lastEditableSession;
     std::atomic<bool> _isLoaded;
     std::atomic<bool> _isModified;
+    std::atomic<bool> _hibernated;
+    bool _convertOnly;
     int _cursorPosX;
     int _cursorPosY;
     int _cursorWidth;
     int _cursorHeight;
-    mutable std::mutex _mutex;
-    std::condition_variable _saveCV;
+    // The single broker mutex is split so that the tile hot path
+    // never contends with save or session management. Lock order,
+    // where several are needed: _saveMutex, then _sessionsMutex, then
+    // _childWsMutex. _tileMutex is independent and only nests over
+    // _childWsMutex.
+
+    /// Guards _sessions.
+    mutable std::mutex _sessionsMutex;
+
+    /// Guards the storage, load and save state.
     std::mutex _saveMutex;
+    std::condition_variable _saveCV;
+
+    /// Guards the tile request dispatch path.
+    std::mutex _tileMutex;
+
+    /// Snapshots queued for upload to storage, oldest first.
+    /// Guarded by _uploadMutex; a newer snapshot supersedes waiting ones.
+    std::deque<std::string> _uploadQueue;
+    std::mutex _uploadMutex;
+    std::condition_variable _uploadCv;
+    std::thread _uploadThread;
+    bool _stopUploader = false;
+
+    /// Distinguishes the upload snapshots of successive saves.
+    size_t _snapshotVersion = 0;
+
+    /// Serializes writes on the child process WebSocket.
+    std::mutex _childWsMutex;
+
+    /// Serializes hibernate() against wakeUp(). Taken outermost:
+    /// hibernation saves (and so takes _saveMutex) under it.
+    std::mutex _hibernateMutex;
+
+    /// Counts completed prisoner bridges (incremented once the
+    /// document is loaded and the session's load replayed), so
+    /// wakeUp() can tell when all sessions have reconnected.
+    std::atomic<size_t> _bridgesConnected;
 
     /// Versioning is used to prevent races between
     /// painting and invalidation.
     std::atomic<size_t> _tileVersion;
 
+    /// The join snapshot: canonical load-handshake replies by command,
+    /// captured from the first session's load. Guarded by
+    /// _joinSnapshotMutex; cleared whenever the document changes.
+    std::map<std::string, std::string> _joinSnapshot;
+    std::mutex _joinSnapshotMutex;
+
+    /// Render admission state of one session: the renders it has at
+    /// the kit and the requests waiting for a free slot.
+    struct RenderQueue
+    {
+        RenderQueue() :
+            _inFlight(0)
+        {
+        }
+
+        size_t _inFlight;
+        std::deque<TileDesc> _pending;
+        std::weak_ptr<ClientSession> _session;
+    };
+
+    /// Per-session render admission, so no single view can flood the
+    /// kit's queue and starve co-editors. Guarded by _tileMutex.
+    std::map<std::string, RenderQueue> _renderQueues;
+
+    /// The area the last prefetch covered, serialized; avoids
+    /// re-requesting the same ring during a scroll storm while the
+    /// renders are still in flight.
+    std::string _lastPrefetchArea;
+
     int _debugRenderedTileCount;
 
     static constexpr auto IdleSaveDurationMs = 30 * 1000;
     static constexpr auto AutoSaveDurationMs = 300 * 1000;
+    static constexpr int UploadRetryCount = 3;
+    /// Renders one session may have outstanding at the kit; more than
+    /// a viewport's worth, so interactive scrolling never queues.
+    static constexpr size_t MaxTilesInFlightPerSession = 64;
+    /// Tiles one session may have waiting for slots; beyond this the
+    /// oldest are dropped (the client re-requests what it still needs).
+    static constexpr size_t MaxPendingTilesPerSession = 1024;
+    /// Upper bound on the tile grid one viewport message may cover;
+    /// caps the damage of a hostile or confused area request.
+    static constexpr size_t MaxViewportTiles = 256;
 };
 
 #endif
@@ -9,10 +9,24 @@
 
 #include "config.h"
 
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include <Poco/DateTimeFormat.h>
+#include <Poco/DateTimeFormatter.h>
+#include <Poco/DateTimeParser.h>
+#include <Poco/DeflatingStream.h>
 #include <Poco/Exception.h>
+#include <Poco/File.h>
 #include <Poco/FileStream.h>
 #include <Poco/Net/HTTPCookie.h>
 #include <Poco/Net/HTTPBasicCredentials.h>
@@ -22,6 +36,7 @@
 #include <Poco/Net/HTTPServer.h>
 #include <Poco/Net/HTTPServerParams.h>
 #include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
 #include <Poco/Net/HTTPServerResponse.h>
 #include <Poco/Net/NameValueCollection.h>
 #include <Poco/Net/NetException.h>
@@ -59,6 +74,174 @@ using Poco::Net::HTTPBasicCredentials;
 using Poco::StreamCopier;
 using Poco::Util::Application;
 
+namespace
+{
+
+/// A static asset held in memory, re-validated against the mtime
+/// on disk so editing a dist file still takes effect immediately.
+struct CachedFile
+{
+    Poco::Timestamp mtime;
+    std::string content;
+    /// Gzipped variant of content; empty when not worthwhile.
+    std::string gzContent;
+    std::string etag;
+};
+
+std::mutex FileCacheMutex;
+std::map<std::string, std::shared_ptr<CachedFile>> FileCache;
+
+/// Return the given file from the in-memory cache, (re)reading
+/// it from disk only when missing or changed since the last read.
+std::shared_ptr<const CachedFile> getCachedFile(const std::string& filepath)
+{
+    const Poco::File file(filepath);
+    if (!file.exists())
+    {
+        throw Poco::FileNotFoundException("File [" + filepath + "] does not exist.");
+    }
+
+    const auto mtime = file.getLastModified();
+
+    std::unique_lock<std::mutex> lock(FileCacheMutex);
+
+    auto& entry = FileCache[filepath];
+    if (!entry || entry->mtime != mtime)
+    {
+        Log::debug("Caching file: " + filepath);
+        auto newEntry = std::make_shared<CachedFile>();
+        newEntry->mtime = mtime;
+        newEntry->etag = '"' + std::to_string(mtime.epochMicroseconds()) + '"';
+
+        FileInputStream stream(filepath);
+        StreamCopier::copyToString(stream, newEntry->content);
+
+        // Prefer a precompressed variant shipped next to the file,
+        // otherwise gzip once now; either way every request streams
+        // ready-made bytes with no per-request compression.
+        if (Poco::File(filepath + ".gz").exists())
+        {
+            FileInputStream gzStream(filepath + ".gz");
+            StreamCopier::copyToString(gzStream, newEntry->gzContent);
+        }
+        else
+        {
+            std::ostringstream oss;
+            Poco::DeflatingOutputStream gzipper(oss, Poco::DeflatingStreamBuf::STREAM_GZIP);
+            gzipper << newEntry->content;
+            gzipper.close();
+            if (oss.str().size() < newEntry->content.size())
+            {
+                newEntry->gzContent = oss.str();
+            }
+        }
+
+        entry = newEntry;
+    }
+
+    return entry;
+}
+
+/// Handle If-None-Match/If-Modified-Since; returns true after
+/// sending a 304 response, false when the body must be sent.
+bool sendNotModifiedIfMatch(HTTPServerRequest& request, HTTPServerResponse& response,
+                            const std::shared_ptr<const CachedFile>& cached)
+{
+    response.set("Last-Modified", Poco::DateTimeFormatter::format(cached->mtime, Poco::DateTimeFormat::HTTP_FORMAT));
+    response.set("ETag", cached->etag);
+
+    bool notModified = false;
+    if (request.has("If-None-Match"))
+    {
+        notModified = (request.get("If-None-Match") == cached->etag);
+    }
+    else if (request.has("If-Modified-Since"))
+    {
+        Poco::DateTime since;
+        int timeZone;
+        if (Poco::DateTimeParser::tryParse(request.get("If-Modified-Since"), since, timeZone))
+        {
+            // HTTP dates have second granularity.
+            notModified = (cached->mtime.epochTime() <= since.timestamp().epochTime());
+        }
+    }
+
+    if (notModified)
+    {
+        response.setStatusAndReason(HTTPResponse::HTTP_NOT_MODIFIED);
+        response.setContentLength(0);
+        response.send();
+    }
+
+    return notModified;
+}
+
+/// Send the body of the given file with sendfile(2), kernel-to-socket
+/// with zero userspace copies. Only possible on a plain socket; with
+/// SSL the bytes must pass through the TLS layer. The caller sets all
+/// headers except Content-Length before calling. Returns false,
+/// without having sent anything, when this response can't take the
+/// zero-copy path and must be streamed instead.
+bool sendFileResponse(HTTPServerRequest& request, HTTPServerResponse& response,
+                      const std::string& filepath)
+{
+    if (LOOLWSD::isSSLEnabled())
+    {
+        return false;
+    }
+
+    // Only the Impl exposes the socket beneath the response streams.
+    auto requestImpl = dynamic_cast<Poco::Net::HTTPServerRequestImpl*>(&request);
+    if (requestImpl == nullptr)
+    {
+        return false;
+    }
+
+    const int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    response.setContentLength(st.st_size);
+    response.setChunkedTransferEncoding(false);
+
+    // Commit the headers, then hand the body to the kernel.
+    response.send().flush();
+
+    const int sockfd = requestImpl->socket().impl()->sockfd();
+    off_t offset = 0;
+    while (offset < st.st_size)
+    {
+        const auto sent = sendfile(sockfd, fd, &offset, st.st_size - offset);
+        if (sent < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        else if (sent <= 0)
+        {
+            // The headers are out already; all we can do is make sure
+            // the truncated connection isn't reused.
+            Log::syserror("sendfile failed for [" + filepath + "] at offset " +
+                          std::to_string(offset) + ".");
+            requestImpl->socket().shutdown();
+            break;
+        }
+    }
+
+    close(fd);
+    return true;
+}
+
+}
+
 bool FileServerRequestHandler::isAdminLoggedIn(HTTPServerRequest& request, HTTPServerResponse& response)
 {
     const auto& config = Application::instance().config();
@@ -172,8 +355,44 @@ void FileServerRequestHandler::handleRequest(HTTPServerRequest& request, HTTPSer
             else
                 mimeType = "text/plain";
 
+            const auto cached = getCachedFile(filepath);
+            if (sendNotModifiedIfMatch(request, response, cached))
+            {
+                return;
+            }
+
+            // Stream the precompressed variant when the client accepts it.
+            const bool gzip = !cached->gzContent.empty() &&
+                              request.get("Accept-Encoding", "").find("gzip") != std::string::npos;
+            if (!cached->gzContent.empty())
+            {
+                response.set("Vary", "Accept-Encoding");
+            }
+
+            if (gzip)
+            {
+                response.set("Content-Encoding", "gzip");
+            }
+
             response.setContentType(mimeType);
-            response.sendFile(filepath, mimeType);
+
+            // Zero-copy fast path: for unmodified assets the body on
+            // disk is exactly what goes on the wire, so let the kernel
+            // push it straight to the socket. Matters most in a login
+            // storm, when hundreds of clients fetch the dist bundle
+            // at once. The gzip variant qualifies only when it was
+            // shipped precompressed next to the file.
+            const std::string diskFile = gzip ? filepath + ".gz" : filepath;
+            if ((!gzip || Poco::File(diskFile).exists()) &&
+                sendFileResponse(request, response, diskFile))
+            {
+                return;
+            }
+
+            const std::string& body = gzip ? cached->gzContent : cached->content;
+            response.setContentLength(body.size());
+            response.setChunkedTransferEncoding(false);
+            response.send() << body;
         }
     }
     catch (const Poco::Net::NotAuthenticatedException& exc)
@@ -231,10 +450,9 @@ void FileServerRequestHandler::preprocessFile(HTTPServerRequest& request, HTTPSe
         return;
     }
 
-    std::string preprocess;
-    FileInputStream file(path.toString());
-    StreamCopier::copyToString(file, preprocess);
-    file.close();
+    // The substituted tokens vary per request, so only the raw
+    // template is cached and no conditional-request headers are sent.
+    std::string preprocess = getCachedFile(path.toString())->content;
 
     const std::string& accessToken = form.get("access_token", "");
     const std::string& accessTokenTtl = form.get("access_token_ttl", "");
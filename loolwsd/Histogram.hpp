@@ -0,0 +1,195 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_HISTOGRAM_HPP
+#define INCLUDED_HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/// A latency histogram with log-linear (HDR-style) buckets.
+///
+/// Values are microseconds. Each power-of-two range is split into 16
+/// sub-buckets, bounding the relative error of any reported quantile
+/// to ~6% while keeping the whole histogram a few KB of memory.
+/// Recording is lock-free; reading takes no lock either and may see a
+/// sample's count before its sum, which is harmless for monitoring.
+///
+/// Instances are named and process-global, created on first use:
+///     Histogram::get("tile_roundtrip").record(micros);
+/// and are serialized for the admin interface by toJSONAll().
+class Histogram
+{
+public:
+    void record(uint64_t micros)
+    {
+        if (micros > MaxValue)
+            micros = MaxValue;
+
+        _buckets[bucketFor(micros)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(micros, std::memory_order_relaxed);
+
+        auto min = _min.load(std::memory_order_relaxed);
+        while (micros < min && !_min.compare_exchange_weak(min, micros))
+        {
+        }
+
+        auto max = _max.load(std::memory_order_relaxed);
+        while (micros > max && !_max.compare_exchange_weak(max, micros))
+        {
+        }
+    }
+
+    /// The value at the given quantile (0.0 - 1.0), as the upper edge
+    /// of the bucket the quantile falls in.
+    uint64_t quantile(const double q) const
+    {
+        const auto count = _count.load(std::memory_order_relaxed);
+        if (count == 0)
+            return 0;
+
+        const uint64_t rank = count * q;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < BucketCount; ++i)
+        {
+            seen += _buckets[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return valueFor(i);
+        }
+
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+    uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+
+    std::string toJSON() const
+    {
+        const auto count = _count.load(std::memory_order_relaxed);
+
+        std::ostringstream oss;
+        oss << "{\"unit\":\"us\""
+            << ",\"count\":" << count
+            << ",\"sum\":" << _sum.load(std::memory_order_relaxed)
+            << ",\"min\":" << (count ? _min.load(std::memory_order_relaxed) : 0)
+            << ",\"max\":" << _max.load(std::memory_order_relaxed)
+            << ",\"p50\":" << quantile(0.50)
+            << ",\"p75\":" << quantile(0.75)
+            << ",\"p90\":" << quantile(0.90)
+            << ",\"p99\":" << quantile(0.99)
+            << ",\"p999\":" << quantile(0.999)
+            << '}';
+        return oss.str();
+    }
+
+    /// The named histogram, created empty on first use.
+    static Histogram& get(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        auto& histogram = registry()[name];
+        if (!histogram)
+        {
+            histogram.reset(new Histogram());
+        }
+
+        return *histogram;
+    }
+
+    /// Visit every histogram; for exporters.
+    static void forEach(const std::function<void(const std::string&, const Histogram&)>& fn)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (const auto& it : registry())
+        {
+            fn(it.first, *it.second);
+        }
+    }
+
+    /// All histograms as one JSON object, keyed by name.
+    static std::string toJSONAll()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+
+        std::string json = "{";
+        for (const auto& it : registry())
+        {
+            if (json.size() > 1)
+                json += ',';
+            json += '"' + it.first + "\":" + it.second->toJSON();
+        }
+
+        json += '}';
+        return json;
+    }
+
+private:
+    Histogram()
+    {
+        for (auto& bucket : _buckets)
+            bucket = 0;
+    }
+
+    /// 16 sub-buckets per power of two.
+    static const unsigned SubBucketBits = 4;
+    static const unsigned SubBuckets = 1 << SubBucketBits;
+    /// Values clamp at ~67 seconds; anything above is equally bad.
+    static const uint64_t MaxValue = (1ULL << 26) - 1;
+    static const unsigned BucketCount = (26 - SubBucketBits + 1) * SubBuckets;
+
+    static unsigned bucketFor(const uint64_t value)
+    {
+        if (value < SubBuckets)
+            return value;
+
+        const unsigned msb = 63 - __builtin_clzll(value);
+        const unsigned shift = msb - SubBucketBits;
+        return ((shift + 1) << SubBucketBits) + ((value >> shift) - SubBuckets);
+    }
+
+    /// The upper edge of a bucket; inverse of bucketFor.
+    static uint64_t valueFor(const unsigned bucket)
+    {
+        if (bucket < SubBuckets)
+            return bucket;
+
+        const unsigned shift = (bucket >> SubBucketBits) - 1;
+        return static_cast<uint64_t>((bucket & (SubBuckets - 1)) + SubBuckets + 1) << shift;
+    }
+
+    static std::map<std::string, std::unique_ptr<Histogram>>& registry()
+    {
+        static std::map<std::string, std::unique_ptr<Histogram>> histograms;
+        return histograms;
+    }
+
+    static std::mutex& registryMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+private:
+    std::atomic<uint64_t> _buckets[BucketCount];
+    std::atomic<uint64_t> _count{ 0 };
+    std::atomic<uint64_t> _sum{ 0 };
+    std::atomic<uint64_t> _min{ MaxValue };
+    std::atomic<uint64_t> _max{ 0 };
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -20,9 +20,14 @@
 #include <sstream>
 #include <string>
 
+#include <Poco/DeflatingStream.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
 #include <Poco/Net/NetException.h>
 #include <Poco/Net/Socket.h>
 #include <Poco/Net/WebSocket.h>
+#include <Poco/String.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/Thread.h>
 #include <Poco/URI.h>
@@ -35,9 +40,95 @@
 using Poco::Net::Socket;
 using Poco::Net::WebSocket;
 
+namespace
+{
+    /// Negative window bits select a raw deflate stream without the
+    /// zlib wrapper, as permessage-deflate requires.
+    constexpr int RawDeflateWindowBits = -15;
+}
+
 namespace IoUtil
 {
 
+bool negotiateWebSocketDeflate(const Poco::Net::HTTPServerRequest& request,
+                               Poco::Net::HTTPServerResponse& response)
+{
+    const auto offered = request.get("Sec-WebSocket-Extensions", "");
+    if (offered.empty())
+    {
+        return false;
+    }
+
+    Poco::StringTokenizer extensions(offered, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY |
+                                                   Poco::StringTokenizer::TOK_TRIM);
+    for (const auto& extension : extensions)
+    {
+        Poco::StringTokenizer params(extension, ";", Poco::StringTokenizer::TOK_IGNORE_EMPTY |
+                                                     Poco::StringTokenizer::TOK_TRIM);
+        if (params.count() > 0 && Poco::icompare(params[0], "permessage-deflate") == 0)
+        {
+            // Decline context takeover in both directions; the client
+            // keeps its default window as we inflate with the maximum.
+            response.set("Sec-WebSocket-Extensions",
+                         "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+            Log::debug("Negotiated permessage-deflate with the client.");
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool deflateMessage(const char* data, const size_t length, std::vector<char>& compressed)
+{
+    std::ostringstream oss;
+    Poco::DeflatingOutputStream deflater(oss, RawDeflateWindowBits, Z_DEFAULT_COMPRESSION);
+    deflater.write(data, length);
+    deflater.close();
+
+    // A finished stream (ending in a final block) is valid RFC 7692;
+    // no need to truncate the empty-block trailer of a flushed one.
+    const auto& result = oss.str();
+    if (result.size() + 8 >= length)
+    {
+        // Incompressible; the frame is smaller as it is.
+        return false;
+    }
+
+    compressed.assign(result.data(), result.data() + result.size());
+    return true;
+}
+
+bool inflateMessage(std::vector<char>& payload)
+{
+    // The sender strips the trailing empty block; restore it so the
+    // inflater sees a complete stream.
+    std::string compressed(payload.data(), payload.size());
+    compressed.append("\x00\x00\xff\xff", 4);
+
+    std::istringstream iss(compressed);
+    Poco::InflatingInputStream inflater(iss, RawDeflateWindowBits);
+
+    std::vector<char> message;
+    char buffer[READ_BUFFER_SIZE];
+    do
+    {
+        inflater.read(buffer, sizeof(buffer));
+        message.insert(message.end(), buffer, buffer + inflater.gcount());
+    }
+    while (inflater.good());
+
+    if (inflater.bad())
+    {
+        Log::error("Failed to inflate a compressed WebSocket message of " +
+                   std::to_string(payload.size()) + " bytes.");
+        return false;
+    }
+
+    payload.swap(message);
+    return true;
+}
+
 int receiveFrame(WebSocket& socket, void* buffer, int length, int& flags)
 {
     while (!TerminationFlag)
@@ -118,7 +209,10 @@ void SocketProcessor(const std::shared_ptr<WebSocket>& ws,
 
             assert(n > 0);
 
-            const std::string firstLine = LOOLProtocol::getFirstLine(payload);
+            // RSV1 of the first frame marks a permessage-deflate
+            // compressed message; continuation frames leave it clear.
+            bool deflated = ((flags & WebSocketFlagDeflated) != 0);
+
             if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) != WebSocket::FrameFlags::FRAME_FLAG_FIN)
             {
                 // One WS message split into multiple frames.
@@ -143,16 +237,34 @@ void SocketProcessor(const std::shared_ptr<WebSocket>& ws,
             }
             else
             {
+                // Inflate before looking at the content; the peer may
+                // have compressed the "nextmessage:" itself.
+                if (deflated)
+                {
+                    if (!inflateMessage(payload))
+                    {
+                        closeFrame();
+                        break;
+                    }
+
+                    deflated = false;
+                }
+
                 int size = 0;
+                const std::string firstLine = LOOLProtocol::getFirstLine(payload);
                 Poco::StringTokenizer tokens(firstLine, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
                 if (tokens.count() == 2 &&
                     tokens[0] == "nextmessage:" && LOOLProtocol::getTokenInteger(tokens[1], "size", size) && size > 0)
                 {
                     // Check if it is a "nextmessage:" and in that case read the large
                     // follow-up message separately, and handle that only.
-                    payload.resize(size);
+                    // The size advertised is that of the uncompressed message;
+                    // leave some slack in case the frame grew under deflate.
+                    payload.resize(size + 64);
 
-                    n = ws->receiveFrame(payload.data(), size, flags);
+                    n = ws->receiveFrame(payload.data(), payload.size(), flags);
+                    payload.resize(n > 0 ? n : 0);
+                    deflated = ((flags & WebSocketFlagDeflated) != 0);
                 }
             }
 
@@ -163,6 +275,12 @@ void SocketProcessor(const std::shared_ptr<WebSocket>& ws,
                 break;
             }
 
+            if (deflated && !inflateMessage(payload))
+            {
+                closeFrame();
+                break;
+            }
+
             // Call the handler.
             const auto success = handler(payload);
             payload.resize(0);
@@ -13,14 +13,48 @@
 #include <functional>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <sys/poll.h>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Logger.h>
 
+namespace Poco
+{
+namespace Net
+{
+class HTTPServerRequest;
+class HTTPServerResponse;
+}
+}
+
 namespace IoUtil
 {
+    /// The RSV1 frame-header bit of RFC 7692 permessage-deflate,
+    /// marking a compressed message. Poco does not name the RSV bits,
+    /// but passes them through in the frame flags both ways.
+    constexpr int WebSocketFlagDeflated = 0x40;
+
+    /// Negotiate RFC 7692 permessage-deflate with the client. Must be
+    /// called before constructing the WebSocket, since its constructor
+    /// completes the upgrade handshake. We accept only with
+    /// no-context-takeover in both directions, so every message is a
+    /// self-contained deflate stream and no per-connection zlib state
+    /// survives between messages. Returns true if the client offered
+    /// the extension and the response header was set.
+    bool negotiateWebSocketDeflate(const Poco::Net::HTTPServerRequest& request,
+                                   Poco::Net::HTTPServerResponse& response);
+
+    /// Compress a message payload for sending in an RSV1-flagged frame.
+    /// Returns false, leaving compressed untouched, when deflating
+    /// doesn't pay for this payload (it grew, or nearly so).
+    bool deflateMessage(const char* data, size_t length, std::vector<char>& compressed);
+
+    /// Decompress an RSV1-flagged message received from the peer,
+    /// in place. Returns false if the payload is not valid deflate data.
+    bool inflateMessage(std::vector<char>& payload);
+
     // Wrapper for WebSocket::receiveFrame() that handles PING frames (by replying with a
     // PONG frame) and PONG frames. PONG frames are ignored.
     // Should we also factor out the handling of non-final and continuation frames into this?
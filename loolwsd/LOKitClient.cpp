@@ -179,7 +179,8 @@ protected:
                 std::vector<char> png;
                 const auto mode = static_cast<LibreOfficeKitTileMode>(loKitDocument->pClass->getTileMode(loKitDocument));
 
-                png::encodeBufferToPNG(pixmap.data(), canvasWidth, canvasHeight, png, mode);
+                png::encodeBufferToPNG(pixmap.data(), canvasWidth, canvasHeight, png, mode,
+                                       png::EncodeProfile::Compact);
 
                 TemporaryFile pngFile;
                 std::ofstream pngStream(pngFile.path(), std::ios::binary);
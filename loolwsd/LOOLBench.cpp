@@ -0,0 +1,226 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Microbenchmarks of the hot-path primitives: message parsing and
+ * tokenization, the tile queue, and tile encoding. Run via 'make
+ * bench'; each case reports ns/op on representative inputs, so
+ * regressions show up as numbers instead of production latency.
+ */
+
+#include "config.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define LOK_USE_UNSTABLE_API
+#include <LibreOfficeKit/LibreOfficeKitEnums.h>
+
+#include "LOOLProtocol.hpp"
+#include "Log.hpp"
+#include "MessageQueue.hpp"
+#include "Png.hpp"
+#include "TileDesc.hpp"
+
+namespace
+{
+
+/// Defeats dead-code elimination of the measured work.
+volatile size_t Sink = 0;
+
+/// Runs the function in growing batches until the timing is stable
+/// and prints its cost per call.
+void benchmark(const char* name, const std::function<void()>& fn)
+{
+    // Warm up caches and one-time initialization.
+    fn();
+
+    size_t iterations = 1;
+    double elapsedNs = 0.;
+    while (true)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            fn();
+        }
+
+        elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        if (elapsedNs >= 2e8 || iterations >= (1ull << 30))
+        {
+            break;
+        }
+
+        iterations *= 2;
+    }
+
+    std::printf("%-36s %12.1f ns/op  %10zu ops\n",
+                name, elapsedNs / iterations, iterations);
+}
+
+/// A representative spread of tile requests: several parts, zoom
+/// levels and positions, as a scrolling client produces them.
+std::vector<std::string> makeTileCorpus()
+{
+    std::vector<std::string> corpus;
+    for (int part = 0; part < 4; ++part)
+    {
+        for (int x = 0; x < 4; ++x)
+        {
+            for (int y = 0; y < 4; ++y)
+            {
+                corpus.push_back("tile part=" + std::to_string(part) +
+                                 " width=256 height=256 tileposx=" + std::to_string(x * 3840) +
+                                 " tileposy=" + std::to_string(y * 3840) +
+                                 " tilewidth=3840 tileheight=3840 ver=" +
+                                 std::to_string(x + y * 4));
+            }
+        }
+    }
+
+    return corpus;
+}
+
+/// The message mix of an editing session, as seen by the queues and
+/// the tokenizer: input events, tiles and invalidations.
+std::vector<std::string> makeMessageCorpus()
+{
+    std::vector<std::string> corpus;
+    for (int i = 0; i < 16; ++i)
+    {
+        corpus.push_back("key type=input char=" + std::to_string(97 + i) + " key=0");
+        corpus.push_back("mouse type=move x=" + std::to_string(i * 120) +
+                         " y=" + std::to_string(i * 75) + " count=1 buttons=0 modifier=0");
+        corpus.push_back("invalidatetiles: part=0 x=" + std::to_string(i * 3840) +
+                         " y=0 width=3840 height=3840");
+        corpus.push_back("tile part=0 width=256 height=256 tileposx=" +
+                         std::to_string(i * 3840) +
+                         " tileposy=0 tilewidth=3840 tileheight=3840");
+    }
+
+    return corpus;
+}
+
+/// A 256x256 RGBA gradient with some structure: neither a solid color
+/// (which short-circuits encoders) nor noise (which no document is).
+std::vector<unsigned char> makeTilePixmap()
+{
+    std::vector<unsigned char> pixmap(256 * 256 * 4);
+    for (int y = 0; y < 256; ++y)
+    {
+        for (int x = 0; x < 256; ++x)
+        {
+            const size_t pos = (y * 256 + x) * 4;
+            pixmap[pos + 0] = static_cast<unsigned char>(x);
+            pixmap[pos + 1] = static_cast<unsigned char>(y);
+            pixmap[pos + 2] = static_cast<unsigned char>((x ^ y) & 0xff);
+            pixmap[pos + 3] = 255;
+        }
+    }
+
+    return pixmap;
+}
+
+}
+
+int main(int /*argc*/, char** /*argv*/)
+{
+    Log::initialize("bnc", "error", false, false, {});
+
+    const auto tiles = makeTileCorpus();
+    const auto messages = makeMessageCorpus();
+    auto pixmap = makeTilePixmap();
+
+    benchmark("TileDesc::parse",
+              [&tiles]()
+              {
+                  for (const auto& msg : tiles)
+                  {
+                      Sink += TileDesc::parse(msg).getTilePosX();
+                  }
+              });
+
+    const std::string combined =
+        "tilecombine part=0 width=256 height=256"
+        " tileposx=0,3840,7680,11520,0,3840,7680,11520"
+        " tileposy=0,0,0,0,3840,3840,3840,3840"
+        " tilewidth=3840 tileheight=3840";
+    benchmark("TileCombined::parse",
+              [&combined]()
+              {
+                  LOOLProtocol::Tokenizer tokens(combined);
+                  Sink += TileCombined::parse(tokens).getTiles().size();
+              });
+
+    benchmark("Tokenizer + getTokenInteger",
+              [&messages]()
+              {
+                  for (const auto& msg : messages)
+                  {
+                      LOOLProtocol::Tokenizer tokens(msg);
+                      int value = 0;
+                      LOOLProtocol::getTokenInteger(tokens, "part", value);
+                      Sink += tokens.count() + value;
+                  }
+              });
+
+    benchmark("getFirstLine",
+              [&messages]()
+              {
+                  for (const auto& msg : messages)
+                  {
+                      Sink += LOOLProtocol::getFirstLine(msg.data(), msg.size()).size();
+                  }
+              });
+
+    // A scroll's worth of traffic through the prioritizing queue: the
+    // put side exercises duplicate detection and parsing, the drain
+    // side the deadline scheduler. One op is the full 64-message cycle.
+    {
+        TileQueue queue;
+        benchmark("TileQueue put+drain (64 msgs)",
+                  [&queue, &messages]()
+                  {
+                      for (const auto& msg : messages)
+                      {
+                          queue.put(msg);
+                      }
+
+                      Sink += queue.get_batch().size();
+                  });
+    }
+
+    benchmark("encodeBufferToPNG (256x256)",
+              [&pixmap]()
+              {
+                  std::vector<char> output;
+                  output.reserve(256 * 256);
+                  png::encodeBufferToPNG(pixmap.data(), 256, 256, output,
+                                         LOK_TILEMODE_RGBA,
+                                         png::EncodeProfile::Interactive);
+                  Sink += output.size();
+              });
+
+    benchmark("encodeSubBufferToRawZ (256x256)",
+              [&pixmap]()
+              {
+                  std::vector<char> output;
+                  output.reserve(256 * 256);
+                  png::encodeSubBufferToRawZ(pixmap.data(), 0, 0, 256, 256, 256, 256,
+                                             output, LOK_TILEMODE_RGBA);
+                  Sink += output.size();
+              });
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -17,14 +17,23 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <set>
+#include <thread>
 
+#include <Poco/DirectoryIterator.h>
+#include <Poco/File.h>
 #include <Poco/Path.h>
 #include <Poco/Process.h>
 #include <Poco/StringTokenizer.h>
@@ -51,6 +60,16 @@ static std::atomic<unsigned> ForkCounter( 0 );
 
 static std::map<Process::PID, std::string> childJails;
 
+// Optional per-kit cgroup placement; empty parents disable it.
+static std::string CgroupCpuParent;
+static unsigned CgroupCpuShares = 0;
+static std::string CgroupMemParent;
+static unsigned CgroupMemLimitMb = 0;
+
+/// Serializes fork() with the jail provisioner thread, so a child
+/// is never forked while the provisioner holds a heap or libc lock.
+static std::mutex ForkMutex;
+
 int ClientPortNumber = DEFAULT_CLIENT_PORT_NUMBER;
 int MasterPortNumber = DEFAULT_MASTER_PORT_NUMBER;
 
@@ -175,6 +194,87 @@ static bool haveCorrectCapabilities()
     return result;
 }
 
+/// Write a single value into a cgroup control file.
+static bool writeCgroupFile(const std::string& path, const std::string& value)
+{
+    std::ofstream file(path);
+    file << value << std::endl;
+    file.close();
+    if (!file)
+    {
+        Log::error("Failed to write '" + value + "' to '" + path + "'.");
+        return false;
+    }
+
+    return true;
+}
+
+/// Place a freshly forked kit into a cgroup of its own under the
+/// configured parents, applying the per-kit CPU weight and memory
+/// ceiling, so one runaway document degrades instead of starving the
+/// host. The parents must exist and be writable by our user.
+static void placeKitInCgroups(const Process::PID pid)
+{
+    const auto sPid = std::to_string(pid);
+
+    if (!CgroupCpuParent.empty())
+    {
+        const auto group = CgroupCpuParent + "/kit" + sPid;
+        if (mkdir(group.c_str(), S_IRWXU) == 0 || errno == EEXIST)
+        {
+            if (CgroupCpuShares > 0)
+            {
+                writeCgroupFile(group + "/cpu.shares", std::to_string(CgroupCpuShares));
+            }
+
+            writeCgroupFile(group + "/cgroup.procs", sPid);
+        }
+        else
+        {
+            Log::syserror("mkdir(\"" + group + "\") failed.");
+        }
+    }
+
+    if (!CgroupMemParent.empty())
+    {
+        const auto group = CgroupMemParent + "/kit" + sPid;
+        if (mkdir(group.c_str(), S_IRWXU) == 0 || errno == EEXIST)
+        {
+            if (CgroupMemLimitMb > 0)
+            {
+                writeCgroupFile(group + "/memory.limit_in_bytes",
+                                std::to_string(static_cast<unsigned long>(CgroupMemLimitMb) * 1024 * 1024));
+            }
+
+            writeCgroupFile(group + "/cgroup.procs", sPid);
+        }
+        else
+        {
+            Log::syserror("mkdir(\"" + group + "\") failed.");
+        }
+    }
+}
+
+/// Remove the per-kit groups of an exited kit. The groups are empty
+/// by then, so a plain rmdir suffices.
+static void removeKitCgroups(const Process::PID pid)
+{
+    const auto sPid = std::to_string(pid);
+    for (const auto& parent : { CgroupCpuParent, CgroupMemParent })
+    {
+        if (parent.empty())
+        {
+            continue;
+        }
+
+        const auto group = parent + "/kit" + sPid;
+        if (rmdir(group.c_str()) != 0 && errno != ENOENT)
+        {
+            Log::syserror("rmdir(\"" + group + "\") failed.");
+        }
+    }
+}
+
 /// Check if some previously forked kids have died.
 static void cleanupChildren()
 {
@@ -187,6 +287,7 @@ static void cleanupChildren()
             Log::info("Child " + std::to_string(exitedChildPid) + " has exited, removing its jail '" + childJails[exitedChildPid] + "'");
             Util::removeFile(childJails[exitedChildPid], true);
             childJails.erase(exitedChildPid);
+            removeKitCgroups(exitedChildPid);
         }
         else
         {
@@ -195,6 +296,68 @@ static void cleanupChildren()
     }
 }
 
+/// How many jails to keep provisioned ahead of need.
+constexpr size_t ReadyJailPoolSize = 2;
+
+/// Keep a small pool of fully-built jails under childRoot/ready, so a
+/// freshly forked kit adopts one with a single rename instead of paying
+/// for the template clone itself. All the work is done under ForkMutex;
+/// while the thread sleeps it holds no locks and forking is safe.
+static void jailProvisionerPoll(const std::string& childRoot,
+                                const std::string& sysTemplate,
+                                const std::string& loTemplate,
+                                const std::string& loSubPath)
+{
+    Util::setThreadName("jail_provision");
+
+    const std::string readyRoot = childRoot + "/" + READY_JAILS_SUBPATH;
+    const std::string tempJail = childRoot + "/ready.tmp";
+    size_t sequence = 0;
+
+    while (!TerminationFlag)
+    {
+        try
+        {
+            size_t ready = 0;
+            Poco::File readyDir(readyRoot);
+            if (readyDir.exists())
+            {
+                for (Poco::DirectoryIterator it(readyDir), end; it != end; ++it)
+                    ++ready;
+            }
+
+            if (ready < ReadyJailPoolSize)
+            {
+                std::unique_lock<std::mutex> lock(ForkMutex);
+
+                // Build into a temporary, then publish atomically.
+                Util::removeFile(tempJail, true);
+                provisionKitJail(childRoot, sysTemplate, loTemplate, loSubPath, tempJail);
+
+                readyDir.createDirectories();
+                const auto target = readyRoot + "/jail" + std::to_string(++sequence);
+                if (rename(tempJail.c_str(), target.c_str()) == 0)
+                {
+                    Log::debug("Pre-provisioned jail '" + target + "'.");
+                }
+                else
+                {
+                    Log::syserror("Failed to publish pre-provisioned jail '" + target + "'.");
+                    Util::removeFile(tempJail, true);
+                }
+
+                continue;
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error(std::string("Jail provisioning failed: ") + exc.what());
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+}
+
 static int createLibreOfficeKit(const std::string& childRoot,
                                 const std::string& sysTemplate,
                                 const std::string& loTemplate,
@@ -203,6 +366,9 @@ static int createLibreOfficeKit(const std::string& childRoot,
 {
     Log::debug("Forking a loolkit process.");
 
+    // Keep the provisioner quiescent across the fork.
+    std::unique_lock<std::mutex> forkLock(ForkMutex);
+
     Process::PID pid;
     if (!(pid = fork()))
     {
@@ -234,6 +400,7 @@ static int createLibreOfficeKit(const std::string& childRoot,
         {
             Log::info("Forked kit [" + std::to_string(pid) + "].");
             childJails[pid] = childRoot + std::to_string(pid);
+            placeKitInCgroups(pid);
         }
 
         UnitKit::get().launchedKit(pid);
@@ -324,6 +491,26 @@ int main(int argc, char** argv)
             eq = std::strchr(cmd, '=');
             ClientPortNumber = std::stoll(std::string(eq+1));
         }
+        else if (std::strstr(cmd, "--cgroupcpuparent=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            CgroupCpuParent = std::string(eq+1);
+        }
+        else if (std::strstr(cmd, "--cgroupcpushares=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            CgroupCpuShares = std::stoul(std::string(eq+1));
+        }
+        else if (std::strstr(cmd, "--cgroupmemparent=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            CgroupMemParent = std::string(eq+1);
+        }
+        else if (std::strstr(cmd, "--cgroupmemlimitmb=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            CgroupMemLimitMb = std::stoul(std::string(eq+1));
+        }
         else if (std::strstr(cmd, "--version") == cmd)
         {
             std::string version, hash;
@@ -366,12 +553,28 @@ int main(int argc, char** argv)
     if (!haveCorrectCapabilities())
         return Application::EXIT_SOFTWARE;
 
+    // Discard any jail farm and ready jails left over from a previous
+    // run, so the first child rebuilds them from the current templates.
+    Util::removeFile(childRoot + "/farm", true);
+    Util::removeFile(childRoot + "/farm.nousr", true);
+    Util::removeFile(childRoot + "/" + READY_JAILS_SUBPATH, true);
+    Util::removeFile(childRoot + "/ready.tmp", true);
+
     // Initialize LoKit
     if (!globalPreinit(loTemplate))
         std::_Exit(Application::EXIT_SOFTWARE);
 
     Log::info("Preinit stage OK.");
 
+    // Provision jails ahead of need, so forked kits only pay for a
+    // rename. Bind-mounted jails cannot be safely renamed, and without
+    // capabilities we make no real jails at all; skip in both cases.
+    if (!NoCapsForKit && !std::getenv("LOOL_BIND_MOUNT"))
+    {
+        std::thread(jailProvisionerPoll, childRoot,
+                    sysTemplate, loTemplate, loSubPath).detach();
+    }
+
     // We must have at least one child, more are created dynamically.
     // Ask this first child to send version information to master process
     if (createLibreOfficeKit(childRoot, sysTemplate, loTemplate, loSubPath, true) < 0)
@@ -11,27 +11,39 @@
  * a document editing session.
  */
 
+#include <dirent.h>
 #include <dlfcn.h>
 #include <ftw.h>
 #include <malloc.h>
 #include <sys/capability.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <climits>
 #include <condition_variable>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <thread>
-#include <thread>
+#include <tuple>
+#include <vector>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitInit.h>
 
+#include <Poco/DirectoryIterator.h>
 #include <Poco/Exception.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
@@ -60,6 +72,8 @@
 #include "Png.hpp"
 #include "Rectangle.hpp"
 #include "TileDesc.hpp"
+#include "TileRing.hpp"
+#include "TraceSpan.hpp"
 #include "Unit.hpp"
 #include "UserMessages.hpp"
 #include "Util.hpp"
@@ -90,9 +104,17 @@ using Poco::Util::Application;
 
 using namespace LOOLProtocol;
 
-// We only host a single document in our lifetime.
+// The documents we host: normally a single one for our whole
+// lifetime, several when WSD places extra documents on us over
+// additional control connections (multidoc mode).
 class Document;
-static std::shared_ptr<Document> document;
+static std::vector<std::weak_ptr<Document>> AllDocuments;
+static std::mutex DocumentsMutex;
+
+/// Control connections currently being serviced.
+static std::atomic<int> ActiveConnections(0);
+/// Whether this process ever hosted a document.
+static std::atomic<bool> HostedDocument(false);
 
 namespace
 {
@@ -141,7 +163,8 @@ namespace
         case FTW_F:
         case FTW_SLN:
             File(newPath.parent()).createDirectories();
-            if (link(fpath, newPath.toString().c_str()) == -1)
+            // EEXIST is fine: a partial farm clone may have linked it already.
+            if (link(fpath, newPath.toString().c_str()) == -1 && errno != EEXIST)
             {
                 Log::syserror("link(\"" + std::string(fpath) + "\",\"" + newPath.toString() +
                            "\") failed. Exiting.");
@@ -199,6 +222,115 @@ namespace
             Log::error("linkOrCopy: nftw() failed for '" + source + "'");
     }
 
+    /// Recursively hardlink-clone the pre-built jail farm into a new
+    /// jail. The farm already encodes all the filtering decisions, so
+    /// this is a straight walk of directories and links; entries the
+    /// jail already has (e.g. the LO install symlink, or a bind-mounted
+    /// usr) are left alone.
+    bool cloneJailFromFarm(const std::string& source, const std::string& destination)
+    {
+        DIR* dir = opendir(source.c_str());
+        if (dir == nullptr)
+        {
+            Log::syserror("opendir(\"" + source + "\") failed.");
+            return false;
+        }
+
+        bool success = true;
+        const struct dirent* entry;
+        while (success && (entry = readdir(dir)) != nullptr)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            const std::string from = source + "/" + entry->d_name;
+            const std::string to = destination + "/" + entry->d_name;
+
+            bool isDir = (entry->d_type == DT_DIR);
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (lstat(from.c_str(), &st) != 0)
+                {
+                    Log::syserror("lstat(\"" + from + "\") failed.");
+                    success = false;
+                    break;
+                }
+
+                isDir = S_ISDIR(st.st_mode);
+            }
+
+            if (isDir)
+            {
+                if (mkdir(to.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 &&
+                    errno != EEXIST)
+                {
+                    Log::syserror("mkdir(\"" + to + "\") failed.");
+                    success = false;
+                }
+                else
+                {
+                    success = cloneJailFromFarm(from, to);
+                }
+            }
+            else if (link(from.c_str(), to.c_str()) != 0 && errno != EEXIST)
+            {
+                // link() does not follow symlinks, so the farm's
+                // symlinks are cloned as symlinks too.
+                Log::syserror("link(\"" + from + "\",\"" + to + "\") failed.");
+                success = false;
+            }
+        }
+
+        closedir(dir);
+        return success;
+    }
+
+    /// Provision a jail from a hardlink farm under childRoot, building
+    /// the farm from the templates on first use. Every subsequent child
+    /// pays only for directories and hardlinks instead of walking the
+    /// whole template trees. Returns false when the farm is disabled or
+    /// broken, in which case the caller provisions the jail from the
+    /// templates directly.
+    bool provisionJailFromFarm(const std::string& childRoot,
+                               const std::string& sysTemplate,
+                               const std::string& loTemplate,
+                               const std::string& loSubPath,
+                               const bool loopMounted,
+                               const Path& jailPath)
+    {
+        if (std::getenv("LOOL_NO_JAIL_FARM"))
+            return false;
+
+        // The farm layout depends on whether usr is bind-mounted.
+        const std::string farmPath = childRoot + "/farm" + (loopMounted ? ".nousr" : "");
+        if (!File(farmPath).exists())
+        {
+            // Build the farm aside and rename it into place, so a
+            // concurrent sibling either sees a complete farm or
+            // builds its own and loses the race.
+            const std::string tempPath = farmPath + ".tmp." + std::to_string(Process::id());
+            Log::info("Building jail farm: " + farmPath);
+            File(tempPath).createDirectories();
+            linkOrCopy(sysTemplate, tempPath, loopMounted ? COPY_NO_USR : COPY_ALL);
+
+            Path farmLOInstallation(tempPath, loSubPath);
+            farmLOInstallation.makeDirectory();
+            File(farmLOInstallation).createDirectories();
+            linkOrCopy(loTemplate, farmLOInstallation, COPY_LO);
+
+            if (rename(tempPath.c_str(), farmPath.c_str()) != 0)
+            {
+                Log::syserror("rename(\"" + tempPath + "\",\"" + farmPath + "\") failed.");
+                Util::removeFile(tempPath, true);
+                if (!File(farmPath).exists())
+                    return false;
+            }
+        }
+
+        return cloneJailFromFarm(farmPath, jailPath.toString());
+    }
+
     void dropCapability(cap_value_t capability)
     {
         cap_t caps;
@@ -256,6 +388,154 @@ namespace
 #endif
 }
 
+/// Recycles large render buffers across tile requests. Painting and
+/// encoding allocate (and fault in) multi-MB buffers per request;
+/// under sustained scrolling that churn dominates kit allocator time.
+template <typename T>
+class BufferPool
+{
+public:
+    /// Returns a buffer of the given size, reusing capacity (and warm
+    /// pages) from a previously released buffer when available.
+    std::vector<T> acquire(const size_t size)
+    {
+        std::vector<T> buffer;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (!_buffers.empty())
+            {
+                buffer = std::move(_buffers.back());
+                _buffers.pop_back();
+            }
+        }
+
+        buffer.resize(size);
+        return buffer;
+    }
+
+    /// Returns a buffer to the pool for reuse.
+    void release(std::vector<T>&& buffer)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_buffers.size() < MaxPooledBuffers)
+        {
+            _buffers.emplace_back(std::move(buffer));
+        }
+    }
+
+    /// Drops the pooled buffers, returning their memory to the allocator.
+    void trim()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _buffers.clear();
+        _buffers.shrink_to_fit();
+    }
+
+private:
+    /// Enough for a combined render's pixmap plus concurrent encoders.
+    static constexpr size_t MaxPooledBuffers = 8;
+
+    std::mutex _mutex;
+    std::vector<std::vector<T>> _buffers;
+};
+
+/// Remembers the last pixels painted for a tile position, and their
+/// encoding. Invalidation is deliberately over-broad in the Core, so
+/// while typing most re-rendered tiles come out pixel-identical to
+/// what was already sent; comparing against the previous pixmap lets
+/// the render path skip the whole encode pipeline for those.
+class RenderedTileCache
+{
+public:
+    struct Entry
+    {
+        std::shared_ptr<std::vector<unsigned char>> pixmap;
+        std::shared_ptr<std::vector<char>> encoded;
+    };
+
+    /// Returns the last rendered entry for the position, if any.
+    Entry lookup(const std::string& key)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _entries.find(key);
+        if (it == _entries.end())
+        {
+            return Entry();
+        }
+
+        _lru.splice(_lru.begin(), _lru, it->second.lruIt);
+        return it->second.entry;
+    }
+
+    /// Stores the latest rendering of the position, evicting the
+    /// least-recently rendered positions beyond the size budget.
+    void insert(const std::string& key, const Entry& entry)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _entries.find(key);
+        if (it != _entries.end())
+        {
+            _size -= sizeOf(it->second.entry);
+            _lru.splice(_lru.begin(), _lru, it->second.lruIt);
+            it->second.entry = entry;
+        }
+        else
+        {
+            _lru.push_front(key);
+            _entries.emplace(key, CachedEntry{entry, _lru.begin()});
+        }
+
+        _size += sizeOf(entry);
+        while (_size > MaxSize && !_lru.empty())
+        {
+            const auto oldest = _entries.find(_lru.back());
+            _size -= sizeOf(oldest->second.entry);
+            _entries.erase(oldest);
+            _lru.pop_back();
+        }
+    }
+
+    /// Drops all cached renderings.
+    void clear()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _entries.clear();
+        _lru.clear();
+        _size = 0;
+    }
+
+private:
+    static size_t sizeOf(const Entry& entry)
+    {
+        return entry.pixmap->size() + entry.encoded->size();
+    }
+
+    struct CachedEntry
+    {
+        Entry entry;
+        std::list<std::string>::iterator lruIt;
+    };
+
+    /// Roughly a viewport's worth of raw tiles.
+    static constexpr size_t MaxSize = 16 * 1024 * 1024;
+
+    std::mutex _mutex;
+    std::map<std::string, CachedEntry> _entries;
+    std::list<std::string> _lru;
+    size_t _size = 0;
+};
+
+/// The tile position and format, without the versioning noise;
+/// deliberately keyed like TileCache::cacheFileName.
+static std::string tilePositionKey(const TileDesc& tile)
+{
+    std::ostringstream oss;
+    oss << tile.getPart() << '_' << tile.getWidth() << 'x' << tile.getHeight() << '.'
+        << tile.getTilePosX() << ',' << tile.getTilePosY() << '.'
+        << tile.getTileWidth() << 'x' << tile.getTileHeight() << '.' << tile.getFormat();
+    return oss.str();
+}
+
 /// A document container.
 /// Owns LOKitDocument instance and connections.
 /// Manages the lifetime of a document.
@@ -296,6 +576,11 @@ public:
         Log::info("Document ctor for url [" + _url + "] on child [" + _jailId + "].");
         assert(_loKit && _loKit->get());
 
+        // The shared ring through which the encoded tiles reach wsd
+        // without crossing the socket; on failure we simply send the
+        // payloads inline as before.
+        _tileRing = TileRing::create(TileRing::ringPath(_docKey), TileRing::DefaultCapacity);
+
         _callbackThread.start(*this);
     }
 
@@ -304,6 +589,22 @@ public:
         Log::info("~Document dtor for url [" + _url + "] on child [" + _jailId +
                   "]. There are " + std::to_string(_clientViews) + " views.");
 
+        // Kill any outstanding snapshot exporters; with the document
+        // going away their result has nowhere to go. Then collect the
+        // watchers before the members they use are destroyed.
+        {
+            std::unique_lock<std::mutex> lock(_exportsMutex);
+            for (const auto pid : _exportPids)
+            {
+                kill(pid, SIGKILL);
+            }
+        }
+
+        for (auto& watcher : _exportWatchers)
+        {
+            watcher.join();
+        }
+
         // Wait for the callback worker to finish.
         _stop = true;
 
@@ -434,6 +735,26 @@ public:
         return !hasSessions();
     }
 
+    /// Release reusable kit-side memory after a spell of inactivity:
+    /// render buffer pools, cached renderings and the allocator's
+    /// free lists. Everything re-populates on demand; this LOK
+    /// version offers no call to drop its internal caches.
+    void trimMemory()
+    {
+        Log::info("Trimming idle memory of document [" + _url + "].");
+
+        _pixmapPool.trim();
+        _outputPool.trim();
+        _renderedTiles.clear();
+
+        {
+            std::unique_lock<std::mutex> lock(_solidTilesMutex);
+            _solidTiles.clear();
+        }
+
+        malloc_trim(0);
+    }
+
     /// Set Document password for given URL
     void setDocumentPassword(int nPasswordType)
     {
@@ -463,10 +784,11 @@ public:
         Log::info("setDocumentPassword returned");
     }
 
-    void renderTile(StringTokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    void renderTile(const std::string& message, const std::shared_ptr<Poco::Net::WebSocket>& ws)
     {
         assert(ws && "Expected a non-null websocket.");
-        auto tile = TileDesc::parse(tokens);
+        const long long renderStart = TraceSpan::enabled() ? TraceSpan::now() : 0;
+        auto tile = TileDesc::parse(message);
 
         // Send back the request with all optional parameters given in the request.
         const auto tileMsg = tile.serialize("tile:");
@@ -476,13 +798,13 @@ public:
         const std::string response = tileMsg + "\n";
 #endif
 
-        std::vector<char> output;
-        output.reserve(response.size() + (4 * tile.getWidth() * tile.getHeight()));
-        output.resize(response.size());
+        const size_t pixmapSize = 4 * tile.getWidth() * tile.getHeight();
+
+        auto output = _outputPool.acquire(response.size());
+        output.reserve(response.size() + pixmapSize);
         std::memcpy(output.data(), response.data(), response.size());
 
-        std::vector<unsigned char> pixmap;
-        pixmap.resize(output.capacity());
+        auto pixmap = _pixmapPool.acquire(pixmapSize);
 
         if (!_loKitDocument)
         {
@@ -509,28 +831,52 @@ public:
                      << " ms (" << area / elapsed << " MP/s)." << Log::end;
         const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
 
-        if (!png::encodeBufferToPNG(pixmap.data(), tile.getWidth(), tile.getHeight(), output, mode))
+        if (!encodeTile(tile, pixmap, mode, output))
         {
             //FIXME: Return error.
             //sendTextFrame("error: cmd=tile kind=failure");
-            Log::error("Failed to encode tile into PNG.");
+            Log::error("Failed to encode tile.");
             return;
         }
 
-        const auto length = output.size();
-        if (length > SMALL_MESSAGE_SIZE)
+        const size_t imgSize = output.size() - response.size();
+        const int64_t ringPos = _tileRing ? _tileRing->write(output.data() + response.size(), imgSize)
+                                          : -1;
+        if (ringPos >= 0)
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            ws->sendFrame(nextmessage.data(), nextmessage.size());
+            // Only the descriptor crosses the socket; the payload sits
+            // in the shared ring for wsd to pick up.
+            std::string message(response.data(), response.size() - 1); // Without the '\n'.
+            message += " imgsize=" + std::to_string(imgSize) +
+                       " shmpos=" + std::to_string(ringPos) + "\n";
+            ws->sendFrame(message.data(), message.size(), WebSocket::FRAME_BINARY);
+        }
+        else
+        {
+            const auto length = output.size();
+            if (length > SMALL_MESSAGE_SIZE)
+            {
+                const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
+                ws->sendFrame(nextmessage.data(), nextmessage.size());
+            }
+
+            Log::trace("Sending render-tile response (" + std::to_string(length) + " bytes) for: " + response);
+            ws->sendFrame(output.data(), length, WebSocket::FRAME_BINARY);
         }
 
-        Log::trace("Sending render-tile response (" + std::to_string(length) + " bytes) for: " + response);
-        ws->sendFrame(output.data(), length, WebSocket::FRAME_BINARY);
+        _pixmapPool.release(std::move(pixmap));
+        _outputPool.release(std::move(output));
+
+        if (renderStart && !_renderedFirstTile.exchange(true))
+        {
+            TraceSpan::record("kit.tile.first", _docKey, renderStart, TraceSpan::now());
+        }
     }
 
-    void renderCombinedTiles(StringTokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    void renderCombinedTiles(const Tokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws)
     {
         assert(ws && "Expected a non-null websocket.");
+        const long long renderStart = TraceSpan::enabled() ? TraceSpan::now() : 0;
         auto tileCombined = TileCombined::parse(tokens);
         auto& tiles = tileCombined.getTiles();
 
@@ -560,7 +906,8 @@ public:
         const size_t pixmapWidth = tilesByX * tileCombined.getWidth();
         const size_t pixmapHeight = tilesByY * tileCombined.getHeight();
         const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
-        std::vector<unsigned char> pixmap(pixmapSize, 0);
+        auto pixmap = _pixmapPool.acquire(pixmapSize);
+        std::memset(pixmap.data(), 0, pixmapSize);
 
         if (!_loKitDocument)
         {
@@ -575,64 +922,338 @@ public:
             return;
         }
 
-        const double area = pixmapWidth * pixmapHeight;
-        Timestamp timestamp;
-        _loKitDocument->paintPartTile(pixmap.data(), tileCombined.getPart(),
-                                      pixmapWidth, pixmapHeight,
-                                      renderArea.getLeft(), renderArea.getTop(),
-                                      renderArea.getWidth(), renderArea.getHeight());
-        const auto elapsed = timestamp.elapsed();
-        Log::debug() << "paintTile (combined) at (" << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
-                     << renderArea.getWidth() << ", " << renderArea.getHeight() << ") ver: " << tileCombined.getVersion()
-                     << " rendered in " << (elapsed/1000.) << " ms (" << area / elapsed << " MP/s)." << Log::end;
         const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
 
-        std::vector<char> output;
-        output.reserve(pixmapWidth * pixmapHeight * 4);
+        // Banded painting: paint the area in horizontal bands of one
+        // tile row each, dropping the document lock between bands so
+        // other callbacks can interleave, and letting the encode
+        // workers start on finished bands while the rest still
+        // paints. The document calls themselves stay serialized, as
+        // the LOK threading model requires.
+        const bool banded = bandedRenderingEnabled() && tilesByY > 1;
+
+        // Tile rows painted so far; encode workers only take tiles
+        // whose row is ready.
+        std::atomic<size_t> rowsPainted(banded ? 0 : tilesByY);
+        std::mutex bandMutex;
+        std::condition_variable bandCV;
 
-        size_t tileIndex = 0;
-        for (Util::Rectangle& tileRect : tileRecs)
+        const double area = pixmapWidth * pixmapHeight;
+        Timestamp timestamp;
+        if (!banded)
         {
-            const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
-            const size_t positionY = (tileRect.getTop() - renderArea.getTop())  / tileCombined.getTileHeight();
+            _loKitDocument->paintPartTile(pixmap.data(), tileCombined.getPart(),
+                                          pixmapWidth, pixmapHeight,
+                                          renderArea.getLeft(), renderArea.getTop(),
+                                          renderArea.getWidth(), renderArea.getHeight());
+            const auto elapsed = timestamp.elapsed();
+            Log::debug() << "paintTile (combined) at (" << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
+                         << renderArea.getWidth() << ", " << renderArea.getHeight() << ") ver: " << tileCombined.getVersion()
+                         << " rendered in " << (elapsed/1000.) << " ms (" << area / elapsed << " MP/s)." << Log::end;
+        }
+
+        // The painted pixmap is ours now (or painted band by band
+        // below); let document input proceed while we encode.
+        lock.unlock();
+
+        // The sub-tiles are independent, so encode them on a pool of
+        // workers and stream each tile back the moment it is ready;
+        // WSD notifies the subscribers per tile.
+        const size_t tileCount = tiles.size();
+        std::atomic<size_t> nextTile(0);
+        std::mutex sendMutex;
 
-            const auto oldSize = output.size();
-            const auto pixelWidth = tileCombined.getWidth();
-            const auto pixelHeight = tileCombined.getHeight();
-            if (!png::encodeSubBufferToPNG(pixmap.data(), positionX * pixelWidth, positionY * pixelHeight,
-                                           pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, output, mode))
+        const auto encodeWorker = [&]()
+        {
+            size_t tileIndex;
+            while ((tileIndex = nextTile++) < tileCount)
             {
-                //FIXME: Return error.
-                //sendTextFrame("error: cmd=tile kind=failure");
-                Log::error("Failed to encode tile into PNG.");
-                return;
-            }
+                const auto& tileRect = tileRecs[tileIndex];
+                const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
+                const size_t positionY = (tileRect.getTop() - renderArea.getTop())  / tileCombined.getTileHeight();
 
-            const auto imgSize = output.size() - oldSize;
-            Log::trace() << "Encoded tile #" << tileIndex << " in " << imgSize << " bytes." << Log::end;
-            tiles[tileIndex++].setImgSize(imgSize);
-        }
+                if (positionY >= rowsPainted)
+                {
+                    // This tile's band is still being painted.
+                    std::unique_lock<std::mutex> bandLock(bandMutex);
+                    bandCV.wait(bandLock, [&rowsPainted, positionY]() { return rowsPainted > positionY; });
+                }
+
+                const auto pixelWidth = tileCombined.getWidth();
+                const auto pixelHeight = tileCombined.getHeight();
+
+                // Extract the sub-tile's pixels so they can be compared
+                // against (and remembered as) the last rendering.
+                const size_t rowBytes = pixelWidth * 4;
+                auto tilePixels = _pixmapPool.acquire(rowBytes * pixelHeight);
+                for (int row = 0; row < pixelHeight; ++row)
+                {
+                    const size_t offset = ((positionY * pixelHeight + row) * pixmapWidth
+                                           + positionX * pixelWidth) * 4;
+                    std::memcpy(tilePixels.data() + row * rowBytes, pixmap.data() + offset, rowBytes);
+                }
+
+                auto output = _outputPool.acquire(0);
+                const bool encoded = encodeTile(tiles[tileIndex], tilePixels, mode, output);
+                _pixmapPool.release(std::move(tilePixels));
+                if (!encoded)
+                {
+                    //FIXME: Return error.
+                    //sendTextFrame("error: cmd=tile kind=failure");
+                    Log::error("Failed to encode tile.");
+                    _outputPool.release(std::move(output));
+                    continue;
+                }
+
+                Log::trace() << "Encoded tile #" << tileIndex << " in " << output.size() << " bytes." << Log::end;
+                tiles[tileIndex].setImgSize(output.size());
 
 #if ENABLE_DEBUG
-        const auto tileMsg = tileCombined.serialize("tilecombine:") + " renderid=" + Util::UniqueId() + "\n";
+                auto tileMsg = tiles[tileIndex].serialize("tile:") + " renderid=" + Util::UniqueId();
 #else
-        const auto tileMsg = tileCombined.serialize("tilecombine:") + "\n";
+                auto tileMsg = tiles[tileIndex].serialize("tile:");
 #endif
-        Log::trace("Sending back painted tiles for " + tileMsg);
+                bool sent = false;
+                if (_tileRing)
+                {
+                    // The ring write and the descriptor send must stay
+                    // under one lock: wsd releases ring space in
+                    // message order, so the two orders must match.
+                    std::unique_lock<std::mutex> sendLock(sendMutex);
+                    const int64_t ringPos = _tileRing->write(output.data(), output.size());
+                    if (ringPos >= 0)
+                    {
+                        const auto message = tileMsg + " shmpos=" + std::to_string(ringPos) + "\n";
+                        ws->sendFrame(message.data(), message.size(), WebSocket::FRAME_BINARY);
+                        sent = true;
+                    }
+                }
 
-        std::vector<char> response;
-        response.resize(tileMsg.size() + output.size());
-        std::copy(tileMsg.begin(), tileMsg.end(), response.begin());
-        std::copy(output.begin(), output.end(), response.begin() + tileMsg.size());
+                if (!sent)
+                {
+                    tileMsg += "\n";
+                    auto response = _outputPool.acquire(tileMsg.size() + output.size());
+                    std::copy(tileMsg.begin(), tileMsg.end(), response.begin());
+                    std::copy(output.begin(), output.end(), response.begin() + tileMsg.size());
 
-        const auto length = response.size();
-        if (length > SMALL_MESSAGE_SIZE)
+                    {
+                        // Keep the nextmessage header and its frame together.
+                        std::unique_lock<std::mutex> sendLock(sendMutex);
+                        const auto length = response.size();
+                        if (length > SMALL_MESSAGE_SIZE)
+                        {
+                            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
+                            ws->sendFrame(nextmessage.data(), nextmessage.size());
+                        }
+
+                        ws->sendFrame(response.data(), length, WebSocket::FRAME_BINARY);
+                    }
+
+                    _outputPool.release(std::move(response));
+                }
+
+                _outputPool.release(std::move(output));
+            }
+        };
+
+        Log::trace() << "Sending back painted tiles for " << tileCombined.serialize("tilecombine:") << Log::end;
+
+        const size_t workerCount = std::min(tileCount, maxEncodeThreads());
+        std::vector<std::thread> workers;
+        if (banded)
+        {
+            // Every worker on its own thread; this thread paints the
+            // bands while they encode the finished ones.
+            for (size_t i = 0; i < workerCount; ++i)
+            {
+                workers.emplace_back(encodeWorker);
+            }
+
+            for (size_t row = 0; row < tilesByY; ++row)
+            {
+                const size_t bandOffset = row * tileCombined.getHeight() * pixmapWidth * 4;
+                {
+                    std::unique_lock<std::mutex> paintLock(_loKitDocument->getLock());
+                    _loKitDocument->paintPartTile(pixmap.data() + bandOffset,
+                                                  tileCombined.getPart(),
+                                                  pixmapWidth, tileCombined.getHeight(),
+                                                  renderArea.getLeft(),
+                                                  renderArea.getTop() + row * tileCombined.getTileHeight(),
+                                                  renderArea.getWidth(), tileCombined.getTileHeight());
+                }
+
+                {
+                    std::lock_guard<std::mutex> bandLock(bandMutex);
+                    ++rowsPainted;
+                }
+                bandCV.notify_all();
+            }
+
+            const auto elapsed = timestamp.elapsed();
+            Log::debug() << "paintTile (combined, " << tilesByY << " bands) at ("
+                         << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
+                         << renderArea.getWidth() << ", " << renderArea.getHeight() << ") ver: " << tileCombined.getVersion()
+                         << " rendered in " << (elapsed/1000.) << " ms (" << area / elapsed << " MP/s)." << Log::end;
+        }
+        else
+        {
+            for (size_t i = 1; i < workerCount; ++i)
+            {
+                workers.emplace_back(encodeWorker);
+            }
+        }
+
+        encodeWorker();
+        for (auto& worker : workers)
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            ws->sendFrame(nextmessage.data(), nextmessage.size());
+            worker.join();
         }
 
-        ws->sendFrame(response.data(), length, WebSocket::FRAME_BINARY);
+        _pixmapPool.release(std::move(pixmap));
+
+        if (renderStart && !_renderedFirstTile.exchange(true))
+        {
+            TraceSpan::record("kit.tile.first", _docKey, renderStart, TraceSpan::now());
+        }
+    }
+
+    /// Whether large combined areas are painted in horizontal bands
+    /// (per_document.banded_rendering), overlapping paint and encode.
+    static bool bandedRenderingEnabled()
+    {
+        static const bool enabled = (std::getenv("LOOL_BANDED_RENDERING") != nullptr);
+        return enabled;
+    }
+
+    /// The number of threads available for encoding painted tiles,
+    /// bounded by the same per-document knob the Core uses.
+    static size_t maxEncodeThreads()
+    {
+        static const size_t count = [] {
+            const char* env = std::getenv("MAX_CONCURRENCY");
+            const int value = (env ? std::atoi(env) : 0);
+            return (value > 0 ? value : 4);
+        }();
+        return count;
+    }
+
+    /// Appends the encoded form of the painted tile pixels to output.
+    /// When the pixels are identical to the last rendering of this
+    /// position, the previous encoding is reused wholesale.
+    bool encodeTile(const TileDesc& tile, std::vector<unsigned char>& pixels,
+                    const LibreOfficeKitTileMode mode, std::vector<char>& output)
+    {
+        // Solid-color tiles (empty document area) are the single most
+        // common tile class; they are also the cheapest to detect.
+        uint32_t color;
+        if (isSolidColor(pixels, color))
+        {
+            return encodeSolidTile(tile, color, pixels, mode, output);
+        }
+
+        const auto key = tilePositionKey(tile);
+        const auto previous = _renderedTiles.lookup(key);
+        if (previous.pixmap && previous.pixmap->size() == pixels.size() &&
+            std::memcmp(previous.pixmap->data(), pixels.data(), pixels.size()) == 0)
+        {
+            Log::trace("Pixels unchanged for " + key + "; reusing the last encoding.");
+            output.insert(output.end(), previous.encoded->begin(), previous.encoded->end());
+            return true;
+        }
+
+        const auto oldSize = output.size();
+        bool encoded;
+        if (tile.getFormat() == TILEFORMAT_RAWZ)
+        {
+            encoded = png::encodeSubBufferToRawZ(pixels.data(), 0, 0,
+                                                 tile.getWidth(), tile.getHeight(),
+                                                 tile.getWidth(), tile.getHeight(), output, mode);
+        }
+        else
+        {
+            // Thumbnails are size-sensitive; interactive tiles need latency.
+            const auto profile = (tile.getId() >= 0 ? png::EncodeProfile::Compact
+                                                    : png::EncodeProfile::Interactive);
+            encoded = png::encodeBufferToPNG(pixels.data(), tile.getWidth(), tile.getHeight(),
+                                             output, mode, profile);
+        }
+
+        if (!encoded)
+        {
+            return false;
+        }
+
+        RenderedTileCache::Entry entry;
+        entry.pixmap = std::make_shared<std::vector<unsigned char>>(pixels.begin(), pixels.end());
+        entry.encoded = std::make_shared<std::vector<char>>(output.begin() + oldSize, output.end());
+        _renderedTiles.insert(key, entry);
+        return true;
+    }
+
+    /// True iff all the pixels have the same color, returned in color.
+    /// A buffer is uniform iff it equals itself shifted by one pixel,
+    /// which a single (vectorized) memcmp can decide.
+    static bool isSolidColor(const std::vector<unsigned char>& pixels, uint32_t& color)
+    {
+        if (pixels.size() < 4 ||
+            std::memcmp(pixels.data(), pixels.data() + 4, pixels.size() - 4) != 0)
+        {
+            return false;
+        }
+
+        std::memcpy(&color, pixels.data(), 4);
+        return true;
+    }
+
+    /// Appends the encoding of a solid-color tile to output. Each
+    /// distinct color/dimensions/format combination is encoded once
+    /// and served from a small cache thereafter, skipping the whole
+    /// encode pipeline for the most common tile class.
+    bool encodeSolidTile(const TileDesc& tile, const uint32_t color,
+                         std::vector<unsigned char>& pixels,
+                         const LibreOfficeKitTileMode mode, std::vector<char>& output)
+    {
+        const auto key = std::make_tuple(color, tile.getWidth(), tile.getHeight(), tile.getFormat());
+        {
+            std::unique_lock<std::mutex> lock(_solidTilesMutex);
+            const auto it = _solidTiles.find(key);
+            if (it != _solidTiles.end())
+            {
+                Log::trace() << "Reusing solid-color tile encoding for color 0x"
+                             << std::hex << color << std::dec << '.' << Log::end;
+                output.insert(output.end(), it->second->begin(), it->second->end());
+                return true;
+            }
+        }
+
+        const auto oldSize = output.size();
+        bool encoded;
+        if (tile.getFormat() == TILEFORMAT_RAWZ)
+        {
+            encoded = png::encodeSubBufferToRawZ(pixels.data(), 0, 0,
+                                                 tile.getWidth(), tile.getHeight(),
+                                                 tile.getWidth(), tile.getHeight(), output, mode);
+        }
+        else
+        {
+            encoded = png::encodeBufferToPNG(pixels.data(), tile.getWidth(), tile.getHeight(),
+                                             output, mode, png::EncodeProfile::Interactive);
+        }
+
+        if (!encoded)
+        {
+            return false;
+        }
+
+        auto body = std::make_shared<std::vector<char>>(output.begin() + oldSize, output.end());
+        std::unique_lock<std::mutex> lock(_solidTilesMutex);
+        if (_solidTiles.size() >= MaxSolidTiles)
+        {
+            _solidTiles.clear();
+        }
+
+        _solidTiles.emplace(key, body);
+        return true;
     }
 
     bool sendTextFrame(const std::string& message) override
@@ -662,7 +1283,43 @@ public:
                          << (exc.nested() ? "( " + exc.nested()->displayText() + ")" : "");
         }
 
-        return false;
+        return false;
+    }
+
+    void watchExport(const pid_t pid, const std::string& doneMsg,
+                     const std::string& failMsg) override
+    {
+        std::unique_lock<std::mutex> lock(_exportsMutex);
+        _exportPids.push_back(pid);
+        _exportWatchers.emplace_back([this, pid, doneMsg, failMsg]()
+        {
+            Util::setThreadName("export_watch");
+
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            {
+            }
+
+            {
+                std::unique_lock<std::mutex> exportsLock(_exportsMutex);
+                const auto it = std::find(_exportPids.begin(), _exportPids.end(), pid);
+                if (it != _exportPids.end())
+                {
+                    _exportPids.erase(it);
+                }
+            }
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+            {
+                sendTextFrame(doneMsg);
+            }
+            else
+            {
+                Log::error("Snapshot export " + std::to_string(pid) + " failed, status " +
+                           std::to_string(status) + ".");
+                sendTextFrame(failMsg);
+            }
+        });
     }
 
     static void GlobalCallback(const int nType, const char* pPayload, void* pData)
@@ -1019,7 +1676,10 @@ private:
             _isDocPasswordProtected = false;
 
             Log::debug("Calling lokit::documentLoad.");
-            _loKitDocument = _loKit->documentLoad(uri.c_str());
+            {
+                TraceSpan::Span loadSpan("kit.lokit.load", _docKey);
+                _loKitDocument = _loKit->documentLoad(uri.c_str());
+            }
             Log::debug("Returned lokit::documentLoad.");
             auto l(_loKitDocument->getLock());
             lockLokDoc.swap(l);
@@ -1183,7 +1843,7 @@ private:
                 }
 
                 const std::string message(input.data(), input.size());
-                StringTokenizer tokens(message, " ");
+                Tokenizer tokens(message);
 
                 if (tokens[0] == "eof")
                 {
@@ -1193,7 +1853,7 @@ private:
 
                 if (tokens[0] == "tile")
                 {
-                    renderTile(tokens, _ws);
+                    renderTile(message, _ws);
                 }
                 else if (tokens[0] == "tilecombine")
                 {
@@ -1209,7 +1869,7 @@ private:
                     int type = std::stoi(tokens[2]);
 
                     // payload is the rest of the message
-                    std::string payload(message.substr(tokens[0].length() + tokens[1].length() + tokens[2].length() + 3));
+                    std::string payload(message.substr(tokens[0].size() + tokens[1].size() + tokens[2].size() + 3));
 
                     // Forward the callback to the same view, demultiplexing is done by the LibreOffice core.
                     // TODO: replace with a map to be faster.
@@ -1268,6 +1928,9 @@ private:
     std::shared_ptr<TileQueue> _tileQueue;
     std::shared_ptr<WebSocket> _ws;
 
+    /// Shared-memory transport for tile payloads; may be null.
+    std::shared_ptr<TileRing> _tileRing;
+
     // Document password provided
     std::string _docPassword;
     // Whether password was provided or not
@@ -1285,6 +1948,30 @@ private:
     std::map<std::string, std::shared_ptr<ChildSession>> _sessions;
     Poco::Thread _callbackThread;
     std::atomic_size_t _clientViews;
+
+    /// Forked snapshot exporters still running and their watcher
+    /// threads; see watchExport. Guarded by _exportsMutex; the dtor
+    /// kills the leftover exporters and joins every watcher.
+    std::mutex _exportsMutex;
+    std::vector<pid_t> _exportPids;
+    std::vector<std::thread> _exportWatchers;
+
+    /// Recycled render buffers; see BufferPool.
+    BufferPool<unsigned char> _pixmapPool;
+    BufferPool<char> _outputPool;
+
+    /// The last rendering per tile position; see RenderedTileCache.
+    RenderedTileCache _renderedTiles;
+
+    /// Whether this document's first tile has been rendered; closes
+    /// the 'kit.tile.first' span on the pipeline trace.
+    std::atomic<bool> _renderedFirstTile{false};
+
+    /// Encodings of solid-color tiles, keyed by color, dimensions and
+    /// format. A handful of colors covers practically all documents.
+    static constexpr size_t MaxSolidTiles = 128;
+    std::mutex _solidTilesMutex;
+    std::map<std::tuple<uint32_t, int, int, int>, std::shared_ptr<std::vector<char>>> _solidTiles;
 };
 
 void documentViewCallback(const int nType, const char* pPayload, void* pData)
@@ -1293,6 +1980,289 @@ void documentViewCallback(const int nType, const char* pPayload, void* pData)
 }
 
 #ifndef BUILDING_TESTS
+/// Open-and-discard a blank document of each major class, so the
+/// expensive lazy initialization (filters, fonts, configuration)
+/// happens while the child idles in the spawn pool instead of on
+/// the first real load. Enabled via the warmup_documents setting.
+static void warmupDocumentClasses(const std::shared_ptr<lok::Office>& loKit)
+{
+    if (!std::getenv("LOOL_WARMUP_DOCS"))
+        return;
+
+    for (const auto factory : { "private:factory/swriter",
+                                "private:factory/scalc",
+                                "private:factory/simpress" })
+    {
+        try
+        {
+            const auto start = std::chrono::steady_clock::now();
+            auto doc = loKit->documentLoad(factory);
+            if (doc)
+            {
+                const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                Log::info() << "Warmed up " << factory << " in " << elapsedMs << " ms." << Log::end;
+            }
+            else
+            {
+                Log::warn("Warm-up load of " + std::string(factory) + " returned no document.");
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            Log::warn("Warm-up load of " + std::string(factory) + " failed: " + exc.what());
+        }
+    }
+}
+
+/// Seconds of inactivity after which a document trims its memory
+/// (per_document.idle_trim_secs); 0 disables trimming.
+static int idleTrimSecs()
+{
+    static const int secs = [] {
+        const char* env = std::getenv("LOOL_IDLE_TRIM_SECS");
+        return (env ? std::atoi(env) : 0);
+    }();
+    return secs;
+}
+
+/// Announce ourselves to WSD on a fresh WebSocket and host one
+/// document's control connection on it, until the document's last
+/// session is gone. The caller increments ActiveConnections before
+/// calling; the matching decrement happens here. In multidoc mode
+/// WSD's adddoc command runs several of these side by side, one
+/// per document, so one process hosts several documents.
+static void serviceDocumentConnection(const std::shared_ptr<lok::Office>& loKit,
+                                      const std::string& jailId,
+                                      const std::string& requestUrl)
+{
+    try
+    {
+        HTTPClientSession cs("127.0.0.1", MasterPortNumber);
+        cs.setTimeout(0);
+        HTTPRequest request(HTTPRequest::HTTP_GET, requestUrl);
+        HTTPResponse response;
+        auto ws = std::make_shared<WebSocket>(cs, request, response);
+        ws->setReceiveTimeout(0);
+
+        auto queue = std::make_shared<TileQueue>();
+        std::shared_ptr<Document> document;
+        bool documentDone = false;
+
+        // For the idle memory trim: when the last command came in,
+        // and whether we have already trimmed since.
+        auto lastActivityTime = std::chrono::steady_clock::now();
+        bool trimmedSinceActivity = false;
+
+        const std::string socketName = "ChildControllerWS";
+        IoUtil::SocketProcessor(ws,
+                [&socketName, &ws, &loKit, &queue, &document, &documentDone, &jailId, &requestUrl,
+                 &lastActivityTime, &trimmedSinceActivity](const std::vector<char>& data)
+                {
+                    std::string message(data.data(), data.size());
+
+                    if (UnitKit::get().filterKitMessage(ws, message))
+                        return true;
+
+                    lastActivityTime = std::chrono::steady_clock::now();
+                    trimmedSinceActivity = false;
+
+                    Log::debug(socketName + ": recv [" + LOOLProtocol::getAbbreviatedMessage(message) + "].");
+                    StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+
+                    // Note: Syntax or parsing errors here are unexpected and fatal.
+                    if (TerminationFlag)
+                    {
+                        Log::debug("Too late, we're going down");
+                    }
+                    else if (tokens[0] == "session")
+                    {
+                        const std::string& sessionId = tokens[1];
+                        const std::string& docKey = tokens[2];
+
+                        std::string url;
+                        URI::decode(docKey, url);
+                        Log::info("New session [" + sessionId + "] request on url [" + url + "].");
+
+                        if (!document)
+                        {
+                            document = std::make_shared<Document>(loKit, jailId, docKey, url, queue, ws);
+
+                            std::lock_guard<std::mutex> docsLock(DocumentsMutex);
+                            AllDocuments.push_back(document);
+                            HostedDocument = true;
+                        }
+
+                        // Validate and create session.
+                        if (!(url == document->getUrl() &&
+                            document->createSession(sessionId)))
+                        {
+                            Log::debug("CreateSession failed.");
+                        }
+                    }
+                    else if (tokens[0] == "adddoc")
+                    {
+                        // WSD wants this process to host another
+                        // document on its own control connection.
+                        Log::info("Opening another control connection to host a new document.");
+                        ++ActiveConnections;
+                        std::thread([loKit, jailId, requestUrl]()
+                            {
+                                Util::setThreadName("doc_control");
+                                serviceDocumentConnection(loKit, jailId, requestUrl);
+                            }).detach();
+                    }
+                    else if (tokens[0] == "tile" || tokens[0] == "tilecombine" || tokens[0] == "canceltiles" ||
+                             LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
+                    {
+                        if (document)
+                        {
+                            queue->put(message);
+                        }
+                        else
+                        {
+                            Log::warn("No document while processing " + tokens[0] + " request.");
+                        }
+                    }
+                    else if (document && document->canDiscard())
+                    {
+                        Log::info("Last session discarded. Closing the document's control connection.");
+                        documentDone = true;
+                    }
+                    else
+                    {
+                        Log::error("Bad or unknown token [" + tokens[0] + "]");
+                    }
+
+                    return true;
+                },
+                []() {},
+                [&document, &documentDone, &lastActivityTime, &trimmedSinceActivity]()
+                {
+                    if (document && document->canDiscard())
+                    {
+                        Log::info("Last session discarded. Closing the document's control connection.");
+                        documentDone = true;
+                    }
+
+                    // Give peak-usage memory back once the document
+                    // has sat idle for a while.
+                    if (document && !trimmedSinceActivity && idleTrimSecs() > 0 &&
+                        (std::chrono::steady_clock::now() - lastActivityTime) >=
+                            std::chrono::seconds(idleTrimSecs()))
+                    {
+                        document->trimMemory();
+                        trimmedSinceActivity = true;
+                    }
+
+                    return TerminationFlag.load() || documentDone;
+                });
+
+        // Destroy the document before declaring the connection done.
+        document.reset();
+    }
+    catch (const Exception& exc)
+    {
+        Log::error() << "Poco Exception: " << exc.displayText()
+                     << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
+                     << Log::end;
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error(std::string("Exception: ") + exc.what());
+    }
+
+    // When the last control connection of a process that did host
+    // a document goes, so does the process.
+    if (--ActiveConnections == 0 && HostedDocument)
+    {
+        Log::info("Last document gone. Terminating.");
+        TerminationFlag = true;
+    }
+}
+
+void provisionKitJail(const std::string& childRoot,
+                      const std::string& sysTemplate,
+                      const std::string& loTemplate,
+                      const std::string& loSubPath,
+                      const std::string& jailRoot)
+{
+    const auto jailPath = Path::forDirectory(jailRoot);
+    File(jailPath).createDirectories();
+
+    // Create a symlink inside the jailPath so that the absolute pathname loTemplate, when
+    // interpreted inside a chroot at jailPath, points to loSubPath (relative to the chroot).
+    symlinkPathToJail(jailPath, loTemplate, loSubPath);
+
+    // Font paths can end up as realpaths so match that too.
+    char *resolved = realpath(loTemplate.c_str(), NULL);
+    if (resolved)
+    {
+        if (strcmp(loTemplate.c_str(), resolved) != 0)
+            symlinkPathToJail(jailPath, std::string(resolved), loSubPath);
+        free (resolved);
+    }
+
+    Path jailLOInstallation(jailPath, loSubPath);
+    jailLOInstallation.makeDirectory();
+    File(jailLOInstallation).createDirectory();
+
+    // Copy (link) LO installation and other necessary files into it from the template.
+    bool bLoopMounted = false;
+    if (std::getenv("LOOL_BIND_MOUNT"))
+    {
+        Path usrSrcPath(sysTemplate, "usr");
+        Path usrDestPath(jailPath, "usr");
+        File(usrDestPath).createDirectory();
+        std::string mountCommand =
+            std::string("loolmount ") +
+            usrSrcPath.toString() +
+            std::string(" ") +
+            usrDestPath.toString();
+        Log::debug("Initializing jail bind mount.");
+        bLoopMounted = !system(mountCommand.c_str());
+        Log::debug("Initialized jail bind mount.");
+    }
+    // Provision the jail from the pre-built hardlink farm when
+    // possible; otherwise walk the template trees directly.
+    if (!provisionJailFromFarm(childRoot, sysTemplate, loTemplate, loSubPath,
+                               bLoopMounted, jailPath))
+    {
+        linkOrCopy(sysTemplate, jailPath,
+                   bLoopMounted ? COPY_NO_USR : COPY_ALL);
+        linkOrCopy(loTemplate, jailLOInstallation, COPY_LO);
+    }
+
+    // We need this because sometimes the hostname is not resolved
+    const auto networkFiles = {"/etc/host.conf", "/etc/hosts", "/etc/nsswitch.conf", "/etc/resolv.conf"};
+    for (const auto& filename : networkFiles)
+    {
+        const auto etcPath = Path(jailPath, filename).toString();
+        const File networkFile(filename);
+        if (networkFile.exists() && !File(etcPath).exists())
+        {
+            networkFile.copyTo(etcPath);
+        }
+    }
+
+    Log::debug("Initialized jail files.");
+
+    // Create the urandom and random devices
+    File(Path(jailPath, "/dev")).createDirectory();
+    if (mknod((jailPath.toString() + "/dev/random").c_str(),
+              S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+              makedev(1, 8)) != 0)
+    {
+        Log::syserror("mknod(" + jailPath.toString() + "/dev/random) failed.");
+    }
+    if (mknod((jailPath.toString() + "/dev/urandom").c_str(),
+              S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+              makedev(1, 9)) != 0)
+    {
+        Log::syserror("mknod(" + jailPath.toString() + "/dev/urandom) failed.");
+    }
+}
+
 void lokit_main(const std::string& childRoot,
                 const std::string& sysTemplate,
                 const std::string& loTemplate,
@@ -1330,6 +2300,10 @@ void lokit_main(const std::string& childRoot,
 
     Log::debug("Process started.");
 
+    // Open the span trace file (if configured) while its path still
+    // resolves; the descriptor survives the chroot below.
+    TraceSpan::init();
+
     Util::setTerminationSignals();
     Util::setFatalSignals();
 
@@ -1349,70 +2323,29 @@ void lokit_main(const std::string& childRoot,
             userdir_url = "file:///user";
             instdir_path = "/" + loSubPath + "/program";
 
-            // Create a symlink inside the jailPath so that the absolute pathname loTemplate, when
-            // interpreted inside a chroot at jailPath, points to loSubPath (relative to the chroot).
-            symlinkPathToJail(jailPath, loTemplate, loSubPath);
-
-            // Font paths can end up as realpaths so match that too.
-            char *resolved = realpath(loTemplate.c_str(), NULL);
-            if (resolved)
-            {
-                if (strcmp(loTemplate.c_str(), resolved) != 0)
-                    symlinkPathToJail(jailPath, std::string(resolved), loSubPath);
-                free (resolved);
-            }
-
-            Path jailLOInstallation(jailPath, loSubPath);
-            jailLOInstallation.makeDirectory();
-            File(jailLOInstallation).createDirectory();
-
-            // Copy (link) LO installation and other necessary files into it from the template.
-            bool bLoopMounted = false;
-            if (std::getenv("LOOL_BIND_MOUNT"))
+            // Adopt a jail forkit provisioned ahead of need, when one
+            // is ready: a single same-filesystem rename instead of
+            // cloning the templates.
+            bool adopted = false;
+            const auto readyRoot = Path::forDirectory(childRoot + "/" + READY_JAILS_SUBPATH);
+            if (File(readyRoot).exists())
             {
-                Path usrSrcPath(sysTemplate, "usr");
-                Path usrDestPath(jailPath, "usr");
-                File(usrDestPath).createDirectory();
-                std::string mountCommand =
-                    std::string("loolmount ") +
-                    usrSrcPath.toString() +
-                    std::string(" ") +
-                    usrDestPath.toString();
-                Log::debug("Initializing jail bind mount.");
-                bLoopMounted = !system(mountCommand.c_str());
-                Log::debug("Initialized jail bind mount.");
-            }
-            linkOrCopy(sysTemplate, jailPath,
-                       bLoopMounted ? COPY_NO_USR : COPY_ALL);
-            linkOrCopy(loTemplate, jailLOInstallation, COPY_LO);
-
-            // We need this because sometimes the hostname is not resolved
-            const auto networkFiles = {"/etc/host.conf", "/etc/hosts", "/etc/nsswitch.conf", "/etc/resolv.conf"};
-            for (const auto& filename : networkFiles)
-            {
-                const auto etcPath = Path(jailPath, filename).toString();
-                const File networkFile(filename);
-                if (networkFile.exists() && !File(etcPath).exists())
+                for (Poco::DirectoryIterator it(readyRoot), end; it != end; ++it)
                 {
-                    networkFile.copyTo(etcPath);
+                    // A sibling may win the race for this one; try the next.
+                    if (rename(it->path().c_str(), jailPath.toString().c_str()) == 0)
+                    {
+                        Log::info("Adopted pre-provisioned jail '" + it->path() + "'.");
+                        adopted = true;
+                        break;
+                    }
                 }
             }
 
-            Log::debug("Initialized jail files.");
-
-            // Create the urandom and random devices
-            File(Path(jailPath, "/dev")).createDirectory();
-            if (mknod((jailPath.toString() + "/dev/random").c_str(),
-                      S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
-                      makedev(1, 8)) != 0)
-            {
-                Log::syserror("mknod(" + jailPath.toString() + "/dev/random) failed.");
-            }
-            if (mknod((jailPath.toString() + "/dev/urandom").c_str(),
-                      S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
-                      makedev(1, 9)) != 0)
+            if (!adopted)
             {
-                Log::syserror("mknod(" + jailPath.toString() + "/dev/urandom) failed.");
+                provisionKitJail(childRoot, sysTemplate, loTemplate, loSubPath,
+                                 jailPath.toString());
             }
 
             Log::info("chroot(\"" + jailPath.toString() + "\")");
@@ -1462,9 +2395,9 @@ void lokit_main(const std::string& childRoot,
         assert(loKit && loKit->get());
         Log::info("Process is ready.");
 
-        // Open websocket connection between the child process and WSD.
-        HTTPClientSession cs("127.0.0.1", MasterPortNumber);
-        cs.setTimeout(0);
+        // Warm up the major document classes before joining the pool,
+        // so the first real load does not pay their initialization.
+        warmupDocumentClasses(loKit);
 
         std::string requestUrl = std::string(NEW_CHILD_URI) + "pid=" + pid;
         if (queryVersion)
@@ -1479,86 +2412,16 @@ void lokit_main(const std::string& childRoot,
             free(versionInfo);
         }
 
-        HTTPRequest request(HTTPRequest::HTTP_GET, requestUrl);
-        HTTPResponse response;
-        auto ws = std::make_shared<WebSocket>(cs, request, response);
-        ws->setReceiveTimeout(0);
-
-        auto queue = std::make_shared<TileQueue>();
-
-        const std::string socketName = "ChildControllerWS";
-        IoUtil::SocketProcessor(ws,
-                [&socketName, &ws, &loKit, &queue](const std::vector<char>& data)
-                {
-                    std::string message(data.data(), data.size());
-
-                    if (UnitKit::get().filterKitMessage(ws, message))
-                        return true;
-
-                    Log::debug(socketName + ": recv [" + LOOLProtocol::getAbbreviatedMessage(message) + "].");
-                    StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-
-                    // Note: Syntax or parsing errors here are unexpected and fatal.
-                    if (TerminationFlag)
-                    {
-                        Log::debug("Too late, we're going down");
-                    }
-                    else if (tokens[0] == "session")
-                    {
-                        const std::string& sessionId = tokens[1];
-                        const std::string& docKey = tokens[2];
-
-                        std::string url;
-                        URI::decode(docKey, url);
-                        Log::info("New session [" + sessionId + "] request on url [" + url + "].");
-
-                        if (!document)
-                        {
-                            document = std::make_shared<Document>(loKit, jailId, docKey, url, queue, ws);
-                        }
-
-                        // Validate and create session.
-                        if (!(url == document->getUrl() &&
-                            document->createSession(sessionId)))
-                        {
-                            Log::debug("CreateSession failed.");
-                        }
-                    }
-                    else if (tokens[0] == "tile" || tokens[0] == "tilecombine" || tokens[0] == "canceltiles" ||
-                             LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
-                    {
-                        if (document)
-                        {
-                            queue->put(message);
-                        }
-                        else
-                        {
-                            Log::warn("No document while processing " + tokens[0] + " request.");
-                        }
-                    }
-                    else if (document && document->canDiscard())
-                    {
-                        Log::info("Last session discarded. Terminating.");
-                        TerminationFlag = true;
-                    }
-                    else
-                    {
-                        Log::error("Bad or unknown token [" + tokens[0] + "]");
-                    }
-
-                    return true;
-                },
-                []() {},
-                []()
-                {
-                    if (document && document->canDiscard())
-                    {
-                        Log::info("Last session discarded. Terminating.");
-                        TerminationFlag = true;
-                    }
+        // Service the first control connection on this thread; in
+        // multidoc mode WSD's adddoc command adds others beside it.
+        ++ActiveConnections;
+        serviceDocumentConnection(loKit, jailId, requestUrl);
 
-                    return TerminationFlag.load();
-                });
+        // Wait for the documents of any remaining connections.
+        while (!TerminationFlag && ActiveConnections > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS / 10));
+        }
 
         // Clean up jail if we created one
         if (bRunInsideJail && !jailPath.isRelative())
@@ -1664,7 +2527,15 @@ namespace Util
 #ifndef BUILDING_TESTS
 void alertAllUsers(const std::string& cmd, const std::string& kind)
 {
-    document->sendTextFrame("errortoall: cmd=" + cmd + " kind=" + kind);
+    std::lock_guard<std::mutex> lock(DocumentsMutex);
+    for (const auto& weakDocument : AllDocuments)
+    {
+        auto doc = weakDocument.lock();
+        if (doc)
+        {
+            doc->sendTextFrame("errortoall: cmd=" + cmd + " kind=" + kind);
+        }
+    }
 }
 #endif
 
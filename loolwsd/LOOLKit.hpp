@@ -18,6 +18,16 @@ void lokit_main(const std::string& childRoot,
                 bool displayVersion);
 
 bool globalPreinit(const std::string &loTemplate);
+
+/// Build a complete kit jail at the given path: the LO symlinks, the
+/// template clone (from the hardlink farm when possible), the network
+/// configuration files and the device nodes. Called by the kit when no
+/// pre-provisioned jail is ready, and by forkit ahead of need.
+void provisionKitJail(const std::string& childRoot,
+                      const std::string& sysTemplate,
+                      const std::string& loTemplate,
+                      const std::string& loSubPath,
+                      const std::string& jailRoot);
 /// Wrapper around private Document::ViewCallback().
 void documentViewCallback(const int nType, const char* pPayload, void* pData);
 
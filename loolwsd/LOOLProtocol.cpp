@@ -58,6 +58,36 @@ namespace LOOLProtocol
         return true;
     }
 
+    bool stringToInteger(const Token& input, int& value)
+    {
+        size_t i = 0;
+        bool negative = false;
+        if (i < input.size() && (input[i] == '-' || input[i] == '+'))
+        {
+            negative = (input[i] == '-');
+            ++i;
+        }
+
+        if (i == input.size())
+        {
+            return false;
+        }
+
+        int result = 0;
+        for (; i < input.size(); ++i)
+        {
+            if (input[i] < '0' || input[i] > '9')
+            {
+                return false;
+            }
+
+            result = result * 10 + (input[i] - '0');
+        }
+
+        value = negative ? -result : result;
+        return true;
+    }
+
     bool getTokenInteger(const std::string& token, const std::string& name, int& value)
     {
         size_t nextIdx;
@@ -119,6 +149,86 @@ namespace LOOLProtocol
         return true;
     }
 
+    bool getTokenInteger(const Token& token, const char* name, int& value)
+    {
+        const auto nameLen = std::strlen(name);
+        if (token.size() < nameLen + 2 ||
+            std::memcmp(token.data(), name, nameLen) != 0 ||
+            token[nameLen] != '=')
+        {
+            return false;
+        }
+
+        return stringToInteger(Token(token.data() + nameLen + 1, token.size() - nameLen - 1), value);
+    }
+
+    bool getTokenString(const Token& token, const char* name, std::string& value)
+    {
+        const auto nameLen = std::strlen(name);
+        if (token.size() < nameLen + 2 ||
+            std::memcmp(token.data(), name, nameLen) != 0 ||
+            token[nameLen] != '=')
+        {
+            return false;
+        }
+
+        value.assign(token.data() + nameLen + 1, token.size() - nameLen - 1);
+        return true;
+    }
+
+    bool getTokenKeyword(const Token& token, const char* name, const std::map<std::string, int>& map, int& value)
+    {
+        std::string t;
+        if (!getTokenString(token, name, t) || t.empty())
+        {
+            return false;
+        }
+
+        if (t[0] == '\'' && t[t.size()-1] == '\'')
+        {
+            t = t.substr(1, t.size()-2);
+        }
+
+        const auto p = map.find(t);
+        if (p == map.cend())
+        {
+            return false;
+        }
+
+        value = p->second;
+        return true;
+    }
+
+    bool getTokenInteger(const Tokenizer& tokens, const char* name, int& value)
+    {
+        for (size_t i = 0; i < tokens.count(); i++)
+        {
+            if (getTokenInteger(tokens[i], name, value))
+                return true;
+        }
+        return false;
+    }
+
+    bool getTokenString(const Tokenizer& tokens, const char* name, std::string& value)
+    {
+        for (size_t i = 0; i < tokens.count(); i++)
+        {
+            if (getTokenString(tokens[i], name, value))
+                return true;
+        }
+        return false;
+    }
+
+    bool getTokenKeyword(const Tokenizer& tokens, const char* name, const std::map<std::string, int>& map, int& value)
+    {
+        for (size_t i = 0; i < tokens.count(); i++)
+        {
+            if (getTokenKeyword(tokens[i], name, map, value))
+                return true;
+        }
+        return false;
+    }
+
     bool getTokenInteger(const Poco::StringTokenizer& tokens, const std::string& name, int& value)
     {
         for (size_t i = 0; i < tokens.count(); i++)
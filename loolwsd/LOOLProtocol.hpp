@@ -10,9 +10,11 @@
 #ifndef INCLUDED_LOOLPROTOCOL_HPP
 #define INCLUDED_LOOLPROTOCOL_HPP
 
+#include <algorithm>
 #include <cstring>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <Poco/StringTokenizer.h>
 
@@ -59,10 +61,179 @@ namespace LOOLProtocol
         return parseNameValuePair(token, name, strValue, delim) && stringToInteger(strValue, value);
     }
 
+    /// A non-owning view of a range of characters inside a message
+    /// buffer. The buffer must outlive the token.
+    class Token
+    {
+    public:
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        Token() :
+            _data(nullptr),
+            _size(0)
+        {
+        }
+
+        Token(const char* data, const size_t size) :
+            _data(data),
+            _size(size)
+        {
+        }
+
+        const char* data() const { return _data; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        char operator[](const size_t index) const { return _data[index]; }
+
+        bool equals(const char* str) const
+        {
+            const auto len = std::strlen(str);
+            return len == _size && std::memcmp(_data, str, len) == 0;
+        }
+
+        bool equals(const std::string& str) const
+        {
+            return str.size() == _size && std::memcmp(_data, str.data(), _size) == 0;
+        }
+
+        bool startsWith(const char* str) const
+        {
+            const auto len = std::strlen(str);
+            return len <= _size && std::memcmp(_data, str, len) == 0;
+        }
+
+        bool contains(const char* str) const
+        {
+            const auto len = std::strlen(str);
+            return std::search(_data, _data + _size, str, str + len) != _data + _size;
+        }
+
+        size_t find(const char c) const
+        {
+            const auto match = static_cast<const char*>(std::memchr(_data, c, _size));
+            return match == nullptr ? npos : match - _data;
+        }
+
+        /// The copying conversions, for the benefit of the many
+        /// string-based APIs; hot paths should stay on the Token.
+        std::string toString() const { return std::string(_data, _size); }
+        std::string substr(const size_t pos) const { return std::string(_data + pos, _size - pos); }
+        operator std::string() const { return toString(); }
+
+    private:
+        const char* _data;
+        size_t _size;
+    };
+
+    inline bool operator==(const Token& token, const char* str) { return token.equals(str); }
+    inline bool operator==(const Token& token, const std::string& str) { return token.equals(str); }
+    inline bool operator!=(const Token& token, const char* str) { return !token.equals(str); }
+    inline bool operator!=(const Token& token, const std::string& str) { return !token.equals(str); }
+    inline std::string operator+(const std::string& str, const Token& token) { return str + token.toString(); }
+    inline std::string operator+(const char* str, const Token& token) { return str + token.toString(); }
+    inline std::string operator+(const Token& token, const std::string& str) { return token.toString() + str; }
+    inline std::string operator+(const Token& token, const char* str) { return token.toString() + str; }
+
+    /// Splits a message into tokens without copying it: the tokens
+    /// are views into the original buffer, which must outlive the
+    /// tokenizer. Empty tokens are skipped, matching what
+    /// Poco::StringTokenizer did with TOK_IGNORE_EMPTY. Typical
+    /// messages tokenize without touching the heap at all.
+    class Tokenizer
+    {
+    public:
+        Tokenizer(const char* data, const size_t size, const char delim = ' ') :
+            _count(0)
+        {
+            size_t start = 0;
+            for (size_t i = 0; i <= size; ++i)
+            {
+                if (i == size || data[i] == delim)
+                {
+                    if (i > start)
+                    {
+                        append(Token(data + start, i - start));
+                    }
+
+                    start = i + 1;
+                }
+            }
+        }
+
+        explicit Tokenizer(const std::string& message, const char delim = ' ') :
+            Tokenizer(message.data(), message.size(), delim)
+        {
+        }
+
+        size_t count() const { return _count; }
+
+        const Token& operator[](const size_t index) const
+        {
+            return _overflow.empty() ? _inline[index] : _overflow[index];
+        }
+
+        /// Concatenate the tokens from the given position on,
+        /// separated by delim (cf. Poco::cat).
+        std::string cat(const std::string& delim, const size_t from) const
+        {
+            std::string result;
+            for (size_t i = from; i < _count; ++i)
+            {
+                if (i != from)
+                {
+                    result += delim;
+                }
+
+                const auto& token = (*this)[i];
+                result.append(token.data(), token.size());
+            }
+
+            return result;
+        }
+
+    private:
+        void append(const Token& token)
+        {
+            if (_overflow.empty() && _count < InlineCapacity)
+            {
+                _inline[_count] = token;
+            }
+            else
+            {
+                if (_overflow.empty())
+                {
+                    _overflow.assign(_inline, _inline + _count);
+                }
+
+                _overflow.push_back(token);
+            }
+
+            ++_count;
+        }
+
+        /// Enough for every message we parse; longer ones spill over
+        /// into the (heap-allocated) vector.
+        static const size_t InlineCapacity = 16;
+
+        Token _inline[InlineCapacity];
+        std::vector<Token> _overflow;
+        size_t _count;
+    };
+
+    bool stringToInteger(const Token& input, int& value);
+
     bool getTokenInteger(const std::string& token, const std::string& name, int& value);
     bool getTokenString(const std::string& token, const std::string& name, std::string& value);
     bool getTokenKeyword(const std::string& token, const std::string& name, const std::map<std::string, int>& map, int& value);
 
+    bool getTokenInteger(const Token& token, const char* name, int& value);
+    bool getTokenString(const Token& token, const char* name, std::string& value);
+    bool getTokenKeyword(const Token& token, const char* name, const std::map<std::string, int>& map, int& value);
+
+    bool getTokenInteger(const Tokenizer& tokens, const char* name, int& value);
+    bool getTokenString(const Tokenizer& tokens, const char* name, std::string& value);
+    bool getTokenKeyword(const Tokenizer& tokens, const char* name, const std::map<std::string, int>& map, int& value);
+
     bool getTokenInteger(const Poco::StringTokenizer& tokens, const std::string& name, int& value);
     bool getTokenString(const Poco::StringTokenizer& tokens, const std::string& name, std::string& value);
     bool getTokenKeyword(const Poco::StringTokenizer& tokens, const std::string& name, const std::map<std::string, int>& map, int& value);
@@ -119,6 +290,15 @@ namespace LOOLProtocol
                 token.find("state") == std::string::npos);
     }
 
+    inline
+    bool tokenIndicatesUserInteraction(const Token& token)
+    {
+        // FIXME: Same substring-matching caveat as above.
+        return (!token.contains("tile") &&
+                !token.contains("status") &&
+                !token.contains("state"));
+    }
+
     /// Returns the first line of a message.
     inline
     std::string getFirstLine(const char *message, const int length)
@@ -30,7 +30,6 @@
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Path.h>
 #include <Poco/String.h>
-#include <Poco/StringTokenizer.h>
 #include <Poco/URI.h>
 
 #include "Common.hpp"
@@ -46,7 +45,6 @@ using Poco::Exception;
 using Poco::IOException;
 using Poco::Net::Socket;
 using Poco::Net::WebSocket;
-using Poco::StringTokenizer;
 
 LOOLSession::LOOLSession(const std::string& id, const Kind kind,
                          std::shared_ptr<WebSocket> ws) :
@@ -60,6 +58,7 @@ LOOLSession::LOOLSession(const std::string& id, const Kind kind,
     _isActive(true),
     _lastActivityTime(std::chrono::steady_clock::now()),
     _isCloseFrame(false),
+    _wsDeflate(false),
     _mutex(),
     _docPassword(""),
     _haveDocPassword(false),
@@ -91,10 +90,25 @@ bool LOOLSession::sendTextFrame(const char* buffer, const int length)
 
         if (length > SMALL_MESSAGE_SIZE)
         {
+            // Always the uncompressed size; the client inflates
+            // transparently before it sees the message.
             const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
             _ws->sendFrame(nextmessage.data(), nextmessage.size());
         }
 
+        if (_wsDeflate && length >= WSDeflateThreshold)
+        {
+            // The big text messages (status, styles, command values)
+            // shrink several-fold; tiny ones aren't worth the cycles.
+            std::vector<char> compressed;
+            if (IoUtil::deflateMessage(buffer, length, compressed))
+            {
+                _ws->sendFrame(compressed.data(), compressed.size(),
+                               WebSocket::FRAME_TEXT | IoUtil::WebSocketFlagDeflated);
+                return true;
+            }
+        }
+
         _ws->sendFrame(buffer, length);
         return true;
     }
@@ -140,11 +154,11 @@ bool LOOLSession::sendBinaryFrame(const char *buffer, int length)
     return false;
 }
 
-void LOOLSession::parseDocOptions(const StringTokenizer& tokens, int& part, std::string& timestamp)
+void LOOLSession::parseDocOptions(const Tokenizer& tokens, int& part, std::string& timestamp)
 {
     // First token is the "load" command itself.
     size_t offset = 1;
-    if (tokens.count() > 2 && tokens[1].find("part=") == 0)
+    if (tokens.count() > 2 && tokens[1].startsWith("part="))
     {
         getTokenInteger(tokens[1], "part", part);
         ++offset;
@@ -152,28 +166,28 @@ void LOOLSession::parseDocOptions(const StringTokenizer& tokens, int& part, std:
 
     for (size_t i = offset; i < tokens.count(); ++i)
     {
-        if (tokens[i].find("url=") == 0)
+        if (tokens[i].startsWith("url="))
         {
             _docURL = tokens[i].substr(strlen("url="));
             ++offset;
         }
-        else if (tokens[i].find("jail=") == 0)
+        else if (tokens[i].startsWith("jail="))
         {
             _jailedFilePath = tokens[i].substr(strlen("jail="));
             ++offset;
         }
-        else if (tokens[i].find("author=") == 0)
+        else if (tokens[i].startsWith("author="))
         {
             std::string userName = tokens[i].substr(strlen("author="));
             Poco::URI::decode(userName, _userName);
             ++offset;
         }
-        else if (tokens[i].find("timestamp=") == 0)
+        else if (tokens[i].startsWith("timestamp="))
         {
             timestamp = tokens[i].substr(strlen("timestamp="));
             ++offset;
         }
-        else if (tokens[i].find("password=") == 0)
+        else if (tokens[i].startsWith("password="))
         {
             _docPassword = tokens[i].substr(strlen("password="));
             _haveDocPassword = true;
@@ -186,7 +200,7 @@ void LOOLSession::parseDocOptions(const StringTokenizer& tokens, int& part, std:
         if (getTokenString(tokens[offset], "options", _docOptions))
         {
             if (tokens.count() > offset + 1)
-                _docOptions += Poco::cat(std::string(" "), tokens.begin() + offset + 1, tokens.end());
+                _docOptions += tokens.cat(" ", offset + 1);
         }
     }
 }
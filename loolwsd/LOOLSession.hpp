@@ -20,9 +20,9 @@
 #include <Poco/Buffer.h>
 #include <Poco/Path.h>
 #include <Poco/Process.h>
-#include <Poco/StringTokenizer.h>
 #include <Poco/Types.h>
 
+#include "Message.hpp"
 #include "MessageQueue.hpp"
 #include "LOOLProtocol.hpp"
 #include "TileCache.hpp"
@@ -51,6 +51,13 @@ public:
         return sendTextFrame(text.data(), text.size());
     }
 
+    /// Send a shared message; the payload is not copied.
+    bool sendMessage(const MessagePtr& message)
+    {
+        return message->isBinary() ? sendBinaryFrame(message->data(), message->size())
+                                   : sendTextFrame(message->data(), message->size());
+    }
+
     bool handleInput(const char *buffer, int length);
 
     /// Invoked when we want to disconnect a session.
@@ -84,53 +91,38 @@ public:
 
     bool isHeadless() const { return _ws == nullptr; }
 
+    /// Enable permessage-deflate on outbound text frames, after the
+    /// client negotiated it on the upgrade. Binary frames carry
+    /// already-compressed PNG tiles and are never deflated.
+    void setWebSocketDeflate(const bool enable) { _wsDeflate = enable; }
+
 protected:
     LOOLSession(const std::string& id, const Kind kind,
                 std::shared_ptr<Poco::Net::WebSocket> ws);
     virtual ~LOOLSession();
 
     /// Parses the options of the "load" command, shared between MasterProcessSession::loadDocument() and ChildProcessSession::loadDocument().
-    void parseDocOptions(const Poco::StringTokenizer& tokens, int& part, std::string& timestamp);
+    void parseDocOptions(const LOOLProtocol::Tokenizer& tokens, int& part, std::string& timestamp);
 
     void updateLastActivityTime()
     {
         _lastActivityTime = std::chrono::steady_clock::now();
     }
 
-    template <typename T>
-    bool forwardToPeer(T& p, const char *buffer, int length, const bool binary)
-    {
-        const auto message = LOOLProtocol::getAbbreviatedMessage(buffer, length);
-
-        auto peer = p.lock();
-        if (!peer)
-        {
-            throw Poco::ProtocolException(getName() + ": no peer to forward to: [" + message + "].");
-        }
-        else if (peer->isCloseFrame())
-        {
-            Log::trace(getName() + ": peer began the closing handshake. Dropping forward message [" + message + "].");
-            return true;
-        }
-        else if (peer->isHeadless())
-        {
-            // Fail silently and return as there is no actual websocket
-            // connection in this case.
-            Log::info(getName() + ": Headless peer, not forwarding message [" + message + "].");
-            return true;
-        }
-
-        Log::trace(getName() + " -> " + peer->getName() + ": " + message);
-        return binary ? peer->sendBinaryFrame(buffer, length)
-                      : peer->sendTextFrame(buffer, length);
-    }
-
     /// Internal lock shared with derived classes.
     std::unique_lock<std::mutex> getLock()
     {
         return std::unique_lock<std::mutex>(_mutex);
     }
 
+    /// Replace the WebSocket of this session (session resume). Safe
+    /// against concurrent sends, which lock around every _ws use.
+    void setWebSocket(const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ws = ws;
+    }
+
 private:
 
     virtual bool _handleInput(const char *buffer, int length) = 0;
@@ -163,6 +155,13 @@ private:
     // Whether websocket received close frame.  Closing Handshake
     std::atomic<bool> _isCloseFrame;
 
+    /// Whether the client negotiated permessage-deflate.
+    std::atomic<bool> _wsDeflate;
+
+    /// Text frames below this size are sent uncompressed; the deflate
+    /// overhead outweighs the saving.
+    static constexpr int WSDeflateThreshold = 1024;
+
     std::mutex _mutex;
 
 protected:
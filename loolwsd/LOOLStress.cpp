@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
@@ -23,7 +24,10 @@
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/KeyConsoleHandler.h>
 #include <Poco/Net/AcceptCertificateHandler.h>
+#include <Poco/File.h>
+#include <Poco/Path.h>
 #include <Poco/StreamCopier.h>
+#include <Poco/TemporaryFile.h>
 #include <Poco/URI.h>
 #include <Poco/Process.h>
 #include <Poco/StringTokenizer.h>
@@ -53,7 +57,11 @@ public:
     ~Stress() {}
 
     static bool Benchmark;
+    static double Speed;
     static size_t Iterations;
+    static size_t Warmup;
+    static unsigned NumDocs;
+    static unsigned RenderRatio;
     static bool NoDelay;
     unsigned _numClients;
     std::string _serverURI;
@@ -97,6 +105,23 @@ long percentile(std::vector<long>& v, const double percentile)
     return v[k - 1] + d * (v[k] - v[k - 1]);
 }
 
+/// One line of the final report: count, best and the latency tail.
+void reportStats(const std::string& name, std::vector<long>& v)
+{
+    if (v.empty())
+    {
+        std::cerr << name << ": no samples." << std::endl;
+        return;
+    }
+
+    std::sort(v.begin(), v.end());
+    std::cerr << name << ": " << v.size() << " samples"
+              << ", best: " << v[0] << " us"
+              << ", p50: " << percentile(v, 50) << " us"
+              << ", p95: " << percentile(v, 95) << " us"
+              << ", p99: " << percentile(v, 99) << " us." << std::endl;
+}
+
 /// Connection class with WSD.
 class Connection
 {
@@ -170,15 +195,18 @@ class Worker: public Runnable
 {
 public:
 
-    Worker(Stress& app, const std::string& uri) :
+    Worker(Stress& app, const std::string& uri, const bool loader = true) :
         _app(app),
-        _uri(uri)
+        _uri(uri),
+        _loader(loader)
     {
     }
 
     std::vector<long> getLatencyStats() const { return _latencyStats; }
     std::vector<long> getRenderingStats() const { return _renderingStats; }
     std::vector<long> getCacheStats() const { return _cacheStats; }
+    std::vector<long> getLoadStats() const { return _loadStats; }
+    std::vector<long> getFirstTileStats() const { return _firstTileStats; }
 
     void run() override
     {
@@ -206,7 +234,7 @@ public:
 
 private:
 
-    bool modifyDoc(const std::shared_ptr<Connection>& con)
+    bool modifyDoc(const std::shared_ptr<Connection>& con, const bool record)
     {
         const auto startModify = std::chrono::steady_clock::now();
 
@@ -216,14 +244,17 @@ private:
 
         const auto now = std::chrono::steady_clock::now();
         const auto deltaModify = std::chrono::duration_cast<std::chrono::microseconds>(now - startModify).count();
-        _latencyStats.push_back(deltaModify);
+        if (record)
+        {
+            _latencyStats.push_back(deltaModify);
+        }
 
         return success;
     }
 
-    bool renderTile(const std::shared_ptr<Connection>& con)
+    bool renderTile(const std::shared_ptr<Connection>& con, const bool record)
     {
-        modifyDoc(con);
+        modifyDoc(con, record);
 
         const auto start = std::chrono::steady_clock::now();
 
@@ -239,12 +270,15 @@ private:
 
         const auto now = std::chrono::steady_clock::now();
         const auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
-        _renderingStats.push_back(delta / expectedTilesCount);
+        if (record)
+        {
+            _renderingStats.push_back(delta / expectedTilesCount);
+        }
 
         return true;
     }
 
-    bool fetchCachedTile(const std::shared_ptr<Connection>& con)
+    bool fetchCachedTile(const std::shared_ptr<Connection>& con, const bool record)
     {
         const auto start = std::chrono::steady_clock::now();
 
@@ -260,14 +294,18 @@ private:
 
         const auto now = std::chrono::steady_clock::now();
         const auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
-        _cacheStats.push_back(delta / expectedTilesCount);
+        if (record)
+        {
+            _cacheStats.push_back(delta / expectedTilesCount);
+        }
 
         return true;
     }
 
     void benchmark()
     {
-        std::cout << "Running " << Stress::Iterations << " iterations of Benchmark." << std::endl;
+        std::cout << "Running " << Stress::Warmup << " warmup plus " << Stress::Iterations
+                  << " iterations of Benchmark." << std::endl;
 
         _cacheStats.reserve(Stress::Iterations * 4);
         _latencyStats.reserve(Stress::Iterations * 4);
@@ -277,16 +315,50 @@ private:
         const auto sessionId = ++SessionId;
         auto connection = Connection::create(_app._serverURI, _uri, std::to_string(sessionId));
 
+        // Only the view that triggers the actual document load times
+        // it; the others merely join an open document.
+        const auto startLoad = std::chrono::steady_clock::now();
         connection->load();
-
-        for (size_t i = 0; i < Stress::Iterations; ++i)
+        if (_loader)
         {
-            renderTile(connection);
+            _loadStats.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - startLoad).count());
+
+            // Time to the very first tile after a fresh load: what a
+            // user waits before seeing anything.
+            const auto startFirst = std::chrono::steady_clock::now();
+            requestFirstTile(connection);
+            if (!helpers::getTileMessage(*connection->getWS(), connection->getName()).empty())
+            {
+                _firstTileStats.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - startFirst).count());
+            }
+        }
 
-            fetchCachedTile(connection);
+        // A deterministic per-session request mix: RenderRatio
+        // percent fresh renders (each preceded by an edit), the rest
+        // cache fetches.
+        std::mt19937 random(sessionId);
+        for (size_t i = 0; i < Stress::Warmup + Stress::Iterations; ++i)
+        {
+            const bool record = (i >= Stress::Warmup);
+            if (random() % 100 < Stress::RenderRatio)
+            {
+                renderTile(connection, record);
+            }
+            else
+            {
+                fetchCachedTile(connection, record);
+            }
         }
     }
 
+    static void requestFirstTile(const std::shared_ptr<Connection>& con)
+    {
+        con->send("tile part=0 width=256 height=256 tileposx=0 tileposy=0 "
+                  "tilewidth=3840 tileheight=3840");
+    }
+
     void replay()
     {
         TraceFileReader traceFile(_uri);
@@ -305,7 +377,9 @@ private:
 
             const auto deltaCurrent = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epochCurrent).count();
             const auto deltaFile = rec.TimestampNs - epochFile;
-            const auto delay = (Stress::NoDelay ? 0 : deltaFile - deltaCurrent);
+            // Compress the recorded gap by the replay speed; sends
+            // stay in trace order regardless, so causality holds.
+            const auto delay = (Stress::NoDelay ? 0 : static_cast<long>(deltaFile / Stress::Speed) - deltaCurrent);
             if (delay > 0)
             {
                 if (delay > 1e6)
@@ -412,11 +486,21 @@ private:
     std::vector<long> _latencyStats;
     std::vector<long> _renderingStats;
     std::vector<long> _cacheStats;
+    std::vector<long> _loadStats;
+    std::vector<long> _firstTileStats;
+
+    /// True for the first view on each document; only it
+    /// times the load and the first tile.
+    const bool _loader;
 };
 
 bool Stress::NoDelay = false;
 bool Stress::Benchmark = false;
+double Stress::Speed = 1.0;
 size_t Stress::Iterations = 100;
+size_t Stress::Warmup = 10;
+unsigned Stress::NumDocs = 1;
+unsigned Stress::RenderRatio = 50;
 
 Stress::Stress() :
     _numClients(1),
@@ -439,8 +523,23 @@ void Stress::defineOptions(OptionSet& optionSet)
     optionSet.addOption(Option("iter", "", "Number of iterations to use for Benchmarking.")
                         .required(false).repeatable(false)
                         .argument("iter"));
+    optionSet.addOption(Option("warmup", "", "Number of unrecorded warmup iterations before Benchmarking.")
+                        .required(false).repeatable(false)
+                        .argument("iter"));
+    optionSet.addOption(Option("docs", "", "Number of documents to load concurrently when Benchmarking. "
+                               "Documents beyond the first are temp copies of the original.")
+                        .required(false).repeatable(false)
+                        .argument("docs"));
+    optionSet.addOption(Option("renderratio", "", "Percentage of tile requests that render fresh "
+                               "(the rest fetch from the cache) when Benchmarking.")
+                        .required(false).repeatable(false)
+                        .argument("percent"));
     optionSet.addOption(Option("nodelay", "", "Replay at full speed disregarding original timing.")
                         .required(false).repeatable(false));
+    optionSet.addOption(Option("speed", "", "Replay time-compression factor: 60 replays an hour "
+                               "of trace in a minute. See --nodelay for uncapped replay.")
+                        .required(false).repeatable(false)
+                        .argument("factor"));
     optionSet.addOption(Option("clientsperdoc", "", "Number of simultaneous clients on each doc.")
                         .required(false).repeatable(false)
                         .argument("concurrency"));
@@ -468,8 +567,16 @@ void Stress::handleOption(const std::string& optionName,
         Stress::Benchmark = true;
     else if (optionName == "iter")
         Stress::Iterations = std::max(std::stoi(value), 1);
+    else if (optionName == "warmup")
+        Stress::Warmup = std::max(std::stoi(value), 0);
+    else if (optionName == "docs")
+        Stress::NumDocs = std::max(std::stoi(value), 1);
+    else if (optionName == "renderratio")
+        Stress::RenderRatio = std::min(std::max(std::stoi(value), 0), 100);
     else if (optionName == "nodelay")
         Stress::NoDelay = true;
+    else if (optionName == "speed")
+        Stress::Speed = std::max(std::stod(value), 0.001);
     else if (optionName == "clientsperdoc")
         _numClients = std::max(std::stoi(value), 1);
     else if (optionName == "server")
@@ -483,7 +590,7 @@ void Stress::handleOption(const std::string& optionName,
 
 int Stress::main(const std::vector<std::string>& args)
 {
-    std::vector<std::unique_ptr<Thread>> clients(_numClients * args.size());
+    std::vector<std::unique_ptr<Thread>> clients;
 
     if (args.size() == 0)
     {
@@ -493,17 +600,41 @@ int Stress::main(const std::vector<std::string>& args)
         return Application::EXIT_NOINPUT;
     }
 
+    // Expand each arg into NumDocs distinct documents, so the server
+    // opens that many DocumentBrokers. The extra documents are temp
+    // copies, removed when we are done.
+    std::vector<std::string> tempFiles;
+    std::vector<std::string> documents;
+    for (const auto& arg : args)
+    {
+        documents.push_back(arg);
+        for (unsigned doc = 1; Stress::Benchmark && doc < Stress::NumDocs; ++doc)
+        {
+            if (Poco::File(arg).exists())
+            {
+                const auto copyPath = Poco::TemporaryFile::tempName() + '_' + Poco::Path(arg).getFileName();
+                Poco::File(arg).copyTo(copyPath);
+                tempFiles.push_back(copyPath);
+                documents.push_back(copyPath);
+            }
+            else
+            {
+                std::cerr << "Cannot copy [" << arg << "], adding another view on it instead." << std::endl;
+                documents.push_back(arg);
+            }
+        }
+    }
+
     std::vector<std::shared_ptr<Worker>> workers;
 
-    unsigned index = 0;
-    for (unsigned i = 0; i < args.size(); ++i)
+    for (const auto& document : documents)
     {
-        std::cout << "Arg: " << args[i] << std::endl;
-        for (unsigned j = 0; j < _numClients; ++j, ++index)
+        std::cout << "Document: " << document << std::endl;
+        for (unsigned j = 0; j < _numClients; ++j)
         {
-            workers.emplace_back(new Worker(*this, args[i]));
-            clients[index].reset(new Thread());
-            clients[index]->start(*workers[workers.size() - 1]);
+            workers.emplace_back(new Worker(*this, document, j == 0));
+            clients.emplace_back(new Thread());
+            clients.back()->start(*workers.back());
         }
     }
 
@@ -517,6 +648,8 @@ int Stress::main(const std::vector<std::string>& args)
         std::vector<long> latencyStats;
         std::vector<long> renderingStats;
         std::vector<long> cachedStats;
+        std::vector<long> loadStats;
+        std::vector<long> firstTileStats;
 
         for (const auto& worker : workers)
         {
@@ -528,22 +661,35 @@ int Stress::main(const std::vector<std::string>& args)
 
             const auto cachedStat = worker->getCacheStats();
             cachedStats.insert(cachedStats.end(), cachedStat.begin(), cachedStat.end());
+
+            const auto loadStat = worker->getLoadStats();
+            loadStats.insert(loadStats.end(), loadStat.begin(), loadStat.end());
+
+            const auto firstTileStat = worker->getFirstTileStats();
+            firstTileStats.insert(firstTileStats.end(), firstTileStat.begin(), firstTileStat.end());
         }
 
-        if (!latencyStats.empty() && !renderingStats.empty() && !cachedStats.empty())
-        {
-            std::cerr << "\nResults:\n";
-            std::cerr << "Iterations: " << Stress::Iterations << "\n";
+        std::cerr << "\nResults:\n";
+        std::cerr << "Documents: " << documents.size() << ", views per document: " << _numClients
+                  << ", warmup: " << Stress::Warmup << ", iterations: " << Stress::Iterations
+                  << ", render ratio: " << Stress::RenderRatio << "%.\n";
 
-            std::cerr << "Latency best: " << latencyStats[0] << " microsecs, 95th percentile: " << percentile(latencyStats, 95) << " microsecs." << std::endl;
-            std::cerr << "Tile best: " << renderingStats[0] << " microsecs, rendering 95th percentile: " << percentile(renderingStats, 95) << " microsecs." << std::endl;
-            std::cerr << "Cached best: " << cachedStats[0] << " microsecs, tile 95th percentile: " << percentile(cachedStats, 95) << " microsecs." << std::endl;
+        reportStats("Document load", loadStats);
+        reportStats("First tile", firstTileStats);
+        reportStats("Keystroke latency", latencyStats);
+        reportStats("Tile render roundtrip", renderingStats);
+        reportStats("Cached tile roundtrip", cachedStats);
 
+        if (!renderingStats.empty())
+        {
             const auto renderingTime = std::accumulate(renderingStats.begin(), renderingStats.end(), 0L);
             const double renderedPixels = 256 * 256 * renderingStats.size();
             const auto pixelsPerSecRendered = renderedPixels / renderingTime;
             std::cerr << "Rendering power: " << pixelsPerSecRendered << " MPixels/sec." << std::endl;
+        }
 
+        if (!cachedStats.empty())
+        {
             const auto cacheTime = std::accumulate(cachedStats.begin(), cachedStats.end(), 0L);
             const double cachePixels = 256 * 256 * cachedStats.size();
             const auto pixelsPerSecCached = cachePixels / cacheTime;
@@ -551,6 +697,11 @@ int Stress::main(const std::vector<std::string>& args)
         }
     }
 
+    for (const auto& tempFile : tempFiles)
+    {
+        Util::removeFile(tempFile);
+    }
+
     return Application::EXIT_OK;
 }
 
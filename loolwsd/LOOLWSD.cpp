@@ -29,19 +29,24 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <clocale>
+#include <cmath>
 #include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <sstream>
 #include <thread>
+#include <vector>
 
 #include <Poco/DOM/AutoPtr.h>
 #include <Poco/DOM/DOMParser.h>
@@ -103,10 +108,13 @@
 #include "LOOLProtocol.hpp"
 #include "LOOLSession.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "PrisonerSession.hpp"
 #include "QueueHandler.hpp"
 #include "Storage.hpp"
+#include "TileCache.hpp"
 #include "TraceFile.hpp"
+#include "TraceSpan.hpp"
 #include "Unit.hpp"
 #include "UnitHTTP.hpp"
 #include "UserMessages.hpp"
@@ -167,8 +175,95 @@ static std::vector<std::shared_ptr<ChildProcess>> newChildren;
 static std::mutex newChildrenMutex;
 static std::condition_variable newChildrenCV;
 static std::chrono::steady_clock::time_point lastForkRequestTime = std::chrono::steady_clock::now();
-static std::map<std::string, std::shared_ptr<DocumentBroker>> docBrokers;
-static std::mutex docBrokersMutex;
+
+/// Window over which document-open arrivals drive the pool target.
+constexpr int ChildArrivalWindowSecs = 60;
+/// Document-open arrivals within the window; guarded by newChildrenMutex.
+static std::deque<std::chrono::steady_clock::time_point> childArrivalTimes;
+/// Moving average of the observed child spawn latency, in milliseconds;
+/// guarded by newChildrenMutex.
+static double spawnLatencyMs = 1000.;
+/// The adaptive prespawn target, between num_prespawn_children and
+/// max_prespawn_children; guarded by newChildrenMutex.
+static int preSpawnTarget = 1;
+
+/// A blocked document-open waiting for a child. addNewChild fills
+/// the slot of the front waiter, so requests are satisfied in FIFO
+/// order the moment a child registers. Guarded by newChildrenMutex.
+struct PendingChildRequest
+{
+    std::shared_ptr<ChildProcess> child;
+};
+static std::deque<PendingChildRequest*> pendingChildRequests;
+
+/// The live DocumentBrokers, sharded by docKey hash so opens of
+/// different documents never serialize on one lock. Only map lookups
+/// and mutations happen under a shard lock; in particular the storage
+/// validation (a synchronous WOPI CheckFileInfo) runs outside it.
+struct DocBrokersShard
+{
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<DocumentBroker>> brokers;
+};
+
+constexpr size_t DocBrokersShardCount = 16;
+static DocBrokersShard docBrokersShards[DocBrokersShardCount];
+
+static DocBrokersShard& docBrokersShard(const std::string& docKey)
+{
+    return docBrokersShards[std::hash<std::string>()(docKey) % DocBrokersShardCount];
+}
+
+/// A point-in-time snapshot of every live DocumentBroker, taken one
+/// shard at a time; for the walkers (autosave, multidoc placement,
+/// alerts) that must not hold any registry lock while calling out.
+static std::vector<std::pair<std::string, std::shared_ptr<DocumentBroker>>> getDocBrokersSnapshot()
+{
+    std::vector<std::pair<std::string, std::shared_ptr<DocumentBroker>>> snapshot;
+    for (auto& shard : docBrokersShards)
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        snapshot.insert(snapshot.end(), shard.brokers.begin(), shard.brokers.end());
+    }
+
+    return snapshot;
+}
+
+/// The owner host of the given docKey under rendezvous (highest
+/// random weight) hashing over the shared cluster host list. Every
+/// instance computes the same winner from the same list, so no
+/// coordination service is needed, and removing a host only moves
+/// the documents that host owned.
+static std::string clusterOwner(const std::string& docKey)
+{
+    // FNV-1a; fixed across hosts and builds (std::hash is not).
+    const auto hash = [](const std::string& text)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (const char c : text)
+        {
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ULL;
+        }
+
+        return h;
+    };
+
+    std::string owner;
+    uint64_t bestWeight = 0;
+    for (const auto& host : LOOLWSD::ClusterHosts)
+    {
+        const auto weight = hash(docKey + '|' + host);
+        if (owner.empty() || weight > bestWeight)
+        {
+            bestWeight = weight;
+            owner = host;
+        }
+    }
+
+    return owner;
+}
+
 // Sessions to pre-spawned child processes that have connected but are not yet assigned a
 // document to work on.
 static std::mutex AvailableChildSessionMutex;
@@ -231,6 +326,38 @@ static void forkChildren(const int number)
         Log::debug("MasterToForKit: " + aMessage.substr(0, aMessage.length() - 1));
         IoUtil::writeToPipe(LOOLWSD::ForKitWritePipe, aMessage);
         lastForkRequestTime = std::chrono::steady_clock::now();
+        UnitWSD::get().onForkRequest(number);
+    }
+}
+
+/// Recompute the prespawn target from the document-open arrival
+/// rate and the observed spawn latency: keep enough spare children
+/// to cover the opens expected while one more child is cooking.
+/// Bounded by num_prespawn_children and max_prespawn_children.
+static void updatePreSpawnTarget()
+{
+    Util::assertIsLocked(newChildrenMutex);
+
+    const auto now = std::chrono::steady_clock::now();
+    while (!childArrivalTimes.empty() &&
+           (now - childArrivalTimes.front()) > std::chrono::seconds(ChildArrivalWindowSecs))
+    {
+        childArrivalTimes.pop_front();
+    }
+
+    const double arrivalsPerSec = static_cast<double>(childArrivalTimes.size()) / ChildArrivalWindowSecs;
+    const int needed = std::ceil(arrivalsPerSec * (spawnLatencyMs / 1000.));
+
+    const int minTarget = LOOLWSD::NumPreSpawnedChildren;
+    const int maxTarget = std::max<int>(LOOLWSD::MaxPreSpawnedChildren, minTarget);
+    const int target = std::min(std::max(needed, minTarget), maxTarget);
+    if (target != preSpawnTarget)
+    {
+        Log::info() << "Prespawn target " << preSpawnTarget << " -> " << target
+                    << " (arrivals last " << ChildArrivalWindowSecs << "s: " << childArrivalTimes.size()
+                    << ", spawn latency: " << static_cast<int>(spawnLatencyMs)
+                    << " ms, pool depth: " << newChildren.size() << ")." << Log::end;
+        preSpawnTarget = target;
     }
 }
 
@@ -241,6 +368,7 @@ static void preForkChildren()
 
     int numPreSpawn = LOOLWSD::NumPreSpawnedChildren;
     UnitWSD::get().preSpawnCount(numPreSpawn);
+    preSpawnTarget = numPreSpawn;
     --numPreSpawn; // ForKit always spawns one child at startup.
 
     forkChildren(numPreSpawn);
@@ -264,6 +392,23 @@ static void prespawnChildren()
         }
     }
 
+    Metrics::SpareChildren = newChildren.size();
+
+    updatePreSpawnTarget();
+
+    const int available = newChildren.size();
+    if (available > preSpawnTarget)
+    {
+        // Gently drain one surplus spare per sweep, so a long
+        // idle spell reclaims the memory of a burst's pool.
+        Log::info() << "Draining a surplus spare child (pool depth: " << available
+                    << ", target: " << preSpawnTarget << ")." << Log::end;
+        newChildren.front()->close(false);
+        newChildren.erase(newChildren.begin());
+        Metrics::SpareChildren = newChildren.size();
+        return;
+    }
+
     const auto duration = (std::chrono::steady_clock::now() - lastForkRequestTime);
     if (std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() <= static_cast<int64_t>(CHILD_TIMEOUT_SECS) * 1000)
     {
@@ -271,8 +416,9 @@ static void prespawnChildren()
         return;
     }
 
-    const int available = newChildren.size();
-    int balance = LOOLWSD::NumPreSpawnedChildren;
+    // Waiting document requests consume children as they register,
+    // so they need covering on top of the spare target.
+    int balance = preSpawnTarget + static_cast<int>(pendingChildRequests.size());
     balance -= available;
     forkChildren(balance);
 }
@@ -280,13 +426,38 @@ static void prespawnChildren()
 static size_t addNewChild(const std::shared_ptr<ChildProcess>& child)
 {
     std::unique_lock<std::mutex> lock(newChildrenMutex);
+
+    // Fold the spawn duration into the latency estimate the pool
+    // controller sizes its headroom with. The fork request that
+    // produced this child is the last one we made.
+    const auto spawnMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - lastForkRequestTime).count();
+    if (spawnMs > 0 && spawnMs <= static_cast<int64_t>(CHILD_TIMEOUT_SECS) * 1000)
+    {
+        spawnLatencyMs = (spawnLatencyMs * 3 + spawnMs) / 4;
+    }
+
+    // Hand the child straight to the longest-waiting document
+    // request, if any; otherwise park it in the pool.
+    if (!pendingChildRequests.empty())
+    {
+        pendingChildRequests.front()->child = child;
+        pendingChildRequests.pop_front();
+        Log::debug("addNewChild: Handing child [" + std::to_string(child->getPid()) +
+                   "] to a waiting request.");
+        newChildrenCV.notify_all();
+        return newChildren.size();
+    }
+
     newChildren.emplace_back(child);
     const auto count = newChildren.size();
+    Metrics::SpareChildren = count;
     Log::info() << "Have " << count << " "
                 << (count == 1 ? "child" : "children")
-                << "." << Log::end;
+                << "; spawn latency: " << static_cast<int>(spawnLatencyMs)
+                << " ms." << Log::end;
 
-    newChildrenCV.notify_one();
+    newChildrenCV.notify_all();
     return count;
 }
 
@@ -296,45 +467,131 @@ static std::shared_ptr<ChildProcess> getNewChild()
 
     namespace chrono = std::chrono;
     const auto startTime = chrono::steady_clock::now();
+
+    // Record the document-open arrival for the pool controller.
+    childArrivalTimes.push_back(startTime);
+    updatePreSpawnTarget();
+
+    const auto deadline = startTime + chrono::milliseconds(CHILD_TIMEOUT_SECS * 4000);
     do
     {
-        const int available = newChildren.size();
-        int balance = LOOLWSD::NumPreSpawnedChildren;
-        if (available == 0)
+        // Fast path: take a live spare directly from the pool.
+        while (!newChildren.empty())
         {
-            Log::error("getNewChild: No available child. Sending spawn request to forkit and failing.");
+            auto child = newChildren.back();
+            newChildren.pop_back();
+            Metrics::SpareChildren = newChildren.size();
+            if (child && child->isAlive())
+            {
+                forkChildren(preSpawnTarget - static_cast<int>(newChildren.size()));
+                Log::debug() << "getNewChild: Returning new child [" << child->getPid()
+                             << "]; pool depth: " << newChildren.size()
+                             << ", target: " << preSpawnTarget << "." << Log::end;
+                return child;
+            }
         }
-        else
+
+        // Queue up; addNewChild will fill our slot the moment
+        // a child registers, oldest request first.
+        PendingChildRequest request;
+        pendingChildRequests.push_back(&request);
+
+        const int balance = preSpawnTarget + static_cast<int>(pendingChildRequests.size());
+        Log::debug("getNewChild: No spare child, waiting in queue of " +
+                   std::to_string(pendingChildRequests.size()) + ", forking " + std::to_string(balance));
+        forkChildren(balance);
+
+        newChildrenCV.wait_until(lock, deadline, [&request]() { return request.child != nullptr; });
+
+        // On timeout we are still queued; drop out before the
+        // slot goes out of scope.
+        const auto it = std::find(pendingChildRequests.begin(), pendingChildRequests.end(), &request);
+        if (it != pendingChildRequests.end())
         {
-            balance -= available - 1; // Minus the one we'll dispatch just now.
-            balance = std::max(balance, 0);
+            pendingChildRequests.erase(it);
         }
 
-        Log::debug("getNewChild: Have " + std::to_string(available) + " children, forking " + std::to_string(balance));
-        forkChildren(balance);
+        // Validate before returning.
+        if (request.child && request.child->isAlive())
+        {
+            const auto waitedMs = chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - startTime).count();
+            Log::debug() << "getNewChild: Returning new child [" << request.child->getPid()
+                         << "] after " << waitedMs << " ms; pool depth: "
+                         << newChildren.size() << ", target: " << preSpawnTarget
+                         << "." << Log::end;
+            return request.child;
+        }
 
-        const auto timeout = chrono::milliseconds(CHILD_TIMEOUT_SECS * 1000);
-        if (newChildrenCV.wait_for(lock, timeout, [](){ return !newChildren.empty(); }))
+        Log::debug("getNewChild: No live child, retrying.");
+    }
+    while (chrono::steady_clock::now() < deadline);
+
+    Log::debug("getNewChild: Timed out while waiting for new child.");
+    return nullptr;
+}
+
+std::shared_ptr<ChildProcess> LOOLWSD::getNewChild()
+{
+    return ::getNewChild();
+}
+
+/// Get a kit process for a new document. In multidoc mode a kit
+/// already hosting fewer than multidoc.max_documents documents is
+/// asked to open another control connection, which registers like
+/// a freshly spawned child and is handed out through the normal
+/// FIFO; otherwise (and as fallback) a fresh process serves.
+static std::shared_ptr<ChildProcess> getChildForDocument()
+{
+    if (LOOLWSD::MultiDocKits)
+    {
+        std::shared_ptr<DocumentBroker> candidate;
         {
-            auto child = newChildren.back();
-            newChildren.pop_back();
+            const auto brokers = getDocBrokersSnapshot();
 
-            // Validate before returning.
-            if (child && child->isAlive())
+            // Count the documents hosted by each kit process.
+            std::map<Poco::Process::PID, unsigned> kitDocCounts;
+            for (const auto& brokerIt : brokers)
             {
-                Log::debug("getNewChild: Returning new child [" + std::to_string(child->getPid()) + "].");
-                return child;
+                const auto pid = brokerIt.second->getChildPid();
+                if (pid > 0)
+                {
+                    ++kitDocCounts[pid];
+                }
+            }
+
+            for (const auto& brokerIt : brokers)
+            {
+                const auto pid = brokerIt.second->getChildPid();
+                if (pid > 0 && kitDocCounts[pid] < LOOLWSD::MaxDocsPerKit &&
+                    !brokerIt.second->isHibernated() && brokerIt.second->isAlive())
+                {
+                    candidate = brokerIt.second;
+                    break;
+                }
             }
         }
 
-        Log::debug("getNewChild: No live child, forking more.");
+        if (candidate)
+        {
+            Log::info() << "Asking kit [" << candidate->getChildPid()
+                        << "] to host another document." << Log::end;
+            candidate->requestAddDoc();
+        }
     }
-    while (chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime).count() < static_cast<int64_t>(CHILD_TIMEOUT_SECS) * 4000);
 
-    Log::debug("getNewChild: Timed out while waiting for new child.");
-    return nullptr;
+    return getNewChild();
 }
 
+/// The number of conversion jobs in flight on the convert-to
+/// endpoint, bounded by convert_to.max_concurrency.
+static std::atomic<int> ConvertJobsInFlight(0);
+
+/// Serial of the next conversion job, to give each a docKey of
+/// its own: parallel conversions (even of the same file) and open
+/// editing sessions must never share a DocumentBroker.
+static std::atomic<unsigned> ConvertJobSerial(0);
+
 /// Handles the filename part of the convert-to POST request payload.
 class ConvertToPartHandler : public PartHandler
 {
@@ -446,93 +703,117 @@ private:
                 {
                     Log::info("Conversion request for URI [" + fromPath + "].");
 
-                    // Request a kit process for this doc.
-                    auto child = getNewChild();
-                    if (!child)
+                    // Admission control: each job takes a prespawned kit of
+                    // its own, so beyond the configured bound reject outright
+                    // (mapped to HTTP 503) and let batch clients back off,
+                    // instead of draining the pool under interactive loads.
+                    if (++ConvertJobsInFlight > static_cast<int>(LOOLWSD::MaxConvertJobs) &&
+                        LOOLWSD::MaxConvertJobs > 0)
                     {
-                        // Let the client know we can't serve now.
-                        throw std::runtime_error("Failed to spawn lokit child.");
+                        --ConvertJobsInFlight;
+                        Log::warn() << "Rejecting conversion request: " << LOOLWSD::MaxConvertJobs
+                                    << " jobs already in flight." << Log::end;
+                        throw std::runtime_error("Conversion service busy.");
                     }
 
-                    auto uriPublic = DocumentBroker::sanitizeURI(fromPath);
-                    const auto docKey = DocumentBroker::getDocKey(uriPublic);
-                    Log::debug("New DocumentBroker for docKey [" + docKey + "].");
-                    auto docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
-                    child->setDocumentBroker(docBroker);
-
-                    // This lock could become a bottleneck.
-                    // In that case, we can use a pool and index by publicPath.
-                    std::unique_lock<std::mutex> lock(docBrokersMutex);
-
-                    //FIXME: What if the same document is already open? Need a fake dockey here?
-                    Log::debug("New DocumentBroker for docKey [" + docKey + "].");
-                    docBrokers.emplace(docKey, docBroker);
-
-                    // Load the document.
-                    std::shared_ptr<WebSocket> ws;
-                    auto session = std::make_shared<ClientSession>(id, ws, docBroker);
-
-                    // Request the child to connect to us and add this session.
-                    auto sessionsCount = docBroker->addSession(session);
-                    Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
-
-                    lock.unlock();
-
-                    // Wait until the client has connected with a prison socket.
-                    waitBridgeCompleted(session);
-                    // Now the bridge between the client and kit processes is connected
-                    // Let messages flow
-
-                    std::string encodedFrom;
-                    URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
-                    const std::string load = "load url=" + encodedFrom;
-                    session->handleInput(load.data(), load.size());
-
-                    //FIXME: Check for security violations.
-                    Path toPath(docBroker->getPublicUri().getPath());
-                    toPath.setExtension(format);
-                    const std::string toJailURL = "file://" + std::string(JAILED_DOCUMENT_ROOT) + toPath.getFileName();
-                    std::string encodedTo;
-                    URI::encode(toJailURL, "", encodedTo);
-
-                    // Convert it to the requested format.
-                    const auto saveas = "saveas url=" + encodedTo + " format=" + format + " options=";
-                    session->handleInput(saveas.data(), saveas.size());
-
-                    // Send it back to the client.
                     try
                     {
-                        Poco::URI resultURL(session->getSaveAsUrl(COMMAND_TIMEOUT_MS));
-                        Log::trace("Save-as URL: " + resultURL.toString());
+                        // Request a kit process for this doc.
+                        auto child = getNewChild();
+                        if (!child)
+                        {
+                            // Let the client know we can't serve now.
+                            throw std::runtime_error("Failed to spawn lokit child.");
+                        }
 
-                        if (!resultURL.getPath().empty())
+                        auto uriPublic = DocumentBroker::sanitizeURI(fromPath);
+                        // A docKey of this job's own, so parallel conversions
+                        // never collide with each other or with an editing
+                        // session of the same document.
+                        const auto docKey = DocumentBroker::getDocKey(uriPublic) +
+                                            "_convert" + std::to_string(++ConvertJobSerial);
+                        Log::debug("New DocumentBroker for docKey [" + docKey + "].");
+                        auto docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
+                        docBroker->setConvertOnly();
+                        child->setDocumentBroker(docBroker);
+
+                        auto& shard = docBrokersShard(docKey);
+                        std::unique_lock<std::mutex> lock(shard.mutex);
+                        shard.brokers.emplace(docKey, docBroker);
+
+                        // Load the document.
+                        std::shared_ptr<WebSocket> ws;
+                        auto session = std::make_shared<ClientSession>(id, ws, docBroker);
+
+                        // Request the child to connect to us and add this session.
+                        auto sessionsCount = docBroker->addSession(session);
+                        Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
+
+                        lock.unlock();
+
+                        // Wait until the client has connected with a prison socket.
+                        waitBridgeCompleted(session);
+                        // Now the bridge between the client and kit processes is connected
+                        // Let messages flow
+
+                        std::string encodedFrom;
+                        URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
+                        const std::string load = "load url=" + encodedFrom;
+                        session->handleInput(load.data(), load.size());
+
+                        //FIXME: Check for security violations.
+                        Path toPath(docBroker->getPublicUri().getPath());
+                        toPath.setExtension(format);
+                        const std::string toJailURL = "file://" + std::string(JAILED_DOCUMENT_ROOT) + toPath.getFileName();
+                        std::string encodedTo;
+                        URI::encode(toJailURL, "", encodedTo);
+
+                        // Convert it to the requested format.
+                        const auto saveas = "saveas url=" + encodedTo + " format=" + format + " options=";
+                        session->handleInput(saveas.data(), saveas.size());
+
+                        // Send it back to the client.
+                        try
                         {
-                            const std::string mimeType = "application/octet-stream";
-                            std::string encodedFilePath;
-                            URI::encode(resultURL.getPath(), "", encodedFilePath);
-                            Log::trace("Sending file: " + encodedFilePath);
-                            response.sendFile(encodedFilePath, mimeType);
-                            sent = true;
+                            Poco::URI resultURL(session->getSaveAsUrl(COMMAND_TIMEOUT_MS));
+                            Log::trace("Save-as URL: " + resultURL.toString());
+
+                            if (!resultURL.getPath().empty())
+                            {
+                                const std::string mimeType = "application/octet-stream";
+                                std::string encodedFilePath;
+                                URI::encode(resultURL.getPath(), "", encodedFilePath);
+                                Log::trace("Sending file: " + encodedFilePath);
+                                response.sendFile(encodedFilePath, mimeType);
+                                sent = true;
+                            }
+                        }
+                        catch (const std::exception& ex)
+                        {
+                            Log::error(std::string("Failed to get save-as url: ") + ex.what());
                         }
-                    }
-                    catch (const std::exception& ex)
-                    {
-                        Log::error(std::string("Failed to get save-as url: ") + ex.what());
-                    }
 
-                    lock.lock();
-                    sessionsCount = docBroker->removeSession(id);
-                    if (sessionsCount == 0)
-                    {
-                        Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
-                        docBrokers.erase(docKey);
+                        lock.lock();
+                        sessionsCount = docBroker->removeSession(id);
+                        if (sessionsCount == 0)
+                        {
+                            Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
+                            shard.brokers.erase(docKey);
+                        }
+                        else
+                        {
+                            Log::error("Multiple sessions during conversion. " + std::to_string(sessionsCount) + " sessions remain.");
+                        }
+
+                        session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE);
                     }
-                    else
+                    catch (...)
                     {
-                        Log::error("Multiple sessions during conversion. " + std::to_string(sessionsCount) + " sessions remain.");
+                        --ConvertJobsInFlight;
+                        throw;
                     }
 
-                    session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE);
+                    --ConvertJobsInFlight;
                 }
 
                 // Clean up the temporary directory the HTMLForm ctor created.
@@ -566,14 +847,15 @@ private:
                 const std::string formName(form.get("name"));
 
                 // Validate the docKey
-                std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
                 std::string decodedUri;
                 URI::decode(tokens[2], decodedUri);
                 const auto docKey = DocumentBroker::getDocKey(DocumentBroker::sanitizeURI(decodedUri));
-                auto docBrokerIt = docBrokers.find(docKey);
+                auto& shard = docBrokersShard(docKey);
+                std::unique_lock<std::mutex> docBrokersLock(shard.mutex);
+                auto docBrokerIt = shard.brokers.find(docKey);
 
                 // Maybe just free the client from sending childid in form ?
-                if (docBrokerIt == docBrokers.end() || docBrokerIt->second->getJailId() != formChildid)
+                if (docBrokerIt == shard.brokers.end() || docBrokerIt->second->getJailId() != formChildid)
                 {
                     throw BadRequestException("DocKey [" + docKey + "] or childid [" + formChildid + "] is invalid.");
                 }
@@ -601,9 +883,10 @@ private:
             std::string decodedUri;
             URI::decode(tokens[2], decodedUri);
             const auto docKey = DocumentBroker::getDocKey(DocumentBroker::sanitizeURI(decodedUri));
-            std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
-            auto docBrokerIt = docBrokers.find(docKey);
-            if (docBrokerIt == docBrokers.end())
+            auto& shard = docBrokersShard(docKey);
+            std::unique_lock<std::mutex> docBrokersLock(shard.mutex);
+            auto docBrokerIt = shard.brokers.find(docKey);
+            if (docBrokerIt == shard.brokers.end())
             {
                 throw BadRequestException("DocKey [" + docKey + "] is invalid.");
             }
@@ -658,7 +941,8 @@ private:
     }
 
     /// Handle GET requests.
-    static void handleGetRequest(const std::string& uri, std::shared_ptr<WebSocket>& ws, const std::string& id)
+    static void handleGetRequest(const std::string& uri, std::shared_ptr<WebSocket>& ws,
+                                 const std::string& id, const bool wsDeflate)
     {
         Log::info("Starting GET request handler for session [" + id + "].");
 
@@ -669,15 +953,49 @@ private:
 
         const auto uriPublic = DocumentBroker::sanitizeURI(uri);
         const auto docKey = DocumentBroker::getDocKey(uriPublic);
+        auto& shard = docBrokersShard(docKey);
         std::shared_ptr<DocumentBroker> docBroker;
 
+        // Cluster routing: every docKey has one owner instance, so all
+        // views of a document collaborate on the same host however the
+        // load balancer spread them. A mis-routed join is redirected
+        // before any state is created here. A document we already host
+        // keeps being served (the host list changed while it was open);
+        // it moves to its owner when it next loads, so a membership
+        // change migrates idle documents first and never interrupts a
+        // live edit.
+        if (LOOLWSD::ClusterEnabled)
+        {
+            const auto owner = clusterOwner(docKey);
+            if (owner != LOOLWSD::ClusterSelf)
+            {
+                bool hostedHere = false;
+                {
+                    std::unique_lock<std::mutex> docBrokersLock(shard.mutex);
+                    hostedHere = (shard.brokers.find(docKey) != shard.brokers.end());
+                }
+
+                if (!hostedHere)
+                {
+                    Log::info("DocKey [" + docKey + "] is owned by [" + owner + "]; redirecting.");
+                    const std::string redirect = "redirect: uri=" + owner;
+                    ws->sendFrame(redirect.data(), redirect.size());
+                    ws->shutdown();
+                    return;
+                }
+
+                Log::warn("DocKey [" + docKey + "] is owned by [" + owner +
+                          "] but still hosted here; serving it until it unloads.");
+            }
+        }
+
         // scope the docBrokersLock
         {
-            std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
+            std::unique_lock<std::mutex> docBrokersLock(shard.mutex);
 
             // Lookup this document.
-            auto it = docBrokers.find(docKey);
-            if (it != docBrokers.end())
+            auto it = shard.brokers.find(docKey);
+            if (it != shard.brokers.end())
             {
                 // Get the DocumentBroker from the Cache.
                 Log::debug("Found DocumentBroker for docKey [" + docKey + "].");
@@ -691,7 +1009,7 @@ private:
                 Log::debug("Inserting a dummy DocumentBroker for docKey [" + docKey + "] temporarily.");
 
                 std::shared_ptr<DocumentBroker> tempBroker = std::make_shared<DocumentBroker>();
-                docBrokers.emplace(docKey, tempBroker);
+                shard.brokers.emplace(docKey, tempBroker);
             }
         }
 
@@ -706,16 +1024,16 @@ private:
             {
                 std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
 
-                std::unique_lock<std::mutex> lock(docBrokersMutex);
-                auto it = docBrokers.find(docKey);
-                if (it == docBrokers.end())
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                auto it = shard.brokers.find(docKey);
+                if (it == shard.brokers.end())
                 {
                     // went away successfully
                     docBroker.reset();
                     Log::debug("Inserting a dummy DocumentBroker for docKey [" + docKey + "] temporarily after the other instance is gone.");
 
                     std::shared_ptr<DocumentBroker> tempBroker = std::make_shared<DocumentBroker>();
-                    docBrokers.emplace(docKey, tempBroker);
+                    shard.brokers.emplace(docKey, tempBroker);
 
                     timedOut = false;
                     break;
@@ -740,8 +1058,13 @@ private:
         if (!docBroker)
         {
             newDoc = true;
-            // Request a kit process for this doc.
-            auto child = getNewChild();
+            // Request a kit process for this doc. Waiting for a spare
+            // kit (or forking one) is its own stage on the load timeline.
+            std::shared_ptr<ChildProcess> child;
+            {
+                TraceSpan::Span span("wsd.kit.handoff", docKey);
+                child = getChildForDocument();
+            }
             if (!child)
             {
                 // Let the client know we can't serve now.
@@ -765,6 +1088,12 @@ private:
             child->setDocumentBroker(docBroker);
         }
 
+        // A hibernated document is revived before a new view joins it.
+        if (docBroker && docBroker->isHibernated())
+        {
+            docBroker->wakeUp();
+        }
+
         // Validate the broker.
         if (!docBroker || !docBroker->isAlive())
         {
@@ -772,8 +1101,8 @@ private:
             if (!newDoc)
             {
                 // Remove.
-                std::unique_lock<std::mutex> lock(docBrokersMutex);
-                docBrokers.erase(docKey);
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                shard.brokers.erase(docKey);
 #if MAX_DOCUMENTS > 0
                 --LOOLWSD::NumDocBrokers;
 #endif
@@ -788,59 +1117,109 @@ private:
 
         if (newDoc)
         {
-            std::unique_lock<std::mutex> lock(docBrokersMutex);
-            docBrokers[docKey] = docBroker;
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            shard.brokers[docKey] = docBroker;
         }
 
-        // Check if readonly session is required
+        // Check if readonly session is required, and whether the
+        // client is trying to resume a parked session.
         bool isReadOnly = false;
+        std::string resumeToken;
         for (const auto& param: uriPublic.getQueryParameters())
         {
             Log::debug("Query param: " + param.first + ", value: " + param.second);
             if (param.first == "permission")
                 isReadOnly = param.second == "readonly";
+            else if (param.first == "resumetoken")
+                resumeToken = param.second;
         }
 
         // Above this point exceptions are safe and will auto-cleanup.
         // Below this, we need to cleanup internal references.
         std::shared_ptr<ClientSession> session;
+        bool parked = false;
         try
         {
-            session = std::make_shared<ClientSession>(id, ws, docBroker, isReadOnly);
-            if (!fileinfo._userName.empty())
+            size_t sessionsCount = 0;
+            if (!resumeToken.empty() && LOOLWSD::SessionResumeSecs > 0)
             {
-                Log::debug(uriPublic.toString() + " requested with username [" + fileinfo._userName + "]");
-                session->setUserName(fileinfo._userName);
+                session = docBroker->takeParkedSession(resumeToken);
             }
 
-            // Request the child to connect to us and add this session.
-            auto sessionsCount = docBroker->addSession(session);
-            Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
+            if (session)
+            {
+                // The session, its kit view and the warm tile cache all
+                // survived the blip; skip the load handshake entirely.
+                Log::info("Resuming session [" + session->getId() + "] of docKey [" + docKey + "].");
+                session->setWebSocketDeflate(wsDeflate);
+                session->rebind(ws);
 
-            // indicator to a client that is waiting to connect to lokit process
-            status = "statusindicator: connect";
-            Log::trace("Sending to Client [" + status + "].");
-            ws->sendFrame(status.data(), (int) status.size());
+                status = "statusindicator: ready";
+                Log::trace("Sending to Client [" + status + "].");
+                ws->sendFrame(status.data(), (int) status.size());
 
-            // Wait until the client has connected with a prison socket.
-            waitBridgeCompleted(session);
+                // Tell the client its session state is intact: it only
+                // needs to re-request the tiles it is still missing,
+                // which the buffered invalidations point at.
+                status = "resumed:";
+                Log::trace("Sending to Client [" + status + "].");
+                ws->sendFrame(status.data(), (int) status.size());
+            }
+            else
+            {
+                if (!resumeToken.empty())
+                {
+                    Log::warn("Resume token for docKey [" + docKey +
+                              "] is unknown or expired; starting a fresh session.");
+                }
 
-            LOOLWSD::dumpEventTrace(docBroker->getJailId(), id, "NewSession: " + uri);
+                session = std::make_shared<ClientSession>(id, ws, docBroker, isReadOnly);
+                session->setWebSocketDeflate(wsDeflate);
+                if (!fileinfo._userName.empty())
+                {
+                    Log::debug(uriPublic.toString() + " requested with username [" + fileinfo._userName + "]");
+                    session->setUserName(fileinfo._userName);
+                }
 
-            // Now the bridge beetween the client and kit process is connected
-            status = "statusindicator: ready";
-            Log::trace("Sending to Client [" + status + "].");
-            ws->sendFrame(status.data(), (int) status.size());
+                // Request the child to connect to us and add this session.
+                sessionsCount = docBroker->addSession(session);
+                Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
 
-            Util::checkDiskSpaceOnRegisteredFileSystems();
+                // indicator to a client that is waiting to connect to lokit process
+                status = "statusindicator: connect";
+                Log::trace("Sending to Client [" + status + "].");
+                ws->sendFrame(status.data(), (int) status.size());
 
-            // If its a WOPI host, return time taken to make calls to it
-            const auto storageCallDuration = docBroker->getStorageLoadDuration();
-            if (storageCallDuration != std::chrono::duration<double>::zero())
-            {
-                status = "stats: wopiloadduration " + std::to_string(storageCallDuration.count());
+                // Wait until the client has connected with a prison socket.
+                waitBridgeCompleted(session);
+
+                LOOLWSD::dumpEventTrace(docBroker->getJailId(), id, "NewSession: " + uri);
+
+                // Now the bridge beetween the client and kit process is connected
+                status = "statusindicator: ready";
                 Log::trace("Sending to Client [" + status + "].");
                 ws->sendFrame(status.data(), (int) status.size());
+
+                if (LOOLWSD::SessionResumeSecs > 0)
+                {
+                    // The token the client presents to reattach after a
+                    // dropped socket, instead of reloading.
+                    status = "resume: token=" + session->getResumeToken() +
+                             " timeout=" + std::to_string(LOOLWSD::SessionResumeSecs);
+                    Log::trace("Sending to Client [" + status + "].");
+                    ws->sendFrame(status.data(), (int) status.size());
+                }
+
+                Util::checkDiskSpaceOnRegisteredFileSystems();
+
+                // If its a WOPI host, return time taken to make calls to it
+                const auto storageCallDuration = docBroker->getStorageLoadDuration();
+                if (storageCallDuration != std::chrono::duration<double>::zero())
+                {
+                    status = "stats: wopiloadduration " + std::to_string(storageCallDuration.count());
+                    Log::trace("Sending to Client [" + status + "].");
+                    ws->sendFrame(status.data(), (int) status.size());
+                }
             }
 
             // Let messages flow.
@@ -852,21 +1231,34 @@ private:
                 [&session]() { session->closeFrame(); },
                 []() { return !!TerminationFlag; });
 
+            // A socket that dropped without the close handshake may be
+            // a blip (laptop sleep, proxy timeout): keep the session
+            // parked for a resume instead of tearing it down.
+            const auto sessionId = session->getId();
+            if (!session->isCloseFrame() && !TerminationFlag &&
+                LOOLWSD::SessionResumeSecs > 0 &&
+                docBroker->parkSessionForResume(session))
+            {
+                parked = true;
+                sessionsCount = docBroker->getSessionsCount();
+            }
+            else
+            {
             // Connection terminated. Destroy session.
             {
-                std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
+                std::unique_lock<std::mutex> docBrokersLock(shard.mutex);
 
                 // We cannot destroy it, before save, if this is the last session.
                 // Otherwise, we may end up removing the one and only session.
                 bool removedSession = false;
 
                 // We issue a force-save when last editable (non-readonly) session is going away
-                const bool forceSave = docBroker->startDestroy(id);
+                const bool forceSave = docBroker->startDestroy(sessionId);
 
                 sessionsCount = docBroker->getSessionsCount();
                 if (sessionsCount > 1)
                 {
-                    sessionsCount = docBroker->removeSession(id);
+                    sessionsCount = docBroker->removeSession(sessionId);
                     removedSession = true;
                     Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
                 }
@@ -886,25 +1278,26 @@ private:
 
                 if (!removedSession)
                 {
-                    sessionsCount = docBroker->removeSession(id);
+                    sessionsCount = docBroker->removeSession(sessionId);
                     Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
                 }
             }
 
             if (sessionsCount == 0)
             {
-                std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
+                std::unique_lock<std::mutex> docBrokersLock(shard.mutex);
                 Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
-                docBrokers.erase(docKey);
+                shard.brokers.erase(docKey);
 #if MAX_DOCUMENTS > 0
                 --LOOLWSD::NumDocBrokers;
 #endif
                 Log::info("Removing complete doc [" + docKey + "] from Admin.");
                 Admin::instance().rmDoc(docKey);
             }
+            }
 
-            LOOLWSD::dumpEventTrace(docBroker->getJailId(), id, "EndSession: " + uri);
-            Log::info("Finishing GET request handler for session [" + id + "].");
+            LOOLWSD::dumpEventTrace(docBroker->getJailId(), sessionId, "EndSession: " + uri);
+            Log::info("Finishing GET request handler for session [" + sessionId + "].");
         }
         catch (const WebSocketErrorMessageException&)
         {
@@ -915,7 +1308,12 @@ private:
             Log::error("Error in client request handler: " + std::string(exc.what()));
         }
 
-        if (session->isCloseFrame())
+        if (parked)
+        {
+            // The session lives on awaiting a resume; only this
+            // socket is done. In particular the kit peer stays up.
+        }
+        else if (session->isCloseFrame())
         {
             Log::trace("Normal close handshake.");
             if (session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE))
@@ -980,6 +1378,18 @@ private:
         return true;
     }
 
+    /// Sends the monitoring counters in Prometheus text format.
+    /// Reads only atomics; a scrape never takes a server lock.
+    static bool handleGetMetrics(HTTPServerResponse& response)
+    {
+        const auto body = Metrics::toPrometheusText();
+        response.setContentLength(body.size());
+        response.setContentType("text/plain; version=0.0.4");
+        response.setChunkedTransferEncoding(false);
+        response.send() << body;
+        return true;
+    }
+
 public:
 
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override
@@ -1055,6 +1465,10 @@ public:
                 // http://server/hosting/discovery
                 responded = handleGetWOPIDiscovery(request, response);
             }
+            else if (request.getMethod() == HTTPRequest::HTTP_GET && request.getURI() == "/lool/metrics")
+            {
+                responded = handleGetMetrics(response);
+            }
             else if (!(request.find("Upgrade") != request.end() && Poco::icompare(request["Upgrade"], "websocket") == 0) &&
                      reqPathTokens.count() > 0 && reqPathTokens[0] == "lool")
             {
@@ -1063,6 +1477,9 @@ public:
             }
             else if (reqPathTokens.count() > 2 && reqPathTokens[0] == "lool" && reqPathTokens[2] == "ws")
             {
+                // Must negotiate before constructing the WebSocket,
+                // which sends the upgrade response.
+                const bool wsDeflate = IoUtil::negotiateWebSocketDeflate(request, response);
                 auto ws = std::make_shared<WebSocket>(request, response);
                 responded = true; // After upgrading to WS we should not set HTTP response.
                 try
@@ -1072,7 +1489,7 @@ public:
                     ws->setSendTimeout(WS_SEND_TIMEOUT_MICROSECS);
                     std::string decodedUri;
                     URI::decode(reqPathTokens[1], decodedUri);
-                    handleGetRequest(decodedUri, ws, id);
+                    handleGetRequest(decodedUri, ws, id, wsDeflate);
                 }
                 catch (const WebSocketErrorMessageException& exc)
                 {
@@ -1225,13 +1642,12 @@ public:
 
             std::shared_ptr<DocumentBroker> docBroker;
             {
-                // This lock could become a bottleneck.
-                // In that case, we can use a pool and index by publicPath.
-                std::unique_lock<std::mutex> lock(docBrokersMutex);
+                auto& shard = docBrokersShard(docKey);
+                std::unique_lock<std::mutex> lock(shard.mutex);
 
                 // Lookup this document.
-                auto it = docBrokers.find(docKey);
-                if (it != docBrokers.end())
+                auto it = shard.brokers.find(docKey);
+                if (it != shard.brokers.end())
                 {
                     // Get the DocumentBroker from the Cache.
                     docBroker = it->second;
@@ -1270,14 +1686,20 @@ public:
                 throw;
             }
 
-            std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
-            AvailableChildSessions.emplace(sessionId, session);
+            // When the bridge is re-established after hibernation, no
+            // client handler waits on it; replay the load instead of
+            // handing the session over.
+            if (!docBroker->resumeSession(sessionId))
+            {
+                std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
+                AvailableChildSessions.emplace(sessionId, session);
 
-            Log::info() << " mapped " << session << " jailId=" << jailId << ", id=" << sessionId
-                        << " into _availableChildSessions, size=" << AvailableChildSessions.size() << Log::end;
+                Log::info() << " mapped " << session << " jailId=" << jailId << ", id=" << sessionId
+                            << " into _availableChildSessions, size=" << AvailableChildSessions.size() << Log::end;
 
-            lock.unlock();
-            AvailableChildSessionCV.notify_one();
+                lock.unlock();
+                AvailableChildSessionCV.notify_one();
+            }
 
             Log::info("Adding doc " + docKey + " to Admin");
             Admin::instance().addDoc(docKey, pid, docBroker->getFilename(), sessionId);
@@ -1467,6 +1889,16 @@ Util::RuntimeConstant<bool> LOOLWSD::SSLTermination;
 static std::string UnitTestLibrary;
 
 unsigned int LOOLWSD::NumPreSpawnedChildren = 0;
+unsigned int LOOLWSD::MaxPreSpawnedChildren = 0;
+unsigned int LOOLWSD::HibernateIdleSecs = 0;
+unsigned int LOOLWSD::SessionResumeSecs = 0;
+unsigned int LOOLWSD::MaxConvertJobs = 4;
+bool LOOLWSD::MultiDocKits = false;
+bool LOOLWSD::ClusterEnabled = false;
+std::vector<std::string> LOOLWSD::ClusterHosts;
+std::string LOOLWSD::ClusterSelf;
+unsigned int LOOLWSD::MaxDocsPerKit = 4;
+unsigned int LOOLWSD::TilePrefetchRing = 1;
 std::atomic<unsigned> LOOLWSD::NumDocBrokers;
 std::atomic<unsigned> LOOLWSD::NumConnections;
 std::unique_ptr<TraceFileWriter> LOOLWSD::TraceDumper;
@@ -1517,8 +1949,25 @@ void LOOLWSD::initialize(Application& self)
         { "server_name", "" },
         { "file_server_root_path", "../loleaflet/../" },
         { "num_prespawn_children", "1" },
+        { "max_prespawn_children", "16" },
+        { "warmup_documents", "false" },
+        { "multidoc.enable", "false" },
+        { "multidoc.max_documents", "4" },
+        { "per_document.banded_rendering", "false" },
+        { "per_document.idle_trim_secs", "300" },
         { "per_document.max_concurrency", "4" },
+        { "per_document.hibernate_idle_secs", "3600" },
+        { "session_resume_secs", "60" },
+        { "convert_to.max_concurrency", "4" },
+        { "cluster.enable", "false" },
+        { "cluster.this_host", "" },
+        { "kit_cgroup.enable", "false" },
+        { "kit_cgroup.cpu_parent", "" },
+        { "kit_cgroup.cpu_shares", "0" },
+        { "kit_cgroup.memory_parent", "" },
+        { "kit_cgroup.memory_limit_mb", "0" },
         { "loleaflet_html", "loleaflet.html" },
+        { "trace_spans", "" },
         { "logging.color", "true" },
         { "logging.level", "trace" },
         { "ssl.enable", "true" },
@@ -1604,6 +2053,14 @@ void LOOLWSD::initialize(Application& self)
 
     Log::initialize("wsd", logLevel, withColor, logToFile, logProperties);
 
+    // Cross-process span tracing: the kits inherit the envvar via forkit.
+    const auto traceSpansPath = getConfigValue<std::string>(conf, "trace_spans", "");
+    if (!traceSpansPath.empty())
+    {
+        setenv("LOOL_TRACE_SPANS", traceSpansPath.c_str(), true);
+        Log::info("Tracing pipeline spans to: " + traceSpansPath);
+    }
+
 #if ENABLE_SSL
     LOOLWSD::SSLEnabled.set(getConfigValue<bool>(conf, "ssl.enable", true));
 #else
@@ -1633,6 +2090,90 @@ void LOOLWSD::initialize(Application& self)
     FileServerRoot = getPathFromConfig("file_server_root_path");
     NumPreSpawnedChildren = getConfigValue<unsigned int>(conf, "num_prespawn_children", 1);
 
+    // Ceiling for the adaptive prespawn controller.
+    MaxPreSpawnedChildren = getConfigValue<unsigned int>(conf, "max_prespawn_children", 16);
+    MaxPreSpawnedChildren = std::max(MaxPreSpawnedChildren, NumPreSpawnedChildren);
+
+    // Host several documents per kit process to raise density.
+    MultiDocKits = getConfigValue<bool>(conf, "multidoc.enable", false);
+    MaxDocsPerKit = std::max(getConfigValue<unsigned int>(conf, "multidoc.max_documents", 4), 1u);
+
+    // Idle documents hibernate (save and release their kit); 0 disables.
+    HibernateIdleSecs = getConfigValue<unsigned int>(conf, "per_document.hibernate_idle_secs", 3600);
+
+    // Dropped sessions linger this long waiting for a resume; 0 disables.
+    SessionResumeSecs = getConfigValue<unsigned int>(conf, "session_resume_secs", 60);
+
+    // Parallel conversion jobs admitted on the convert-to endpoint; 0 for unlimited.
+    MaxConvertJobs = getConfigValue<unsigned int>(conf, "convert_to.max_concurrency", 4);
+
+    // Consistent-hash document routing across several loolwsd instances.
+    ClusterEnabled = getConfigValue<bool>(conf, "cluster.enable", false);
+    if (ClusterEnabled)
+    {
+        ClusterSelf = getConfigValue<std::string>(conf, "cluster.this_host", "");
+        ClusterHosts.clear();
+        for (size_t i = 0; ; ++i)
+        {
+            const std::string path = "cluster.host[" + std::to_string(i) + "]";
+            const auto host = getConfigValue<std::string>(conf, path, "");
+            if (!host.empty())
+            {
+                Log::info("Adding cluster host: [" + host + "].");
+                ClusterHosts.push_back(host);
+            }
+            else if (!conf.has(path))
+            {
+                break;
+            }
+        }
+
+        if (ClusterSelf.empty() ||
+            std::find(ClusterHosts.begin(), ClusterHosts.end(), ClusterSelf) == ClusterHosts.end())
+        {
+            Log::error("cluster.this_host is empty or not in the cluster host list; "
+                       "disabling cluster routing.");
+            ClusterEnabled = false;
+        }
+    }
+
+    // Speculatively render a ring of tiles around each viewport; 0 disables.
+    TilePrefetchRing = getConfigValue<unsigned int>(conf, "tile_prefetch_ring", 1);
+
+    const auto tileCacheMemorySizeMb =
+        getConfigValue<unsigned int>(conf, "tile_cache_memory_size_mb",
+                                     DEFAULT_TILE_CACHE_MEMORY_SIZE / (1024 * 1024));
+    TileCache::setMaxMemorySize(static_cast<size_t>(tileCacheMemorySizeMb) * 1024 * 1024);
+
+    const auto tileCacheSizeMb =
+        getConfigValue<unsigned int>(conf, "tile_cache_size_mb",
+                                     DEFAULT_TILE_CACHE_STORE_SIZE / (1024 * 1024));
+    TileCache::setMaxStoreSize(static_cast<size_t>(tileCacheSizeMb) * 1024 * 1024);
+
+    const auto tileCacheGlobalSizeMb =
+        getConfigValue<unsigned int>(conf, "tile_cache_global_size_mb",
+                                     DEFAULT_TILE_CACHE_GLOBAL_SIZE / (1024 * 1024));
+    TileCache::setMaxGlobalStoreSize(static_cast<size_t>(tileCacheGlobalSizeMb) * 1024 * 1024);
+
+    // Ask the kit processes to pre-open each major document class.
+    if (getConfigValue<bool>(conf, "warmup_documents", false))
+    {
+        setenv("LOOL_WARMUP_DOCS", "1", 1);
+    }
+
+    // Paint large combined tile areas in bands in the kits.
+    if (getConfigValue<bool>(conf, "per_document.banded_rendering", false))
+    {
+        setenv("LOOL_BANDED_RENDERING", "1", 1);
+    }
+
+    // Idle kits trim their memory; 0 disables.
+    const auto idleTrimSecs = getConfigValue<unsigned int>(conf, "per_document.idle_trim_secs", 300);
+    if (idleTrimSecs > 0)
+    {
+        setenv("LOOL_IDLE_TRIM_SECS", std::to_string(idleTrimSecs).c_str(), 1);
+    }
+
     const auto maxConcurrency = getConfigValue<unsigned int>(conf, "per_document.max_concurrency", 4);
     if (maxConcurrency > 0)
     {
@@ -1864,6 +2405,28 @@ Process::PID LOOLWSD::createForKit()
     args.push_back("--lotemplate=" + LoTemplate);
     args.push_back("--childroot=" + ChildRoot);
     args.push_back("--clientport=" + std::to_string(ClientPortNumber));
+
+    // Optional cgroup placement of the kits, configured per deployment.
+    auto& conf = Application::instance().config();
+    if (getConfigValue<bool>(conf, "kit_cgroup.enable", false))
+    {
+        const auto cpuParent = getConfigValue<std::string>(conf, "kit_cgroup.cpu_parent", "");
+        if (!cpuParent.empty())
+        {
+            args.push_back("--cgroupcpuparent=" + cpuParent);
+            args.push_back("--cgroupcpushares=" +
+                           std::to_string(getConfigValue<unsigned int>(conf, "kit_cgroup.cpu_shares", 0)));
+        }
+
+        const auto memParent = getConfigValue<std::string>(conf, "kit_cgroup.memory_parent", "");
+        if (!memParent.empty())
+        {
+            args.push_back("--cgroupmemparent=" + memParent);
+            args.push_back("--cgroupmemlimitmb=" +
+                           std::to_string(getConfigValue<unsigned int>(conf, "kit_cgroup.memory_limit_mb", 0)));
+        }
+    }
+
     if (UnitWSD::get().hasKitHooks())
         args.push_back("--unitlib=" + UnitTestLibrary);
     if (DisplayVersion)
@@ -1968,7 +2531,13 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     if (!psvs)
         return Application::EXIT_SOFTWARE;
 
-    ThreadPool threadPool(NumPreSpawnedChildren*6, MAX_SESSIONS * 2);
+    // Each connection occupies a mostly-idle thread blocked in
+    // receiveFrame, so at high session counts the default (multi-MB)
+    // thread stacks dominate the address space. The handlers are
+    // shallow; a quarter MB is plenty.
+    constexpr int ServerThreadStackSize = 256 * 1024;
+
+    ThreadPool threadPool(NumPreSpawnedChildren*6, MAX_SESSIONS * 2, 60, ServerThreadStackSize);
     HTTPServer srv(new ClientRequestHandlerFactory(), threadPool, *psvs, params1);
     Log::info("Starting master server listening on " + std::to_string(ClientPortNumber));
     srv.start();
@@ -2069,10 +2638,40 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
                 {
                     try
                     {
-                        std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
-                        for (auto& brokerIt : docBrokers)
+                        // Walk a snapshot: saving or hibernating one
+                        // document must not block opens of any other.
+                        for (auto& brokerIt : getDocBrokersSnapshot())
                         {
                             brokerIt.second->autoSave(false, 0);
+
+                            // Tear down parked sessions whose resume window
+                            // passed; unload the document if none remain.
+                            if (LOOLWSD::SessionResumeSecs > 0 &&
+                                brokerIt.second->expireParkedSessions(LOOLWSD::SessionResumeSecs) > 0 &&
+                                brokerIt.second->getSessionsCount() == 0)
+                            {
+                                Log::info("Last parked session of [" + brokerIt.first +
+                                          "] expired; unloading the document.");
+                                brokerIt.second->autoSave(true, COMMAND_TIMEOUT_MS);
+
+                                auto& shard = docBrokersShard(brokerIt.first);
+                                std::unique_lock<std::mutex> lock(shard.mutex);
+                                shard.brokers.erase(brokerIt.first);
+#if MAX_DOCUMENTS > 0
+                                --LOOLWSD::NumDocBrokers;
+#endif
+                                Admin::instance().rmDoc(brokerIt.first);
+                                continue;
+                            }
+
+                            // Evict the kit of a long-idle document; it revives
+                            // transparently on the next client message.
+                            if (LOOLWSD::HibernateIdleSecs > 0 &&
+                                !brokerIt.second->isHibernated() &&
+                                brokerIt.second->getIdleTimeMs() >= LOOLWSD::HibernateIdleSecs * 1000.)
+                            {
+                                brokerIt.second->hibernate();
+                            }
                         }
                     }
                     catch (const std::exception& exc)
@@ -2142,6 +2741,7 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     return returnValue;
 }
 
+#if ENABLE_UNIT_HOOKS
 void UnitWSD::testHandleRequest(TestRequest type, UnitHTTPServerRequest& request, UnitHTTPServerResponse& response)
 {
     switch (type)
@@ -2157,15 +2757,14 @@ void UnitWSD::testHandleRequest(TestRequest type, UnitHTTPServerRequest& request
         break;
     }
 }
+#endif
 
 namespace Util
 {
 
 void alertAllUsers(const std::string& cmd, const std::string& kind)
 {
-    std::lock_guard<std::mutex> docBrokersLock(docBrokersMutex);
-
-    for (auto& brokerIt : docBrokers)
+    for (auto& brokerIt : getDocBrokersSnapshot())
     {
         brokerIt.second->alertAllUsersOfDocument(cmd, kind);
     }
@@ -13,6 +13,7 @@
 #include <atomic>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include <Poco/Path.h>
 #include <Poco/Process.h>
@@ -39,6 +40,16 @@ public:
     // so just keep these as statics.
     static std::atomic<unsigned> NextSessionId;
     static unsigned int NumPreSpawnedChildren;
+    static unsigned int MaxPreSpawnedChildren;
+    static unsigned int HibernateIdleSecs;
+    static unsigned int SessionResumeSecs;
+    static unsigned int MaxConvertJobs;
+    static bool MultiDocKits;
+    static unsigned int MaxDocsPerKit;
+    static bool ClusterEnabled;
+    static std::vector<std::string> ClusterHosts;
+    static std::string ClusterSelf;
+    static unsigned int TilePrefetchRing;
     static bool NoCapsForKit;
     static int ForKitWritePipe;
     static std::string Cache;
@@ -70,6 +81,11 @@ public:
         return LOOLWSD::SSLTermination.get();
     }
 
+    /// Take a spare kit process from the prespawned pool, replenishing
+    /// it. Used by DocumentBroker to wake hibernated documents.
+    static
+    std::shared_ptr<ChildProcess> getNewChild();
+
     static
     void dumpEventTrace(const std::string& pId, const std::string& sessionId, const std::string& data);
 
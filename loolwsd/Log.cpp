@@ -7,13 +7,20 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <pthread.h>
 #include <sys/prctl.h>
 
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
 #include <iomanip>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <sys/syscall.h>
 #include <unistd.h>
@@ -52,6 +59,143 @@ namespace Log
     };
     static StaticNames Source;
 
+    std::string prefix(const char* level);
+
+    /// Asynchronous logging backend: emitters enqueue the formatted
+    /// line and a dedicated thread feeds the Poco channel, so the
+    /// hot path pays a queue push instead of a channel lock plus a
+    /// write syscall. The queue is bounded; on overflow messages are
+    /// dropped and the drop count is reported by the writer.
+    class AsyncWriter
+    {
+    public:
+        AsyncWriter() :
+            _stop(false),
+            _dropped(0)
+        {
+            // The writer thread does not survive fork(); re-arm it
+            // in the child so forked kits keep logging asynchronously.
+            pthread_atfork(&AsyncWriter::prepareFork, &AsyncWriter::completeForkParent,
+                           &AsyncWriter::completeForkChild);
+            _thread = std::thread(&AsyncWriter::run, this);
+        }
+
+        ~AsyncWriter()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+
+            _cv.notify_one();
+            if (_thread.joinable())
+            {
+                _thread.join();
+            }
+        }
+
+        void enqueue(const Poco::Message::Priority priority, std::string text)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_queue.size() >= MaxQueueSize)
+                {
+                    ++_dropped;
+                    return;
+                }
+
+                _queue.emplace_back(priority, std::move(text));
+            }
+
+            _cv.notify_one();
+        }
+
+    private:
+        static AsyncWriter& instance();
+
+        static void prepareFork()
+        {
+            instance()._mutex.lock();
+        }
+
+        static void completeForkParent()
+        {
+            instance()._mutex.unlock();
+        }
+
+        static void completeForkChild()
+        {
+            auto& writer = instance();
+            writer._mutex.unlock();
+            // Pending messages belong to the parent, which will
+            // write them itself.
+            writer._queue.clear();
+            writer._thread.detach();
+            writer._thread = std::thread(&AsyncWriter::run, &writer);
+        }
+
+        void run()
+        {
+            prctl(PR_SET_NAME, reinterpret_cast<unsigned long>("log_writer"), 0, 0, 0);
+
+            std::vector<std::pair<Poco::Message::Priority, std::string>> batch;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _cv.wait(lock, [this]() { return _stop || !_queue.empty(); });
+                    if (_queue.empty())
+                    {
+                        // Stopping, and everything queued has been written.
+                        break;
+                    }
+
+                    batch.assign(std::make_move_iterator(_queue.begin()),
+                                 std::make_move_iterator(_queue.end()));
+                    _queue.clear();
+                }
+
+                auto& log = logger();
+                for (auto& item : batch)
+                {
+                    log.log(Poco::Message(log.name(), item.second, item.first));
+                }
+
+                const auto dropped = _dropped.exchange(0);
+                if (dropped > 0)
+                {
+                    log.log(Poco::Message(log.name(),
+                                          prefix("WRN") + "Logger dropped " + std::to_string(dropped) +
+                                          " messages on queue overflow.",
+                                          Poco::Message::PRIO_WARNING));
+                }
+
+                batch.clear();
+            }
+        }
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::deque<std::pair<Poco::Message::Priority, std::string>> _queue;
+        std::thread _thread;
+        bool _stop;
+        std::atomic<unsigned> _dropped;
+
+        static const std::size_t MaxQueueSize = 32 * 1024;
+    };
+
+    static AsyncWriter& asyncWriter()
+    {
+        static AsyncWriter writer;
+        return writer;
+    }
+
+    AsyncWriter& AsyncWriter::instance()
+    {
+        return asyncWriter();
+    }
+
     // We need a signal safe means of writing messages
     //   $ man 7 signal
     void signalLog(const char *message)
@@ -159,34 +303,45 @@ namespace Log
 
     void trace(const std::string& msg)
     {
-        logger().trace(prefix("TRC") + msg);
+        if (logger().is(Poco::Message::PRIO_TRACE))
+            asyncWriter().enqueue(Poco::Message::PRIO_TRACE, prefix("TRC") + msg);
     }
 
     void debug(const std::string& msg)
     {
-        logger().debug(prefix("DBG") + msg);
+        if (logger().is(Poco::Message::PRIO_DEBUG))
+            asyncWriter().enqueue(Poco::Message::PRIO_DEBUG, prefix("DBG") + msg);
     }
 
     void info(const std::string& msg)
     {
-        logger().information(prefix("INF") + msg);
+        if (logger().is(Poco::Message::PRIO_INFORMATION))
+            asyncWriter().enqueue(Poco::Message::PRIO_INFORMATION, prefix("INF") + msg);
     }
 
     void warn(const std::string& msg)
     {
-        logger().warning(prefix("WRN") + msg);
+        if (logger().is(Poco::Message::PRIO_WARNING))
+            asyncWriter().enqueue(Poco::Message::PRIO_WARNING, prefix("WRN") + msg);
     }
 
+    // Errors go through the queue too, to keep them ordered with
+    // the messages that led up to them.
     void error(const std::string& msg)
     {
-        logger().error(prefix("ERR") + msg);
+        if (logger().is(Poco::Message::PRIO_ERROR))
+            asyncWriter().enqueue(Poco::Message::PRIO_ERROR, prefix("ERR") + msg);
     }
 
     void syserror(const std::string& msg)
     {
-        logger().error(prefix("ERR") + msg + " (errno: " + std::string(std::strerror(errno)) + ")");
+        if (logger().is(Poco::Message::PRIO_ERROR))
+            asyncWriter().enqueue(Poco::Message::PRIO_ERROR,
+                                  prefix("ERR") + msg + " (errno: " + std::string(std::strerror(errno)) + ")");
     }
 
+    // Fatal errors are written synchronously: the process may not
+    // live long enough for the writer thread to drain them.
     void fatal(const std::string& msg)
     {
         logger().fatal(prefix("FTL") + msg);
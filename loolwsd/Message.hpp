@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_MESSAGE_HPP
+#define INCLUDED_MESSAGE_HPP
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "LOOLProtocol.hpp"
+
+/// An immutable message payload, shared (via shared_ptr) between all
+/// the sessions it is delivered to: fanning a message out to N views
+/// distributes pointers, while the bytes and the pre-parsed header
+/// exist only once.
+class Message
+{
+public:
+    enum class Type { Text, Binary };
+
+    Message(const char* data, const size_t size, const Type type) :
+        _data(data, data + size),
+        _firstLine(LOOLProtocol::getFirstLine(data, size)),
+        _firstToken(LOOLProtocol::getFirstToken(data, static_cast<int>(size), ' ')),
+        _type(type)
+    {
+    }
+
+    Message(const std::string& message, const Type type) :
+        Message(message.data(), message.size(), type)
+    {
+    }
+
+    /// Takes ownership of the given buffer, avoiding a copy.
+    Message(std::vector<char>&& data, const Type type) :
+        _data(std::move(data)),
+        _firstLine(LOOLProtocol::getFirstLine(_data)),
+        _firstToken(LOOLProtocol::getFirstToken(_data)),
+        _type(type)
+    {
+    }
+
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+
+    const char* data() const { return _data.data(); }
+    size_t size() const { return _data.size(); }
+
+    /// The first line, parsed once at construction.
+    const std::string& firstLine() const { return _firstLine; }
+
+    /// The first token, parsed once at construction.
+    const std::string& firstToken() const { return _firstToken; }
+
+    bool isBinary() const { return _type == Type::Binary; }
+
+    /// An abbreviated version of the payload, for logging.
+    std::string abbreviation() const { return LOOLProtocol::getAbbreviatedMessage(_data); }
+
+    /// Microseconds since the message was constructed; the queue
+    /// wait, by the time the message reaches a socket.
+    uint64_t elapsedMicros() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - _ctime).count();
+    }
+
+private:
+    const std::vector<char> _data;
+    const std::string _firstLine;
+    const std::string _firstToken;
+    const Type _type;
+    const std::chrono::steady_clock::time_point _ctime = std::chrono::steady_clock::now();
+};
+
+using MessagePtr = std::shared_ptr<const Message>;
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
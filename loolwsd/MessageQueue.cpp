@@ -10,15 +10,94 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <cstdint>
+#include <set>
 
 #include <Poco/StringTokenizer.h>
 
 #include <LOOLProtocol.hpp>
 #include <Log.hpp>
+#include <Rectangle.hpp>
 #include <TileDesc.hpp>
 
 using Poco::StringTokenizer;
 
+namespace
+{
+
+/// Splits a "callback <viewId> <type> <payload>" message.
+bool splitCallback(const std::string& msg, std::string& viewId, int& type, std::string& payload)
+{
+    const auto first = msg.find(' ');
+    const auto second = msg.find(' ', first + 1);
+    const auto third = msg.find(' ', second + 1);
+    if (first == std::string::npos || second == std::string::npos || third == std::string::npos)
+    {
+        return false;
+    }
+
+    viewId = msg.substr(first + 1, second - first - 1);
+    try
+    {
+        type = std::stoi(msg.substr(second + 1, third - second - 1));
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+
+    payload = msg.substr(third + 1);
+    return true;
+}
+
+/// Parses an invalidation payload "x, y, width, height[, part]";
+/// part is -1 when not present.
+bool parseInvalidationRect(const std::string& payload, Util::Rectangle& rect, int& part)
+{
+    StringTokenizer tokens(payload, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    if (tokens.count() != 4 && tokens.count() != 5)
+    {
+        return false;
+    }
+
+    try
+    {
+        rect = Util::Rectangle(std::stoi(tokens[0]), std::stoi(tokens[1]),
+                               std::stoi(tokens[2]), std::stoi(tokens[3]));
+        part = (tokens.count() == 5 ? std::stoi(tokens[4]) : -1);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool intersects(const Util::Rectangle& a, const Util::Rectangle& b)
+{
+    return a._x1 <= b._x2 && b._x1 <= a._x2 &&
+           a._y1 <= b._y2 && b._y1 <= a._y2;
+}
+
+/// The cover set a merged invalidation burst is reduced towards;
+/// above this, the least-wasteful pair is united unconditionally.
+constexpr size_t MaxInvalidationRects = 4;
+
+/// Bursts larger than this skip the pairwise merge (it is quadratic)
+/// and collapse straight to one bounding box per part.
+constexpr size_t MaxInvalidationSweep = 64;
+
+/// Deadline budgets, in milliseconds, per payload class. A queued
+/// tile is due this long after it was enqueued; within the cursor
+/// class the more recently active view is due a millisecond sooner
+/// per rank, preserving the view ordering. Previews have no budget:
+/// they render only when nothing else is pending.
+constexpr int CursorTileDeadlineMs = 50;
+constexpr int TileDeadlineMs = 250;
+
+}
+
 MessageQueue::~MessageQueue()
 {
     clear();
@@ -26,41 +105,167 @@ MessageQueue::~MessageQueue()
 
 void MessageQueue::put(const Payload& value)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    put_impl(value);
-    lock.unlock();
-    _cv.notify_one();
+    if (enqueueRing(value))
+    {
+        // Move it (and anything else pending) into the queue right
+        // away when nobody else is busy with the queue; under
+        // contention leave that to whoever holds the lock.
+        std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+        if (lock.owns_lock())
+        {
+            drainRing_impl();
+        }
+    }
+    else
+    {
+        // Ring full: fall back to the locked path, draining first to
+        // preserve ordering.
+        std::unique_lock<std::mutex> lock(_mutex);
+        drainRing_impl();
+        put_impl(value);
+    }
+
+    wakeConsumer();
 }
 
-MessageQueue::Payload MessageQueue::get(const unsigned timeoutMs)
+bool MessageQueue::enqueueRing(const Payload& value)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        RingCell& cell = _ring[pos & (RingSize - 1)];
+        const size_t seq = cell.seq.load(std::memory_order_acquire);
+        const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.data = value;
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Full.
+            return false;
+        }
+        else
+        {
+            // Another producer took this slot; retry.
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void MessageQueue::drainRing_impl()
+{
+    for (;;)
+    {
+        RingCell& cell = _ring[_dequeuePos & (RingSize - 1)];
+        if (cell.seq.load(std::memory_order_acquire) != _dequeuePos + 1)
+        {
+            // Nothing published (the next producer hasn't finished yet).
+            break;
+        }
+
+        put_impl(cell.data);
+        cell.data = Payload();
+        cell.seq.store(_dequeuePos + RingSize, std::memory_order_release);
+        ++_dequeuePos;
+    }
+}
+
+void MessageQueue::wakeConsumer()
+{
+    // Pair with the fence in get(): after publishing, decide whether
+    // the consumer is (or is about to go) asleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_consumerWaiting.load(std::memory_order_relaxed))
+    {
+        // Serialize against the consumer's check-then-sleep: once we
+        // get the mutex, it is actually waiting on the cv.
+        std::unique_lock<std::mutex> lock(_mutex);
+        lock.unlock();
+        _cv.notify_one();
+    }
+}
+
+void MessageQueue::waitForMessage(std::unique_lock<std::mutex>& lock, const unsigned timeoutMs)
+{
+    const auto pred = [this]
+    {
+        drainRing_impl();
+        if (wait_impl())
+        {
+            _consumerWaiting.store(false, std::memory_order_relaxed);
+            return true;
+        }
+
+        // Tell the producers we are about to sleep, then look once
+        // more for anything they published in between.
+        _consumerWaiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        drainRing_impl();
+        if (wait_impl())
+        {
+            _consumerWaiting.store(false, std::memory_order_relaxed);
+            return true;
+        }
+
+        return false;
+    };
 
     if (timeoutMs > 0)
     {
-        if (!_cv.wait_for(lock, std::chrono::milliseconds(timeoutMs),
-                          [this] { return wait_impl(); }))
+        if (!_cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred))
         {
+            _consumerWaiting.store(false, std::memory_order_relaxed);
             throw std::runtime_error("Timed out waiting to get queue item.");
         }
     }
     else
     {
-        _cv.wait(lock, [this] { return wait_impl(); });
+        _cv.wait(lock, pred);
     }
+}
+
+MessageQueue::Payload MessageQueue::get(const unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    waitForMessage(lock, timeoutMs);
 
     return get_impl();
 }
 
+std::vector<MessageQueue::Payload> MessageQueue::get_batch(const unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    waitForMessage(lock, timeoutMs);
+
+    std::vector<Payload> batch;
+    do
+    {
+        batch.emplace_back(get_impl());
+    }
+    while (wait_impl());
+
+    return batch;
+}
+
 void MessageQueue::clear()
 {
     std::unique_lock<std::mutex> lock(_mutex);
+    drainRing_impl();
     clear_impl();
 }
 
 void MessageQueue::remove_if(const std::function<bool(const Payload&)>& pred)
 {
     std::unique_lock<std::mutex> lock(_mutex);
+    drainRing_impl();
     std::remove_if(_queue.begin(), _queue.end(), pred);
 }
 
@@ -98,24 +303,28 @@ void TileQueue::put_impl(const Payload& value)
         Log::trace() << "Before canceltiles have " << _queue.size() << " in queue." << Log::end;
         const auto seqs = msg.substr(12);
         StringTokenizer tokens(seqs, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-        _queue.erase(std::remove_if(_queue.begin(), _queue.end(),
-                [&tokens](const Payload& v)
-                {
-                    const std::string s(v.data(), v.size());
-                    for (size_t i = 0; i < tokens.count(); ++i)
-                    {
-                        if (s.find("ver=" + tokens[i]) != std::string::npos)
-                        {
-                            Log::trace("Matched " + tokens[i] + ", Removing [" + s + "]");
-                            return true;
-                        }
-                    }
-
-                    return false;
+        std::set<int> versions;
+        for (size_t i = 0; i < tokens.count(); ++i)
+        {
+            versions.insert(std::stoi(tokens[i]));
+        }
 
-                }), _queue.end());
+        for (size_t i = 0; i < _queue.size(); )
+        {
+            if (_parsed[i] && versions.find(_parsed[i]->getVersion()) != versions.end())
+            {
+                Log::trace() << "Matched " << _parsed[i]->getVersion() << ", Removing ["
+                             << std::string(_queue[i].data(), _queue[i].size()) << "]" << Log::end;
+                eraseEntry(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
 
         // Don't push canceltiles into the queue.
+        rebuildTileKeys();
         Log::trace() << "After canceltiles have " << _queue.size() << " in queue." << Log::end;
         return;
     }
@@ -127,31 +336,147 @@ void TileQueue::put_impl(const Payload& value)
         for (auto& tile : tileCombined.getTiles())
         {
             const std::string newMsg = tile.serialize("tile");
+            const auto key = tileKey(newMsg);
 
-            removeDuplicate(newMsg);
+            removeDuplicate(newMsg, key);
 
+            _tileKeys[key] = _queue.size();
+            _parsed.push_back(std::make_shared<TileDesc>(tile));
+            _priorities.push_back(priority(tile));
+            _times.push_back(std::chrono::steady_clock::now());
             MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
         }
         return;
     }
     else if (firstToken == "tile")
     {
-        removeDuplicate(msg);
-
+        const auto key = tileKey(msg);
+        removeDuplicate(msg, key);
+
+        _tileKeys[key] = _queue.size();
+        // Parse once here; everything downstream uses the TileDesc.
+        auto desc = std::make_shared<TileDesc>(TileDesc::parse(msg));
+        _priorities.push_back(priority(*desc));
+        _parsed.push_back(std::move(desc));
+        _times.push_back(std::chrono::steady_clock::now());
         MessageQueue::put_impl(value);
         return;
     }
 
-    // TODO probably we could deduplacite the invalidation callbacks (later
-    // one wins) the same way as we do for the tiles - to be tested.
+    else if (firstToken == "callback")
+    {
+        // Deduplicate the invalidation callbacks the same way as the
+        // tiles - later one wins - by merging overlapping rectangles.
+        std::string viewId;
+        std::string payload;
+        int type = -1;
+        if (splitCallback(msg, viewId, type, payload) &&
+            type == LOK_CALLBACK_INVALIDATE_TILES &&
+            coalesceInvalidation(viewId, payload))
+        {
+            return;
+        }
+    }
 
+    _parsed.push_back(nullptr);
+    _priorities.push_back(-1);
+    _times.push_back(std::chrono::steady_clock::now());
     MessageQueue::put_impl(value);
 }
 
-void TileQueue::removeDuplicate(const std::string& tileMsg)
+bool TileQueue::coalesceInvalidation(const std::string& viewId, const std::string& payload)
 {
-    assert(LOOLProtocol::getFirstToken(tileMsg) == "tile");
+    const bool invalidateAll = (payload.compare(0, 5, "EMPTY") == 0);
+    Util::Rectangle rect;
+    int part = -1;
+    if (!invalidateAll && !parseInvalidationRect(payload, rect, part))
+    {
+        return false;
+    }
+
+    bool merged = false;
+    for (size_t i = 0; i < _queue.size(); )
+    {
+        if (_parsed[i])
+        {
+            ++i;
+            continue;
+        }
+
+        const std::string qMsg(_queue[i].data(), _queue[i].size());
+        std::string qViewId;
+        std::string qPayload;
+        int qType = -1;
+        if (LOOLProtocol::getFirstToken(qMsg) != "callback" ||
+            !splitCallback(qMsg, qViewId, qType, qPayload) ||
+            qType != LOK_CALLBACK_INVALIDATE_TILES || qViewId != viewId)
+        {
+            ++i;
+            continue;
+        }
+
+        if (qPayload.compare(0, 5, "EMPTY") == 0)
+        {
+            // Everything is queued to be invalidated already;
+            // the incoming rectangle is redundant.
+            Log::trace("Dropping invalidation [" + payload + "] within queued [" + qMsg + "]");
+            return true;
+        }
+
+        Util::Rectangle qRect;
+        int qPart = -1;
+        if (!parseInvalidationRect(qPayload, qRect, qPart))
+        {
+            ++i;
+            continue;
+        }
+
+        if (invalidateAll || (qPart == part && intersects(rect, qRect)))
+        {
+            // Merging can only grow the invalidated region, which is
+            // always safe.
+            Log::trace("Merging queued invalidation [" + qMsg + "] into [" + payload + "]");
+            rect.extend(qRect);
+            eraseEntryAndReindex(i);
+            merged = true;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    if (!merged)
+    {
+        // Nothing coalesced; queue the message untouched.
+        return false;
+    }
 
+    std::string newMsg = "callback " + viewId + ' ' +
+                         std::to_string(LOK_CALLBACK_INVALIDATE_TILES) + ' ';
+    if (invalidateAll)
+    {
+        newMsg += payload;
+    }
+    else
+    {
+        newMsg += std::to_string(rect.getLeft()) + ", " + std::to_string(rect.getTop()) +
+                  ", " + std::to_string(rect.getWidth()) + ", " + std::to_string(rect.getHeight());
+        if (part >= 0)
+        {
+            newMsg += ", " + std::to_string(part);
+        }
+    }
+
+    _parsed.push_back(nullptr);
+    _priorities.push_back(-1);
+    _times.push_back(std::chrono::steady_clock::now());
+    MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+    return true;
+}
+
+std::string TileQueue::tileKey(const std::string& tileMsg)
+{
     // FIXME: This looks rather fragile; but OTOH if I understand correctly this doesn't handle
     // input from clients, but strings we have created ourselves here in C++ code, so probably we
     // can be sure that the "ver" parameter is always in such a location that this does what we
@@ -159,26 +484,88 @@ void TileQueue::removeDuplicate(const std::string& tileMsg)
     // FIXME: also the ver=... is only for debugging from what I can see, so
     // double-check if we can actually avoid the 'ver' everywhere in the non-debug
     // builds
-    const std::string newMsg = tileMsg.substr(0, tileMsg.find(" ver"));
+    return tileMsg.substr(0, tileMsg.find(" ver"));
+}
+
+void TileQueue::removeDuplicate(const std::string& tileMsg, const std::string& key)
+{
+    assert(LOOLProtocol::getFirstToken(tileMsg) == "tile");
+    (void) tileMsg;
+
+    const auto dup = _tileKeys.find(key);
+    if (dup == _tileKeys.end())
+    {
+        return;
+    }
+
+    // The new message replaces the queued duplicate, but still goes
+    // to the back of the queue (the dedup predates the prioritization
+    // and some callers rely on the reordering).
+    const auto index = dup->second;
+    Log::debug() << "Remove duplicate message: "
+                 << std::string(_queue[index].data(), _queue[index].size())
+                 << " -> " << tileMsg << Log::end;
+    _tileKeys.erase(key);
+    eraseEntryAndReindex(index);
+}
+
+void TileQueue::eraseEntry(const size_t index)
+{
+    _queue.erase(_queue.begin() + index);
+    _parsed.erase(_parsed.begin() + index);
+    _priorities.erase(_priorities.begin() + index);
+    _times.erase(_times.begin() + index);
+}
+
+void TileQueue::eraseEntryAndReindex(const size_t index)
+{
+    eraseEntry(index);
+
+    // Shift the positions of everything that was behind it.
+    for (auto& tile : _tileKeys)
+    {
+        if (tile.second > index)
+        {
+            --tile.second;
+        }
+    }
+}
 
+void TileQueue::updatePriorities()
+{
+    for (size_t i = 0; i < _parsed.size(); ++i)
+    {
+        if (_parsed[i] && _parsed[i]->getId() < 0)
+        {
+            _priorities[i] = priority(*_parsed[i]);
+        }
+    }
+}
+
+void TileQueue::rebuildTileKeys()
+{
+    _tileKeys.clear();
     for (size_t i = 0; i < _queue.size(); ++i)
     {
-        auto& it = _queue[i];
-        const std::string old(it.data(), it.size());
-        const std::string oldMsg = old.substr(0, old.find(" ver"));
-        if (newMsg == oldMsg)
+        const std::string msg(_queue[i].data(), _queue[i].size());
+        if (LOOLProtocol::getFirstToken(msg) == "tile")
         {
-            Log::debug() << "Remove duplicate message: " << old << " -> " << tileMsg << Log::end;
-            _queue.erase(_queue.begin() + i);
-            break;
+            _tileKeys[tileKey(msg)] = i;
         }
     }
 }
 
-int TileQueue::priority(const std::string& tileMsg)
+void TileQueue::clear_impl()
 {
-    auto tile = TileDesc::parse(tileMsg); //FIXME: Expensive, avoid.
+    MessageQueue::clear_impl();
+    _tileKeys.clear();
+    _parsed.clear();
+    _priorities.clear();
+    _times.clear();
+}
 
+int TileQueue::priority(const TileDesc& tile)
+{
     for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
     {
         auto& cursor = _cursorPositions[_viewOrder[i]];
@@ -189,100 +576,302 @@ int TileQueue::priority(const std::string& tileMsg)
     return -1;
 }
 
-void TileQueue::deprioritizePreviews()
+std::chrono::steady_clock::time_point TileQueue::effectiveDeadline(const size_t index) const
 {
-    for (size_t i = 0; i < _queue.size(); ++i)
+    const auto& desc = _parsed[index];
+    if (!desc)
     {
-        const auto front = _queue.front();
-        const std::string message(front.data(), front.size());
-
-        // stop at the first non-tile or non-'id' (preview) message
-        std::string id;
-        if (LOOLProtocol::getFirstToken(message) != "tile" || !LOOLProtocol::getTokenStringFromMessage(message, "id", id))
-            break;
+        // Due on arrival: non-tiles keep their mutual FIFO order and
+        // only yield to tiles that have overrun their budget.
+        return _times[index];
+    }
 
-        _queue.pop_front();
-        _queue.push_back(front);
+    const int prio = _priorities[index];
+    if (prio >= 0)
+    {
+        return _times[index] + std::chrono::milliseconds(CursorTileDeadlineMs - prio);
     }
+
+    return _times[index] + std::chrono::milliseconds(TileDeadlineMs);
 }
 
-MessageQueue::Payload TileQueue::get_impl()
+MessageQueue::Payload TileQueue::mergeInvalidations(const size_t index, const std::string& viewId, const std::string& payload)
 {
-    const auto front = _queue.front();
+    // The re-queued remainder of the cover set keeps the enqueue time
+    // of the invalidation it came from.
+    const auto when = _times[index];
+    eraseEntry(index);
+
+    bool invalidateAll = (payload.compare(0, 5, "EMPTY") == 0);
+    std::vector<std::pair<int, Util::Rectangle>> rects;
+    if (!invalidateAll)
+    {
+        Util::Rectangle rect;
+        int part = -1;
+        if (!parseInvalidationRect(payload, rect, part))
+        {
+            // Unparseable; pass it through untouched.
+            rebuildTileKeys();
+            const auto msg = "callback " + viewId + ' ' +
+                             std::to_string(LOK_CALLBACK_INVALIDATE_TILES) + ' ' + payload;
+            return Payload(msg.data(), msg.data() + msg.size());
+        }
 
-    auto msg = std::string(front.data(), front.size());
+        rects.emplace_back(part, rect);
+    }
 
-    std::string id;
-    bool isTile = (LOOLProtocol::getFirstToken(msg) == "tile");
-    bool isPreview = isTile && LOOLProtocol::getTokenStringFromMessage(msg, "id", id);
-    if (!isTile || isPreview)
+    // Gather the rest of the burst: every queued invalidation of this view.
+    for (size_t i = 0; i < _queue.size(); )
     {
-        // Don't combine non-tiles or tiles with id.
-        Log::trace() << "MessageQueue res: " << msg << Log::end;
-        _queue.pop_front();
+        bool swept = false;
+        if (!_parsed[i])
+        {
+            const std::string qMsg(_queue[i].data(), _queue[i].size());
+            std::string qViewId;
+            std::string qPayload;
+            int qType = -1;
+            if (LOOLProtocol::getFirstToken(qMsg) == "callback" &&
+                splitCallback(qMsg, qViewId, qType, qPayload) &&
+                qType == LOK_CALLBACK_INVALIDATE_TILES && qViewId == viewId)
+            {
+                Util::Rectangle qRect;
+                int qPart = -1;
+                if (qPayload.compare(0, 5, "EMPTY") == 0)
+                {
+                    invalidateAll = true;
+                    swept = true;
+                }
+                else if (parseInvalidationRect(qPayload, qRect, qPart))
+                {
+                    rects.emplace_back(qPart, qRect);
+                    swept = true;
+                }
+            }
+        }
 
-        // de-prioritize the other tiles with id - usually the previews in
-        // Impress
-        if (isPreview)
-            deprioritizePreviews();
+        if (swept)
+        {
+            eraseEntry(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
 
-        return front;
+    if (invalidateAll)
+    {
+        rebuildTileKeys();
+        const auto msg = "callback " + viewId + ' ' +
+                         std::to_string(LOK_CALLBACK_INVALIDATE_TILES) + " EMPTY";
+        Log::trace("Collapsed invalidation burst into: " + msg);
+        return Payload(msg.data(), msg.data() + msg.size());
     }
 
-    // We are handling a tile; first try to find one that is at the cursor's
-    // position, otherwise handle the one that is at the front
-    int prioritized = 0;
-    int prioritySoFar = -1;
-    for (size_t i = 0; i < _queue.size(); ++i)
+    if (rects.size() > MaxInvalidationSweep)
     {
-        auto& it = _queue[i];
-        const std::string prio(it.data(), it.size());
+        // A huge burst; one bounding box per part is the sane cover.
+        std::map<int, Util::Rectangle> parts;
+        for (auto& entry : rects)
+        {
+            const auto it = parts.find(entry.first);
+            if (it == parts.end())
+            {
+                parts[entry.first] = entry.second;
+            }
+            else
+            {
+                it->second.extend(entry.second);
+            }
+        }
+
+        rects.clear();
+        for (auto& part : parts)
+        {
+            rects.emplace_back(part.first, part.second);
+        }
+    }
 
-        // avoid starving - stop the search when we reach a non-tile,
-        // otherwise we may keep growing the queue of unhandled stuff (both
-        // tiles and non-tiles)
-        if (LOOLProtocol::getFirstToken(prio) != "tile" || LOOLProtocol::getTokenStringFromMessage(prio, "id", id))
+    const auto area = [](Util::Rectangle& rect)
+    {
+        return static_cast<int64_t>(rect.getWidth()) * rect.getHeight();
+    };
+
+    // Reduce to a minimal cover set: greedily unite the pair of the
+    // same part whose union wastes the least area, while the waste
+    // stays moderate (over-invalidation only re-renders a few extra
+    // tiles) or the set is still too large to be worth sending.
+    bool merged = true;
+    while (merged && rects.size() > 1)
+    {
+        merged = false;
+        int64_t bestWaste = std::numeric_limits<int64_t>::max();
+        size_t bestA = 0;
+        size_t bestB = 0;
+        for (size_t a = 0; a < rects.size(); ++a)
+        {
+            for (size_t b = a + 1; b < rects.size(); ++b)
+            {
+                if (rects[a].first != rects[b].first)
+                {
+                    continue;
+                }
+
+                Util::Rectangle candidate = rects[a].second;
+                candidate.extend(rects[b].second);
+                const auto waste = area(candidate) - area(rects[a].second) - area(rects[b].second);
+                if (waste < bestWaste)
+                {
+                    bestWaste = waste;
+                    bestA = a;
+                    bestB = b;
+                }
+            }
+        }
+
+        if (bestB == 0)
+        {
+            // No two rectangles share a part.
             break;
+        }
 
-        int p = priority(prio);
+        const auto sum = area(rects[bestA].second) + area(rects[bestB].second);
+        if (rects.size() > MaxInvalidationRects || bestWaste <= sum)
+        {
+            rects[bestA].second.extend(rects[bestB].second);
+            rects.erase(rects.begin() + bestB);
+            merged = true;
+        }
+    }
 
-        if (p > prioritySoFar)
+    const auto serializeRect = [&viewId](std::pair<int, Util::Rectangle>& entry)
+    {
+        auto& rect = entry.second;
+        std::string msg = "callback " + viewId + ' ' +
+                          std::to_string(LOK_CALLBACK_INVALIDATE_TILES) + ' ' +
+                          std::to_string(rect.getLeft()) + ", " + std::to_string(rect.getTop()) +
+                          ", " + std::to_string(rect.getWidth()) + ", " +
+                          std::to_string(rect.getHeight());
+        if (entry.first >= 0)
         {
-            prioritySoFar = p;
-            prioritized = i;
-            msg = prio;
+            msg += ", " + std::to_string(entry.first);
+        }
+
+        return msg;
+    };
 
-            // found the highest priority already?
-            if (prioritySoFar == static_cast<int>(_viewOrder.size()) - 1)
-                break;
+    // The rest of the cover set goes back to the front of the queue,
+    // so it is delivered ahead of anything queued after the burst.
+    for (size_t i = rects.size(); i > 1; --i)
+    {
+        const auto msg = serializeRect(rects[i - 1]);
+        _queue.emplace_front(msg.data(), msg.data() + msg.size());
+        _parsed.emplace_front(nullptr);
+        _priorities.emplace_front(-1);
+        _times.emplace_front(when);
+    }
+
+    rebuildTileKeys();
+
+    const auto msg = serializeRect(rects[0]);
+    Log::trace() << "Collapsed invalidation burst into " << rects.size()
+                 << " rectangle(s), first: " << msg << Log::end;
+    return Payload(msg.data(), msg.data() + msg.size());
+}
+
+MessageQueue::Payload TileQueue::get_impl()
+{
+    // Pick the entry with the earliest effective deadline. Every
+    // class drains within its budget, so nothing starves and the
+    // worst-case age of a queued tile is bounded instead of depending
+    // on what else is in flight. Previews are not a class in this
+    // ordering: they render strictly while the kit is otherwise idle,
+    // so populating the slide sorter never costs the editing view a
+    // frame, however long the previews have been waiting.
+    size_t best = _queue.size();
+    std::chrono::steady_clock::time_point bestDeadline;
+    for (size_t i = 0; i < _queue.size(); ++i)
+    {
+        if (_parsed[i] && _parsed[i]->getId() >= 0)
+        {
+            // A preview; only the idle fallback below considers it.
+            continue;
+        }
+
+        const auto deadline = effectiveDeadline(i);
+        if (best == _queue.size() || deadline < bestDeadline)
+        {
+            bestDeadline = deadline;
+            best = i;
+        }
+    }
+
+    if (best == _queue.size())
+    {
+        // Only previews are pending: the kit is idle, serve the oldest.
+        best = 0;
+        for (size_t i = 1; i < _queue.size(); ++i)
+        {
+            if (_times[i] < _times[best])
+            {
+                best = i;
+            }
+        }
+    }
+
+    const auto result = _queue[best];
+    const auto desc = _parsed[best];
+
+    const bool isTile = (desc != nullptr);
+    const bool isPreview = isTile && desc->getId() >= 0;
+
+    if (!isTile)
+    {
+        // An invalidation callback sweeps up the whole queued burst of
+        // its view before leaving the kit.
+        const std::string msg(result.data(), result.size());
+        std::string viewId;
+        std::string payload;
+        int type = -1;
+        if (LOOLProtocol::getFirstToken(msg) == "callback" &&
+            splitCallback(msg, viewId, type, payload) &&
+            type == LOK_CALLBACK_INVALIDATE_TILES)
+        {
+            return mergeInvalidations(best, viewId, payload);
         }
     }
 
-    _queue.erase(_queue.begin() + prioritized);
+    if (!isTile || isPreview)
+    {
+        // Don't combine non-tiles or tiles with id.
+        Log::trace() << "MessageQueue res: " << std::string(result.data(), result.size()) << Log::end;
+        eraseEntry(best);
+        rebuildTileKeys();
+        return result;
+    }
 
     std::vector<TileDesc> tiles;
-    tiles.emplace_back(TileDesc::parse(msg));
+    tiles.emplace_back(*desc);
+    eraseEntry(best);
 
     // Combine as many tiles as possible with the top one.
     for (size_t i = 0; i < _queue.size(); )
     {
-        auto& it = _queue[i];
-        msg = std::string(it.data(), it.size());
-        if (LOOLProtocol::getFirstToken(msg) != "tile" || LOOLProtocol::getTokenStringFromMessage(msg, "id", id))
+        const auto& desc = _parsed[i];
+        if (!desc || desc->getId() >= 0)
         {
             // Don't combine non-tiles or tiles with id.
             ++i;
             continue;
         }
 
-        auto tile2 = TileDesc::parse(msg);
-        Log::trace() << "combining candidate: " << msg << Log::end;
+        Log::trace() << "combining candidate: " << std::string(_queue[i].data(), _queue[i].size()) << Log::end;
 
         // Check if it's on the same row.
-        if (tiles[0].onSameRow(tile2))
+        if (tiles[0].onSameRow(*desc))
         {
-            tiles.emplace_back(tile2);
-            _queue.erase(_queue.begin() + i);
+            tiles.emplace_back(*desc);
+            eraseEntry(i);
         }
         else
         {
@@ -292,9 +881,11 @@ MessageQueue::Payload TileQueue::get_impl()
 
     Log::trace() << "Combined " << tiles.size() << " tiles, leaving " << _queue.size() << " in queue." << Log::end;
 
+    rebuildTileKeys();
+
     if (tiles.size() == 1)
     {
-        msg = tiles[0].serialize("tile");
+        const auto msg = tiles[0].serialize("tile");
         Log::trace() << "MessageQueue res: " << msg << Log::end;
         return Payload(msg.data(), msg.data() + msg.size());
     }
@@ -11,12 +11,19 @@
 #define INCLUDED_MESSAGEQUEUE_HPP
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+class TileDesc;
+
 /** Thread-safe message queue (FIFO).
 */
 class MessageQueue
@@ -26,8 +33,16 @@ public:
     typedef std::vector<char> Payload;
 
     MessageQueue() :
-        _mutex()
+        _mutex(),
+        _enqueuePos(0),
+        _dequeuePos(0),
+        _consumerWaiting(false),
+        _ring(new RingCell[RingSize])
     {
+        for (size_t i = 0; i < RingSize; ++i)
+        {
+            _ring[i].seq.store(i, std::memory_order_relaxed);
+        }
     }
 
     virtual ~MessageQueue();
@@ -46,6 +61,11 @@ public:
     /// timeoutMs can be 0 to signify infinity.
     Payload get(const unsigned timeoutMs = 0);
 
+    /// Thread safe draining of all pending messages under a single
+    /// lock acquisition; blocks until at least one is available.
+    /// timeoutMs can be 0 to signify infinity.
+    std::vector<Payload> get_batch(const unsigned timeoutMs = 0);
+
     /// Thread safe removal of all the pending messages.
     void clear();
 
@@ -53,9 +73,40 @@ public:
     void remove_if(const std::function<bool(const Payload&)>& pred);
 
 private:
+    /// Try to enqueue into the lock-free ring; false when full.
+    bool enqueueRing(const Payload& value);
+
+    /// Move everything published in the ring into _queue, in order.
+    /// Must be called with _mutex held.
+    void drainRing_impl();
+
+    /// Notify the consumer, taking _mutex only when it is (going)
+    /// asleep, to close the check-then-sleep race.
+    void wakeConsumer();
+
+    /// Wait (with _mutex held) until a message is available, draining
+    /// the ring as needed; throws on timeout.
+    void waitForMessage(std::unique_lock<std::mutex>& lock, const unsigned timeoutMs);
+
     std::mutex _mutex;
     std::condition_variable _cv;
 
+    /// A cell of the bounded MPSC ring (Vyukov-style): seq tells
+    /// producers and the consumer whose turn a cell is.
+    struct RingCell
+    {
+        std::atomic<size_t> seq;
+        Payload data;
+    };
+
+    /// Must be a power of two.
+    static constexpr size_t RingSize = 1024;
+
+    std::atomic<size_t> _enqueuePos;
+    size_t _dequeuePos; //< Consumer-side only, guarded by _mutex.
+    std::atomic<bool> _consumerWaiting;
+    std::unique_ptr<RingCell[]> _ring;
+
 protected:
     virtual void put_impl(const Payload& value);
 
@@ -63,7 +114,7 @@ protected:
 
     virtual Payload get_impl();
 
-    void clear_impl();
+    virtual void clear_impl();
 
     std::deque<Payload> _queue;
 };
@@ -110,6 +161,8 @@ public:
         }
 
         _viewOrder.push_back(viewId);
+
+        updatePriorities();
     }
 
     void removeCursorPosition(int viewId)
@@ -121,6 +174,8 @@ public:
         }
 
         _cursorPositions.erase(viewId);
+
+        updatePriorities();
     }
 
 protected:
@@ -128,22 +183,83 @@ protected:
 
     virtual Payload get_impl() override;
 
-private:
-    /// Search the queue for a duplicate tile and remove it (if present).
-    void removeDuplicate(const std::string& tileMsg);
+    virtual void clear_impl() override;
 
-    /// De-prioritize the previews (tiles with 'id') - move them to the end of
-    /// the queue.
-    void deprioritizePreviews();
+private:
+    /// The canonical form of a tile message, without the parts that
+    /// vary between re-requests of the same tile (currently 'ver').
+    static std::string tileKey(const std::string& tileMsg);
 
-    /// Priority of the given tile message.
+    /// Search the queue for a duplicate tile and remove it (if present).
+    /// The canonical key of the message must be given.
+    void removeDuplicate(const std::string& tileMsg, const std::string& key);
+
+    /// Recompute _tileKeys from the queue; for the (rare) paths that
+    /// erase or reorder entries wholesale.
+    void rebuildTileKeys();
+
+    /// The time the entry at the given position is due: non-tiles at
+    /// their enqueue time (so they stay FIFO among themselves), tiles
+    /// after the budget of their class (cursor-adjacent < visible).
+    /// Dequeuing picks the earliest, which bounds the worst-case age
+    /// of every queued payload by its class budget. Previews sit
+    /// outside this ordering entirely: get_impl serves them, oldest
+    /// first, only when nothing else is queued.
+    std::chrono::steady_clock::time_point effectiveDeadline(size_t index) const;
+
+    /// Priority of the given tile.
     /// -1 means the lowest prio (the tile does not intersect any of the cursors),
     /// the higher the number, the bigger is priority [up to _viewOrder.size()-1].
-    int priority(const std::string& tileMsg);
+    int priority(const TileDesc& tile);
+
+    /// Remove the entry at the given position from the queue and the
+    /// parallel structures.
+    void eraseEntry(size_t index);
+
+    /// As eraseEntry, but also shifts the _tileKeys positions that
+    /// were behind the removed entry.
+    void eraseEntryAndReindex(size_t index);
+
+    /// Merge an incoming invalidation callback with the overlapping
+    /// invalidations already queued for the same view ('later one
+    /// wins'). Returns true when the message was handled here.
+    bool coalesceInvalidation(const std::string& viewId, const std::string& payload);
+
+    /// Collapse the invalidation callback at the given position and
+    /// the queued invalidations of the same view into a minimal cover
+    /// set; returns the first cover rectangle as the dequeued message
+    /// and puts the rest back at the front. The queue depth is the
+    /// merge window: a recalculation storm outruns the consumer and
+    /// gets swept up in a single call.
+    Payload mergeInvalidations(size_t index, const std::string& viewId, const std::string& payload);
+
+    /// Recompute the cached priority of every queued tile; called when
+    /// the cursor positions or the view order change. Dequeuing then
+    /// only compares the cached values.
+    void updatePriorities();
 
 private:
     std::map<int, CursorPosition> _cursorPositions;
 
+    /// Canonical key of every queued tile -> its position in _queue,
+    /// so duplicate detection on insertion is O(1) instead of a
+    /// string-constructing scan of the whole queue.
+    std::unordered_map<std::string, size_t> _tileKeys;
+
+    /// The parsed form of each queued message, parallel to _queue;
+    /// null for non-tile messages. Tiles are parsed once on insertion
+    /// and only serialized again when leaving the queue.
+    std::deque<std::shared_ptr<const TileDesc>> _parsed;
+
+    /// The priority of each queued message, parallel to _queue; kept
+    /// current by put_impl and updatePriorities. -1 for non-tiles;
+    /// >= 0 marks a tile cursor-adjacent for the deadline scheduler.
+    std::deque<int> _priorities;
+
+    /// The enqueue time of each queued message, parallel to _queue;
+    /// the anchor the effective deadline is computed from.
+    std::deque<std::chrono::steady_clock::time_point> _times;
+
     /// Check the views in the order of how the editing (cursor movement) has
     /// been happening (0 == oldest, size() - 1 == newest).
     std::vector<int> _viewOrder;
@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "Metrics.hpp"
+#include "config.h"
+
+#include <sstream>
+
+#include "Histogram.hpp"
+
+namespace Metrics
+{
+
+std::atomic<int> DocumentsActive(0);
+std::atomic<int> SessionsActive(0);
+std::atomic<int> SpareChildren(0);
+std::atomic<uint64_t> TileCacheHits(0);
+std::atomic<uint64_t> TileCacheMisses(0);
+std::atomic<int> SenderQueueDepth(0);
+
+namespace
+{
+
+void appendGauge(std::ostringstream& oss, const char* name, const char* help, const int64_t value)
+{
+    oss << "# HELP " << name << ' ' << help << '\n'
+        << "# TYPE " << name << " gauge\n"
+        << name << ' ' << value << '\n';
+}
+
+void appendCounter(std::ostringstream& oss, const char* name, const char* help, const uint64_t value)
+{
+    oss << "# HELP " << name << ' ' << help << '\n'
+        << "# TYPE " << name << " counter\n"
+        << name << ' ' << value << '\n';
+}
+
+}
+
+std::string toPrometheusText()
+{
+    std::ostringstream oss;
+
+    appendGauge(oss, "lool_documents_active",
+                "Open documents.", DocumentsActive);
+    appendGauge(oss, "lool_sessions_active",
+                "Client sessions across all documents.", SessionsActive);
+    appendGauge(oss, "lool_spare_children",
+                "Spare kit processes waiting in the pool.", SpareChildren);
+    appendCounter(oss, "lool_tilecache_hits_total",
+                  "Tile requests answered from the cache.", TileCacheHits);
+    appendCounter(oss, "lool_tilecache_misses_total",
+                  "Tile requests that needed a render.", TileCacheMisses);
+    appendGauge(oss, "lool_sender_queue_depth",
+                "Messages waiting in session sender queues.", SenderQueueDepth);
+
+    // The latency histograms, as summaries in seconds.
+    Histogram::forEach(
+        [&oss](const std::string& name, const Histogram& histogram)
+        {
+            const std::string metric = "lool_" + name + "_seconds";
+            oss << "# TYPE " << metric << " summary\n";
+            for (const auto quantile : { 0.5, 0.75, 0.9, 0.99, 0.999 })
+            {
+                oss << metric << "{quantile=\"" << quantile << "\"} "
+                    << histogram.quantile(quantile) / 1e6 << '\n';
+            }
+
+            oss << metric << "_sum " << histogram.sum() / 1e6 << '\n'
+                << metric << "_count " << histogram.count() << '\n';
+        });
+
+    return oss.str();
+}
+
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,43 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_METRICS_HPP
+#define INCLUDED_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/// Process-global monitoring counters, exported in Prometheus text
+/// format by the /lool/metrics endpoint. Producers update plain
+/// atomics inline, so maintaining them costs the hot path nothing
+/// measurable and a scrape takes no lock at all.
+namespace Metrics
+{
+    /// Live DocumentBrokers.
+    extern std::atomic<int> DocumentsActive;
+    /// Client sessions across all documents.
+    extern std::atomic<int> SessionsActive;
+    /// Spare kit processes waiting in the pool.
+    extern std::atomic<int> SpareChildren;
+    /// Tile requests answered from the cache.
+    extern std::atomic<uint64_t> TileCacheHits;
+    /// Tile requests that needed a render.
+    extern std::atomic<uint64_t> TileCacheMisses;
+    /// Messages waiting in session sender queues.
+    extern std::atomic<int> SenderQueueDepth;
+
+    /// All counters, and the latency histograms as summaries,
+    /// in the Prometheus text exposition format.
+    std::string toPrometheusText();
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
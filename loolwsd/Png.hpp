@@ -47,9 +47,14 @@
 
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
+#include <zlib.h>
 
 #include <cassert>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 namespace png
 {
 
@@ -74,41 +79,166 @@ extern "C"
 }
 
 
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
+/* Unpremultiplies a single pixel and converts native endian ARGB => RGBA bytes */
+static inline void
+unpremultiply_pixel (uint8_t *b)
+{
+    uint32_t pixel;
+    uint8_t  alpha;
+
+    memcpy (&pixel, b, sizeof (uint32_t));
+    alpha = (pixel & 0xff000000) >> 24;
+    if (alpha == 0)
+    {
+        b[0] = b[1] = b[2] = b[3] = 0;
+    }
+    else
+    {
+        b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
+        b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
+        b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
+        b[3] = alpha;
+    }
+}
+
+static void
+unpremultiply_row_scalar (png_bytep data, size_t rowbytes)
+{
+    for (size_t i = 0; i < rowbytes; i += 4)
+        unpremultiply_pixel (&data[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Vectorized variants. Document tiles are overwhelmingly groups of
+ * fully-opaque (or fully-transparent) pixels, which need channel
+ * swizzling but no division at all; only mixed groups fall back to the
+ * exact scalar per-pixel formula. */
+
 static void
-unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+unpremultiply_row_sse2 (png_bytep data, size_t rowbytes)
 {
-    unsigned int i;
+    const __m128i alphaMask = _mm_set1_epi32 (0xff000000);
+    const __m128i loMask = _mm_set1_epi32 (0x000000ff);
+    const __m128i gaMask = _mm_set1_epi32 (0xff00ff00);
 
-    for (i = 0; i < row_info->rowbytes; i += 4)
+    size_t i = 0;
+    for (; i + 16 <= rowbytes; i += 16)
     {
-        uint8_t *b = &data[i];
-        uint32_t pixel;
-        uint8_t  alpha;
+        const __m128i pix = _mm_loadu_si128 (reinterpret_cast<const __m128i *>(data + i));
+        const __m128i alpha = _mm_and_si128 (pix, alphaMask);
 
-        memcpy (&pixel, b, sizeof (uint32_t));
-        alpha = (pixel & 0xff000000) >> 24;
-        if (alpha == 0)
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, alphaMask)) == 0xffff)
+        {
+            // All opaque: just swap R and B.
+            const __m128i r = _mm_and_si128 (_mm_srli_epi32 (pix, 16), loMask);
+            const __m128i b = _mm_slli_epi32 (_mm_and_si128 (pix, loMask), 16);
+            const __m128i swizzled = _mm_or_si128 (_mm_and_si128 (pix, gaMask),
+                                                   _mm_or_si128 (r, b));
+            _mm_storeu_si128 (reinterpret_cast<__m128i *>(data + i), swizzled);
+        }
+        else if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, _mm_setzero_si128 ())) == 0xffff)
         {
-            b[0] = b[1] = b[2] = b[3] = 0;
+            // All transparent.
+            _mm_storeu_si128 (reinterpret_cast<__m128i *>(data + i), _mm_setzero_si128 ());
         }
         else
         {
-            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-            b[3] = alpha;
+            for (size_t j = 0; j < 16; j += 4)
+                unpremultiply_pixel (&data[i + j]);
         }
     }
+
+    for (; i < rowbytes; i += 4)
+        unpremultiply_pixel (&data[i]);
 }
 
+__attribute__((target("avx2")))
+static void
+unpremultiply_row_avx2 (png_bytep data, size_t rowbytes)
+{
+    const __m256i alphaMask = _mm256_set1_epi32 (0xff000000);
+    const __m256i swizzle = _mm256_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7,
+                                              10, 9, 8, 11, 14, 13, 12, 15,
+                                              2, 1, 0, 3, 6, 5, 4, 7,
+                                              10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 32 <= rowbytes; i += 32)
+    {
+        const __m256i pix = _mm256_loadu_si256 (reinterpret_cast<const __m256i *>(data + i));
+        const __m256i alpha = _mm256_and_si256 (pix, alphaMask);
+
+        if (_mm256_movemask_epi8 (_mm256_cmpeq_epi32 (alpha, alphaMask)) == -1)
+        {
+            // All opaque: just swap R and B.
+            _mm256_storeu_si256 (reinterpret_cast<__m256i *>(data + i),
+                                 _mm256_shuffle_epi8 (pix, swizzle));
+        }
+        else if (_mm256_movemask_epi8 (_mm256_cmpeq_epi32 (alpha, _mm256_setzero_si256 ())) == -1)
+        {
+            // All transparent.
+            _mm256_storeu_si256 (reinterpret_cast<__m256i *>(data + i),
+                                 _mm256_setzero_si256 ());
+        }
+        else
+        {
+            for (size_t j = 0; j < 32; j += 4)
+                unpremultiply_pixel (&data[i + j]);
+        }
+    }
+
+    for (; i < rowbytes; i += 4)
+        unpremultiply_pixel (&data[i]);
+}
+
+#endif
+
+/* Unpremultiplies a row and converts native endian ARGB => RGBA bytes,
+ * dispatching to the widest vector unit available at runtime. */
+static void
+unpremultiply_row (png_bytep data, size_t rowbytes)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool haveAvx2 = __builtin_cpu_supports ("avx2") != 0;
+    static const bool haveSse2 = __builtin_cpu_supports ("sse2") != 0;
+
+    if (haveAvx2)
+        unpremultiply_row_avx2 (data, rowbytes);
+    else if (haveSse2)
+        unpremultiply_row_sse2 (data, rowbytes);
+    else
+        unpremultiply_row_scalar (data, rowbytes);
+#else
+    unpremultiply_row_scalar (data, rowbytes);
+#endif
+}
+
+static void
+unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+{
+    unpremultiply_row (data, row_info->rowbytes);
+}
+
+/// Encoder settings, trading compression ratio for encode latency.
+enum class EncodeProfile
+{
+    /// Latency-sensitive tiles on the interactive path: no row
+    /// filtering and the fastest zlib setting.
+    Interactive,
+    /// Size-sensitive output (previews, font renderings): the libpng
+    /// defaults of adaptive filtering and default zlib level.
+    Compact
+};
+
 // Sadly, older libpng headers don't use const for the pixmap pointer parameter to
 // png_write_row(), so can't use const here for pixmap.
 inline
 bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
                           int width, int height,
                           int bufferWidth, int bufferHeight,
-                          std::vector<char>& output, LibreOfficeKitTileMode mode)
+                          std::vector<char>& output, LibreOfficeKitTileMode mode,
+                          EncodeProfile profile)
 {
     if (bufferWidth < width || bufferHeight < height)
     {
@@ -127,6 +257,13 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
 
     png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
+    if (profile == EncodeProfile::Interactive)
+    {
+        png_set_filter(png_ptr, 0, PNG_FILTER_NONE);
+        png_set_compression_level(png_ptr, Z_BEST_SPEED);
+        png_set_compression_strategy(png_ptr, Z_RLE);
+    }
+
     png_set_write_fn(png_ptr, &output, user_write_fn, user_flush_fn);
     png_set_write_status_fn(png_ptr, user_write_status_fn);
 
@@ -152,9 +289,50 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
 
 inline
 bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
-                       std::vector<char>& output, LibreOfficeKitTileMode mode)
+                       std::vector<char>& output, LibreOfficeKitTileMode mode,
+                       EncodeProfile profile)
+{
+    return encodeSubBufferToPNG(pixmap, 0, 0, width, height, width, height, output, mode, profile);
+}
+
+/// Encodes a sub-buffer as zlib-deflated unpremultiplied RGBA pixels
+/// (TILEFORMAT_RAWZ). Far cheaper to produce than PNG; the dimensions
+/// travel in the accompanying tile message, so the payload is bare.
+inline
+bool encodeSubBufferToRawZ(unsigned char* pixmap, size_t startX, size_t startY,
+                           int width, int height,
+                           int bufferWidth, int bufferHeight,
+                           std::vector<char>& output, LibreOfficeKitTileMode mode)
 {
-    return encodeSubBufferToPNG(pixmap, 0, 0, width, height, width, height, output, mode);
+    if (bufferWidth < width || bufferHeight < height)
+    {
+        return false;
+    }
+
+    const size_t rowBytes = width * 4;
+    std::vector<unsigned char> raw(rowBytes * height);
+    for (int y = 0; y < height; ++y)
+    {
+        const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+        std::memcpy(raw.data() + y * rowBytes, pixmap + position, rowBytes);
+        if (mode == LOK_TILEMODE_BGRA)
+        {
+            unpremultiply_row(raw.data() + y * rowBytes, rowBytes);
+        }
+    }
+
+    const size_t oldSize = output.size();
+    uLongf compressedSize = compressBound(raw.size());
+    output.resize(oldSize + compressedSize);
+    if (compress2(reinterpret_cast<Bytef*>(output.data() + oldSize), &compressedSize,
+                  raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK)
+    {
+        output.resize(oldSize);
+        return false;
+    }
+
+    output.resize(oldSize + compressedSize);
+    return true;
 }
 
 static
@@ -105,7 +105,8 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
                     errorKind == "passwordrequired:to-modify" ||
                     errorKind == "wrongpassword")
                 {
-                    forwardToPeer(_peer, buffer, length, isBinary);
+                    peer->enqueueSendMessage(
+                        std::make_shared<Message>(buffer, length, Message::Type::Binary));
                     Log::warn("Document load failed: " + errorKind);
                     return false;
                 }
@@ -170,8 +171,22 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
         {
             _docBroker->setLoaded();
 
+            // Capture the canonical reply for the join snapshot, so
+            // later sessions get it from WSD memory.
+            const std::string stringMsg(buffer, length);
+            const auto cached = _docBroker->getJoinReply("status");
+            if (cached == stringMsg && peer->gotSnapshotStatus())
+            {
+                // The peer already built its UI from the snapshot.
+                Log::trace(getName() + ": Suppressing duplicate status of the join snapshot.");
+                return true;
+            }
+
+            _docBroker->cacheJoinReply("status", stringMsg);
+
             // Forward the status response to the client.
-            return forwardToPeer(_peer, buffer, length, isBinary);
+            return peer->enqueueSendMessage(
+                std::make_shared<Message>(buffer, length, Message::Type::Binary));
         }
         else if (tokens[0] == "commandvalues:")
         {
@@ -249,14 +264,25 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
     // text part and the rest is binary.
     isBinary = buffer[length - 1] != '}' && firstLine.find('{') == std::string::npos;
 
-    // Forward everything else.
-    forwardToPeer(_peer, buffer, length, isBinary);
+    // Forward everything else. The peer's sender thread delivers it,
+    // so a slow client never blocks this socket loop.
+    peer->enqueueSendMessage(
+        std::make_shared<Message>(buffer, length,
+                                  isBinary ? Message::Type::Binary : Message::Type::Text));
     return true;
 }
 
 bool PrisonerSession::shutdownPeer(Poco::UInt16 statusCode)
 {
     auto peer = _peer.lock();
+    if (_docBroker && _docBroker->isHibernated())
+    {
+        // The kit went away on purpose; the client stays connected
+        // and revives the document with its next message.
+        Log::debug(getName() + ": Not shutting down the peer of a hibernated document.");
+        return peer != nullptr;
+    }
+
     if (peer && !peer->isCloseFrame())
     {
         peer->shutdown(statusCode);
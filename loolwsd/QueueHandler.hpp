@@ -35,19 +35,27 @@ public:
 
         try
         {
-            while (true)
+            bool stop = false;
+            while (!stop)
             {
-                const auto input = _queue->get();
-                if (LOOLProtocol::getFirstToken(input) == "eof")
+                // Drain everything pending under a single lock and
+                // dispatch without touching the queue in between.
+                const auto batch = _queue->get_batch();
+                for (const auto& input : batch)
                 {
-                    Log::info("Received EOF. Finishing.");
-                    break;
-                }
+                    if (LOOLProtocol::getFirstToken(input) == "eof")
+                    {
+                        Log::info("Received EOF. Finishing.");
+                        stop = true;
+                        break;
+                    }
 
-                if (!_session->handleInput(input.data(), input.size()))
-                {
-                    Log::info("Socket handler flagged for finishing.");
-                    break;
+                    if (!_session->handleInput(input.data(), input.size()))
+                    {
+                        Log::info("Socket handler flagged for finishing.");
+                        stop = true;
+                        break;
+                    }
                 }
             }
         }
@@ -10,9 +10,14 @@
 #include "Storage.hpp"
 #include "config.h"
 
+#include <unistd.h>
+
+#include <atomic>
 #include <cassert>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
@@ -21,8 +26,10 @@
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/HTTPSClientSession.h>
+#include <Poco/DigestEngine.h>
 #include <Poco/Net/NetworkInterface.h>
 #include <Poco/Net/SSLManager.h>
+#include <Poco/SHA1Engine.h>
 #include <Poco/StreamCopier.h>
 
 #include "Auth.hpp"
@@ -58,6 +65,39 @@ size_t StorageBase::getFileSize(const std::string& filename)
     return std::ifstream(filename, std::ifstream::ate | std::ifstream::binary).tellg();
 }
 
+std::string StorageBase::hashFile(const std::string& path)
+{
+    std::ifstream ifs(path, std::ifstream::binary);
+    if (!ifs.good())
+    {
+        return std::string();
+    }
+
+    Poco::SHA1Engine engine;
+    std::vector<char> buffer(64 * 1024);
+    do
+    {
+        ifs.read(buffer.data(), buffer.size());
+        const auto read = ifs.gcount();
+        if (read <= 0)
+        {
+            break;
+        }
+
+        engine.update(buffer.data(), read);
+    }
+    while (ifs.good());
+
+    return Poco::DigestEngine::digestToHex(engine.digest());
+}
+
+std::string StorageBase::hashForUpload(const std::string& path)
+{
+    const auto hash = hashFile(path);
+    _lastSaveSkipped = (!hash.empty() && hash == _lastUploadedHash);
+    return hash;
+}
+
 void StorageBase::initialize()
 {
     const auto& app = Poco::Util::Application::instance();
@@ -207,7 +247,12 @@ std::string LocalStorage::loadStorageFileToLocal()
         if (!Poco::File(_jailedFilePath).exists())
         {
             Log::info("Copying " + publicFilePath + " to " + _jailedFilePath);
-            Poco::File(publicFilePath).copyTo(_jailedFilePath);
+            // Prefer a reflink/in-kernel copy; fall back to copying the bytes.
+            if (!Util::copyFile(publicFilePath, _jailedFilePath))
+            {
+                Poco::File(publicFilePath).copyTo(_jailedFilePath);
+            }
+
             _isCopy = true;
         }
     }
@@ -217,25 +262,40 @@ std::string LocalStorage::loadStorageFileToLocal()
         throw;
     }
 
+    // Storage has this content; an unchanged save need not copy back.
+    _lastUploadedHash = hashFile(_jailedFilePath);
+
     _isLoaded = true;
     // Now return the jailed path.
     return Poco::Path(_jailPath, filename).toString();
 }
 
-bool LocalStorage::saveLocalFileToStorage()
+bool LocalStorage::saveLocalFileToStorage(const std::string& path)
 {
     try
     {
         // Copy the file back.
-        if (_isCopy && Poco::File(_jailedFilePath).exists())
+        if (_isCopy && Poco::File(path).exists())
         {
-            Log::info("Copying " + _jailedFilePath + " to " + _uri.getPath());
-            Poco::File(_jailedFilePath).copyTo(_uri.getPath());
+            const auto hash = hashForUpload(path);
+            if (_lastSaveSkipped)
+            {
+                Log::debug("Skipping copy of [" + path + "]: content unchanged since the last save.");
+                return true;
+            }
+
+            Log::info("Copying " + path + " to " + _uri.getPath());
+            if (!Util::copyFile(path, _uri.getPath()))
+            {
+                Poco::File(path).copyTo(_uri.getPath());
+            }
+
+            _lastUploadedHash = hash;
         }
     }
     catch (const Poco::Exception& exc)
     {
-        Log::error("copyTo(\"" + _jailedFilePath + "\", \"" + _uri.getPath() + "\") failed: " + exc.displayText());
+        Log::error("copyTo(\"" + path + "\", \"" + _uri.getPath() + "\") failed: " + exc.displayText());
         throw;
     }
 
@@ -251,6 +311,60 @@ Poco::Net::HTTPClientSession* getHTTPClientSession(const Poco::URI& uri)
                        : new Poco::Net::HTTPClientSession(uri.getHost(), uri.getPort());
 }
 
+/// Read buffer for storage downloads; large enough that the
+/// copy is bounded by the network, not by per-byte stream calls.
+const size_t DownloadBufferSize = 128 * 1024;
+
+/// Files at least this big are fetched with parallel range requests.
+const size_t ParallelDownloadThreshold = 16 * 1024 * 1024;
+const unsigned ParallelDownloadConnections = 4;
+
+/// Copy an HTTP response body to the target in large chunks.
+void copyResponseToFile(std::istream& rs, std::ostream& ofs)
+{
+    std::vector<char> buffer(DownloadBufferSize);
+    do
+    {
+        rs.read(buffer.data(), buffer.size());
+        const auto read = rs.gcount();
+        if (read <= 0)
+        {
+            break;
+        }
+
+        ofs.write(buffer.data(), read);
+    }
+    while (rs.good() && ofs.good());
+}
+
+/// Download [offset, offset + length) of the document with an HTTP
+/// range request, writing it at the same offset of the preallocated
+/// jailed file. Returns false when the server ignores the range.
+bool downloadRange(const Poco::URI& uriObject, const size_t offset, const size_t length,
+                   const std::string& jailedFilePath)
+{
+    std::unique_ptr<Poco::Net::HTTPClientSession> psession(getHTTPClientSession(uriObject));
+
+    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uriObject.getPathAndQuery(), Poco::Net::HTTPMessage::HTTP_1_1);
+    request.set("User-Agent", "LOOLWSD WOPI Agent");
+    request.set("Range", "bytes=" + std::to_string(offset) + '-' + std::to_string(offset + length - 1));
+    psession->sendRequest(request);
+
+    Poco::Net::HTTPResponse response;
+    std::istream& rs = psession->receiveResponse(response);
+    if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_PARTIAL_CONTENT)
+    {
+        Log::debug("WOPI::GetFile range request not honored: " +
+                   std::to_string(response.getStatus()) + " " + response.getReason());
+        return false;
+    }
+
+    std::fstream ofs(jailedFilePath, std::ios::in | std::ios::out | std::ios::binary);
+    ofs.seekp(offset);
+    copyResponseToFile(rs, ofs);
+    return ofs.good();
+}
+
 } // anonymous namespace
 
 StorageBase::FileInfo WopiStorage::getFileInfo()
@@ -333,46 +447,113 @@ std::string WopiStorage::loadStorageFileToLocal()
     Log::debug("Wopi requesting: " + uriObject.toString());
 
     const auto startTime = std::chrono::steady_clock::now();
-    std::unique_ptr<Poco::Net::HTTPClientSession> psession(getHTTPClientSession(uriObject));
+    _jailedFilePath = Poco::Path(getLocalRootPath(), _fileInfo._filename).toString();
 
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uriObject.getPathAndQuery(), Poco::Net::HTTPMessage::HTTP_1_1);
-    request.set("User-Agent", "LOOLWSD WOPI Agent");
-    psession->sendRequest(request);
+    std::string statusLine;
+    bool downloaded = false;
+    if (_fileInfo._size >= ParallelDownloadThreshold)
+    {
+        Log::debug() << "WOPI::GetFile downloading " << _fileInfo._size << " bytes over "
+                     << ParallelDownloadConnections << " connections." << Log::end;
 
-    Poco::Net::HTTPResponse response;
-    std::istream& rs = psession->receiveResponse(response);
+        // Preallocate the file, so each connection writes its slice in place.
+        std::ofstream(_jailedFilePath, std::ios::binary).close();
+        if (truncate(_jailedFilePath.c_str(), _fileInfo._size) == 0)
+        {
+            const size_t chunk = (_fileInfo._size + ParallelDownloadConnections - 1) / ParallelDownloadConnections;
+            std::atomic<bool> success(true);
+            std::vector<std::thread> threads;
+            for (unsigned i = 0; i < ParallelDownloadConnections; ++i)
+            {
+                const size_t offset = i * chunk;
+                if (offset >= _fileInfo._size)
+                {
+                    break;
+                }
 
-    auto logger = Log::trace();
-    logger << "WOPI::GetFile header for URI [" << _uri.toString() << "]:\n";
-    for (auto& pair : response)
-    {
-        logger << '\t' + pair.first + ": " + pair.second << " / ";
+                const size_t length = std::min(chunk, _fileInfo._size - offset);
+                threads.emplace_back([&, offset, length]()
+                    {
+                        try
+                        {
+                            if (!downloadRange(uriObject, offset, length, _jailedFilePath))
+                            {
+                                success = false;
+                            }
+                        }
+                        catch (const std::exception& ex)
+                        {
+                            Log::error(std::string("WOPI::GetFile range download failed: ") + ex.what());
+                            success = false;
+                        }
+                    });
+            }
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            downloaded = success;
+            if (!downloaded)
+            {
+                Log::warn("WOPI::GetFile parallel download failed, falling back to a single stream.");
+            }
+        }
     }
 
-    logger << Log::end;
+    if (!downloaded)
+    {
+        std::unique_ptr<Poco::Net::HTTPClientSession> psession(getHTTPClientSession(uriObject));
+
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uriObject.getPathAndQuery(), Poco::Net::HTTPMessage::HTTP_1_1);
+        request.set("User-Agent", "LOOLWSD WOPI Agent");
+        psession->sendRequest(request);
+
+        Poco::Net::HTTPResponse response;
+        std::istream& rs = psession->receiveResponse(response);
+
+        auto logger = Log::trace();
+        logger << "WOPI::GetFile header for URI [" << _uri.toString() << "]:\n";
+        for (auto& pair : response)
+        {
+            logger << '\t' + pair.first + ": " + pair.second << " / ";
+        }
+
+        logger << Log::end;
+
+        std::ofstream ofs(_jailedFilePath, std::ios::binary | std::ios::trunc);
+        copyResponseToFile(rs, ofs);
+        statusLine = " : " + std::to_string(response.getStatus()) + " " + response.getReason();
+    }
 
-    _jailedFilePath = Poco::Path(getLocalRootPath(), _fileInfo._filename).toString();
-    std::ofstream ofs(_jailedFilePath);
-    std::copy(std::istreambuf_iterator<char>(rs),
-              std::istreambuf_iterator<char>(),
-              std::ostreambuf_iterator<char>(ofs));
     const auto endTime = std::chrono::steady_clock::now();
     const std::chrono::duration<double> diff = (endTime - startTime);
     _wopiLoadDuration += diff;
     const auto size = getFileSize(_jailedFilePath);
     Log::info() << "WOPI::GetFile downloaded " << size << " bytes from [" << uriObject.toString()
-                << "] -> " << _jailedFilePath << " in " + std::to_string(diff.count()) + "s : "
-                << response.getStatus() << " " << response.getReason() << Log::end;
+                << "] -> " << _jailedFilePath << " in " + std::to_string(diff.count()) + "s"
+                << statusLine << Log::end;
+
+    // Storage has this content; an unchanged save need not upload.
+    _lastUploadedHash = hashFile(_jailedFilePath);
 
     _isLoaded = true;
     // Now return the jailed path.
     return Poco::Path(_jailPath, _fileInfo._filename).toString();
 }
 
-bool WopiStorage::saveLocalFileToStorage()
+bool WopiStorage::saveLocalFileToStorage(const std::string& path)
 {
-    Log::info("Uploading URI [" + _uri.toString() + "] from [" + _jailedFilePath + "].");
-    const auto size = getFileSize(_jailedFilePath);
+    const auto hash = hashForUpload(path);
+    if (_lastSaveSkipped)
+    {
+        Log::info("WOPI::PutFile skipped for [" + path + "]: content unchanged since the last upload.");
+        return true;
+    }
+
+    Log::info("Uploading URI [" + _uri.toString() + "] from [" + path + "].");
+    const auto size = getFileSize(path);
 
     Poco::URI uriObject(_uri);
     uriObject.setPath(uriObject.getPath() + "/contents");
@@ -386,7 +567,7 @@ bool WopiStorage::saveLocalFileToStorage()
     request.setContentLength(size);
 
     std::ostream& os = psession->sendRequest(request);
-    std::ifstream ifs(_jailedFilePath);
+    std::ifstream ifs(path);
     Poco::StreamCopier::copyStream(ifs, os);
 
     Poco::Net::HTTPResponse response;
@@ -396,7 +577,11 @@ bool WopiStorage::saveLocalFileToStorage()
 
     Log::info("WOPI::PutFile response: " + oss.str());
     const auto success = (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK);
-    Log::info() << "WOPI::PutFile uploaded " << size << " bytes from [" << _jailedFilePath  << "]:"
+    if (success)
+    {
+        _lastUploadedHash = hash;
+    }
+    Log::info() << "WOPI::PutFile uploaded " << size << " bytes from [" << path  << "]:"
                 << "] -> [" << uriObject.toString() << "]: "
                 <<  response.getStatus() << " " << response.getReason() << Log::end;
 
@@ -417,7 +602,7 @@ std::string WebDAVStorage::loadStorageFileToLocal()
     return _uri.toString();
 }
 
-bool WebDAVStorage::saveLocalFileToStorage()
+bool WebDAVStorage::saveLocalFileToStorage(const std::string& /*path*/)
 {
     // TODO: implement webdav PUT.
     return false;
@@ -65,7 +65,8 @@ public:
         _localStorePath(localStorePath),
         _jailPath(jailPath),
         _fileInfo("", Poco::Timestamp(), 0, "", ""),
-        _isLoaded(false)
+        _isLoaded(false),
+        _lastSaveSkipped(false)
     {
         Log::debug("Storage ctor: " + uri.toString());
     }
@@ -76,6 +77,10 @@ public:
 
     bool isLoaded() const { return _isLoaded; }
 
+    /// Mark the storage as not loaded, so the next load
+    /// re-populates a fresh jail (e.g. after hibernation).
+    void setLoaded(const bool loaded) { _isLoaded = loaded; }
+
     void setLocalStorePath(const std::string& localStorePath) { _localStorePath = localStorePath; }
 
     void setJailPath(const std::string& jailPath) { _jailPath = jailPath; }
@@ -91,7 +96,18 @@ public:
     /// TODO: Should we save to the specific client's URI?
     /// The advantage is that subseqent views (to the first)
     /// will not depend on the token of the first.
-    virtual bool saveLocalFileToStorage() = 0;
+    bool saveLocalFileToStorage() { return saveLocalFileToStorage(_jailedFilePath); }
+
+    /// Writes the given local file (e.g. an upload snapshot of the
+    /// jailed document) back to the source.
+    virtual bool saveLocalFileToStorage(const std::string& path) = 0;
+
+    /// The path of the document file inside the jail.
+    const std::string& getJailedFilePath() const { return _jailedFilePath; }
+
+    /// True when the last (successful) save skipped the upload
+    /// because the content matched what storage already has.
+    bool lastSaveSkipped() const { return _lastSaveSkipped; }
 
     static
     size_t getFileSize(const std::string& filename);
@@ -104,6 +120,15 @@ public:
                                                const std::string& jailRoot,
                                                const std::string& jailPath);
 
+protected:
+    /// SHA1 of the file's content, streamed in chunks; empty on error.
+    static std::string hashFile(const std::string& path);
+
+    /// Decides whether uploading path would be a no-op, recording
+    /// the decision for lastSaveSkipped(). Returns the content hash
+    /// to store in _lastUploadedHash once the upload succeeds.
+    std::string hashForUpload(const std::string& path);
+
 protected:
     const Poco::URI _uri;
     std::string _localStorePath;
@@ -111,6 +136,10 @@ protected:
     std::string _jailedFilePath;
     FileInfo _fileInfo;
     bool _isLoaded;
+    /// Hash of the content storage is known to have; set after
+    /// load and after each successful upload.
+    std::string _lastUploadedHash;
+    bool _lastSaveSkipped;
 
     static bool FilesystemEnabled;
     static bool WopiEnabled;
@@ -137,7 +166,7 @@ public:
 
     std::string loadStorageFileToLocal() override;
 
-    bool saveLocalFileToStorage() override;
+    bool saveLocalFileToStorage(const std::string& path) override;
 
 private:
     /// True if the jailed file is not linked but copied.
@@ -166,7 +195,7 @@ public:
     /// uri format: http://server/<...>/wopi*/files/<id>/content
     std::string loadStorageFileToLocal() override;
 
-    bool saveLocalFileToStorage() override;
+    bool saveLocalFileToStorage(const std::string& path) override;
 
     /// Total time taken for making WOPI calls during load (includes GetFileInfo calls)
     const std::chrono::duration<double> getWopiLoadDuration() const { return _wopiLoadDuration; }
@@ -195,7 +224,7 @@ public:
 
     std::string loadStorageFileToLocal() override;
 
-    bool saveLocalFileToStorage() override;
+    bool saveLocalFileToStorage(const std::string& path) override;
 
 private:
     std::unique_ptr<AuthBase> _authAgent;
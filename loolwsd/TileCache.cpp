@@ -13,6 +13,7 @@
 #include <cassert>
 #include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -22,7 +23,6 @@
 #include <vector>
 
 #include <Poco/DigestEngine.h>
-#include <Poco/DirectoryIterator.h>
 #include <Poco/Exception.h>
 #include <Poco/File.h>
 #include <Poco/Path.h>
@@ -32,17 +32,23 @@
 
 #include "ClientSession.hpp"
 #include "Common.hpp"
+#include "Histogram.hpp"
 #include "LOOLProtocol.hpp"
+#include "Metrics.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 
-using Poco::DirectoryIterator;
 using Poco::File;
 using Poco::StringTokenizer;
 using Poco::Timestamp;
 
 using namespace LOOLProtocol;
 
+size_t TileCache::MaxMemorySize = DEFAULT_TILE_CACHE_MEMORY_SIZE;
+size_t TileCache::MaxStoreSize = DEFAULT_TILE_CACHE_STORE_SIZE;
+size_t TileCache::MaxGlobalStoreSize = DEFAULT_TILE_CACHE_GLOBAL_SIZE;
+std::atomic<size_t> TileCache::GlobalStoreSize(0);
+
 TileCache::TileCache(const std::string& docURL,
                      const Timestamp& modifiedTime,
                      const std::string& cacheDir) :
@@ -55,23 +61,154 @@ TileCache::TileCache(const std::string& docURL,
                 << "] modifiedTime=" << (modifiedTime.raw()/1000000)
                 << " getLastModified()=" << (getLastModified().raw()/1000000) << Log::end;
     File directory(_cacheDir);
-    if (directory.exists() &&
-        (getLastModified() < modifiedTime ||
-         getTextFile("unsaved.txt") != ""))
+    if (directory.exists())
     {
-        // Document changed externally or modifications were not saved after all. Cache not useful.
-        Util::removeFile(_cacheDir, true);
-        Log::info("Completely cleared tile cache: " + _cacheDir);
+        _generation = static_cast<unsigned>(
+            std::strtoul(getTextFile("generation.txt").c_str(), nullptr, 10));
+
+        if (getLastModified() < modifiedTime ||
+            getTextFile("unsaved.txt") != "")
+        {
+            // Document changed externally or modifications were not saved
+            // after all, so the cached tiles are not to be trusted. The
+            // generation is part of every tile key: bumping it makes the
+            // stale entries unreachable (loadTileIndex reclaims them)
+            // without wiping the directory, so the content-independent
+            // renderings (fonts, styles) stay warm.
+            ++_generation;
+            saveTextFile(std::to_string(_generation), "generation.txt");
+            removeFile("unsaved.txt");
+            Log::info("Tile cache generation bumped to " +
+                      std::to_string(_generation) + ": " + _cacheDir);
+        }
     }
 
     File(_cacheDir).createDirectories();
 
     saveLastModified(modifiedTime);
+
+    _tileStore.reset(new TileStore(_cacheDir + "/tiles.bin"));
+
+    loadTileIndex();
+
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        updateStoreSize();
+        enforceStoreSize();
+    }
+
+    _saveThread = std::thread([this]() { saveThread(); });
 }
 
 TileCache::~TileCache()
 {
     Log::info("~TileCache dtor for uri [" + _docURL + "].");
+
+    // Flush pending saves and stop the write-behind thread.
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        _stopping = true;
+    }
+
+    _saveCond.notify_one();
+    if (_saveThread.joinable())
+    {
+        _saveThread.join();
+    }
+
+    GlobalStoreSize -= _storeSize;
+
+    Log::info() << "STATISTICS: tilecache [" << _docURL << "] memory hits: " << _stats.memoryHits
+                << ", store hits: " << _stats.storeHits << ", misses: " << _stats.misses
+                << ", evictions: " << _stats.evictions << Log::end;
+}
+
+TileCache::Statistics TileCache::getStatistics() const
+{
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    return _stats;
+}
+
+void TileCache::saveThread()
+{
+    Util::setThreadName("tile_save");
+
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    while (!_stopping || !_saveQueue.empty())
+    {
+        if (_saveQueue.empty())
+        {
+            _saveCond.wait(lock);
+            continue;
+        }
+
+        const auto entry = _saveQueue.front();
+        _saveQueue.pop_front();
+
+        if (_tileStore->save(entry.first, entry.second->data(), entry.second->size()))
+            Log::trace() << "Saved cache tile: " << entry.first << Log::end;
+
+        updateStoreSize();
+        enforceStoreSize();
+    }
+}
+
+void TileCache::updateStoreSize()
+{
+    const size_t newSize = _tileStore->getLiveSize();
+    GlobalStoreSize += newSize - _storeSize;
+    _storeSize = newSize;
+}
+
+void TileCache::enforceStoreSize()
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    while (!_storeLru.empty() &&
+           ((MaxStoreSize != 0 && _storeSize > MaxStoreSize) ||
+            (MaxGlobalStoreSize != 0 && GlobalStoreSize > MaxGlobalStoreSize)))
+    {
+        const std::string victim = _storeLru.back();
+        Log::trace("Evicting tile from store: " + victim);
+        removeTile(victim);
+        ++_stats.evictions;
+        updateStoreSize();
+    }
+}
+
+void TileCache::removeTile(const std::string& cachedName)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    removeMemoryTile(cachedName);
+    _tileStore->remove(cachedName);
+
+    // Drop any not-yet-persisted copy too.
+    for (auto qIt = _saveQueue.begin(); qIt != _saveQueue.end(); )
+    {
+        if (qIt->first == cachedName)
+            qIt = _saveQueue.erase(qIt);
+        else
+            ++qIt;
+    }
+
+    const auto it = _indexedTiles.find(cachedName);
+    if (it != _indexedTiles.end())
+    {
+        auto& bucket = _tileIndex[it->second.part];
+        const auto range = bucket.equal_range(it->second.y);
+        for (auto bucketIt = range.first; bucketIt != range.second; ++bucketIt)
+        {
+            if (bucketIt->second.name == cachedName)
+            {
+                bucket.erase(bucketIt);
+                break;
+            }
+        }
+
+        _storeLru.erase(it->second.lruIt);
+        _indexedTiles.erase(it);
+    }
 }
 
 /// Tracks the rendering of a given tile
@@ -117,48 +254,255 @@ std::shared_ptr<TileCache::TileBeingRendered> TileCache::findTileBeingRendered(c
     return (tile != _tilesBeingRendered.end() ? tile->second : nullptr);
 }
 
-void TileCache::forgetTileBeingRendered(const TileDesc& tile)
+std::vector<std::string> TileCache::forgetTileBeingRendered(const TileDesc& tile)
 {
     const std::string cachedName = cacheFileName(tile);
 
     Util::assertIsLocked(_tilesBeingRenderedMutex);
 
-    _tilesBeingRendered.erase(cachedName);
+    std::vector<std::string> subscribers;
+    const auto it = _tilesBeingRendered.find(cachedName);
+    if (it != _tilesBeingRendered.end())
+    {
+        for (const auto& i: it->second->_subscribers)
+        {
+            auto subscriber = i.lock();
+            if (subscriber)
+            {
+                subscribers.push_back(subscriber->getId());
+            }
+        }
+
+        _tilesBeingRendered.erase(it);
+    }
+
+    return subscribers;
+}
+
+TileCache::Tile TileCache::findMemoryTile(const std::string& cachedName)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const auto it = _memoryTiles.find(cachedName);
+    if (it == _memoryTiles.end())
+        return nullptr;
+
+    // Make it the most-recently-used.
+    _memoryLru.splice(_memoryLru.begin(), _memoryLru, it->second.lruIt);
+    return it->second.data;
+}
+
+void TileCache::saveMemoryTile(const std::string& cachedName, const Tile& tile)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const size_t size = tile->size();
+    if (MaxMemorySize == 0 || size > MaxMemorySize)
+        return;
+
+    removeMemoryTile(cachedName);
+
+    // Evict the least-recently-used entries to make room.
+    while (!_memoryLru.empty() && _memorySize + size > MaxMemorySize)
+    {
+        const auto it = _memoryTiles.find(_memoryLru.back());
+        assert(it != _memoryTiles.end());
+        Log::trace("Evicting tile from memory cache: " + it->first);
+        _memorySize -= it->second.data->size();
+        _memoryTiles.erase(it);
+        _memoryLru.pop_back();
+    }
+
+    _memoryLru.push_front(cachedName);
+    _memoryTiles[cachedName] = MemoryTile{ tile, _memoryLru.begin() };
+    _memorySize += size;
+}
+
+void TileCache::removeMemoryTile(const std::string& cachedName)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const auto it = _memoryTiles.find(cachedName);
+    if (it != _memoryTiles.end())
+    {
+        _memorySize -= it->second.data->size();
+        _memoryLru.erase(it->second.lruIt);
+        _memoryTiles.erase(it);
+    }
+}
+
+void TileCache::addTileToIndex(const std::string& cachedName, int part, int x, int y,
+                               int tileWidth, int tileHeight)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const auto it = _indexedTiles.find(cachedName);
+    if (it != _indexedTiles.end())
+    {
+        // Already indexed; just freshen it.
+        _storeLru.splice(_storeLru.begin(), _storeLru, it->second.lruIt);
+        return;
+    }
+
+    _storeLru.push_front(cachedName);
+    _indexedTiles[cachedName] = IndexedTile{ part, y, _storeLru.begin() };
+    _tileIndex[part].emplace(y, TileLocation{ cachedName, x, y, tileWidth, tileHeight });
+    _maxTileHeight = std::max(_maxTileHeight, tileHeight);
+}
+
+void TileCache::loadTileIndex()
+{
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    // Index everything the store kept; afterwards the index is kept
+    // up-to-date incrementally. Entries from older generations are
+    // unreachable under the current keys; reclaim their space here
+    // instead of deleting the whole cache up front.
+    std::vector<std::string> stale;
+    for (const auto& name : _tileStore->getNames())
+    {
+        unsigned generation;
+        int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+        if (parseCacheFileName(name, generation, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
+        {
+            if (generation == _generation)
+            {
+                addTileToIndex(name, part, tilePosX, tilePosY, tileWidth, tileHeight);
+            }
+            else
+            {
+                stale.push_back(name);
+            }
+        }
+    }
+
+    for (const auto& name : stale)
+    {
+        _tileStore->remove(name);
+    }
+
+    Log::debug() << "Indexed " << _indexedTiles.size() << " cached tiles ("
+                 << stale.size() << " stale reclaimed) in " << _cacheDir << Log::end;
 }
 
-std::unique_ptr<std::fstream> TileCache::lookupTile(const TileDesc& tile)
+TileCache::Tile TileCache::findTile(const TileDesc& tile)
 {
-    const std::string fileName = _cacheDir + "/" + cacheFileName(tile);
+    Util::assertIsLocked(_cacheMutex);
+
+    const std::string cachedName = cacheFileName(tile);
+
+    Tile result = findMemoryTile(cachedName);
+    if (result)
+    {
+        ++_stats.memoryHits;
+        ++Metrics::TileCacheHits;
+    }
+    else
+    {
+        // Second level: the packed store.
+        size_t size = 0;
+        const char* data = _tileStore->lookup(cachedName, size);
+        if (data != nullptr)
+        {
+            result = std::make_shared<std::vector<char>>(data, data + size);
+
+            // Promote the hot tile into the memory layer.
+            saveMemoryTile(cachedName, result);
+            ++_stats.storeHits;
+            ++Metrics::TileCacheHits;
+        }
+        else
+        {
+            ++_stats.misses;
+            ++Metrics::TileCacheMisses;
+        }
+    }
+
+    if (result)
+    {
+        // Freshen the tile for store eviction too.
+        const auto it = _indexedTiles.find(cachedName);
+        if (it != _indexedTiles.end())
+            _storeLru.splice(_storeLru.begin(), _storeLru, it->second.lruIt);
+    }
 
-    std::unique_ptr<std::fstream> result(new std::fstream(fileName, std::ios::in));
     UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
                               tile.getTilePosX(), tile.getTilePosY(),
                               tile.getTileWidth(), tile.getTileHeight(), result);
 
-    if (result && result->is_open())
+    if (result)
     {
-        Log::trace("Found cache tile: " + fileName);
+        Log::trace("Found cache tile: " + cachedName);
         return result;
     }
 
     return nullptr;
 }
 
-void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
+TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
 {
-    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+    std::unique_lock<std::mutex> lock(_cacheMutex);
 
-    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
+    return findTile(tile);
+}
+
+bool TileCache::hasTile(const TileDesc& tile)
+{
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    const std::string cachedName = cacheFileName(tile);
+    size_t size = 0;
+    return findMemoryTile(cachedName) != nullptr ||
+           _tileStore->lookup(cachedName, size) != nullptr;
+}
+
+void TileCache::lookupTiles(const std::vector<TileDesc>& tiles,
+                            std::vector<std::pair<TileDesc, Tile>>& hits,
+                            std::vector<TileDesc>& misses)
+{
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    for (const auto& tile : tiles)
+    {
+        Tile cachedTile = findTile(tile);
+        if (cachedTile)
+        {
+            hits.emplace_back(tile, cachedTile);
+        }
+        else
+        {
+            misses.push_back(tile);
+        }
+    }
+}
 
-    // Save to disk.
-    const auto cachedName = (tileBeingRendered ? tileBeingRendered->getCacheName()
-                                               : cacheFileName(tile));
+std::vector<std::string> TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
+{
+    const auto cachedName = cacheFileName(tile);
+
+    std::vector<std::string> notified;
+
+    // Update the in-memory layer first, so that subsequent lookups hit
+    // without touching the disk. Note the lock order: _cacheMutex is
+    // always taken before _tilesBeingRenderedMutex.
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+
+        // One buffer, shared by the memory layer and the write-behind
+        // queue; the store write happens off the delivery path.
+        auto tileData = std::make_shared<std::vector<char>>(data, data + size);
+        saveMemoryTile(cachedName, tileData);
+        _saveQueue.emplace_back(cachedName, tileData);
+
+        addTileToIndex(cachedName, tile.getPart(), tile.getTilePosX(), tile.getTilePosY(),
+                       tile.getTileWidth(), tile.getTileHeight());
+    }
 
-    // Ignore if we can't save the tile, things will work anyway, but slower. An error indication
-    // has been supposed to be sent to all users in that case.
-    const auto fileName = _cacheDir + "/" + cachedName;
-    if (Util::saveDataToFileSafely(fileName, data, size))
-        Log::trace() << "Saved cache tile: " << fileName << Log::end;
+    _saveCond.notify_one();
+
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
 
     // Notify subscribers, if any.
     if (tileBeingRendered)
@@ -170,7 +514,6 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
             response += '\n';
 
             std::vector<char> output;
-            output.reserve(static_cast<size_t>(4) * tile.getWidth() * tile.getHeight());
             output.resize(response.size());
             std::memcpy(output.data(), response.data(), response.size());
 
@@ -178,6 +521,9 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
             output.resize(pos + size);
             std::memcpy(output.data() + pos, data, size);
 
+            // One shared payload for all the subscribers.
+            const auto message = std::make_shared<Message>(std::move(output), Message::Type::Binary);
+
             for (const auto& i: tileBeingRendered->_subscribers)
             {
                 auto subscriber = i.lock();
@@ -185,12 +531,16 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
                 {
                     try
                     {
-                        subscriber->sendBinaryFrame(output.data(), output.size());
+                        subscriber->enqueueSendMessage(message);
                     }
                     catch (const std::exception& ex)
                     {
                         Log::warn("Failed to send tile to " + subscriber->getName() + ": " + ex.what());
                     }
+
+                    // Queued or not, the render this session waited
+                    // for is done; free its slot either way.
+                    notified.push_back(subscriber->getId());
                 }
             }
         }
@@ -202,8 +552,10 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
         // Remove subscriptions.
         if (tileBeingRendered->getVersion() <= tile.getVersion())
         {
+            const auto elapsedMs = tileBeingRendered->getElapsedTimeMs();
+            Histogram::get("tile_roundtrip").record(elapsedMs * 1000.);
             Log::debug() << "STATISTICS: tile " << tile.getVersion() << " internal roundtrip "
-                         << tileBeingRendered->getElapsedTimeMs() << " ms." << Log::end;
+                         << elapsedMs << " ms." << Log::end;
             _tilesBeingRendered.erase(cachedName);
         }
     }
@@ -211,6 +563,8 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
     {
         Log::debug("No subscribers for: " + cachedName);
     }
+
+    return notified;
 }
 
 std::string TileCache::getTextFile(const std::string& fileName)
@@ -302,23 +656,59 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
                  << ", width: " << width
                  << ", height: " << height << Log::end;
 
-    File dir(_cacheDir);
-
     std::unique_lock<std::mutex> lock(_cacheMutex);
     std::unique_lock<std::mutex> lockSubscribers(_tilesBeingRenderedMutex);
 
-    if (dir.exists() && dir.isDirectory())
+    // Visit only tiles of the affected part whose y-range can intersect,
+    // instead of scanning the whole cache directory.
+    const int bottom = (height > INT_MAX - y ? INT_MAX : y + height);
+    for (auto& partIndex : _tileIndex)
     {
-        for (auto tileIterator = DirectoryIterator(dir); tileIterator != DirectoryIterator(); ++tileIterator)
+        if (part != -1 && partIndex.first != part)
+            continue;
+
+        auto& bucket = partIndex.second;
+        auto it = bucket.lower_bound(y - _maxTileHeight);
+        const auto end = bucket.upper_bound(bottom);
+        while (it != end)
         {
-            const std::string fileName = tileIterator.path().getFileName();
-            if (intersectsTile(fileName, part, x, y, width, height))
+            const auto& loc = it->second;
+            const int left = std::max(x, loc.x);
+            const int right = std::min(x + width, loc.x + loc.width);
+            const int top = std::max(y, loc.y);
+            const int bot = std::min(bottom, loc.y + loc.height);
+            if (left <= right && top <= bot)
+            {
+                Log::debug("Removing tile: " + loc.name);
+                removeMemoryTile(loc.name);
+                _tileStore->remove(loc.name);
+
+                // Drop any not-yet-persisted copy too.
+                for (auto qIt = _saveQueue.begin(); qIt != _saveQueue.end(); )
+                {
+                    if (qIt->first == loc.name)
+                        qIt = _saveQueue.erase(qIt);
+                    else
+                        ++qIt;
+                }
+
+                const auto idxIt = _indexedTiles.find(loc.name);
+                if (idxIt != _indexedTiles.end())
+                {
+                    _storeLru.erase(idxIt->second.lruIt);
+                    _indexedTiles.erase(idxIt);
+                }
+
+                it = bucket.erase(it);
+            }
+            else
             {
-                Log::debug("Removing tile: " + tileIterator.path().toString());
-                Util::removeFile(tileIterator.path());
+                ++it;
             }
         }
     }
+
+    updateStoreSize();
 }
 
 void TileCache::invalidateTiles(const std::string& tiles)
@@ -361,35 +751,17 @@ void TileCache::removeFile(const std::string& fileName)
 std::string TileCache::cacheFileName(const TileDesc& tile)
 {
     std::ostringstream oss;
-    oss << tile.getPart() << '_' << tile.getWidth() << 'x' << tile.getHeight() << '.'
+    oss << _generation << '-'
+        << tile.getPart() << '_' << tile.getWidth() << 'x' << tile.getHeight() << '.'
         << tile.getTilePosX() << ',' << tile.getTilePosY() << '.'
-        << tile.getTileWidth() << 'x' << tile.getTileHeight() << ".png";
+        << tile.getTileWidth() << 'x' << tile.getTileHeight()
+        << (tile.getFormat() == TILEFORMAT_RAWZ ? ".rawz" : ".png");
     return oss.str();
 }
 
-bool TileCache::parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight) const
+bool TileCache::parseCacheFileName(const std::string& fileName, unsigned& generation, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight) const
 {
-    return (std::sscanf(fileName.c_str(), "%d_%dx%d.%d,%d.%dx%d.png", &part, &width, &height, &tilePosX, &tilePosY, &tileWidth, &tileHeight) == 7);
-}
-
-bool TileCache::intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height) const
-{
-    int tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight;
-    if (parseCacheFileName(fileName, tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight))
-    {
-        if (part != -1 && tilePart != part)
-            return false;
-
-        const int left = std::max(x, tilePosX);
-        const int right = std::min(x + width, tilePosX + tileWidth);
-        const int top = std::max(y, tilePosY);
-        const int bottom = std::min(y + height, tilePosY + tileHeight);
-
-        if (left <= right && top <= bottom)
-            return true;
-    }
-
-    return false;
+    return (std::sscanf(fileName.c_str(), "%u-%d_%dx%d.%d,%d.%dx%d.png", &generation, &part, &width, &height, &tilePosX, &tilePosY, &tileWidth, &tileHeight) == 8);
 }
 
 Timestamp TileCache::getLastModified()
@@ -414,11 +786,11 @@ void TileCache::saveLastModified(const Timestamp& timestamp)
 }
 
 // FIXME: to be further simplified when we centralize tile messages.
-void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared_ptr<ClientSession> &subscriber)
+void TileCache::subscribeToTile(const TileDesc& tile, const std::shared_ptr<ClientSession>& subscriber)
 {
     assert(subscriber->getKind() == LOOLSession::Kind::ToClient);
 
-    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+    Util::assertIsLocked(_tilesBeingRenderedMutex);
 
     std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
 
@@ -465,6 +837,24 @@ void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared
     }
 }
 
+void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared_ptr<ClientSession> &subscriber)
+{
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    subscribeToTile(tile, subscriber);
+}
+
+void TileCache::subscribeToTileRendering(const std::vector<TileDesc>& tiles,
+                                         const std::shared_ptr<ClientSession> &subscriber)
+{
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    for (const auto& tile : tiles)
+    {
+        subscribeToTile(tile, subscriber);
+    }
+}
+
 std::string TileCache::cancelTiles(const std::shared_ptr<ClientSession> &subscriber)
 {
     assert(subscriber && "cancelTiles expects valid subscriber");
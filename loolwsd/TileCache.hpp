@@ -10,15 +10,22 @@
 #ifndef INCLUDED_TILECACHE_HPP
 #define INCLUDED_TILECACHE_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iosfwd>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Poco/Timestamp.h>
 
 #include "TileDesc.hpp"
+#include "TileStore.hpp"
 
 class ClientSession;
 
@@ -30,6 +37,9 @@ class TileCache
     std::shared_ptr<TileBeingRendered> findTileBeingRendered(const TileDesc& tile);
 
 public:
+    /// The in-memory data of a cached tile.
+    using Tile = std::shared_ptr<std::vector<char>>;
+
     /// When the docURL is a non-file:// url, the timestamp has to be provided by the caller.
     /// For file:// url's, it's ignored.
     /// When it is missing for non-file:// url, it is assumed the document must be read, and no cached value used.
@@ -42,12 +52,32 @@ public:
     /// Otherwise returns 0 to signify a subscription exists.
     void subscribeToTileRendering(const TileDesc& tile, const std::shared_ptr<ClientSession> &subscriber);
 
+    /// Subscribes to all the given tiles under a single lock.
+    void subscribeToTileRendering(const std::vector<TileDesc>& tiles,
+                                  const std::shared_ptr<ClientSession> &subscriber);
+
     /// Cancels all tile requests by the given subscriber.
     std::string cancelTiles(const std::shared_ptr<ClientSession> &subscriber);
 
-    std::unique_ptr<std::fstream> lookupTile(const TileDesc& tile);
+    /// Find the tile, first in the in-memory LRU layer, then on disk.
+    /// Disk hits are promoted into memory. Returns nullptr on miss.
+    Tile lookupTile(const TileDesc& tile);
+
+    /// Resolve all tiles of a combined request against the cache in a
+    /// single pass under one lock. Hits are returned paired with their
+    /// data; the descriptors still needing rendering are appended to misses.
+    void lookupTiles(const std::vector<TileDesc>& tiles,
+                     std::vector<std::pair<TileDesc, Tile>>& hits,
+                     std::vector<TileDesc>& misses);
 
-    void saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size);
+    /// Presence probe: true when the tile is in the memory layer or
+    /// the store. Counts in no statistics and promotes nothing.
+    bool hasTile(const TileDesc& tile);
+
+    /// Save the rendered tile and send it to its subscribers.
+    /// Returns the session ids the tile was delivered to, one entry
+    /// per subscriber, so the broker can release their render slots.
+    std::vector<std::string> saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size);
 
     std::string getTextFile(const std::string& fileName);
 
@@ -71,19 +101,86 @@ public:
 
     std::unique_lock<std::mutex> getTilesBeingRenderedLock() { return std::unique_lock<std::mutex>(_tilesBeingRenderedMutex); }
 
-    void forgetTileBeingRendered(const TileDesc& tile);
+    /// Drop the in-flight record of a tile render. Returns the session
+    /// ids that were subscribed to it and now get no tile.
+    /// Expects the lock from getTilesBeingRenderedLock() to be held.
+    std::vector<std::string> forgetTileBeingRendered(const TileDesc& tile);
+
+    /// Set the process-wide budget, in bytes, for the in-memory tile layer
+    /// of each document. Zero disables the memory layer altogether.
+    static void setMaxMemorySize(const size_t size) { MaxMemorySize = size; }
+
+    /// Set the per-document budget, in bytes, for the persistent tile
+    /// store. Zero for unlimited.
+    static void setMaxStoreSize(const size_t size) { MaxStoreSize = size; }
+
+    /// Set the budget, in bytes, for the persistent tile stores of all
+    /// documents together. Zero for unlimited.
+    static void setMaxGlobalStoreSize(const size_t size) { MaxGlobalStoreSize = size; }
+
+    /// Cache effectiveness counters, for sizing the budgets from real data.
+    struct Statistics
+    {
+        size_t memoryHits = 0;
+        size_t storeHits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+    };
+
+    Statistics getStatistics() const;
 
 private:
+    /// Find a tile in the memory layer or the store, promoting and
+    /// freshening on a hit. Expects _cacheMutex to be locked.
+    Tile findTile(const TileDesc& tile);
+
+    /// Subscribe one session to one tile being rendered.
+    /// Expects _tilesBeingRenderedMutex to be locked.
+    void subscribeToTile(const TileDesc& tile, const std::shared_ptr<ClientSession>& subscriber);
+
+    /// Get the in-memory tile, if any, and make it most-recently-used.
+    /// Expects _cacheMutex to be locked.
+    Tile findMemoryTile(const std::string& cachedName);
+
+    /// Insert (or replace) an in-memory tile, evicting
+    /// least-recently-used entries to stay within budget.
+    /// Expects _cacheMutex to be locked.
+    void saveMemoryTile(const std::string& cachedName, const Tile& tile);
+
+    /// Drop an in-memory tile, if present. Expects _cacheMutex to be locked.
+    void removeMemoryTile(const std::string& cachedName);
+
+    /// Add a cached tile to the spatial index, if not indexed already,
+    /// and make it most-recently-used. Expects _cacheMutex to be locked.
+    void addTileToIndex(const std::string& cachedName, int part, int x, int y,
+                        int tileWidth, int tileHeight);
+
+    /// Remove a tile from the index, the memory layer and the store.
+    /// Expects _cacheMutex to be locked.
+    void removeTile(const std::string& cachedName);
+
+    /// Evict least-recently-used tiles until the store is within both
+    /// the per-document and the global budget.
+    /// Expects _cacheMutex to be locked.
+    void enforceStoreSize();
+
+    /// Adjust the global store size accounting after store mutations.
+    /// Expects _cacheMutex to be locked.
+    void updateStoreSize();
+
+    /// Populate the spatial index from the packed tile store at startup.
+    void loadTileIndex();
+
+    /// The write-behind thread: persists queued tiles into the store.
+    void saveThread();
+
     void invalidateTiles(int part, int x, int y, int width, int height);
 
     // Removes the given file from the cache
     void removeFile(const std::string& fileName);
 
     std::string cacheFileName(const TileDesc& tile);
-    bool parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight) const;
-
-    /// Extract location from fileName, and check if it intersects with [x, y, width, height].
-    bool intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height) const;
+    bool parseCacheFileName(const std::string& fileName, unsigned& generation, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight) const;
 
     /// Load the timestamp from modtime.txt.
     Poco::Timestamp getLastModified();
@@ -92,7 +189,85 @@ private:
 
     const std::string _cacheDir;
 
-    std::mutex _cacheMutex;
+    /// The packed, memory-mapped second-level tile store.
+    std::unique_ptr<TileStore> _tileStore;
+
+    /// The in-memory LRU layer in front of the file store.
+    /// An entry holds the tile data and its position in _memoryLru.
+    struct MemoryTile
+    {
+        Tile data;
+        std::list<std::string>::iterator lruIt;
+    };
+
+    static size_t MaxMemorySize;
+
+    static size_t MaxStoreSize;
+
+    static size_t MaxGlobalStoreSize;
+
+    /// Live bytes in all documents' stores together.
+    static std::atomic<size_t> GlobalStoreSize;
+
+    /// Location and extent of a cached tile, in twips.
+    struct TileLocation
+    {
+        std::string name;
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    /// Spatial index of every cached tile: part -> tilePosY -> location,
+    /// so invalidation visits only the affected y-range of the right part.
+    std::map<int, std::multimap<int, TileLocation>> _tileIndex;
+
+    /// Bookkeeping of an indexed tile: its spatial bucket and its
+    /// position in _storeLru.
+    struct IndexedTile
+    {
+        int part;
+        int y;
+        std::list<std::string>::iterator lruIt;
+    };
+
+    /// All indexed tiles, for duplicate detection and eviction by name.
+    std::map<std::string, IndexedTile> _indexedTiles;
+
+    /// Cached tile names, most-recently-used first, for store eviction.
+    std::list<std::string> _storeLru;
+
+    /// This document's contribution to GlobalStoreSize.
+    size_t _storeSize = 0;
+
+    Statistics _stats;
+
+    /// The tallest tile seen, bounding the index range scans.
+    int _maxTileHeight = 0;
+
+    /// The document generation, part of every tile key; bumped when
+    /// the document changed behind our back, so stale entries become
+    /// unreachable instead of forcing a full cache wipe.
+    unsigned _generation = 0;
+
+    std::map<std::string, MemoryTile> _memoryTiles;
+
+    /// Cache file names, most-recently-used first.
+    std::list<std::string> _memoryLru;
+
+    size_t _memorySize = 0;
+
+    /// Tiles queued for write-behind persistence, oldest first.
+    std::deque<std::pair<std::string, Tile>> _saveQueue;
+
+    std::thread _saveThread;
+
+    std::condition_variable _saveCond;
+
+    bool _stopping = false;
+
+    mutable std::mutex _cacheMutex;
 
     mutable std::mutex _tilesBeingRenderedMutex;
 
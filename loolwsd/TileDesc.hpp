@@ -11,21 +11,74 @@
 #define INCLUDED_TILEDESC_HPP
 
 #include <cassert>
-#include <map>
-#include <sstream>
+#include <cstring>
 #include <string>
 
-#include <Poco/StringTokenizer.h>
-
 #include "Exceptions.hpp"
 #include "LOOLProtocol.hpp"
 
+/// Wire formats for tile payloads, carried in the optional 'format'
+/// attribute of tile messages. PNG remains the default.
+enum TileFormat : int
+{
+    TILEFORMAT_PNG = 0,
+    /// Unpremultiplied RGBA pixels, zlib-deflated. A CPU-cheap
+    /// alternative for deployments with bandwidth to spare.
+    TILEFORMAT_RAWZ = 1
+};
+
+/// Minimal integer-to-chars helpers for the tile serializers below:
+/// they run for every tile message in both wsd and kit, so they write
+/// into a caller-provided stack buffer instead of going through
+/// ostringstream or std::to_string.
+namespace tiledetail
+{
+    /// Appends the decimal form of value at p; returns the new end.
+    inline char* appendInt(char* p, int value)
+    {
+        if (value < 0)
+        {
+            *p++ = '-';
+            value = -value;
+        }
+
+        char digits[12];
+        char* d = digits;
+        do
+        {
+            *d++ = static_cast<char>('0' + (value % 10));
+            value /= 10;
+        }
+        while (value > 0);
+
+        while (d != digits)
+        {
+            *p++ = *(--d);
+        }
+
+        return p;
+    }
+
+    /// Appends " name=value" at p; returns the new end.
+    inline char* appendPair(char* p, const char* name, int value)
+    {
+        *p++ = ' ';
+        while (*name)
+        {
+            *p++ = *name++;
+        }
+
+        *p++ = '=';
+        return appendInt(p, value);
+    }
+}
+
 /// Tile Descriptor
 /// Represents a tile's coordinates and dimensions.
 class TileDesc
 {
 public:
-    TileDesc(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, int ver = -1, int imgSize = 0, int id = -1) :
+    TileDesc(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, int ver = -1, int imgSize = 0, int id = -1, int format = TILEFORMAT_PNG) :
         _part(part),
         _width(width),
         _height(height),
@@ -35,7 +88,8 @@ public:
         _tileHeight(tileHeight),
         _ver(ver),
         _imgSize(imgSize),
-        _id(id)
+        _id(id),
+        _format(format)
     {
         if (_part < 0 ||
             _width <= 0 ||
@@ -62,6 +116,7 @@ public:
     int getImgSize() const { return _imgSize; }
     void setImgSize(const int imgSize) { _imgSize = imgSize; }
     int getId() const { return _id; }
+    int getFormat() const { return _format; }
 
     bool intersectsWithRect(int x, int y, int w, int h) const
     {
@@ -110,68 +165,157 @@ public:
     /// Optionally prepend a prefix.
     std::string serialize(const std::string& prefix = "") const
     {
-        std::ostringstream oss;
-        oss << prefix
-            << " part=" << _part
-            << " width=" << _width
-            << " height=" << _height
-            << " tileposx=" << _tilePosX
-            << " tileposy=" << _tilePosY
-            << " tilewidth=" << _tileWidth
-            << " tileheight=" << _tileHeight
-            << " ver=" << _ver;
+        // 11 pairs of at most ~22 characters each.
+        char buffer[256];
+        char* p = buffer;
+        p = tiledetail::appendPair(p, "part", _part);
+        p = tiledetail::appendPair(p, "width", _width);
+        p = tiledetail::appendPair(p, "height", _height);
+        p = tiledetail::appendPair(p, "tileposx", _tilePosX);
+        p = tiledetail::appendPair(p, "tileposy", _tilePosY);
+        p = tiledetail::appendPair(p, "tilewidth", _tileWidth);
+        p = tiledetail::appendPair(p, "tileheight", _tileHeight);
+        p = tiledetail::appendPair(p, "ver", _ver);
 
         if (_imgSize > 0)
         {
-            oss << " imgsize=" << _imgSize;
+            p = tiledetail::appendPair(p, "imgsize", _imgSize);
         }
 
         if (_id >= 0)
         {
-            oss << " id=" << _id;
+            p = tiledetail::appendPair(p, "id", _id);
+        }
+
+        if (_format != TILEFORMAT_PNG)
+        {
+            p = tiledetail::appendPair(p, "format", _format);
         }
 
-        return oss.str();
+        std::string res = prefix;
+        res.append(buffer, p - buffer);
+        return res;
     }
 
-    /// Deserialize a TileDesc from a tokenized string.
+    /// Deserialize a TileDesc from a message, in a single pass.
+    /// Fixed-field decoding: every " name=value" pair is decoded in
+    /// place and dispatched on the key length; no tokenizing, no
+    /// copies, no allocation. Pairs with an unknown key or a
+    /// non-integer value are skipped, so messages carrying extra
+    /// attributes (renderid, shmpos) parse unchanged. This is the
+    /// most parsed type in the system - it runs per tile message in
+    /// both wsd and kit - hence the care.
     static
-    TileDesc parse(const Poco::StringTokenizer& tokens)
+    TileDesc parse(const char* data, const size_t size)
     {
-        // We don't expect undocumented fields and
-        // assume all values to be int.
-        std::map<std::string, int> pairs;
-
-        // Optional.
-        pairs["ver"] = -1;
-        pairs["imgsize"] = 0;
-        pairs["id"] = -1;
+        // Defaults for the optional fields.
+        int part = 0;
+        int width = 0;
+        int height = 0;
+        int tilePosX = 0;
+        int tilePosY = 0;
+        int tileWidth = 0;
+        int tileHeight = 0;
+        int ver = -1;
+        int imgSize = 0;
+        int id = -1;
+        int format = TILEFORMAT_PNG;
 
-        for (size_t i = 0; i < tokens.count(); ++i)
+        const char* p = data;
+        const char* const end = data + size;
+        while (p < end)
         {
-            std::string name;
-            int value = -1;
-            if (LOOLProtocol::parseNameIntegerPair(tokens[i], name, value))
+            // The key, up to '='; a token without one (e.g. the
+            // command prefix) is skipped whole.
+            while (p < end && *p == ' ')
+                ++p;
+
+            const char* const key = p;
+            while (p < end && *p != '=' && *p != ' ')
+                ++p;
+
+            if (p == end || *p != '=')
+                continue;
+
+            const size_t keyLen = p - key;
+            ++p;
+
+            // The value; anything non-integer means the pair is not ours.
+            bool negative = false;
+            if (p < end && *p == '-')
             {
-                pairs[name] = value;
+                negative = true;
+                ++p;
+            }
+
+            const bool haveDigits = (p < end && *p >= '0' && *p <= '9');
+            int value = 0;
+            while (p < end && *p >= '0' && *p <= '9')
+            {
+                value = value * 10 + (*p++ - '0');
+            }
+
+            if (!haveDigits || (p < end && *p != ' '))
+            {
+                while (p < end && *p != ' ')
+                    ++p;
+
+                continue;
+            }
+
+            if (negative)
+            {
+                value = -value;
+            }
+
+            switch (keyLen)
+            {
+            case 2:
+                if (std::memcmp(key, "id", 2) == 0) { id = value; }
+                break;
+            case 3:
+                if (std::memcmp(key, "ver", 3) == 0) { ver = value; }
+                break;
+            case 4:
+                if (std::memcmp(key, "part", 4) == 0) { part = value; }
+                break;
+            case 5:
+                if (std::memcmp(key, "width", 5) == 0) { width = value; }
+                break;
+            case 6:
+                if (std::memcmp(key, "height", 6) == 0) { height = value; }
+                else if (std::memcmp(key, "format", 6) == 0) { format = value; }
+                break;
+            case 7:
+                if (std::memcmp(key, "imgsize", 7) == 0) { imgSize = value; }
+                break;
+            case 8:
+                if (std::memcmp(key, "tilepos", 7) == 0)
+                {
+                    if (key[7] == 'x') { tilePosX = value; }
+                    else if (key[7] == 'y') { tilePosY = value; }
+                }
+                break;
+            case 9:
+                if (std::memcmp(key, "tilewidth", 9) == 0) { tileWidth = value; }
+                break;
+            case 10:
+                if (std::memcmp(key, "tileheight", 10) == 0) { tileHeight = value; }
+                break;
+            default:
+                break;
             }
         }
 
-        return TileDesc(pairs["part"], pairs["width"], pairs["height"],
-                        pairs["tileposx"], pairs["tileposy"],
-                        pairs["tilewidth"], pairs["tileheight"],
-                        pairs["ver"],
-                        pairs["imgsize"], pairs["id"]);
+        return TileDesc(part, width, height, tilePosX, tilePosY,
+                        tileWidth, tileHeight, ver, imgSize, id, format);
     }
 
     /// Deserialize a TileDesc from a string format.
     static
     TileDesc parse(const std::string& message)
     {
-        Poco::StringTokenizer tokens(message, " ",
-                                     Poco::StringTokenizer::TOK_IGNORE_EMPTY |
-                                     Poco::StringTokenizer::TOK_TRIM);
-        return parse(tokens);
+        return parse(message.data(), message.size());
     }
 
 private:
@@ -185,6 +329,7 @@ private:
     int _ver;       //< Versioning support.
     int _imgSize;   //< Used for responses.
     int _id;
+    int _format;    //< The payload wire format.
 };
 
 /// One or more tile header.
@@ -196,14 +341,15 @@ private:
     TileCombined(int part, int width, int height,
                  const std::string& tilePositionsX, const std::string& tilePositionsY,
                  int tileWidth, int tileHeight, int ver = -1,
-                 const std::string& imgSizes = "", int id = -1) :
+                 const std::string& imgSizes = "", int id = -1, int format = TILEFORMAT_PNG) :
         _part(part),
         _width(width),
         _height(height),
         _tileWidth(tileWidth),
         _tileHeight(tileHeight),
         _ver(ver),
-        _id(id)
+        _id(id),
+        _format(format)
     {
         if (_part < 0 ||
             _width <= 0 ||
@@ -214,9 +360,9 @@ private:
             throw BadArgumentException("Invalid tilecombine descriptor.");
         }
 
-        Poco::StringTokenizer positionXtokens(tilePositionsX, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-        Poco::StringTokenizer positionYtokens(tilePositionsY, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-        Poco::StringTokenizer sizeTokens(imgSizes, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        LOOLProtocol::Tokenizer positionXtokens(tilePositionsX, ',');
+        LOOLProtocol::Tokenizer positionYtokens(tilePositionsY, ',');
+        LOOLProtocol::Tokenizer sizeTokens(imgSizes, ',');
 
         const auto numberOfPositions = positionYtokens.count();
 
@@ -246,7 +392,7 @@ private:
                 throw BadArgumentException("Invalid tilecombine descriptor.");
             }
 
-            _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, size, id);
+            _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, size, id, format);
         }
     }
 
@@ -259,6 +405,7 @@ public:
     int getTileHeight() const { return _tileHeight; }
     int getVersion() const { return _ver; }
     void setVersion(const int ver) { _ver = ver; }
+    int getFormat() const { return _format; }
 
     const std::vector<TileDesc>& getTiles() const { return _tiles; }
     std::vector<TileDesc>& getTiles() { return _tiles; }
@@ -267,109 +414,118 @@ public:
     /// Optionally prepend a prefix.
     std::string serialize(const std::string& prefix = "") const
     {
-        std::ostringstream oss;
-        oss << prefix
-            << " part=" << _part
-            << " width=" << _width
-            << " height=" << _height
-            << " tileposx=";
+        std::string res = prefix;
+        res.reserve(res.size() + 128 + 12 * 3 * _tiles.size());
+
+        char buffer[128];
+        char* p = buffer;
+        p = tiledetail::appendPair(p, "part", _part);
+        p = tiledetail::appendPair(p, "width", _width);
+        p = tiledetail::appendPair(p, "height", _height);
+        res.append(buffer, p - buffer);
+
+        res.append(" tileposx=");
         for (const auto& tile : _tiles)
         {
-            oss << tile.getTilePosX() << ',';
+            p = tiledetail::appendInt(buffer, tile.getTilePosX());
+            *p++ = ',';
+            res.append(buffer, p - buffer);
         }
 
-        oss.seekp(-1, std::ios_base::cur); // Remove last comma.
+        res.pop_back(); // Remove last comma.
 
-        oss << " tileposy=";
+        res.append(" tileposy=");
         for (const auto& tile : _tiles)
         {
-            oss << tile.getTilePosY() << ',';
+            p = tiledetail::appendInt(buffer, tile.getTilePosY());
+            *p++ = ',';
+            res.append(buffer, p - buffer);
         }
 
-        oss.seekp(-1, std::ios_base::cur); // Remove last comma.
+        res.pop_back(); // Remove last comma.
 
-        oss << " imgsize=";
+        res.append(" imgsize=");
         for (const auto& tile : _tiles)
         {
-            oss << tile.getImgSize() << ',';
+            p = tiledetail::appendInt(buffer, tile.getImgSize());
+            *p++ = ',';
+            res.append(buffer, p - buffer);
         }
 
-        oss.seekp(-1, std::ios_base::cur); // Remove last comma.
+        res.pop_back(); // Remove last comma.
+
+        p = buffer;
+        p = tiledetail::appendPair(p, "tilewidth", _tileWidth);
+        p = tiledetail::appendPair(p, "tileheight", _tileHeight);
 
-        oss << " tilewidth=" << _tileWidth
-            << " tileheight=" << _tileHeight;
         if (_ver >= 0)
         {
-            oss << " ver=" << _ver;
+            p = tiledetail::appendPair(p, "ver", _ver);
         }
 
         if (_id >= 0)
         {
-            oss << " id=" << _id;
+            p = tiledetail::appendPair(p, "id", _id);
         }
 
-        return oss.str();
+        if (_format != TILEFORMAT_PNG)
+        {
+            p = tiledetail::appendPair(p, "format", _format);
+        }
+
+        res.append(buffer, p - buffer);
+        return res;
     }
 
     /// Deserialize a TileDesc from a tokenized string.
     static
-    TileCombined parse(const Poco::StringTokenizer& tokens)
+    TileCombined parse(const LOOLProtocol::Tokenizer& tokens)
     {
-        // We don't expect undocumented fields and
-        // assume all values to be int.
-        std::map<std::string, int> pairs;
-
-        // Optional.
-        pairs["ver"] = -1;
-        pairs["id"] = -1;
+        // We don't expect undocumented fields and, except for the
+        // position/size lists, assume all values to be int.
+        int part = 0;
+        int width = 0;
+        int height = 0;
+        int tileWidth = 0;
+        int tileHeight = 0;
+        int ver = -1;
+        int id = -1;
+        int format = TILEFORMAT_PNG;
 
         std::string tilePositionsX;
         std::string tilePositionsY;
         std::string imgSizes;
+
+        using LOOLProtocol::getTokenInteger;
+        using LOOLProtocol::getTokenString;
         for (size_t i = 0; i < tokens.count(); ++i)
         {
-            std::string name;
-            std::string value;
-            if (LOOLProtocol::parseNameValuePair(tokens[i], name, value))
-            {
-                if (name == "tileposx")
-                {
-                    tilePositionsX = value;
-                }
-                else if (name == "tileposy")
-                {
-                    tilePositionsY = value;
-                }
-                else if (name == "imgsize")
-                {
-                    imgSizes = value;
-                }
-                else
-                {
-                    int v = 0;
-                    if (LOOLProtocol::stringToInteger(value, v))
-                    {
-                        pairs[name] = v;
-                    }
-                }
-            }
+            const auto& token = tokens[i];
+            int value = 0;
+            if (getTokenString(token, "tileposx", tilePositionsX)) { }
+            else if (getTokenString(token, "tileposy", tilePositionsY)) { }
+            else if (getTokenString(token, "imgsize", imgSizes)) { }
+            else if (getTokenInteger(token, "part", value)) { part = value; }
+            else if (getTokenInteger(token, "width", value)) { width = value; }
+            else if (getTokenInteger(token, "height", value)) { height = value; }
+            else if (getTokenInteger(token, "tilewidth", value)) { tileWidth = value; }
+            else if (getTokenInteger(token, "tileheight", value)) { tileHeight = value; }
+            else if (getTokenInteger(token, "ver", value)) { ver = value; }
+            else if (getTokenInteger(token, "id", value)) { id = value; }
+            else if (getTokenInteger(token, "format", value)) { format = value; }
         }
 
-        return TileCombined(pairs["part"], pairs["width"], pairs["height"],
+        return TileCombined(part, width, height,
                             tilePositionsX, tilePositionsY,
-                            pairs["tilewidth"], pairs["tileheight"],
-                            pairs["ver"],
-                            imgSizes, pairs["id"]);
+                            tileWidth, tileHeight, ver,
+                            imgSizes, id, format);
     }
 
     /// Deserialize a TileDesc from a string format.
     static
     TileCombined parse(const std::string& message)
     {
-        Poco::StringTokenizer tokens(message, " ",
-                                     Poco::StringTokenizer::TOK_IGNORE_EMPTY |
-                                     Poco::StringTokenizer::TOK_TRIM);
-        return parse(tokens);
+        return parse(LOOLProtocol::Tokenizer(message));
     }
 
     static
@@ -377,19 +533,20 @@ public:
     {
         assert(!tiles.empty());
 
-        std::ostringstream xs;
-        std::ostringstream ys;
+        std::string xs;
+        std::string ys;
         int ver = -1;
 
         for (auto& tile : tiles)
         {
-            xs << tile.getTilePosX() << ',';
-            ys << tile.getTilePosY() << ',';
+            xs.append(std::to_string(tile.getTilePosX())).append(1, ',');
+            ys.append(std::to_string(tile.getTilePosY())).append(1, ',');
             ver = std::max(tile.getVersion(), ver);
         }
 
         return TileCombined(tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
-                            xs.str(), ys.str(), tiles[0].getTileWidth(), tiles[0].getTileHeight(), ver, "", -1);
+                            xs, ys, tiles[0].getTileWidth(), tiles[0].getTileHeight(), ver, "", -1,
+                            tiles[0].getFormat());
     }
 
 private:
@@ -401,6 +558,7 @@ private:
     int _tileHeight;
     int _ver;       //< Versioning support.
     int _id;
+    int _format;    //< The payload wire format.
 };
 
 #endif
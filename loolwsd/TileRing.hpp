@@ -0,0 +1,233 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILERING_HPP
+#define INCLUDED_TILERING_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Log.hpp"
+
+/// A single-producer, single-consumer ring of tile payloads in a
+/// file mapped by both processes: the kit writes the encoded tiles,
+/// wsd reads them straight into the cache. The file lives inside the
+/// jail (/tmp/... for the kit, childroot/<jailId>/tmp/... for wsd),
+/// so both map the very same pages and the payload bytes never cross
+/// the prisoner socket; the tile message carries only a position.
+///
+/// Positions are absolute, monotonically increasing byte counters;
+/// the offset in the file is the position modulo the capacity.
+/// Records are contiguous: the writer pads up to the wrap boundary
+/// when a record would straddle it, and since records are consumed
+/// in message order, the reader releasing a later record implicitly
+/// frees any padding before it.
+class TileRing
+{
+    /// Lives at the start of the mapped file.
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t capacity;
+        /// Bytes produced; written by the kit only.
+        std::atomic<uint64_t> head;
+        /// Bytes consumed; written by wsd only.
+        std::atomic<uint64_t> tail;
+    };
+
+    static constexpr uint64_t Magic = 0x4C4F4F4C52494E47ull; // "LOOLRING"
+
+    TileRing(const int fd, void* map, const size_t mapSize) :
+        _fd(fd),
+        _map(map),
+        _mapSize(mapSize),
+        _header(static_cast<Header*>(map)),
+        _data(static_cast<char*>(map) + sizeof(Header))
+    {
+    }
+
+    /// Records are 8-byte aligned so the header atomics stay so too.
+    static uint64_t align(const uint64_t length)
+    {
+        return (length + 7) & ~static_cast<uint64_t>(7);
+    }
+
+public:
+    static constexpr size_t DefaultCapacity = 16 * 1024 * 1024;
+
+    ~TileRing()
+    {
+        munmap(_map, _mapSize);
+        close(_fd);
+    }
+
+    TileRing(const TileRing&) = delete;
+    TileRing& operator=(const TileRing&) = delete;
+
+    /// The ring file of the given document, relative to the jail root.
+    static std::string ringPath(const std::string& docKey)
+    {
+        return "/tmp/tilering-" + std::to_string(std::hash<std::string>()(docKey));
+    }
+
+    /// Create the ring file; the kit side.
+    /// Returns nullptr (and logs) on failure; callers fall back to
+    /// sending the payloads inline over the socket.
+    static std::shared_ptr<TileRing> create(const std::string& path, const size_t capacity)
+    {
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0)
+        {
+            Log::syserror("Failed to create tile ring [" + path + "].");
+            return nullptr;
+        }
+
+        const size_t mapSize = sizeof(Header) + capacity;
+        void* map = MAP_FAILED;
+        if (ftruncate(fd, mapSize) != 0 ||
+            (map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+            Log::syserror("Failed to size or map tile ring [" + path + "].");
+            close(fd);
+            return nullptr;
+        }
+
+        auto header = static_cast<Header*>(map);
+        header->capacity = capacity;
+        header->head.store(0);
+        header->tail.store(0);
+        // The magic goes last, so the reader never sees a half-made ring.
+        header->magic = Magic;
+
+        Log::info("Created tile ring [" + path + "] of " + std::to_string(capacity) + " bytes.");
+        return std::shared_ptr<TileRing>(new TileRing(fd, map, mapSize));
+    }
+
+    /// Open the ring the kit created; the wsd side.
+    static std::shared_ptr<TileRing> open(const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+        {
+            Log::syserror("Failed to open tile ring [" + path + "].");
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= sizeof(Header))
+        {
+            Log::error("Tile ring [" + path + "] is missing or truncated.");
+            close(fd);
+            return nullptr;
+        }
+
+        const size_t mapSize = st.st_size;
+        void* map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            Log::syserror("Failed to map tile ring [" + path + "].");
+            close(fd);
+            return nullptr;
+        }
+
+        auto header = static_cast<Header*>(map);
+        if (header->magic != Magic || header->capacity != mapSize - sizeof(Header))
+        {
+            Log::error("Tile ring [" + path + "] has a bad header.");
+            munmap(map, mapSize);
+            close(fd);
+            return nullptr;
+        }
+
+        Log::info("Opened tile ring [" + path + "] of " + std::to_string(header->capacity) + " bytes.");
+        return std::shared_ptr<TileRing>(new TileRing(fd, map, mapSize));
+    }
+
+    /// Copy one payload into the ring and return its position, or -1
+    /// when the reader is too far behind to make room; the caller
+    /// then sends the payload inline instead. Serialized internally,
+    /// as the encode workers write concurrently.
+    int64_t write(const char* data, const size_t length)
+    {
+        std::unique_lock<std::mutex> lock(_writeMutex);
+
+        const uint64_t capacity = _header->capacity;
+        const uint64_t needed = align(length);
+        if (needed == 0 || needed > capacity)
+        {
+            return -1;
+        }
+
+        uint64_t position = _header->head.load(std::memory_order_relaxed);
+        if (position % capacity + needed > capacity)
+        {
+            // Pad to the wrap boundary; records stay contiguous.
+            position += capacity - position % capacity;
+        }
+
+        const uint64_t tail = _header->tail.load(std::memory_order_acquire);
+        if (position + needed - tail > capacity)
+        {
+            // Full; the reader hasn't caught up yet.
+            return -1;
+        }
+
+        std::memcpy(_data + position % capacity, data, length);
+        _header->head.store(position + needed, std::memory_order_release);
+        return static_cast<int64_t>(position);
+    }
+
+    /// Copy the payload at the given position out of the ring and
+    /// release its space. Returns false when the position is not a
+    /// live record (a corrupt or restarted ring).
+    bool read(const int64_t position, char* buffer, const size_t length)
+    {
+        const uint64_t capacity = _header->capacity;
+        const uint64_t pos = static_cast<uint64_t>(position);
+        const uint64_t head = _header->head.load(std::memory_order_acquire);
+        const uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+        if (position < 0 || pos < tail || pos + length > head ||
+            pos % capacity + length > capacity)
+        {
+            Log::error("Invalid tile ring read of " + std::to_string(length) +
+                       " bytes at position " + std::to_string(position) + ".");
+            return false;
+        }
+
+        std::memcpy(buffer, _data + pos % capacity, length);
+
+        // Records are consumed in message order, so freeing up to our
+        // end also frees any wrap padding before us.
+        _header->tail.store(pos + align(length), std::memory_order_release);
+        return true;
+    }
+
+private:
+    const int _fd;
+    void* const _map;
+    const size_t _mapSize;
+    Header* const _header;
+    char* const _data;
+    /// Serializes writers; the kit encodes tiles on several threads.
+    std::mutex _writeMutex;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
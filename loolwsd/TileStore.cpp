@@ -0,0 +1,400 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TileStore.hpp"
+#include "config.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Poco/SHA1Engine.h>
+
+#include "Log.hpp"
+
+namespace
+{
+    constexpr uint32_t TileStoreMagic = 0x4c4f5443; // 'LOTC'
+    constexpr uint32_t TileStoreVersion = 2;
+
+    /// The file header: magic, version and the high-water mark of the
+    /// records, which is persisted through the mapping itself.
+    struct StoreHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t usedSize;
+    };
+
+    /// Grow the file in 4MB steps, so appends are normally just a memcpy.
+    constexpr size_t ChunkSize = 4 * 1024 * 1024;
+
+    struct RecordHeader
+    {
+        uint32_t kind;
+        uint32_t nameSize;
+        uint32_t dataSize;
+    };
+
+    /// The content address of a payload, as raw SHA1 bytes.
+    std::string digestOf(const char* data, const size_t size)
+    {
+        Poco::SHA1Engine engine;
+        engine.update(data, size);
+        const auto& digest = engine.digest();
+        return std::string(digest.begin(), digest.end());
+    }
+}
+
+TileStore::TileStore(const std::string& filePath) :
+    _filePath(filePath),
+    _fd(-1),
+    _map(nullptr),
+    _mapSize(0),
+    _deadSize(0),
+    _liveSize(0)
+{
+    _fd = ::open(_filePath.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (_fd < 0)
+    {
+        Log::error("Failed to open tile store: " + _filePath);
+        return;
+    }
+
+    struct stat st;
+    if (::fstat(_fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(StoreHeader)) ||
+        !remap(st.st_size) || !load())
+    {
+        // Brand new, truncated or corrupt: start afresh.
+        create();
+    }
+    else if (_deadSize > (getUsedSize() - sizeof(StoreHeader)) / 2)
+    {
+        compact();
+    }
+
+    Log::debug() << "TileStore [" << _filePath << "] opened with "
+                 << _index.size() << " tiles." << Log::end;
+}
+
+TileStore::~TileStore()
+{
+    unmap();
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+    }
+}
+
+size_t TileStore::getUsedSize() const
+{
+    return reinterpret_cast<const StoreHeader*>(_map)->usedSize;
+}
+
+void TileStore::setUsedSize(const size_t size)
+{
+    reinterpret_cast<StoreHeader*>(_map)->usedSize = size;
+}
+
+void TileStore::unmap()
+{
+    if (_map != nullptr)
+    {
+        ::munmap(_map, _mapSize);
+        _map = nullptr;
+        _mapSize = 0;
+    }
+}
+
+bool TileStore::remap(const size_t size)
+{
+    // Round up to the allocation chunk.
+    const size_t newSize = ((size + ChunkSize - 1) / ChunkSize) * ChunkSize;
+    if (_map != nullptr && newSize <= _mapSize)
+        return true;
+
+    unmap();
+
+    if (::ftruncate(_fd, newSize) != 0)
+    {
+        Log::error("Failed to grow tile store: " + _filePath);
+        return false;
+    }
+
+    void* map = ::mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        Log::error("Failed to map tile store: " + _filePath);
+        return false;
+    }
+
+    _map = static_cast<char*>(map);
+    _mapSize = newSize;
+    return true;
+}
+
+bool TileStore::create()
+{
+    _index.clear();
+    _blobs.clear();
+    _deadSize = 0;
+    _liveSize = 0;
+
+    if (!remap(sizeof(StoreHeader)))
+        return false;
+
+    auto header = reinterpret_cast<StoreHeader*>(_map);
+    header->magic = TileStoreMagic;
+    header->version = TileStoreVersion;
+    header->usedSize = sizeof(StoreHeader);
+    return true;
+}
+
+bool TileStore::load()
+{
+    const auto header = reinterpret_cast<const StoreHeader*>(_map);
+    if (header->magic != TileStoreMagic || header->version != TileStoreVersion ||
+        header->usedSize < sizeof(StoreHeader) || header->usedSize > _mapSize)
+    {
+        Log::warn("Invalid tile store, recreating: " + _filePath);
+        return false;
+    }
+
+    const size_t usedSize = header->usedSize;
+    size_t offset = sizeof(StoreHeader);
+    while (offset < usedSize)
+    {
+        if (offset + sizeof(RecordHeader) > usedSize)
+            return false;
+
+        RecordHeader rec;
+        std::memcpy(&rec, _map + offset, sizeof(rec));
+        offset += sizeof(rec);
+        if (rec.nameSize == 0 || offset + rec.nameSize + rec.dataSize > usedSize)
+            return false;
+
+        const std::string name(_map + offset, rec.nameSize);
+        offset += rec.nameSize;
+
+        switch (static_cast<RecordKind>(rec.kind))
+        {
+            case RecordKind::Data:
+            {
+                if (rec.dataSize == 0)
+                    return false;
+
+                // Later records win.
+                unref(name);
+
+                const std::string digest = digestOf(_map + offset, rec.dataSize);
+                const auto it = _blobs.find(digest);
+                if (it != _blobs.end())
+                {
+                    // A duplicate payload (e.g. pre-dedup records); the new bytes are dead.
+                    ++it->second.refs;
+                    _deadSize += rec.dataSize;
+                }
+                else
+                {
+                    _blobs[digest] = Blob{ offset, rec.dataSize, 1 };
+                    _liveSize += rec.dataSize;
+                }
+
+                _index[name] = digest;
+                offset += rec.dataSize;
+                break;
+            }
+
+            case RecordKind::Alias:
+            {
+                unref(name);
+
+                const std::string digest(_map + offset, rec.dataSize);
+                const auto it = _blobs.find(digest);
+                if (it != _blobs.end())
+                {
+                    ++it->second.refs;
+                    _index[name] = digest;
+                }
+
+                offset += rec.dataSize;
+                break;
+            }
+
+            case RecordKind::Tombstone:
+                unref(name);
+                _deadSize += sizeof(rec) + rec.nameSize;
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void TileStore::unref(const std::string& name)
+{
+    const auto it = _index.find(name);
+    if (it == _index.end())
+        return;
+
+    const auto blobIt = _blobs.find(it->second);
+    if (blobIt != _blobs.end() && --blobIt->second.refs == 0)
+    {
+        _deadSize += blobIt->second.size;
+        _liveSize -= blobIt->second.size;
+        _blobs.erase(blobIt);
+    }
+
+    _index.erase(it);
+}
+
+void TileStore::compact()
+{
+    Log::debug() << "Compacting tile store [" << _filePath << "]: "
+                 << _deadSize << " dead bytes." << Log::end;
+
+    // Collect the distinct payloads and the name mapping,
+    // then rewrite the store from scratch.
+    std::unordered_map<std::string, std::vector<char>> payloads;
+    for (const auto& it : _blobs)
+    {
+        payloads[it.first] = std::vector<char>(_map + it.second.offset,
+                                               _map + it.second.offset + it.second.size);
+    }
+
+    const std::unordered_map<std::string, std::string> index = _index;
+
+    if (!create())
+        return;
+
+    for (const auto& it : index)
+    {
+        const auto& payload = payloads[it.second];
+        save(it.first, payload.data(), payload.size());
+    }
+}
+
+size_t TileStore::appendRecord(const RecordKind kind, const std::string& name,
+                               const char* data, const size_t size)
+{
+    const size_t usedSize = getUsedSize();
+    const size_t recordSize = sizeof(RecordHeader) + name.size() + size;
+    if (usedSize + recordSize > _mapSize && !remap(usedSize + recordSize))
+        return 0;
+
+    RecordHeader rec{ static_cast<uint32_t>(kind),
+                      static_cast<uint32_t>(name.size()),
+                      static_cast<uint32_t>(size) };
+    size_t offset = usedSize;
+    std::memcpy(_map + offset, &rec, sizeof(rec));
+    offset += sizeof(rec);
+    std::memcpy(_map + offset, name.data(), name.size());
+    offset += name.size();
+    if (size > 0)
+    {
+        std::memcpy(_map + offset, data, size);
+    }
+
+    // Publish the record only after it is fully written.
+    setUsedSize(usedSize + recordSize);
+    return offset;
+}
+
+const char* TileStore::lookup(const std::string& name, size_t& size)
+{
+    if (_map == nullptr)
+        return nullptr;
+
+    const auto it = _index.find(name);
+    if (it == _index.end())
+        return nullptr;
+
+    const auto blobIt = _blobs.find(it->second);
+    if (blobIt == _blobs.end())
+        return nullptr;
+
+    size = blobIt->second.size;
+    return _map + blobIt->second.offset;
+}
+
+bool TileStore::save(const std::string& name, const char* data, const size_t size)
+{
+    if (_map == nullptr || size == 0)
+        return false;
+
+    const std::string digest = digestOf(data, size);
+
+    const auto it = _index.find(name);
+    if (it != _index.end())
+    {
+        if (it->second == digest)
+        {
+            // Re-saving identical content: nothing to do.
+            return true;
+        }
+
+        unref(name);
+    }
+
+    const auto blobIt = _blobs.find(digest);
+    if (blobIt != _blobs.end())
+    {
+        // Identical content is already stored; only map the name onto it.
+        if (appendRecord(RecordKind::Alias, name, digest.data(), digest.size()) == 0)
+            return false;
+
+        ++blobIt->second.refs;
+    }
+    else
+    {
+        const size_t offset = appendRecord(RecordKind::Data, name, data, size);
+        if (offset == 0)
+            return false;
+
+        _blobs[digest] = Blob{ offset, size, 1 };
+        _liveSize += size;
+    }
+
+    _index[name] = digest;
+    return true;
+}
+
+void TileStore::remove(const std::string& name)
+{
+    if (_map == nullptr)
+        return;
+
+    if (_index.find(name) == _index.end())
+        return;
+
+    // Tombstone, so the removal survives a reload.
+    appendRecord(RecordKind::Tombstone, name, nullptr, 0);
+    unref(name);
+}
+
+std::vector<std::string> TileStore::getNames() const
+{
+    std::vector<std::string> names;
+    names.reserve(_index.size());
+    for (const auto& it : _index)
+    {
+        names.push_back(it.first);
+    }
+
+    return names;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILESTORE_HPP
+#define INCLUDED_TILESTORE_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// A packed, memory-mapped store of cached tiles for one document.
+///
+/// All tiles live in a single file, so a lookup is a hash probe plus a
+/// pointer into mapped memory, and neither lookups nor appends create
+/// files or perform path lookups. The file layout is a fixed header
+/// followed by a sequence of records:
+///
+///     uint32_t kind | uint32_t nameSize | uint32_t dataSize | name | data
+///
+/// Tile data is content-addressed: a Data record stores a payload once,
+/// an Alias record maps another name onto an existing payload (by SHA1
+/// digest), and a Tombstone unmaps a name. Since most documents are
+/// mostly whitespace, the many byte-identical (blank) tiles are thus
+/// stored once and refcounted. On load, later records win, and the
+/// store is compacted when dead data dominates. The file is grown in
+/// chunks so an append is normally just a memcpy into the mapping.
+///
+/// Not thread-safe; the caller is expected to serialize access.
+class TileStore
+{
+public:
+    /// Opens (or creates) the store file, rebuilding the lookup index
+    /// from the records. A corrupt store is discarded and recreated.
+    TileStore(const std::string& filePath);
+    ~TileStore();
+
+    TileStore(const TileStore&) = delete;
+
+    /// Returns a pointer into the mapped memory and sets size,
+    /// or nullptr if the name is not stored.
+    const char* lookup(const std::string& name, size_t& size);
+
+    /// Appends (or replaces) a tile. Returns false on disk errors.
+    bool save(const std::string& name, const char* data, const size_t size);
+
+    /// Tombstones a tile, if present.
+    void remove(const std::string& name);
+
+    /// The names of all live tiles, for index rebuilds.
+    std::vector<std::string> getNames() const;
+
+    size_t getTileCount() const { return _index.size(); }
+
+    /// Total bytes of live (referenced, deduplicated) payloads.
+    size_t getLiveSize() const { return _liveSize; }
+
+private:
+    enum class RecordKind : uint32_t
+    {
+        Data = 0,
+        Tombstone = 1,
+        Alias = 2
+    };
+
+    /// A refcounted, content-addressed payload within the file.
+    struct Blob
+    {
+        size_t offset;
+        size_t size;
+        size_t refs;
+    };
+
+    /// Read the records and build the index. Returns false if corrupt.
+    bool load();
+
+    /// Rewrite the file with live records only.
+    void compact();
+
+    /// Map (or re-map) the file, growing it to at least size bytes.
+    bool remap(const size_t size);
+
+    void unmap();
+
+    /// Start afresh with an empty store file.
+    bool create();
+
+    /// Raw record append. Returns the data offset, or 0 on failure.
+    size_t appendRecord(const RecordKind kind, const std::string& name,
+                        const char* data, const size_t size);
+
+    /// Unmap a name, releasing its blob when the last reference goes.
+    void unref(const std::string& name);
+
+    size_t getUsedSize() const;
+    void setUsedSize(const size_t size);
+
+    const std::string _filePath;
+
+    int _fd;
+
+    char* _map;
+
+    /// Bytes mapped (and allocated in the file).
+    size_t _mapSize;
+
+    /// Bytes tombstoned or superseded, pending compaction.
+    size_t _deadSize;
+
+    /// Bytes of live payloads.
+    size_t _liveSize;
+
+    /// Tile name -> content digest of its payload.
+    std::unordered_map<std::string, std::string> _index;
+
+    /// Content digest -> payload location and refcount.
+    std::unordered_map<std::string, Blob> _blobs;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
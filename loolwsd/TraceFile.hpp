@@ -7,15 +7,27 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <iterator>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <Poco/DeflatingStream.h>
 #include <Poco/InflatingStream.h>
 
+#include "Log.hpp"
 #include "Util.hpp"
 
 /// Dumps commands and notification trace.
@@ -46,6 +58,13 @@ public:
 
 /// Trace-file generator class.
 /// Writes records into a trace file.
+///
+/// Sessions only format their record and queue it; a dedicated writer
+/// thread does the deflating, file writes and flushing. The sessions'
+/// critical section is a single deque push, so capture stays cheap
+/// enough to leave enabled on a loaded host. When the writer cannot
+/// keep up, the queue drops records (and says so once, at the end)
+/// rather than stall document traffic.
 class TraceFileWriter
 {
 public:
@@ -57,17 +76,30 @@ public:
         _filter(true),
         _stream(path, compress ? std::ios::binary : std::ios::out),
         _deflater(_stream, Poco::DeflatingStreamBuf::STREAM_GZIP),
-        _mutex()
+        _mutex(),
+        _stop(false),
+        _dropped(0)
     {
         for (const auto& f : filters)
         {
             _filter.deny(f);
         }
+
+        _writerThread = std::thread(&TraceFileWriter::writerThread, this);
     }
 
     ~TraceFileWriter()
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+
+        _cv.notify_one();
+        if (_writerThread.joinable())
+        {
+            _writerThread.join();
+        }
 
         _deflater.close();
         _stream.close();
@@ -75,73 +107,113 @@ public:
 
     void writeEvent(const std::string& pId, const std::string& sessionId, const std::string& data)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
-        writeLocked(pId, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Event));
-        flushLocked();
+        enqueue(pId, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Event));
     }
 
     void writeIncoming(const std::string& pId, const std::string& sessionId, const std::string& data)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
         if (_filter.match(data))
         {
-            writeLocked(pId, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Incoming));
+            enqueue(pId, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Incoming));
         }
     }
 
     void writeOutgoing(const std::string& pId, const std::string& sessionId, const std::string& data)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
         if (_recordOutgoing && _filter.match(data))
         {
-            writeLocked(pId, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Outgoing));
+            enqueue(pId, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Outgoing));
         }
     }
 
 private:
-    void flushLocked()
+    void enqueue(const std::string& pId, const std::string& sessionId, const std::string& data,
+                 const char delim)
     {
-        Util::assertIsLocked(_mutex);
+        // Format outside the lock; only the finished line goes
+        // through the queue. The timestamp is taken here, so the
+        // file reflects capture time, not write time.
+        const Poco::Int64 usec = Poco::Timestamp().epochMicroseconds() - _epochStart;
+        std::string line;
+        line.reserve(pId.size() + sessionId.size() + data.size() + 32);
+        line += delim;
+        line += std::to_string(usec);
+        line += delim;
+        line += pId;
+        line += delim;
+        line += sessionId;
+        line += delim;
+        line += data;
+        line += '\n';
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_queue.size() >= MaxQueueSize)
+        {
+            // Losing trace records beats stalling sessions.
+            ++_dropped;
+            return;
+        }
 
-        _deflater.flush();
-        _stream.flush();
+        _queue.emplace_back(std::move(line));
+        lock.unlock();
+        _cv.notify_one();
     }
 
-    void writeLocked(const std::string& pId, const std::string& sessionId, const std::string& data, const char delim)
+    void writerThread()
     {
-        Util::assertIsLocked(_mutex);
+        Util::setThreadName("trace_writer");
 
-        const Poco::Int64 usec = Poco::Timestamp().epochMicroseconds() - _epochStart;
-        if (_compress)
+        std::vector<std::string> batch;
+        for (;;)
         {
-            _deflater.write(&delim, 1);
-            _deflater << usec;
-            _deflater.write(&delim, 1);
-            _deflater << pId;
-            _deflater.write(&delim, 1);
-            _deflater << sessionId;
-            _deflater.write(&delim, 1);
-            _deflater.write(data.c_str(), data.size());
-            _deflater.write("\n", 1);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [this] { return _stop || !_queue.empty(); });
+                if (_queue.empty())
+                {
+                    // Stop only once everything queued is on disk.
+                    break;
+                }
+
+                batch.assign(std::make_move_iterator(_queue.begin()),
+                             std::make_move_iterator(_queue.end()));
+                _queue.clear();
+            }
+
+            for (const auto& line : batch)
+            {
+                if (_compress)
+                {
+                    _deflater.write(line.data(), line.size());
+                }
+                else
+                {
+                    _stream.write(line.data(), line.size());
+                }
+            }
+
+            // One flush per batch keeps the file current if we crash,
+            // without the old per-record flush cost.
+            if (_compress)
+            {
+                _deflater.flush();
+            }
+
+            _stream.flush();
+            batch.clear();
         }
-        else
+
+        const auto dropped = _dropped.load();
+        if (dropped > 0)
         {
-            _stream.write(&delim, 1);
-            _stream << usec;
-            _stream.write(&delim, 1);
-            _stream << pId;
-            _stream.write(&delim, 1);
-            _stream << sessionId;
-            _stream.write(&delim, 1);
-            _stream.write(data.c_str(), data.size());
-            _stream.write("\n", 1);
+            Log::warn("Trace writer dropped " + std::to_string(dropped) +
+                      " records; the writer could not keep up.");
         }
     }
 
 private:
+    static const size_t MaxQueueSize = 16 * 1024;
+
     const Poco::Int64 _epochStart;
     const bool _recordOutgoing;
     const bool _compress;
@@ -149,10 +221,23 @@ private:
     std::ofstream _stream;
     Poco::DeflatingOutputStream _deflater;
     std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::string> _queue;
+    std::thread _writerThread;
+    bool _stop;
+    std::atomic<unsigned> _dropped;
 };
 
 /// Trace-file parser class.
 /// Reads records from a trace file.
+///
+/// An uncompressed trace is memory-mapped and parsed lazily, record by
+/// record, so opening a multi-GB capture is near-instant and reading a
+/// window touches only the pages of that window. Records carry their
+/// timestamp and are written in capture order, so seekTo() can
+/// binary-search the mapping directly — no separate index is needed.
+/// Gzip-compressed traces allow no random access and keep the old
+/// behavior of parsing everything up front.
 class TraceFileReader
 {
 public:
@@ -163,23 +248,113 @@ public:
         _inflater(_stream, Poco::InflatingStreamBuf::STREAM_GZIP),
         _index(0),
         _indexIn(-1),
-        _indexOut(-1)
+        _indexOut(-1),
+        _map(nullptr),
+        _size(0),
+        _fd(-1),
+        _pos(0),
+        _posIn(NotFound),
+        _posOut(NotFound)
     {
-        readFile();
+        if (_compressed)
+        {
+            readFile();
+        }
+        else
+        {
+            mapFile(path);
+        }
     }
 
     ~TraceFileReader()
     {
+        if (_map != nullptr)
+        {
+            munmap(const_cast<char*>(_map), _size);
+        }
+
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+        }
+
         _stream.close();
     }
 
     Poco::Int64 getEpoch() const { return _epochStart; }
 
+    /// Position all cursors at the first record with a timestamp at
+    /// or after the given microsecond offset from the epoch, for
+    /// replaying or analyzing a partial time range.
+    void seekTo(const Poco::Int64 usec)
+    {
+        if (_compressed)
+        {
+            // No random access into the gzip stream; scan the index.
+            _index = 0;
+            while (_index < _records.size() &&
+                   static_cast<Poco::Int64>(_records[_index].TimestampNs) < usec)
+            {
+                ++_index;
+            }
+
+            _indexIn = advance(_index - 1, TraceFileRecord::Direction::Incoming);
+            _indexOut = advance(_index - 1, TraceFileRecord::Direction::Outgoing);
+            return;
+        }
+
+        TraceFileRecord rec;
+        size_t next;
+        if (parseRecordAt(0, rec, next) && static_cast<Poco::Int64>(rec.TimestampNs) >= usec)
+        {
+            _pos = 0;
+        }
+        else
+        {
+            // Bisect byte positions: move 'lo' up while the first
+            // record starting after it is still before the target.
+            size_t lo = 0;
+            size_t hi = _size;
+            while (lo < hi)
+            {
+                const size_t mid = lo + (hi - lo) / 2;
+                const size_t start = recordStartAfter(mid);
+                if (start < _size && parseRecordAt(start, rec, next) &&
+                    static_cast<Poco::Int64>(rec.TimestampNs) < usec)
+                {
+                    lo = start;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            }
+
+            _pos = recordStartAfter(lo);
+        }
+
+        _posIn = findNext(_pos, TraceFileRecord::Direction::Incoming);
+        _posOut = findNext(_pos, TraceFileRecord::Direction::Outgoing);
+    }
+
     TraceFileRecord getNextRecord()
     {
-        if (_index < _records.size())
+        if (_compressed)
+        {
+            if (_index < _records.size())
+            {
+                return _records[_index++];
+            }
+        }
+        else
         {
-            return _records[_index++];
+            TraceFileRecord rec;
+            size_t next;
+            if (parseRecordAt(_pos, rec, next))
+            {
+                _pos = next;
+                return rec;
+            }
         }
 
         // Invalid.
@@ -188,7 +363,18 @@ public:
 
     TraceFileRecord getNextRecord(const TraceFileRecord::Direction dir)
     {
-        if (dir == TraceFileRecord::Direction::Incoming)
+        if (!_compressed)
+        {
+            auto& pos = (dir == TraceFileRecord::Direction::Incoming) ? _posIn : _posOut;
+            TraceFileRecord rec;
+            size_t next;
+            if (pos != NotFound && parseRecordAt(pos, rec, next))
+            {
+                pos = findNext(next, dir);
+                return rec;
+            }
+        }
+        else if (dir == TraceFileRecord::Direction::Incoming)
         {
             if (_indexIn < _records.size())
             {
@@ -212,22 +398,114 @@ public:
     }
 
 private:
-    void readFile()
+    void mapFile(const std::string& path)
     {
-        _records.clear();
+        _fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (_fd < 0 || fstat(_fd, &st) != 0 || st.st_size == 0)
+        {
+            fprintf(stderr, "Invalid trace file. [%s]\n", path.c_str());
+            throw std::runtime_error("Invalid trace file.");
+        }
 
-        std::string line;
-        for (;;)
+        _size = st.st_size;
+        void* map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (map == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map trace file.");
+        }
+
+        _map = static_cast<const char*>(map);
+
+        TraceFileRecord rec;
+        size_t next;
+        if (!parseRecordAt(0, rec, next) ||
+            rec.Dir != TraceFileRecord::Direction::Event ||
+            rec.Payload.find("NewSession") != 0)
+        {
+            fprintf(stderr, "Invalid trace file. First record: %s\n",
+                    rec.Payload.empty() ? "<empty>" : rec.Payload.c_str());
+            throw std::runtime_error("Invalid trace file.");
+        }
+
+        _epochStart = rec.TimestampNs;
+        _posIn = findNext(0, TraceFileRecord::Direction::Incoming);
+        _posOut = findNext(0, TraceFileRecord::Direction::Outgoing);
+    }
+
+    /// Parse the record beginning at the given byte offset, skipping
+    /// malformed lines; 'next' receives the offset past the parsed
+    /// line. Returns false at the end of the capture.
+    bool parseRecordAt(size_t offset, TraceFileRecord& rec, size_t& next) const
+    {
+        while (offset < _size)
         {
-            if (_compressed)
+            const char* start = _map + offset;
+            const auto* newline = static_cast<const char*>(std::memchr(start, '\n', _size - offset));
+            const size_t length = newline ? newline - start : _size - offset;
+            next = offset + length + 1;
+
+            if (length == 0)
             {
-                std::getline(_inflater, line);
+                // A blank line ends the capture.
+                return false;
             }
-            else
+
+            const std::string line(start, length);
+            const auto v = split(line, line[0]);
+            if (v.size() == 4)
+            {
+                rec.Dir = static_cast<TraceFileRecord::Direction>(line[0]);
+                unsigned index = 0;
+                rec.TimestampNs = std::atoi(v[index++].c_str());
+                rec.Pid = std::atoi(v[index++].c_str());
+                rec.SessionId = v[index++];
+                rec.Payload = v[index++];
+                return true;
+            }
+
+            fprintf(stderr, "Invalid trace file record, expected 4 tokens. [%s]\n", line.c_str());
+            offset = next;
+        }
+
+        return false;
+    }
+
+    /// The offset of the record starting after the given position.
+    size_t recordStartAfter(const size_t offset) const
+    {
+        const auto* newline = static_cast<const char*>(
+            std::memchr(_map + offset, '\n', _size - offset));
+        return newline ? (newline - _map) + 1 : _size;
+    }
+
+    /// The offset of the first record of the given direction at or
+    /// after the given offset, or NotFound.
+    size_t findNext(size_t offset, const TraceFileRecord::Direction dir) const
+    {
+        TraceFileRecord rec;
+        size_t next;
+        while (parseRecordAt(offset, rec, next))
+        {
+            if (rec.Dir == dir)
             {
-                std::getline(_stream, line);
+                return offset;
             }
 
+            offset = next;
+        }
+
+        return NotFound;
+    }
+
+    void readFile()
+    {
+        _records.clear();
+
+        std::string line;
+        for (;;)
+        {
+            std::getline(_inflater, line);
             if (line.empty())
             {
                 break;
@@ -296,14 +574,24 @@ private:
     }
 
 private:
+    static const size_t NotFound = static_cast<size_t>(-1);
+
     const bool _compressed;
     Poco::Int64 _epochStart;
     std::ifstream _stream;
     Poco::InflatingInputStream _inflater;
+    /// The up-front index; compressed traces only.
     std::vector<TraceFileRecord> _records;
     unsigned _index;
     unsigned _indexIn;
     unsigned _indexOut;
+    /// The mapping; uncompressed traces only.
+    const char* _map;
+    size_t _size;
+    int _fd;
+    size_t _pos;
+    size_t _posIn;
+    size_t _posOut;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
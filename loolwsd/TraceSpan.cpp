@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TraceSpan.hpp"
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+
+/// The O_APPEND descriptor all spans of this process go to.
+/// -1 means tracing is off, -2 that init() has not run yet.
+int TraceFd = -2;
+
+}
+
+namespace TraceSpan
+{
+
+void init()
+{
+    if (TraceFd != -2)
+    {
+        return;
+    }
+
+    const char* path = std::getenv("LOOL_TRACE_SPANS");
+    TraceFd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND,
+                          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+                   : -1;
+}
+
+bool enabled()
+{
+    if (TraceFd == -2)
+    {
+        init();
+    }
+
+    return TraceFd >= 0;
+}
+
+long long now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+void record(const char* name, const std::string& id,
+            long long startUs, long long endUs)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    // The id is a docKey or URL; keep the JSON valid whatever is in it.
+    std::string cleanId = id;
+    for (auto& c : cleanId)
+    {
+        if (c == '"' || c == '\\')
+        {
+            c = '_';
+        }
+    }
+
+    // One complete event per single O_APPEND write, so concurrent
+    // processes never interleave. chrome://tracing accepts the
+    // resulting comma-terminated, unterminated JSON array as-is.
+    char buffer[512];
+    const int len = std::snprintf(buffer, sizeof(buffer),
+        "{\"name\":\"%s\",\"cat\":\"lool\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+        "\"pid\":%d,\"tid\":0,\"args\":{\"id\":\"%s\"}},\n",
+        name, startUs, endUs - startUs, getpid(), cleanId.c_str());
+    if (len <= 0 || len >= static_cast<int>(sizeof(buffer)))
+    {
+        return;
+    }
+
+    const auto written = write(TraceFd, buffer, len);
+    (void)written;
+}
+
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
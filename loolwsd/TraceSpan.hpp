@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#ifndef INCLUDED_TRACESPAN_HPP
+#define INCLUDED_TRACESPAN_HPP
+
+#include <string>
+
+/// Lightweight cross-process span tracing of the document pipelines.
+///
+/// When the LOOL_TRACE_SPANS environment variable names a file (wsd
+/// sets it from the trace_spans config entry; forkit and the kits
+/// inherit it), every process appends one chrome://tracing JSON event
+/// per completed span. Loading the file in chrome://tracing shows the
+/// stages of a document load, save or first render across all three
+/// processes on one timeline. Spans of one document correlate via the
+/// document key, which already travels on the internal child URL, so
+/// no message format changes.
+///
+/// Appends are a single write() on an O_APPEND descriptor, so events
+/// from concurrent processes never interleave. Disabled (the default),
+/// the instrumentation costs one pointer check per site.
+namespace TraceSpan
+{
+    /// Open the trace file named by LOOL_TRACE_SPANS, if set. Runs
+    /// implicitly on first use; the kit must call it before entering
+    /// its chroot, where the path no longer resolves (the descriptor
+    /// survives the jail). Safe to call repeatedly.
+    void init();
+
+    /// Whether span tracing is enabled in this process.
+    bool enabled();
+
+    /// Wall-clock microseconds; shared across processes so their
+    /// spans land on one timeline.
+    long long now();
+
+    /// Append one completed span with the given correlation id.
+    void record(const char* name, const std::string& id,
+                long long startUs, long long endUs);
+
+    /// Records the span from construction to destruction.
+    class Span
+    {
+    public:
+        Span(const char* name, const std::string& id) :
+            _name(name),
+            _id(id),
+            _start(enabled() ? now() : 0)
+        {
+        }
+
+        ~Span()
+        {
+            if (_start)
+            {
+                record(_name, _id, _start, now());
+            }
+        }
+
+    private:
+        const char* const _name;
+        const std::string _id;
+        const long long _start;
+    };
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
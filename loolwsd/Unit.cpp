@@ -21,6 +21,8 @@
 #include "Log.hpp"
 #include "Util.hpp"
 
+#if ENABLE_UNIT_HOOKS
+
 UnitBase *UnitBase::Global = nullptr;
 
 static Poco::Thread TimeoutThread("unit timeout");
@@ -133,9 +135,9 @@ UnitWSD::~UnitWSD()
 }
 
 void UnitWSD::lookupTile(int part, int width, int height, int tilePosX, int tilePosY,
-                         int tileWidth, int tileHeight, std::unique_ptr<std::fstream>& cacheFile)
+                         int tileWidth, int tileHeight, std::shared_ptr<std::vector<char>>& tile)
 {
-    if (cacheFile && cacheFile->is_open())
+    if (tile)
     {
         onTileCacheHit(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
     }
@@ -181,4 +183,6 @@ void UnitBase::returnValue(int &retValue)
     Global = nullptr;
 }
 
+#endif // ENABLE_UNIT_HOOKS
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
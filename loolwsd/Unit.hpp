@@ -9,10 +9,13 @@
 #ifndef INCLUDED_UNIT_HPP
 #define INCLUDED_UNIT_HPP
 
+#include "config.h"
+
 #include <string>
 #include <memory>
 #include <atomic>
 #include <cassert>
+#include <vector>
 
 #include <Poco/Net/WebSocket.h>
 
@@ -37,10 +40,13 @@ namespace Poco {
 
 class StorageBase;
 
+extern "C" { typedef struct _LibreOfficeKit LibreOfficeKit; }
+
+#if ENABLE_UNIT_HOOKS
+
 typedef UnitBase *(CreateUnitHooksFunction)();
 extern "C" { UnitBase *unit_create_wsd(void); }
 extern "C" { UnitBase *unit_create_kit(void); }
-extern "C" { typedef struct _LibreOfficeKit LibreOfficeKit; }
 
 /// Derive your WSD unit test / hooks from me.
 class UnitBase
@@ -119,6 +125,8 @@ public:
     virtual void invokeTest() {}
     /// Tweak the count of pre-spawned kits.
     virtual void preSpawnCount(int & /* numPrefork */) {}
+    /// A spawn request for this many children was sent to the forkit.
+    virtual void onForkRequest(const int /* number */) {}
     /// When a new child kit process reports
     virtual void newChild(const std::shared_ptr<Poco::Net::WebSocket> & /* socket */) {}
     /// Intercept createStorage
@@ -141,7 +149,8 @@ public:
     // ---------------- TileCache hooks ----------------
     /// Called before the lookupTile call returns. Should always be called to fire events.
     virtual void lookupTile(int part, int width, int height, int tilePosX, int tilePosY,
-                            int tileWidth, int tileHeight, std::unique_ptr<std::fstream>& cacheFile);
+                            int tileWidth, int tileHeight,
+                            std::shared_ptr<std::vector<char>>& tile);
 
     // ---------------- WSD events ----------------
     virtual void onChildConnected(const int /* pid */, const std::string& /* sessionId */) {}
@@ -198,6 +207,87 @@ public:
         { return NULL; }
 };
 
+#else // ENABLE_UNIT_HOOKS
+
+/// The hook layer compiled down to nothing: the classes keep their
+/// interface so the call sites stay unchanged, but every method is a
+/// non-virtual inline no-op on a static instance, which the compiler
+/// folds away. No unit library can be loaded in this build.
+class UnitBase
+{
+public:
+    enum UnitType { TYPE_WSD, TYPE_KIT };
+
+    /// Only the no-library case can succeed here.
+    static bool init(UnitType /* type */, const std::string& unitLibPath)
+    {
+        return unitLibPath.empty();
+    }
+
+    void returnValue(int& /* retValue */) {}
+};
+
+class UnitWSD : public UnitBase
+{
+public:
+    static UnitWSD& get()
+    {
+        static UnitWSD hooks;
+        return hooks;
+    }
+
+    enum TestRequest { TEST_REQ_CLIENT, TEST_REQ_PRISONER };
+
+    bool hasKitHooks() { return false; }
+    void setHasKitHooks(bool /* hasHooks */ = true) {}
+
+    void configure(Poco::Util::LayeredConfiguration& /* config */) {}
+    void invokeTest() {}
+    void preSpawnCount(int& /* numPrefork */) {}
+    void newChild(const std::shared_ptr<Poco::Net::WebSocket>& /* socket */) {}
+    bool createStorage(const Poco::URI& /* uri */,
+                       const std::string& /* jailRoot */,
+                       const std::string& /* jailPath */,
+                       std::unique_ptr<StorageBase>& /* rStorage */)
+        { return false; }
+    bool filterHandleRequest(TestRequest /* type */,
+                             Poco::Net::HTTPServerRequest& /* request */,
+                             Poco::Net::HTTPServerResponse& /* response */)
+        { return false; }
+    bool filterChildMessage(const std::vector<char>& /* payload */) { return false; }
+
+    void lookupTile(int /* part */, int /* width */, int /* height */,
+                    int /* tilePosX */, int /* tilePosY */,
+                    int /* tileWidth */, int /* tileHeight */,
+                    std::shared_ptr<std::vector<char>>& /* tile */) {}
+
+    void onChildConnected(const int /* pid */, const std::string& /* sessionId */) {}
+    void onAdminNotifyMessage(const std::string& /* message */) {}
+    void onAdminQueryMessage(const std::string& /* message */) {}
+};
+
+class UnitKit : public UnitBase
+{
+public:
+    static UnitKit& get()
+    {
+        static UnitKit hooks;
+        return hooks;
+    }
+
+    void invokeForKitTest() {}
+    void launchedKit(int /* pid */) {}
+    void postFork() {}
+    bool filterKitMessage(const std::shared_ptr<Poco::Net::WebSocket>& /* ws */,
+                          std::string& /* message */)
+        { return false; }
+    LibreOfficeKit *lok_init(const char * /* instdir */,
+                             const char * /* userdir */)
+        { return NULL; }
+};
+
+#endif // ENABLE_UNIT_HOOKS
+
 #endif
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -12,13 +12,21 @@
 
 #include <execinfo.h>
 #include <csignal>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
+// Not in older kernel headers; the value is fixed ABI.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 #include <atomic>
 #include <cassert>
 #include <chrono>
@@ -28,6 +36,7 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <random>
 #include <sstream>
@@ -157,6 +166,77 @@ namespace Util
         return std::getenv("DISPLAY") != nullptr;
     }
 
+    bool copyFile(const std::string& fromPath, const std::string& toPath)
+    {
+        const int from = open(fromPath.c_str(), O_RDONLY);
+        if (from < 0)
+        {
+            Log::syserror("Failed to open [" + fromPath + "] for copying.");
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(from, &st) != 0)
+        {
+            Log::syserror("Failed to stat [" + fromPath + "] for copying.");
+            close(from);
+            return false;
+        }
+
+        const int to = open(toPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+        if (to < 0)
+        {
+            Log::syserror("Failed to create [" + toPath + "] for copying.");
+            close(from);
+            return false;
+        }
+
+        bool success = false;
+
+        // A reflink shares the source's extents: a metadata-only
+        // copy on filesystems that can clone (btrfs, xfs).
+        if (ioctl(to, FICLONE, from) == 0)
+        {
+            Log::debug("Reflinked [" + fromPath + "] to [" + toPath + "].");
+            success = true;
+        }
+#ifdef __NR_copy_file_range
+        else
+        {
+            // In-kernel copy; the bytes never bounce through userspace.
+            off_t remaining = st.st_size;
+            while (remaining > 0)
+            {
+                const ssize_t copied = syscall(__NR_copy_file_range, from, nullptr,
+                                               to, nullptr, remaining, 0);
+                if (copied <= 0)
+                {
+                    break;
+                }
+
+                remaining -= copied;
+            }
+
+            success = (remaining == 0);
+        }
+#endif
+
+        close(from);
+        if (close(to) != 0)
+        {
+            success = false;
+        }
+
+        if (!success)
+        {
+            // Leave no partial copy behind; the caller falls
+            // back to a userspace copy.
+            std::remove(toPath.c_str());
+        }
+
+        return success;
+    }
+
     bool saveDataToFileSafely(const std::string& fileName, const char *data, size_t size)
     {
         const auto tempFileName = fileName + ".temp";
@@ -482,35 +562,113 @@ namespace Util
         }
     }
 
-    int getMemoryUsage(const Poco::Process::PID nPid)
+    /// Sums the Pss fields of a smaps-format /proc file.
+    /// Returns -1 when the file cannot be read.
+    static int readProcPssKb(const std::string& path)
     {
-        //TODO: Instead of RSS, return PSS
-        const auto cmd = "ps o rss= -p " + std::to_string(nPid);
-        FILE* fp = popen(cmd.c_str(), "r");
-        if (fp == nullptr)
+        std::ifstream file(path);
+        if (!file)
         {
-            return 0;
+            return -1;
         }
 
-        std::string sResponse;
-        char cmdBuffer[1024];
-        while (fgets(cmdBuffer, sizeof(cmdBuffer) - 1, fp) != nullptr)
+        int totalKb = 0;
+        bool found = false;
+        std::string line;
+        while (std::getline(file, line))
         {
-            sResponse += cmdBuffer;
+            if (line.compare(0, 4, "Pss:") == 0)
+            {
+                totalKb += std::atoi(line.c_str() + 4);
+                found = true;
+            }
         }
-        pclose(fp);
 
-        int nMem = -1;
-        try
+        return found ? totalKb : -1;
+    }
+
+    int getMemoryUsage(const Poco::Process::PID nPid)
+    {
+        const std::string proc = "/proc/" + std::to_string(nPid);
+
+        // PSS splits shared (COW) pages evenly across their users, so
+        // the per-process numbers add up to the real total. One short
+        // file on current kernels; a page-table walk on older ones.
+        int memKb = readProcPssKb(proc + "/smaps_rollup");
+        if (memKb < 0)
         {
-            nMem = std::stoi(sResponse);
+            memKb = readProcPssKb(proc + "/smaps");
         }
-        catch(const std::exception&)
+
+        if (memKb < 0)
+        {
+            // Last resort: the resident size.
+            std::ifstream status(proc + "/status");
+            std::string line;
+            while (status && std::getline(status, line))
+            {
+                if (line.compare(0, 6, "VmRSS:") == 0)
+                {
+                    memKb = std::atoi(line.c_str() + 6);
+                    break;
+                }
+            }
+        }
+
+        if (memKb < 0)
         {
             Log::warn() << "Trying to find memory of invalid/dead PID" << Log::end;
         }
 
-        return nMem;
+        return memKb;
+    }
+
+    std::map<Poco::Process::PID, int> getMemoryUsage(const std::vector<Poco::Process::PID>& pids)
+    {
+        std::map<Poco::Process::PID, int> usage;
+        for (const auto pid : pids)
+        {
+            usage[pid] = getMemoryUsage(pid);
+        }
+
+        return usage;
+    }
+
+    long getCpuUsage(const Poco::Process::PID nPid)
+    {
+        std::ifstream stat("/proc/" + std::to_string(nPid) + "/stat");
+        std::string line;
+        if (!stat || !std::getline(stat, line))
+        {
+            return -1;
+        }
+
+        // The comm field may itself contain spaces and parentheses;
+        // the fixed fields start after the last closing parenthesis.
+        // utime and stime are fields 14 and 15 (one-based).
+        const auto paren = line.rfind(')');
+        if (paren == std::string::npos)
+        {
+            return -1;
+        }
+
+        std::istringstream fields(line.substr(paren + 1));
+        std::string token;
+        long utime = -1;
+        long stime = -1;
+        for (int field = 3; field <= 15 && fields >> token; ++field)
+        {
+            if (field == 14)
+            {
+                utime = std::atol(token.c_str());
+            }
+            else if (field == 15)
+            {
+                stime = std::atol(token.c_str());
+            }
+        }
+
+        return (utime >= 0 && stime >= 0) ? utime + stime : -1;
     }
 
     std::string replace(const std::string& s, const std::string& a, const std::string& b)
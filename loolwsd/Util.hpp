@@ -13,11 +13,13 @@
 #include <atomic>
 #include <cassert>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <Poco/File.h>
 #include <Poco/Net/WebSocket.h>
@@ -49,6 +51,13 @@ namespace Util
 
     bool windowingAvailable();
 
+    // Copy a file without moving its bytes through userspace when the
+    // kernel allows: first as a reflink (FICLONE), which is a
+    // metadata-only clone on btrfs/xfs, then via copy_file_range.
+    // Returns false when neither worked; the caller should fall back
+    // to a plain copy.
+    bool copyFile(const std::string& fromPath, const std::string& toPath);
+
     // Save data to a file (overwriting an existing file if necessary) with checks for errors. Write
     // to a temporary file in the same directory that is then atomically renamed to the desired name
     // if everything goes well. In case of any error, both the destination file (if it already
@@ -139,8 +148,20 @@ namespace Util
 
     void requestTermination(const Poco::Process::PID& pid);
 
+    /// The memory used by a process in KB: its PSS, which splits
+    /// shared (COW) pages across their users, read natively from
+    /// /proc. -1 for a dead or inaccessible process.
     int getMemoryUsage(const Poco::Process::PID nPid);
 
+    /// The memory used by each given process; a convenience wrapper
+    /// that reads the per-pid /proc entries one by one.
+    std::map<Poco::Process::PID, int> getMemoryUsage(const std::vector<Poco::Process::PID>& pids);
+
+    /// The total CPU time a process has consumed so far, in clock
+    /// ticks (utime + stime from /proc/<pid>/stat); the caller turns
+    /// deltas into a usage rate. -1 for a dead or inaccessible process.
+    long getCpuUsage(const Poco::Process::PID nPid);
+
     std::string replace(const std::string& s, const std::string& a, const std::string& b);
 
     std::string formatLinesForLog(const std::string& s);
@@ -9,6 +9,8 @@
 
 #include "config.h"
 
+#include <cstdlib>
+
 #include <Poco/Net/WebSocket.h>
 #include <cppunit/extensions/HelperMacros.h>
 
@@ -51,6 +53,7 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testSimple);
     CPPUNIT_TEST(testSimpleCombine);
+    CPPUNIT_TEST(testViewport);
     CPPUNIT_TEST(testPerformance);
     CPPUNIT_TEST(testCancelTiles);
     CPPUNIT_TEST(testCancelTilesMultiView);
@@ -72,6 +75,7 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     void testSimple();
     void testSimpleCombine();
+    void testViewport();
     void testPerformance();
     void testCancelTiles();
     void testCancelTilesMultiView();
@@ -122,6 +126,15 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
         return v;
     }
 
+    /// The performance budget of the given name, overridable from the
+    /// environment for slow (or fast) deployments.
+    static
+    int getBudgetMs(const char* name, const int def)
+    {
+        const auto value = std::getenv(name);
+        return value ? std::atoi(value) : def;
+    }
+
 public:
     TileCacheTests()
         : _uri(helpers::getTestServerURI())
@@ -175,9 +188,8 @@ void TileCacheTests::testSimple()
 
     // Find Tile
     file = tc.lookupTile(tile);
-    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", file && file->is_open());
-    const auto tileData = readDataFromFile(file);
-    CPPUNIT_ASSERT_MESSAGE("cached tile corrupted", data == tileData);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", file && !file->empty());
+    CPPUNIT_ASSERT_MESSAGE("cached tile corrupted", data == *file);
 
     // Invalidate Tiles
     tc.invalidateTiles("invalidatetiles: EMPTY");
@@ -220,26 +232,90 @@ void TileCacheTests::testSimpleCombine()
     CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile2b.empty());
 }
 
+void TileCacheTests::testViewport()
+{
+    std::string documentPath, documentURL;
+    getDocumentPathAndURL("hello.odt", documentPath, documentURL);
+
+    auto socket = loadDocAndGetSocket(_uri, documentURL, "viewport ");
+
+    // A 2x2-tile area; the server derives the tiles itself.
+    sendTextFrame(socket, "viewport part=0 width=256 height=256 area=0,0,7680,7680 tilewidth=3840 tileheight=3840");
+
+    for (int i = 0; i < 4; ++i)
+    {
+        const auto tile = getResponseMessage(socket, "tile:");
+        CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
+    }
+
+    // Re-subscribing to the same area streams the now-cached tiles.
+    sendTextFrame(socket, "viewport part=0 width=256 height=256 area=0,0,7680,7680 tilewidth=3840 tileheight=3840");
+
+    for (int i = 0; i < 4; ++i)
+    {
+        const auto tile = getResponseMessage(socket, "tile:");
+        CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
+    }
+
+    // A malformed area must be rejected, not crash the scheduler.
+    sendTextFrame(socket, "viewport part=0 width=256 height=256 area=bogus tilewidth=3840 tileheight=3840");
+    const auto error = getResponseMessage(socket, "error:");
+    CPPUNIT_ASSERT_MESSAGE("did not receive an error: message as expected", !error.empty());
+}
+
 void TileCacheTests::testPerformance()
 {
+    // Deliberately loose budgets: trip-wires for order-of-magnitude
+    // regressions in tile delivery, not precise timings. Override via
+    // the environment where the defaults don't fit the hardware.
+    const auto totalBudgetMs = getBudgetMs("LOOL_TEST_TILE_TOTAL_BUDGET_MS", 30000);
+    const auto tileBudgetMs = getBudgetMs("LOOL_TEST_TILE_BUDGET_MS", 1000);
+
     auto socket = *loadDocAndGetSocket("hello.odt", _uri, "performance ");
 
+    constexpr int rounds = 5;
+    constexpr int tilesPerRound = 8;
+    int rendered = 0;
+
     Poco::Timestamp timestamp;
-    for (auto x = 0; x < 5; ++x)
+    for (auto x = 0; x < rounds; ++x)
     {
         sendTextFrame(socket, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680,11520,0,3840,7680,11520 tileposy=0,0,0,0,3840,3840,3840,3840 tilewidth=3840 tileheight=3840");
-        for (auto i = 0; i < 8; ++i)
+        for (auto i = 0; i < tilesPerRound; ++i)
         {
-            auto tile = getResponseMessage(socket, "tile:", "tile-performance ");
-            CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
+            const auto tile = assertResponseString(socket, "tile:", "tile-performance ");
+
+            std::string renderId;
+            if (LOOLProtocol::getTokenString(tile, "renderid", renderId) && renderId != "cached")
+            {
+                ++rendered;
+            }
         }
     }
 
-    std::cerr << "Tile rendering roundtrip for 5 x 8 tiles combined: " << timestamp.elapsed() / 1000.
-              << " ms. Per-tilecombine: " << timestamp.elapsed() / (1000. * 5)
-              << " ms. Per-tile: " << timestamp.elapsed() / (1000. * 5 * 8) << "ms."
+    const auto elapsedMs = timestamp.elapsed() / 1000.;
+    const auto perTileMs = elapsedMs / (rounds * tilesPerRound);
+    std::cerr << "Tile rendering roundtrip for " << rounds << " x " << tilesPerRound
+              << " tiles combined: " << elapsedMs
+              << " ms. Per-tilecombine: " << elapsedMs / rounds
+              << " ms. Per-tile: " << perTileMs << "ms."
               << std::endl;
 
+    CPPUNIT_ASSERT_MESSAGE("total tile delivery took " + std::to_string(elapsedMs) +
+                           " ms, over the budget of " + std::to_string(totalBudgetMs) + " ms",
+                           elapsedMs <= totalBudgetMs);
+    CPPUNIT_ASSERT_MESSAGE("per-tile latency of " + std::to_string(perTileMs) +
+                           " ms is over the budget of " + std::to_string(tileBudgetMs) + " ms",
+                           perTileMs <= tileBudgetMs);
+
+#if ENABLE_DEBUG
+    // The rounds are identical, so all but the first must be served
+    // from the cache: each unique tile rendered at most once.
+    CPPUNIT_ASSERT_MESSAGE("rendered " + std::to_string(rendered) + " tiles where " +
+                           std::to_string(tilesPerRound) + " unique tiles were requested",
+                           rendered <= tilesPerRound);
+#endif
+
     socket.shutdown();
 }
 
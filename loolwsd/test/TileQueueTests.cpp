@@ -43,7 +43,8 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileCombinedRendering);
     CPPUNIT_TEST(testTileRecombining);
     CPPUNIT_TEST(testViewOrder);
-    CPPUNIT_TEST(testPreviewsDeprioritization);
+    CPPUNIT_TEST(testDeadlineScheduling);
+    CPPUNIT_TEST(testInvalidationCoalescing);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -51,7 +52,8 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     void testTileCombinedRendering();
     void testTileRecombining();
     void testViewOrder();
-    void testPreviewsDeprioritization();
+    void testDeadlineScheduling();
+    void testInvalidationCoalescing();
 };
 
 void TileQueueTests::testTileQueuePriority()
@@ -194,11 +196,12 @@ void TileQueueTests::testViewOrder()
     }
 }
 
-void TileQueueTests::testPreviewsDeprioritization()
+void TileQueueTests::testDeadlineScheduling()
 {
     TileQueue queue;
 
-    // simple case - put previews to the queue and get everything back again
+    // simple case - put previews to the queue and get everything back again,
+    // in order
     const std::vector<std::string> previews =
     {
         "tile part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=-1 id=0",
@@ -218,9 +221,8 @@ void TileQueueTests::testPreviewsDeprioritization()
     // stays empty after all is done
     CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue._queue.size()));
 
-    // re-ordering case - put previews and normal tiles to the queue and get
-    // everything back again but this time the tiles have to interleave with
-    // the previews
+    // idle case - previews render only while nothing else is pending,
+    // so a visible tile jumps the whole batch queued ahead of it
     const std::vector<std::string> tiles =
     {
         "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=-1",
@@ -232,19 +234,26 @@ void TileQueueTests::testPreviewsDeprioritization()
 
     queue.put(tiles[0]);
 
-    CPPUNIT_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
     CPPUNIT_ASSERT_EQUAL(tiles[0], payloadAsString(queue.get()));
-    CPPUNIT_ASSERT_EQUAL(previews[1], payloadAsString(queue.get()));
-
-    queue.put(tiles[1]);
 
-    CPPUNIT_ASSERT_EQUAL(previews[2], payloadAsString(queue.get()));
-    CPPUNIT_ASSERT_EQUAL(tiles[1], payloadAsString(queue.get()));
-    CPPUNIT_ASSERT_EQUAL(previews[3], payloadAsString(queue.get()));
+    for (size_t i = 0; i < previews.size(); ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(previews[i], payloadAsString(queue.get()));
+    }
 
     // stays empty after all is done
     CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue._queue.size()));
 
+    // no budget case - even a preview that has been waiting far longer
+    // than any tile budget never preempts interactive work
+    queue.put(previews[0]);
+    queue.put(tiles[0]);
+
+    queue._times[0] -= std::chrono::milliseconds(3000);
+
+    CPPUNIT_ASSERT_EQUAL(tiles[0], payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
+
     // cursor positioning case - the cursor position should not prioritize the
     // previews
     queue.updateCursorPosition(0, 0, 0, 0, 10, 100);
@@ -259,6 +268,44 @@ void TileQueueTests::testPreviewsDeprioritization()
     CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue._queue.size()));
 }
 
+void TileQueueTests::testInvalidationCoalescing()
+{
+    TileQueue queue;
+
+    // overlapping invalidations of the same view merge into their union
+    queue.put("callback -1 0 0, 0, 3840, 3840");
+    queue.put("callback -1 0 3839, 0, 3840, 3840");
+
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue._queue.size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback -1 0 0, 0, 7679, 3840"), payloadAsString(queue.get()));
+
+    // disjoint invalidations stay separate, in order
+    queue.put("callback -1 0 0, 0, 100, 100");
+    queue.put("callback -1 0 10000, 10000, 100, 100");
+
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue._queue.size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback -1 0 0, 0, 100, 100"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback -1 0 10000, 10000, 100, 100"), payloadAsString(queue.get()));
+
+    // an EMPTY invalidation subsumes the queued rectangles...
+    queue.put("callback -1 0 0, 0, 100, 100");
+    queue.put("callback -1 0 EMPTY");
+
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue._queue.size()));
+
+    // ...and later rectangles are dropped while EMPTY is queued
+    queue.put("callback -1 0 200, 200, 100, 100");
+
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue._queue.size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback -1 0 EMPTY"), payloadAsString(queue.get()));
+
+    // different views do not coalesce
+    queue.put("callback 1 0 0, 0, 100, 100");
+    queue.put("callback 2 0 0, 0, 100, 100");
+
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue._queue.size()));
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(TileQueueTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
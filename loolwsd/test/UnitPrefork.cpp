@@ -13,7 +13,11 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
 
 #include <mutex>
@@ -43,6 +47,12 @@ class UnitPrefork : public UnitWSD
     std::condition_variable _cv;
     std::vector< std::shared_ptr<Poco::Net::WebSocket> > _childSockets;
 
+    /// The spawn benchmark: the send time of each pending fork
+    /// request, matched FIFO against the child arrivals.
+    std::mutex _spawnMutex;
+    std::deque<std::chrono::steady_clock::time_point> _forkRequestTimes;
+    std::vector<double> _spawnLatenciesMs;
+
 public:
     UnitPrefork()
         : _childPSS(0),
@@ -59,6 +69,79 @@ public:
         numPrefork = NumToPrefork;
     }
 
+    virtual void onForkRequest(const int number) override
+    {
+        // Called with wsd's spawn lock held; only take our own.
+        std::unique_lock<std::mutex> lock(_spawnMutex);
+        const auto now = std::chrono::steady_clock::now();
+        for (int i = 0; i < number; ++i)
+        {
+            _forkRequestTimes.push_back(now);
+        }
+    }
+
+    /// Record the latency of the arrived child: the time since the
+    /// fork request that asked for it.
+    void addSpawnLatency()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(_spawnMutex);
+
+        double latencyMs;
+        if (_forkRequestTimes.empty())
+        {
+            // The forkit spawns its first child unbidden on startup;
+            // anchor that one at test start.
+            latencyMs = (1000. * _startTime.elapsed()) / Poco::Timestamp::resolution();
+        }
+        else
+        {
+            latencyMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - _forkRequestTimes.front()).count();
+            _forkRequestTimes.pop_front();
+        }
+
+        _spawnLatenciesMs.push_back(latencyMs);
+        std::cerr << "child # " << _spawnLatenciesMs.size() << " spawn latency: "
+                  << latencyMs << " ms"
+                  << (_spawnLatenciesMs.size() == 1 ? " (cold jail)" : "") << std::endl;
+    }
+
+    /// Report the cold/warm split and check the regression threshold.
+    /// The first child builds its jail from scratch; the rest reuse
+    /// the warm jail machinery, which is what linkOrCopy and
+    /// globalPreinit changes move.
+    void checkSpawnLatencies()
+    {
+        const auto budgetMs = [](const char* name, const int def)
+        {
+            const auto value = std::getenv(name);
+            return static_cast<double>(value ? std::atoi(value) : def);
+        }("LOOL_TEST_SPAWN_BUDGET_MS", 20000);
+
+        std::unique_lock<std::mutex> lock(_spawnMutex);
+
+        const auto coldMs = _spawnLatenciesMs[0];
+        double warmTotalMs = 0.;
+        double warmWorstMs = 0.;
+        for (size_t i = 1; i < _spawnLatenciesMs.size(); ++i)
+        {
+            warmTotalMs += _spawnLatenciesMs[i];
+            warmWorstMs = std::max(warmWorstMs, _spawnLatenciesMs[i]);
+        }
+
+        const auto warmCount = _spawnLatenciesMs.size() - 1;
+        std::cerr << "Spawn latency cold " << coldMs << " ms, warm average "
+                  << (warmCount ? warmTotalMs / warmCount : 0.) << " ms, warm worst "
+                  << warmWorstMs << " ms, budget " << budgetMs << " ms" << std::endl;
+
+        if (warmWorstMs > budgetMs)
+        {
+            _failure = "Warm spawn latency of " + std::to_string(warmWorstMs) +
+                       " ms is over the budget of " + std::to_string(budgetMs) + " ms.";
+        }
+    }
+
     virtual bool filterChildMessage(const std::vector<char>& payload) override
     {
         const std::string memory = LOOLProtocol::getFirstLine(payload);
@@ -105,6 +188,8 @@ public:
 
     virtual void newChild(const std::shared_ptr<Poco::Net::WebSocket> &socket) override
     {
+        addSpawnLatency();
+
         _childSockets.push_back(socket);
         if (_childSockets.size() >= NumToPrefork)
         {
@@ -145,6 +230,8 @@ public:
             totalTime /= socketsCopy.size();
             std::cerr << "Launch time average " << totalTime << " ms" << std::endl;
 
+            checkSpawnLatencies();
+
             if (!_failure.empty())
             {
                 std::cerr << "UnitPrefork failed due to: " << _failure << std::endl;
@@ -73,6 +73,26 @@ void WhiteBoxTests::testLOOLProtocolFunctions()
     CPPUNIT_ASSERT(LOOLProtocol::getTokenKeywordFromMessage(message, "mumble", map, mumble));
     CPPUNIT_ASSERT_EQUAL(2, mumble);
 
+    // The zero-copy tokenizer must behave like the Poco one above.
+    LOOLProtocol::Tokenizer viewTokens(message);
+    CPPUNIT_ASSERT_EQUAL(tokens.count(), viewTokens.count());
+    CPPUNIT_ASSERT(viewTokens[0] == "hello");
+    CPPUNIT_ASSERT(viewTokens[7] == "zap");
+
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenInteger(viewTokens, "foo", foo));
+    CPPUNIT_ASSERT_EQUAL(42, foo);
+
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenString(viewTokens, "bar", bar));
+    CPPUNIT_ASSERT_EQUAL(std::string("hello-sailor"), bar);
+
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenKeyword(viewTokens, "mumble", map, mumble));
+    CPPUNIT_ASSERT_EQUAL(2, mumble);
+
+    CPPUNIT_ASSERT(!LOOLProtocol::getTokenInteger(viewTokens, "bar", foo));
+
+    CPPUNIT_ASSERT_EQUAL(std::string("zip zap"), viewTokens.cat(" ", 6));
+    CPPUNIT_ASSERT(viewTokens[3].startsWith("foo="));
+    CPPUNIT_ASSERT_EQUAL(std::string("42"), viewTokens[3].substr(4));
 }
 
 void WhiteBoxTests::testRegexListMatcher()
@@ -197,6 +217,11 @@ public:
     {
         return true;
     }
+
+    void watchExport(const pid_t /*pid*/, const std::string& /*doneMsg*/,
+                     const std::string& /*failMsg*/) override
+    {
+    }
 };
 
 void WhiteBoxTests::testEmptyCellCursor()
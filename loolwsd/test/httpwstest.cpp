@@ -11,6 +11,7 @@
 
 #include <algorithm>
 #include <condition_variable>
+#include <cstdlib>
 #include <mutex>
 #include <thread>
 #include <regex>
@@ -98,6 +99,8 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testCursorPosition);
     CPPUNIT_TEST(testAlertAllUsers);
     CPPUNIT_TEST(testViewInfoMsg);
+    CPPUNIT_TEST(testBroadcastScalability);
+    CPPUNIT_TEST(testSessionResume);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -142,9 +145,16 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     void testCursorPosition();
     void testAlertAllUsers();
     void testViewInfoMsg();
+    void testBroadcastScalability();
+    void testSessionResume();
 
     void loadDoc(const std::string& documentURL, const std::string& testname);
 
+    double measureBroadcastLatencyMs(const std::string& documentURL,
+                                     const int numViews,
+                                     const int rounds,
+                                     const std::string& testname);
+
     void getPartHashCodes(const std::string response,
                           std::vector<std::string>& parts);
 
@@ -2147,6 +2157,140 @@ void HTTPWSTest::testViewInfoMsg()
     }
 }
 
+double HTTPWSTest::measureBroadcastLatencyMs(const std::string& documentURL,
+                                             const int numViews,
+                                             const int rounds,
+                                             const std::string& testname)
+{
+    // One editor and numViews - 1 watchers on the same document.
+    auto editor = loadDocAndGetSocket(_uri, documentURL, testname + "editor ");
+
+    std::vector<std::shared_ptr<Poco::Net::WebSocket>> watchers;
+    for (int i = 1; i < numViews; ++i)
+    {
+        watchers.emplace_back(loadDocAndGetSocket(_uri, documentURL,
+                                                  testname + "view " + std::to_string(i) + " "));
+    }
+
+    // One unmeasured edit collected by every watcher, so the
+    // load-time invalidations don't pollute the measured rounds.
+    sendTextFrame(editor, "key type=input char=97 key=0", testname);
+    sendTextFrame(editor, "key type=up char=0 key=512", testname);
+    for (const auto& watcher : watchers)
+    {
+        getResponseString(watcher, "invalidatetiles:", testname);
+    }
+
+    Poco::Timestamp timestamp;
+    for (int round = 0; round < rounds; ++round)
+    {
+        sendTextFrame(editor, "key type=input char=97 key=0", testname);
+        sendTextFrame(editor, "key type=up char=0 key=512", testname);
+        for (const auto& watcher : watchers)
+        {
+            const auto response = getResponseString(watcher, "invalidatetiles:", testname);
+            CPPUNIT_ASSERT_MESSAGE("watcher did not receive the invalidation broadcast",
+                                   !response.empty());
+        }
+    }
+
+    return (timestamp.elapsed() / 1000.) / (rounds * watchers.size());
+}
+
+void HTTPWSTest::testBroadcastScalability()
+{
+    const auto testname = "broadcastScalability ";
+
+    // Fan-out that stays linear in the view count has flat per-view
+    // latency; fail when the larger fan-out deviates by more than
+    // this factor (plus a little absolute slack against noise when
+    // the small case is nearly instant).
+    const auto factorEnv = std::getenv("LOOL_TEST_BROADCAST_FACTOR");
+    const double factor = factorEnv ? std::atof(factorEnv) : 5.;
+
+    std::string docPath;
+    std::string docURL;
+    getDocumentPathAndURL("hello.odt", docPath, docURL);
+
+    try
+    {
+        const auto smallMs = measureBroadcastLatencyMs(docURL, 4, 4, "broadcastScalability-small ");
+        const auto largeMs = measureBroadcastLatencyMs(docURL, 16, 4, "broadcastScalability-large ");
+
+        std::cerr << testname << "per-view broadcast latency: " << smallMs
+                  << " ms with 4 views, " << largeMs << " ms with 16 views." << std::endl;
+
+        CPPUNIT_ASSERT_MESSAGE("per-view broadcast latency grew from " +
+                               std::to_string(smallMs) + " ms to " + std::to_string(largeMs) +
+                               " ms with the view count: superlinear fan-out",
+                               largeMs <= smallMs * factor + 10.);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
+void HTTPWSTest::testSessionResume()
+{
+    const auto testname = "sessionResume ";
+
+    std::string docPath;
+    std::string docURL;
+    getDocumentPathAndURL("hello.odt", docPath, docURL);
+
+    try
+    {
+        // Connect by hand: the 'resume:' token arrives right after
+        // 'statusindicator: ready', before the load.
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, docURL);
+        auto socket = connectLOKit(_uri, request, _response, testname);
+
+        const auto resumeMsg = getResponseString(socket, "resume:", testname);
+        CPPUNIT_ASSERT_MESSAGE("did not receive a resume: token", !resumeMsg.empty());
+        std::string token;
+        CPPUNIT_ASSERT(LOOLProtocol::getTokenString(resumeMsg, "token", token));
+        CPPUNIT_ASSERT(!token.empty());
+
+        sendTextFrame(socket, "load url=" + docURL, testname);
+        CPPUNIT_ASSERT_MESSAGE("cannot load the document " + docURL,
+                               isDocumentLoaded(*socket, testname));
+
+        sendTextFrame(socket, "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840", testname);
+        assertResponseString(socket, "tile:", testname);
+
+        // Drop the connection abruptly: no WebSocket close handshake,
+        // as a sleeping laptop or timing-out proxy would.
+        socket->close();
+        socket.reset();
+
+        // Give wsd a moment to notice the drop and park the session.
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        // Reconnect presenting the token inside the document URI.
+        std::string encoded;
+        Poco::URI::encode("file://" + Poco::Path(docPath).makeAbsolute().toString() +
+                          "?resumetoken=" + token, ":/?", encoded);
+        Poco::Net::HTTPRequest resumeRequest(Poco::Net::HTTPRequest::HTTP_GET,
+                                             "lool/" + encoded + "/ws");
+        auto socket2 = connectLOKit(_uri, resumeRequest, _response, testname);
+
+        const auto resumed = getResponseString(socket2, "resumed:", testname);
+        CPPUNIT_ASSERT_MESSAGE("did not receive resumed: on reconnect", !resumed.empty());
+
+        // The session is immediately usable: no load handshake, and
+        // the tile comes from the still-warm cache.
+        sendTextFrame(socket2, "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840", testname);
+        assertResponseString(socket2, "tile:", testname);
+
+        socket2->shutdown();
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(HTTPWSTest);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
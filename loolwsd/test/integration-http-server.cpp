@@ -9,6 +9,9 @@
 
 #include "config.h"
 
+#include <thread>
+#include <vector>
+
 #include <Poco/Net/AcceptCertificateHandler.h>
 #include <Poco/Net/FilePartSource.h>
 #include <Poco/Net/HTMLForm.h>
@@ -45,6 +48,7 @@ class HTTPServerTest : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testScriptsAndLinksGet);
     CPPUNIT_TEST(testScriptsAndLinksPost);
     CPPUNIT_TEST(testConvertTo);
+    CPPUNIT_TEST(testConvertToParallel);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -56,6 +60,7 @@ class HTTPServerTest : public CPPUNIT_NS::TestFixture
     void testScriptsAndLinksGet();
     void testScriptsAndLinksPost();
     void testConvertTo();
+    void testConvertToParallel();
 
     void testNoExtraLoolKitsLeft();
 
@@ -275,6 +280,68 @@ void HTTPServerTest::testConvertTo()
     CPPUNIT_ASSERT_EQUAL(expectedStream.str(), actualString);
 }
 
+void HTTPServerTest::testConvertToParallel()
+{
+    // Convert the same source file on several connections at once;
+    // each conversion gets a broker (and kit process) of its own,
+    // so none of them may collide or corrupt another's result.
+    constexpr int jobs = 4;
+    const auto srcPath = Util::getTempFilePath(TDOC, "hello.odt");
+
+    std::ifstream fileStream(TDOC "/hello.txt");
+    std::stringstream expectedStream;
+    expectedStream << fileStream.rdbuf();
+    const std::string expected = expectedStream.str();
+
+    std::vector<std::string> results(jobs);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < jobs; ++i)
+    {
+        threads.emplace_back([this, i, &srcPath, &results]()
+        {
+            try
+            {
+                std::unique_ptr<Poco::Net::HTTPClientSession> session(helpers::createSession(_uri));
+                session->setTimeout(Poco::Timespan(30, 0)); // Jobs compete for kits.
+
+                Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/lool/convert-to");
+                Poco::Net::HTMLForm form;
+                form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
+                form.set("format", "txt");
+                form.addPart("data", new Poco::Net::FilePartSource(srcPath));
+                form.prepareSubmit(request);
+                form.write(session->sendRequest(request));
+
+                Poco::Net::HTTPResponse response;
+                std::stringstream actualStream;
+                std::istream& responseStream = session->receiveResponse(response);
+                Poco::StreamCopier::copyStream(responseStream, actualStream);
+                results[i] = actualStream.str();
+            }
+            catch (const std::exception&)
+            {
+                // Leave the result empty; asserted below.
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Remove the temp files.
+    Util::removeFile(srcPath);
+
+    for (auto result : results)
+    {
+        // Skip the UTF-8 BOM, as in testConvertTo.
+        if (result.size() > 3 && result[0] == '\xEF' && result[1] == '\xBB' && result[2] == '\xBF')
+            result = result.substr(3);
+        CPPUNIT_ASSERT_EQUAL(expected, result);
+    }
+}
+
 void HTTPServerTest::testNoExtraLoolKitsLeft()
 {
     const auto countNow = countLoolKitProcesses(InitialLoolKitCount);